@@ -20,10 +20,135 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <algorithm>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif /* __linux__ */
+
 #include "channel.hh"
 
 namespace pdns::channel
 {
+namespace detail
+{
+#ifdef __linux__
+  WakeUpDescriptor::WakeUpDescriptor() :
+    d_read(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+  {
+    if (d_read.getHandle() < 0) {
+      throw std::runtime_error("Error creating channel eventfd: " + stringerror());
+    }
+  }
+
+  void WakeUpDescriptor::signal() const
+  {
+    uint64_t value = 1;
+    while (write(d_read.getHandle(), &value, sizeof(value)) != sizeof(value)) {
+      if (errno == EINTR) {
+        continue;
+      }
+      /* EAGAIN means that the counter is about to overflow, so the descriptor is readable anyway */
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      }
+      throw std::runtime_error("Unable to signal channel eventfd: " + stringerror());
+    }
+  }
+
+  void WakeUpDescriptor::clear() const
+  {
+    uint64_t value{0};
+    while (read(d_read.getHandle(), &value, sizeof(value)) != sizeof(value)) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      }
+      throw std::runtime_error("Error while clearing channel eventfd: " + stringerror());
+    }
+  }
+#else /* __linux__ */
+  WakeUpDescriptor::WakeUpDescriptor()
+  {
+    std::array<int, 2> fds = {-1, -1};
+    if (pipe(fds.data()) < 0) {
+      throw std::runtime_error("Error creating channel pipe: " + stringerror());
+    }
+    d_read = FDWrapper(fds[0]);
+    d_write = FDWrapper(fds[1]);
+    if (!setNonBlocking(d_read.getHandle()) || !setNonBlocking(d_write.getHandle())) {
+      int err = errno;
+      throw std::runtime_error("Error making channel pipe non-blocking: " + stringerror(err));
+    }
+  }
+
+  void WakeUpDescriptor::signal() const
+  {
+    char data = 'a';
+    while (write(d_write.getHandle(), &data, sizeof(data)) != sizeof(data)) {
+      if (errno == EINTR) {
+        continue;
+      }
+      /* the pipe is full, so it is readable anyway */
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      }
+      throw std::runtime_error("Unable to signal channel pipe: " + stringerror());
+    }
+  }
+
+  void WakeUpDescriptor::clear() const
+  {
+    std::array<char, 64> data{};
+    while (true) {
+      auto got = read(d_read.getHandle(), data.data(), data.size());
+      if (got > 0) {
+        continue;
+      }
+      if (got == -1 && errno == EINTR) {
+        continue;
+      }
+      if (got == 0 || errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      }
+      throw std::runtime_error("Error while clearing channel pipe: " + stringerror());
+    }
+  }
+#endif /* __linux__ */
+
+  void WakeUpDescriptor::wait() const
+  {
+    pollfd pfd{};
+    pfd.fd = d_read.getHandle();
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, -1) < 0) {
+      if (errno != EINTR) {
+        throw std::runtime_error("Error while waiting on channel descriptor: " + stringerror());
+      }
+    }
+  }
+
+  size_t getRingCapacity(size_t pipeBufferSize)
+  {
+    /* the default size of a pipe on Linux */
+    static const size_t defaultPipeBufferSize = 65536;
+    static const size_t minimumCapacity = 64;
+
+    /* the ring holds as many objects as the pipe would have held pointers, so that a queue
+       configured to be deep, like the one of a TCP worker, stays as deep. Unlike the pages of
+       a pipe, the ring is allocated upfront */
+    size_t wanted = (pipeBufferSize > 0 ? pipeBufferSize : defaultPipeBufferSize) / sizeof(void*);
+    wanted = std::max(wanted, minimumCapacity);
+    size_t capacity = minimumCapacity;
+    while (capacity < wanted) {
+      capacity *= 2;
+    }
+    return capacity;
+  }
+}
+
 
 Notifier::Notifier(FDWrapper&& descriptor) :
   d_fd(std::move(descriptor))
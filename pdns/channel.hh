@@ -20,34 +20,14 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 #pragma once
+#include <atomic>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <optional>
 
 #include "misc.hh"
 
-/* g++ defines __SANITIZE_THREAD__
-   clang++ supports the nice __has_feature(thread_sanitizer),
-   let's merge them */
-#if defined(__has_feature)
-#if __has_feature(thread_sanitizer)
-#define __SANITIZE_THREAD__ 1
-#endif
-#endif
-
-#if __SANITIZE_THREAD__
-#if defined __has_include
-#if __has_include(<sanitizer/tsan_interface.h>)
-#include <sanitizer/tsan_interface.h>
-#else /* __has_include(<sanitizer/tsan_interface.h>) */
-extern "C" void __tsan_acquire(void* addr);
-extern "C" void __tsan_release(void* addr);
-#endif /* __has_include(<sanitizer/tsan_interface.h>) */
-#else /* defined __has_include */
-extern "C" void __tsan_acquire(void* addr);
-extern "C" void __tsan_release(void* addr);
-#endif /* defined __has_include */
-#endif /* __SANITIZE_THREAD__ */
-
 namespace pdns
 {
 namespace channel
@@ -63,6 +43,133 @@ namespace channel
     ReceiverBlocking
   };
 
+  namespace detail
+  {
+    /**
+     * The descriptor a receiver waits on, readable when objects might be available.
+     *
+     * An eventfd on Linux, a pipe elsewhere.
+     */
+    class WakeUpDescriptor
+    {
+    public:
+      WakeUpDescriptor();
+      /**
+       * \brief Make the descriptor readable, if it is not already.
+       */
+      void signal() const;
+      /**
+       * \brief Make the descriptor not readable anymore.
+       */
+      void clear() const;
+      /**
+       * \brief Wait until the descriptor becomes readable.
+       */
+      void wait() const;
+      int getDescriptor() const
+      {
+        return d_read.getHandle();
+      }
+
+    private:
+      FDWrapper d_read;
+      /* only used with a pipe */
+      FDWrapper d_write;
+    };
+
+    /**
+     * \brief The number of objects a ring can hold, from the size of the pipe that would have been used instead.
+     */
+    size_t getRingCapacity(size_t pipeBufferSize);
+
+    /**
+     * A bounded, lock-free, ring of objects accepting several producers and consumers (Dmitry Vyukov's bounded MPMC queue).
+     *
+     * Each cell carries a sequence number telling whether it is ready to be written to, or read from, for a given position.
+     * These sequence numbers are updated with sequential consistency, which the wake-up logic of ObjectQueue relies on.
+     */
+    template <typename T, typename D>
+    class ObjectRing
+    {
+    public:
+      ObjectRing(size_t capacity);
+      ObjectRing(const ObjectRing&) = delete;
+      ObjectRing& operator=(const ObjectRing&) = delete;
+      ObjectRing(ObjectRing&&) = delete;
+      ObjectRing& operator=(ObjectRing&&) = delete;
+      ~ObjectRing() = default;
+
+      /**
+       * \brief Move the object into the ring, unless it is full.
+       *
+       * \return True if the object has been queued, False if the ring is full, in which case the object is left untouched.
+       */
+      bool tryPush(std::unique_ptr<T, D>& object);
+      std::optional<std::unique_ptr<T, D>> tryPop();
+
+    private:
+      struct Cell
+      {
+        std::atomic<size_t> d_sequence{0};
+        std::unique_ptr<T, D> d_object{nullptr, D()};
+      };
+
+      std::unique_ptr<Cell[]> d_cells;
+      const size_t d_mask;
+      /* producers and consumers should not be bouncing the same cache line */
+      alignas(64) std::atomic<size_t> d_enqueuePos{0};
+      alignas(64) std::atomic<size_t> d_dequeuePos{0};
+    };
+
+    /**
+     * The state shared by the two ends of an object channel.
+     *
+     * Senders only signal the wake-up descriptor when the receiver is parked, meaning that it found the ring
+     * empty and is about to wait for the descriptor to become readable, so a burst of objects only costs
+     * a single wake-up.
+     */
+    template <typename T, typename D>
+    class ObjectQueue
+    {
+    public:
+      ObjectQueue(size_t capacity) :
+        d_ring(capacity)
+      {
+      }
+
+      /**
+       * \brief Queue the object, waking up the receiver if needed.
+       *
+       * \return True if the object has been queued, False if the ring is full, in which case the object is left untouched.
+       */
+      bool push(std::unique_ptr<T, D>& object);
+      /**
+       * \brief Wait until the object can be queued.
+       *
+       * \throw runtime_error if the receiver has been closed.
+       */
+      void pushBlocking(std::unique_ptr<T, D>& object);
+      std::optional<std::unique_ptr<T, D>> pop();
+      /**
+       * \brief Tell senders to signal the next object. The ring has to be checked again afterwards.
+       */
+      void park();
+      void closeSender();
+      void closeReceiver();
+
+      WakeUpDescriptor d_wakeUp;
+      std::atomic<bool> d_senderClosed{false};
+      std::atomic<bool> d_receiverClosed{false};
+
+    private:
+      ObjectRing<T, D> d_ring;
+      std::mutex d_fullLock;
+      std::condition_variable d_fullCondition;
+      std::atomic<size_t> d_blockedSenders{0};
+      std::atomic<bool> d_receiverParked{true};
+    };
+  }
+
   /**
    * The sender's end of a channel used to pass objects between threads.
    *
@@ -73,15 +180,26 @@ namespace channel
   {
   public:
     Sender() = default;
-    Sender(FDWrapper&& descriptor) :
-      d_fd(std::move(descriptor))
+    Sender(std::shared_ptr<detail::ObjectQueue<T, D>> queue, bool blocking) :
+      d_queue(std::move(queue)), d_blocking(blocking)
     {
     }
     Sender(const Sender&) = delete;
     Sender& operator=(const Sender&) = delete;
     Sender(Sender&&) = default;
-    Sender& operator=(Sender&&) = default;
-    ~Sender() = default;
+    Sender& operator=(Sender&& rhs) noexcept
+    {
+      if (this != &rhs) {
+        close();
+        d_queue = std::move(rhs.d_queue);
+        d_blocking = rhs.d_blocking;
+      }
+      return *this;
+    }
+    ~Sender()
+    {
+      close();
+    }
     /**
      * \brief Try to send the supplied object to the other end of that channel. Might block if the channel was created in blocking mode.
      *
@@ -93,7 +211,8 @@ namespace channel
     void close();
 
   private:
-    FDWrapper d_fd;
+    std::shared_ptr<detail::ObjectQueue<T, D>> d_queue;
+    bool d_blocking{false};
   };
 
   /**
@@ -106,15 +225,28 @@ namespace channel
   {
   public:
     Receiver() = default;
-    Receiver(FDWrapper&& descriptor, bool throwOnEOF = true) :
-      d_fd(std::move(descriptor)), d_throwOnEOF(throwOnEOF)
+    Receiver(std::shared_ptr<detail::ObjectQueue<T, D>> queue, bool blocking, bool throwOnEOF = true) :
+      d_queue(std::move(queue)), d_blocking(blocking), d_throwOnEOF(throwOnEOF)
     {
     }
     Receiver(const Receiver&) = delete;
     Receiver& operator=(const Receiver&) = delete;
     Receiver(Receiver&&) = default;
-    Receiver& operator=(Receiver&&) = default;
-    ~Receiver() = default;
+    Receiver& operator=(Receiver&& rhs) noexcept
+    {
+      if (this != &rhs) {
+        close();
+        d_queue = std::move(rhs.d_queue);
+        d_closed = rhs.d_closed;
+        d_blocking = rhs.d_blocking;
+        d_throwOnEOF = rhs.d_throwOnEOF;
+      }
+      return *this;
+    }
+    ~Receiver()
+    {
+      close();
+    }
     /**
      * \brief Try to read an object sent by the other end of that channel. Might block if the channel was created in blocking mode.
      *
@@ -128,11 +260,14 @@ namespace channel
     /**
      * \brief Get a descriptor that can be used with an I/O multiplexer to wait for an object to become available.
      *
+     * The descriptor stays readable as long as objects might be available, so receive() should be called until it
+     * returns std::nullopt before waiting for the descriptor again, unless the multiplexer is level-triggered.
+     *
      * \return A valid descriptor or -1 if the Receiver was not properly initialized.
      */
     int getDescriptor() const
     {
-      return d_fd.getHandle();
+      return d_queue ? d_queue->d_wakeUp.getDescriptor() : -1;
     }
     /**
      * \brief Whether the remote end has closed the channel.
@@ -143,14 +278,20 @@ namespace channel
     }
 
   private:
-    FDWrapper d_fd;
+    void close();
+
+    std::shared_ptr<detail::ObjectQueue<T, D>> d_queue;
     bool d_closed{false};
+    bool d_blocking{false};
     bool d_throwOnEOF{true};
   };
 
   /**
    * \brief Create a channel to pass objects between threads, accepting multiple senders and receivers.
    *
+   * The objects are passed through a lock-free ring holding as many objects as a pipe of pipeBufferSize bytes could hold pointers,
+   * within limits, and the receiver is only woken up, through a descriptor, when it has found the ring empty.
+   *
    * \return A pair of Sender and Receiver objects.
    *
    * \throw runtime_error if the channel creation failed.
@@ -236,53 +377,170 @@ namespace channel
    */
   std::pair<Notifier, Waiter> createNotificationQueue(bool nonBlocking = true, size_t pipeBufferSize = 0, bool throwOnEOF = true);
 
-  template <typename T, typename D>
-  bool Sender<T, D>::send(std::unique_ptr<T, D>&& object) const
+  namespace detail
   {
-    /* we cannot touch the initial unique pointer after writing to the pipe,
-       not even to release it, so let's transfer it to a local object */
-    auto localObj = std::move(object);
-    auto ptr = localObj.get();
-    static_assert(sizeof(ptr) <= PIPE_BUF, "Writes up to PIPE_BUF are guaranted not to interleaved and to either fully succeed or fail");
-    while (true) {
-#if __SANITIZE_THREAD__
-      __tsan_release(ptr);
-#endif /* __SANITIZE_THREAD__ */
-      ssize_t sent = write(d_fd.getHandle(), &ptr, sizeof(ptr));
-
-      if (sent == sizeof(ptr)) {
-        // coverity[leaked_storage]
-        localObj.release();
-        return true;
-      }
-      else if (sent == 0) {
-#if __SANITIZE_THREAD__
-        __tsan_acquire(ptr);
-#endif /* __SANITIZE_THREAD__ */
-        throw std::runtime_error("Unable to write to channel: remote end has been closed");
+    template <typename T, typename D>
+    ObjectRing<T, D>::ObjectRing(size_t capacity) :
+      d_cells(std::make_unique<Cell[]>(capacity)), d_mask(capacity - 1)
+    {
+      for (size_t idx = 0; idx < capacity; idx++) {
+        d_cells[idx].d_sequence.store(idx, std::memory_order_relaxed);
       }
-      else {
-#if __SANITIZE_THREAD__
-        __tsan_acquire(ptr);
-#endif /* __SANITIZE_THREAD__ */
-        if (errno == EINTR) {
-          continue;
+    }
+
+    template <typename T, typename D>
+    bool ObjectRing<T, D>::tryPush(std::unique_ptr<T, D>& object)
+    {
+      auto pos = d_enqueuePos.load(std::memory_order_relaxed);
+      while (true) {
+        auto& cell = d_cells[pos & d_mask];
+        auto sequence = cell.d_sequence.load();
+        auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+          if (d_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            cell.d_object = std::move(object);
+            cell.d_sequence.store(pos + 1);
+            return true;
+          }
         }
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-          object = std::move(localObj);
+        else if (diff < 0) {
+          /* that cell has not been read since the last time we went around the ring */
           return false;
         }
         else {
-          throw std::runtime_error("Unable to write to channel:" + stringerror());
+          pos = d_enqueuePos.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    template <typename T, typename D>
+    std::optional<std::unique_ptr<T, D>> ObjectRing<T, D>::tryPop()
+    {
+      auto pos = d_dequeuePos.load(std::memory_order_relaxed);
+      while (true) {
+        auto& cell = d_cells[pos & d_mask];
+        auto sequence = cell.d_sequence.load();
+        auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+        if (diff == 0) {
+          if (d_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            auto object = std::move(cell.d_object);
+            cell.d_sequence.store(pos + d_mask + 1);
+            return object;
+          }
+        }
+        else if (diff < 0) {
+          /* that cell has not been written to yet */
+          return std::nullopt;
+        }
+        else {
+          pos = d_dequeuePos.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    template <typename T, typename D>
+    bool ObjectQueue<T, D>::push(std::unique_ptr<T, D>& object)
+    {
+      if (!d_ring.tryPush(object)) {
+        return false;
+      }
+      /* the cell has been updated with sequential consistency, so either the receiver sees our object,
+         or we see that it is parked */
+      if (d_receiverParked.load() && d_receiverParked.exchange(false)) {
+        d_wakeUp.signal();
+      }
+      return true;
+    }
+
+    template <typename T, typename D>
+    void ObjectQueue<T, D>::pushBlocking(std::unique_ptr<T, D>& object)
+    {
+      {
+        std::unique_lock<std::mutex> lock(d_fullLock);
+        /* either we see the cell freed by the receiver, or the receiver sees that we are waiting */
+        ++d_blockedSenders;
+        while (!d_ring.tryPush(object)) {
+          if (d_receiverClosed.load()) {
+            --d_blockedSenders;
+            throw std::runtime_error("Unable to write to channel: remote end has been closed");
+          }
+          d_fullCondition.wait(lock);
         }
+        --d_blockedSenders;
+      }
+      if (d_receiverParked.load() && d_receiverParked.exchange(false)) {
+        d_wakeUp.signal();
+      }
+    }
+
+    template <typename T, typename D>
+    std::optional<std::unique_ptr<T, D>> ObjectQueue<T, D>::pop()
+    {
+      auto object = d_ring.tryPop();
+      if (!object) {
+        return object;
       }
+      if (d_blockedSenders.load() > 0) {
+        std::lock_guard<std::mutex> lock(d_fullLock);
+        d_fullCondition.notify_all();
+      }
+      /* we parked but objects were queued before the senders noticed, so nobody signalled them:
+         make sure the descriptor stays readable until the ring has been emptied */
+      if (d_receiverParked.load() && d_receiverParked.exchange(false)) {
+        d_wakeUp.signal();
+      }
+      return object;
+    }
+
+    template <typename T, typename D>
+    void ObjectQueue<T, D>::park()
+    {
+      d_wakeUp.clear();
+      d_receiverParked.store(true);
+    }
+
+    template <typename T, typename D>
+    void ObjectQueue<T, D>::closeSender()
+    {
+      d_senderClosed.store(true);
+      d_wakeUp.signal();
+    }
+
+    template <typename T, typename D>
+    void ObjectQueue<T, D>::closeReceiver()
+    {
+      d_receiverClosed.store(true);
+      std::lock_guard<std::mutex> lock(d_fullLock);
+      d_fullCondition.notify_all();
+    }
+  }
+
+  template <typename T, typename D>
+  bool Sender<T, D>::send(std::unique_ptr<T, D>&& object) const
+  {
+    if (!d_queue) {
+      throw std::runtime_error("Unable to write to channel: not initialized");
+    }
+    if (d_queue->d_receiverClosed.load()) {
+      throw std::runtime_error("Unable to write to channel: remote end has been closed");
     }
+    if (d_queue->push(object)) {
+      return true;
+    }
+    if (!d_blocking) {
+      return false;
+    }
+    d_queue->pushBlocking(object);
+    return true;
   }
 
   template <typename T, typename D>
   void Sender<T, D>::close()
   {
-    d_fd.reset();
+    if (d_queue) {
+      d_queue->closeSender();
+      d_queue.reset();
+    }
   }
 
   template <typename T, typename D>
@@ -294,63 +552,52 @@ namespace channel
   template <typename T, typename D>
   std::optional<std::unique_ptr<T, D>> Receiver<T, D>::receive(D deleter)
   {
+    if (!d_queue) {
+      throw std::runtime_error("Error while reading from Channel receiver: not initialized");
+    }
+    bool parked = false;
     while (true) {
-      std::optional<std::unique_ptr<T, D>> result;
-      T* objPtr{nullptr};
-      ssize_t got = read(d_fd.getHandle(), &objPtr, sizeof(objPtr));
-      if (got == sizeof(objPtr)) {
-#if __SANITIZE_THREAD__
-        __tsan_acquire(objPtr);
-#endif /* __SANITIZE_THREAD__ */
-        return std::unique_ptr<T, D>(objPtr, deleter);
+      /* has to be checked before the ring, otherwise we might miss objects sent right before the channel was closed */
+      bool senderClosed = d_queue->d_senderClosed.load();
+      auto object = d_queue->pop();
+      if (object) {
+        return std::unique_ptr<T, D>(object->release(), deleter);
       }
-      else if (got == 0) {
+      if (senderClosed) {
         d_closed = true;
         if (!d_throwOnEOF) {
-          return result;
+          return std::nullopt;
         }
         throw std::runtime_error("EOF while reading from Channel receiver");
       }
-      else if (got == -1) {
-        if (errno == EINTR) {
-          continue;
-        }
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-          return result;
-        }
-        throw std::runtime_error("Error while reading from Channel receiver: " + stringerror());
+      if (!parked) {
+        /* and look again, since an object might have been queued before the senders noticed */
+        d_queue->park();
+        parked = true;
+        continue;
       }
-      else {
-        throw std::runtime_error("Partial read from Channel receiver");
+      if (!d_blocking) {
+        return std::nullopt;
       }
+      d_queue->d_wakeUp.wait();
+      parked = false;
     }
   }
 
   template <typename T, typename D>
-  std::pair<Sender<T, D>, Receiver<T, D>> createObjectQueue(SenderBlockingMode senderBlockingMode, ReceiverBlockingMode receiverBlockingMode, size_t pipeBufferSize, bool throwOnEOF)
+  void Receiver<T, D>::close()
   {
-    int fds[2] = {-1, -1};
-    if (pipe(fds) < 0) {
-      throw std::runtime_error("Error creating channel pipe: " + stringerror());
-    }
-
-    FDWrapper sender(fds[1]);
-    FDWrapper receiver(fds[0]);
-    if (receiverBlockingMode == ReceiverBlockingMode::ReceiverNonBlocking && !setNonBlocking(receiver.getHandle())) {
-      int err = errno;
-      throw std::runtime_error("Error making channel pipe non-blocking: " + stringerror(err));
-    }
-
-    if (senderBlockingMode == SenderBlockingMode::SenderNonBlocking && !setNonBlocking(sender.getHandle())) {
-      int err = errno;
-      throw std::runtime_error("Error making channel pipe non-blocking: " + stringerror(err));
-    }
-
-    if (pipeBufferSize > 0 && getPipeBufferSize(receiver.getHandle()) < pipeBufferSize) {
-      setPipeBufferSize(receiver.getHandle(), pipeBufferSize);
+    if (d_queue) {
+      d_queue->closeReceiver();
+      d_queue.reset();
     }
+  }
 
-    return {Sender<T, D>(std::move(sender)), Receiver<T, D>(std::move(receiver), throwOnEOF)};
+  template <typename T, typename D>
+  std::pair<Sender<T, D>, Receiver<T, D>> createObjectQueue(SenderBlockingMode senderBlockingMode, ReceiverBlockingMode receiverBlockingMode, size_t pipeBufferSize, bool throwOnEOF)
+  {
+    auto queue = std::make_shared<detail::ObjectQueue<T, D>>(detail::getRingCapacity(pipeBufferSize));
+    return {Sender<T, D>(queue, senderBlockingMode == SenderBlockingMode::SenderBlocking), Receiver<T, D>(queue, receiverBlockingMode == ReceiverBlockingMode::ReceiverBlocking, throwOnEOF)};
   }
 }
 }
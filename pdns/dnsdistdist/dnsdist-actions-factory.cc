@@ -34,6 +34,7 @@
 #include "dnsdist-edns.hh"
 #include "dnsdist-lua.hh"
 #include "dnsdist-lua-ffi.hh"
+#include "dnsdist-lua-per-thread.hh"
 #include "dnsdist-mac-address.hh"
 #include "dnsdist-protobuf.hh"
 #include "dnsdist-proxy-protocol.hh"
@@ -521,28 +522,40 @@ public:
 class LuaAction : public DNSAction
 {
 public:
-  LuaAction(LuaActionFunction func) :
+  LuaAction(LuaActionFunction func, std::optional<std::string> perThreadCode) :
     d_func(std::move(func))
-  {}
+  {
+    if (perThreadCode) {
+      d_perThreadFunc.emplace(std::move(*perThreadCode));
+    }
+  }
 
   DNSAction::Action operator()(DNSQuestion* dnsquestion, std::string* ruleresult) const override
   {
     try {
-      DNSAction::Action result{};
-      {
-        auto lock = g_lua.lock();
-        auto ret = d_func(dnsquestion);
-        if (ruleresult != nullptr) {
-          if (boost::optional<std::string> rule = std::get<1>(ret)) {
-            *ruleresult = *rule;
-          }
-          else {
-            // default to empty string
-            ruleresult->clear();
-          }
+      std::tuple<int, boost::optional<std::string>> ret;
+      if (d_perThreadFunc) {
+        const auto* func = d_perThreadFunc->get();
+        if (func == nullptr) {
+          /* the function was not properly initialized */
+          return DNSAction::Action::None;
         }
-        result = static_cast<Action>(std::get<0>(ret));
+        ret = (*func)(dnsquestion);
+      }
+      else {
+        auto lock = dnsdist::lua::lockGlobalState();
+        ret = d_func(dnsquestion);
       }
+      if (ruleresult != nullptr) {
+        if (boost::optional<std::string> rule = std::get<1>(ret)) {
+          *ruleresult = *rule;
+        }
+        else {
+          // default to empty string
+          ruleresult->clear();
+        }
+      }
+      auto result = static_cast<Action>(std::get<0>(ret));
       dnsdist::handleQueuedAsynchronousEvents();
       return result;
     }
@@ -557,37 +570,51 @@ public:
 
   [[nodiscard]] std::string toString() const override
   {
-    return "Lua script";
+    return d_perThreadFunc ? "Lua per-thread script" : "Lua script";
   }
 
 private:
   LuaActionFunction d_func;
+  std::optional<dnsdist::lua::perthread::Function<LuaActionFunction>> d_perThreadFunc;
 };
 
 class LuaResponseAction : public DNSResponseAction
 {
 public:
-  LuaResponseAction(LuaResponseActionFunction func) :
+  LuaResponseAction(LuaResponseActionFunction func, std::optional<std::string> perThreadCode) :
     d_func(std::move(func))
-  {}
+  {
+    if (perThreadCode) {
+      d_perThreadFunc.emplace(std::move(*perThreadCode));
+    }
+  }
+
   DNSResponseAction::Action operator()(DNSResponse* response, std::string* ruleresult) const override
   {
     try {
-      DNSResponseAction::Action result{};
-      {
-        auto lock = g_lua.lock();
-        auto ret = d_func(response);
-        if (ruleresult != nullptr) {
-          if (boost::optional<std::string> rule = std::get<1>(ret)) {
-            *ruleresult = *rule;
-          }
-          else {
-            // default to empty string
-            ruleresult->clear();
-          }
+      std::tuple<int, boost::optional<std::string>> ret;
+      if (d_perThreadFunc) {
+        const auto* func = d_perThreadFunc->get();
+        if (func == nullptr) {
+          /* the function was not properly initialized */
+          return DNSResponseAction::Action::None;
         }
-        result = static_cast<Action>(std::get<0>(ret));
+        ret = (*func)(response);
+      }
+      else {
+        auto lock = dnsdist::lua::lockGlobalState();
+        ret = d_func(response);
       }
+      if (ruleresult != nullptr) {
+        if (boost::optional<std::string> rule = std::get<1>(ret)) {
+          *ruleresult = *rule;
+        }
+        else {
+          // default to empty string
+          ruleresult->clear();
+        }
+      }
+      auto result = static_cast<Action>(std::get<0>(ret));
       dnsdist::handleQueuedAsynchronousEvents();
       return result;
     }
@@ -602,11 +629,12 @@ public:
 
   [[nodiscard]] std::string toString() const override
   {
-    return "Lua response script";
+    return d_perThreadFunc ? "Lua per-thread response script" : "Lua response script";
   }
 
 private:
   LuaResponseActionFunction d_func;
+  std::optional<dnsdist::lua::perthread::Function<LuaResponseActionFunction>> d_perThreadFunc;
 };
 
 class LuaFFIAction : public DNSAction
@@ -623,7 +651,7 @@ public:
     try {
       DNSAction::Action result{};
       {
-        auto lock = g_lua.lock();
+        auto lock = dnsdist::lua::lockGlobalState();
         auto ret = d_func(&dqffi);
         if (ruleresult != nullptr) {
           if (dqffi.result) {
@@ -742,7 +770,7 @@ public:
     try {
       DNSResponseAction::Action result{};
       {
-        auto lock = g_lua.lock();
+        auto lock = dnsdist::lua::lockGlobalState();
         auto ret = d_func(&ffiResponse);
         if (ruleresult != nullptr) {
           if (ffiResponse.result) {
@@ -1493,10 +1521,8 @@ static std::tuple<DnstapMessage::ProtocolType, boost::optional<DnstapMessage::Ht
   throw std::runtime_error("Unhandled protocol for dnstap: " + protocol.toPrettyString());
 }
 
-static void remoteLoggerQueueData(RemoteLoggerInterface& remoteLogger, const std::string& data)
+static void remoteLoggerLogResult(const RemoteLoggerInterface& remoteLogger, RemoteLoggerInterface::Result ret)
 {
-  auto ret = remoteLogger.queueData(data);
-
   switch (ret) {
   case RemoteLoggerInterface::Result::Queued:
     break;
@@ -1513,6 +1539,11 @@ static void remoteLoggerQueueData(RemoteLoggerInterface& remoteLogger, const std
   }
 }
 
+static void remoteLoggerQueueData(RemoteLoggerInterface& remoteLogger, const std::string& data)
+{
+  remoteLoggerLogResult(remoteLogger, remoteLogger.queueData(data));
+}
+
 class DnstapLogAction : public DNSAction, public boost::noncopyable
 {
 public:
@@ -1532,7 +1563,7 @@ public:
     DnstapMessage message(std::move(data), !dnsquestion->getHeader()->qr ? DnstapMessage::MessageType::client_query : DnstapMessage::MessageType::client_response, d_identity, &dnsquestion->ids.origRemote, &dnsquestion->ids.origDest, protocol, reinterpret_cast<const char*>(dnsquestion->getData().data()), dnsquestion->getData().size(), &dnsquestion->getQueryRealTime(), nullptr, boost::none, httpProtocol);
     {
       if (d_alterFunc) {
-        auto lock = g_lua.lock();
+        auto lock = dnsdist::lua::lockGlobalState();
         (*d_alterFunc)(dnsquestion, &message);
       }
     }
@@ -1646,17 +1677,19 @@ public:
     addMetaDataToProtobuf(message, *dnsquestion, d_metas);
 
     if (d_alterFunc) {
-      auto lock = g_lua.lock();
+      auto lock = dnsdist::lua::lockGlobalState();
       (*d_alterFunc)(dnsquestion, &message);
     }
 
-    static thread_local std::string data;
-    data.clear();
-    message.serialize(data);
-    if (!dnsquestion->ids.d_rawProtobufContent.empty()) {
-      data.insert(data.end(), dnsquestion->ids.d_rawProtobufContent.begin(), dnsquestion->ids.d_rawProtobufContent.end());
-    }
-    remoteLoggerQueueData(*d_logger, data);
+    /* serialize directly into the logger's buffer when it supports it */
+    const auto& rawContent = dnsquestion->ids.d_rawProtobufContent;
+    auto ret = d_logger->serializeAndQueue([&message, &rawContent](std::string& data) {
+      message.serialize(data);
+      if (!rawContent.empty()) {
+        data.insert(data.end(), rawContent.begin(), rawContent.end());
+      }
+    });
+    remoteLoggerLogResult(*d_logger, ret);
 
     return Action::None;
   }
@@ -1788,7 +1821,7 @@ public:
     DnstapMessage message(std::move(data), DnstapMessage::MessageType::client_response, d_identity, &response->ids.origRemote, &response->ids.origDest, protocol, reinterpret_cast<const char*>(response->getData().data()), response->getData().size(), &response->getQueryRealTime(), &now, boost::none, httpProtocol);
     {
       if (d_alterFunc) {
-        auto lock = g_lua.lock();
+        auto lock = dnsdist::lua::lockGlobalState();
         (*d_alterFunc)(response, &message);
       }
     }
@@ -1857,23 +1890,28 @@ public:
     }
 
     if (d_alterFunc) {
-      auto lock = g_lua.lock();
+      auto lock = dnsdist::lua::lockGlobalState();
       (*d_alterFunc)(response, &message);
     }
 
-    static thread_local std::string data;
-    data.clear();
-    message.serialize(data, !d_delay);
-
-    if (!response->ids.d_rawProtobufContent.empty()) {
-      data.insert(data.end(), response->ids.d_rawProtobufContent.begin(), response->ids.d_rawProtobufContent.end());
-    }
-
+    const auto& rawContent = response->ids.d_rawProtobufContent;
     if (d_delay) {
-      response->ids.delayedResponseMsgs.emplace_back(data, std::shared_ptr<RemoteLoggerInterface>(d_logger));
+      std::string data;
+      message.serialize(data, false);
+      if (!rawContent.empty()) {
+        data.insert(data.end(), rawContent.begin(), rawContent.end());
+      }
+      response->ids.delayedResponseMsgs.emplace_back(std::move(data), std::shared_ptr<RemoteLoggerInterface>(d_logger));
     }
     else {
-      d_logger->queueData(data);
+      /* serialize directly into the logger's buffer when it supports it */
+      auto ret = d_logger->serializeAndQueue([&message, &rawContent](std::string& data) {
+        message.serialize(data, true);
+        if (!rawContent.empty()) {
+          data.insert(data.end(), rawContent.begin(), rawContent.end());
+        }
+      });
+      remoteLoggerLogResult(*d_logger, ret);
     }
 
     return Action::None;
@@ -2468,9 +2506,9 @@ private:
   uint32_t d_max{std::numeric_limits<uint32_t>::max()};
 };
 
-std::shared_ptr<DNSAction> getLuaAction(dnsdist::actions::LuaActionFunction function)
+std::shared_ptr<DNSAction> getLuaAction(dnsdist::actions::LuaActionFunction function, std::optional<std::string> perThreadCode)
 {
-  return std::shared_ptr<DNSAction>(new LuaAction(std::move(function)));
+  return std::shared_ptr<DNSAction>(new LuaAction(std::move(function), std::move(perThreadCode)));
 }
 
 std::shared_ptr<DNSAction> getLuaFFIAction(dnsdist::actions::LuaActionFFIFunction function)
@@ -2478,9 +2516,9 @@ std::shared_ptr<DNSAction> getLuaFFIAction(dnsdist::actions::LuaActionFFIFunctio
   return std::shared_ptr<DNSAction>(new LuaFFIAction(std::move(function)));
 }
 
-std::shared_ptr<DNSResponseAction> getLuaResponseAction(dnsdist::actions::LuaResponseActionFunction function)
+std::shared_ptr<DNSResponseAction> getLuaResponseAction(dnsdist::actions::LuaResponseActionFunction function, std::optional<std::string> perThreadCode)
 {
-  return std::shared_ptr<DNSResponseAction>(new LuaResponseAction(std::move(function)));
+  return std::shared_ptr<DNSResponseAction>(new LuaResponseAction(std::move(function), std::move(perThreadCode)));
 }
 
 std::shared_ptr<DNSResponseAction> getLuaFFIResponseAction(dnsdist::actions::LuaResponseActionFFIFunction function)
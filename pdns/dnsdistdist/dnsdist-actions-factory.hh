@@ -62,9 +62,10 @@ struct SOAParams
 #include "dnsdist-actions-factory-generated.hh"
 #include "dnsdist-response-actions-factory-generated.hh"
 
-std::shared_ptr<DNSAction> getLuaAction(dnsdist::actions::LuaActionFunction function);
+/* if 'perThreadCode' is set, the function is instantiated from that bytecode in the per-thread Lua states instead */
+std::shared_ptr<DNSAction> getLuaAction(dnsdist::actions::LuaActionFunction function, std::optional<std::string> perThreadCode = std::nullopt);
 std::shared_ptr<DNSAction> getLuaFFIAction(dnsdist::actions::LuaActionFFIFunction function);
-std::shared_ptr<DNSResponseAction> getLuaResponseAction(dnsdist::actions::LuaResponseActionFunction function);
+std::shared_ptr<DNSResponseAction> getLuaResponseAction(dnsdist::actions::LuaResponseActionFunction function, std::optional<std::string> perThreadCode = std::nullopt);
 std::shared_ptr<DNSResponseAction> getLuaFFIResponseAction(dnsdist::actions::LuaResponseActionFFIFunction function);
 
 std::shared_ptr<DNSAction> getContinueAction(std::shared_ptr<DNSAction> action);
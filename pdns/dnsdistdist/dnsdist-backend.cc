@@ -108,9 +108,7 @@ bool DownstreamState::reconnect(bool initialAttempt)
 
   for (auto& fd : sockets) {
     if (fd != -1) {
-      if (sockets.size() > 1) {
-        (*mplexer.lock())->removeReadFD(fd);
-      }
+      removeSocketFromMultiplexer(fd);
 #ifdef HAVE_XSK
       if (!d_xskInfos.empty()) {
         removeXSKDestination(fd);
@@ -144,9 +142,7 @@ bool DownstreamState::reconnect(bool initialAttempt)
     try {
       setDscp(fd, d_config.remote.sin4.sin_family, d_config.dscp);
       SConnect(fd, d_config.tcpFastOpen, d_config.remote);
-      if (sockets.size() > 1) {
-        (*mplexer.lock())->addReadFD(fd, [](int, boost::any) {});
-      }
+      addSocketToMultiplexer(fd);
 #ifdef HAVE_XSK
       if (!d_xskInfos.empty()) {
         addXSKDestination(fd);
@@ -183,14 +179,12 @@ bool DownstreamState::reconnect(bool initialAttempt)
           removeXSKDestination(fd);
         }
 #endif /* HAVE_XSK */
-        if (sockets.size() > 1) {
-          try {
-            (*mplexer.lock())->removeReadFD(fd);
-          }
-          catch (const FDMultiplexerException& e) {
-            /* some sockets might not have been added to the multiplexer
-               yet, that's fine */
-          }
+        try {
+          removeSocketFromMultiplexer(fd);
+        }
+        catch (const FDMultiplexerException& e) {
+          /* some sockets might not have been added to the multiplexer
+             yet, that's fine */
         }
         /* shutdown() is needed to wake up recv() in the responderThread */
         shutdown(fd, SHUT_RDWR);
@@ -276,6 +270,8 @@ void DownstreamState::setId(const boost::uuids::uuid& newId)
   // compute hashes only if already done
   if (hashesComputed) {
     hash();
+    /* the rings built from our previous hashes are now stale */
+    dnsdist::lbpolicies::rebuildHashRings(this);
   }
 }
 
@@ -290,6 +286,8 @@ void DownstreamState::setWeight(int newWeight)
 
   if (hashesComputed) {
     hash();
+    /* the rings built from our previous hashes are now stale */
+    dnsdist::lbpolicies::rebuildHashRings(this);
   }
 }
 
@@ -369,14 +367,27 @@ void DownstreamState::connectUDPSockets()
 {
   const auto& config = dnsdist::configuration::getImmutableConfiguration();
   if (config.d_randomizeIDsToBackend) {
-    idStates.clear();
+    /* any 16-bit ID might be picked, so we need one slot per possible ID */
+    idStates.resize(static_cast<size_t>(std::numeric_limits<uint16_t>::max()) + 1);
   }
   else {
     idStates.resize(config.d_maxUDPOutstanding);
   }
   sockets.resize(d_config.d_numberOfSockets);
 
-  if (sockets.size() > 1) {
+  if (!config.d_udpResponderMultiplexer.empty()) {
+    /* enough events for the multiplexer to hand us responses in batches */
+    auto receiver = std::unique_ptr<FDMultiplexer>(FDMultiplexer::getMultiplexerSilent(config.d_udpResponderMultiplexer, 64));
+    if (receiver->supportsReceive()) {
+      d_receiveThroughMultiplexer = true;
+      *(mplexer.lock()) = std::move(receiver);
+    }
+    else {
+      warnlog("The '%s' multiplexer cannot receive responses on this system, the responses from backend %s will be read with recv() instead", config.d_udpResponderMultiplexer, getNameWithAddr());
+    }
+  }
+
+  if (!d_receiveThroughMultiplexer && sockets.size() > 1) {
     *(mplexer.lock()) = std::unique_ptr<FDMultiplexer>(FDMultiplexer::getMultiplexerSilent(sockets.size()));
   }
 
@@ -423,6 +434,33 @@ int DownstreamState::pickSocketForSending()
   return sockets[idx % numberOfSockets];
 }
 
+void DownstreamState::addSocketToMultiplexer(int fd)
+{
+  if (d_receiveThroughMultiplexer) {
+    (*mplexer.lock())->addReceiveFD(fd, getUDPResponseReceiveSize());
+  }
+  else if (sockets.size() > 1) {
+    (*mplexer.lock())->addReadFD(fd, [](int, boost::any) {});
+  }
+}
+
+void DownstreamState::removeSocketFromMultiplexer(int fd)
+{
+  if (d_receiveThroughMultiplexer) {
+    (*mplexer.lock())->removeReceiveFD(fd);
+  }
+  else if (sockets.size() > 1) {
+    (*mplexer.lock())->removeReadFD(fd);
+  }
+}
+
+void DownstreamState::receiveResponses(std::vector<FDMultiplexer::ReceivedData>& received)
+{
+  received.clear();
+  /* the data stays valid until the next call, since only this thread waits on the multiplexer */
+  (*mplexer.lock())->getReceivedData(received, 1000);
+}
+
 void DownstreamState::pickSocketsReadyForReceiving(std::vector<int>& ready)
 {
   ready.clear();
@@ -457,6 +495,8 @@ void DownstreamState::handleUDPTimeout(IDState& ids)
   auto sender = ids.internal.du == nullptr ? nullptr : ids.internal.du->getQuerySender();
   if (!handleTimeoutResponseRules(timeoutRespRules, ids.internal, shared_from_this(), sender)) {
     DOHUnitInterface::handleTimeout(std::move(ids.internal.du));
+    /* the query has not been restarted, so the identical queries parked behind it will not be answered either */
+    handleCoalescingLeaderFailure(ids.internal, this);
   }
 
   if (g_rings.shouldRecordResponses()) {
@@ -485,6 +525,11 @@ void DownstreamState::reportResponse(uint8_t rcode)
 
 void DownstreamState::reportTimeoutOrError()
 {
+  /* account for it as a response that took as long as the UDP timeout, so that
+     the latency-aware policy moves away from this backend */
+  const auto udpTimeout = d_config.udpTimeout > 0 ? d_config.udpTimeout : dnsdist::configuration::getImmutableConfiguration().d_udpTimeout;
+  updatePolicyLatency(udpTimeout * 1000000.0);
+
   if (d_config.d_availability == Availability::Auto && d_config.d_healthCheckMode == HealthCheckMode::Lazy && d_config.d_lazyHealthCheckSampleSize > 0) {
     d_lazyHealthCheckStats.lock()->d_lastResults.push_back(true);
   }
@@ -498,37 +543,22 @@ void DownstreamState::handleUDPTimeouts()
 
   const auto& config = dnsdist::configuration::getImmutableConfiguration();
   const auto udpTimeout = d_config.udpTimeout > 0 ? d_config.udpTimeout : config.d_udpTimeout;
-  if (config.d_randomizeIDsToBackend) {
-    auto map = d_idStatesMap.lock();
-    for (auto it = map->begin(); it != map->end(); ) {
-      auto& ids = it->second;
-      if (isIDSExpired(ids, udpTimeout)) {
-        handleUDPTimeout(ids);
-        it = map->erase(it);
+  if (outstanding.load() > 0) {
+    for (IDState& ids : idStates) {
+      if (!ids.isInUse()) {
         continue;
       }
-      ++ids.age;
-      ++it;
-    }
-  }
-  else {
-    if (outstanding.load() > 0) {
-      for (IDState& ids : idStates) {
-        if (!ids.isInUse()) {
-          continue;
-        }
-        if (!isIDSExpired(ids, udpTimeout)) {
-          ++ids.age;
-          continue;
-        }
-        auto guard = ids.acquire();
-        if (!guard) {
-          continue;
-        }
-        /* check again, now that we have locked this state */
-        if (ids.isInUse() && isIDSExpired(ids, udpTimeout)) {
-          handleUDPTimeout(ids);
-        }
+      if (!isIDSExpired(ids, udpTimeout)) {
+        ++ids.age;
+        continue;
+      }
+      auto guard = ids.acquire();
+      if (!guard) {
+        continue;
+      }
+      /* check again, now that we have locked this state */
+      if (ids.isInUse() && isIDSExpired(ids, udpTimeout)) {
+        handleUDPTimeout(ids);
       }
     }
   }
@@ -537,54 +567,34 @@ void DownstreamState::handleUDPTimeouts()
 uint16_t DownstreamState::saveState(InternalQueryState&& state)
 {
   const auto& config = dnsdist::configuration::getImmutableConfiguration();
-  if (config.d_randomizeIDsToBackend) {
-    /* if the state is already in use we will retry,
-       up to 5 five times. The last selected one is used
-       even if it was already in use */
-    size_t remainingAttempts = 5;
-    auto map = d_idStatesMap.lock();
-
-    do {
-      uint16_t selectedID = dnsdist::getRandomValue(std::numeric_limits<uint16_t>::max());
-      auto [it, inserted] = map->emplace(selectedID, IDState());
-
-      if (!inserted) {
-        remainingAttempts--;
-        if (remainingAttempts > 0) {
-          continue;
-        }
-
-        auto oldDU = std::move(it->second.internal.du);
-        ++reuseds;
-        ++dnsdist::metrics::g_stats.downstreamTimeouts;
-        DOHUnitInterface::handleTimeout(std::move(oldDU));
-      }
-      else {
-        ++outstanding;
-      }
-
-      it->second.internal = std::move(state);
-      it->second.age.store(0);
-
-      return it->first;
-    }
-    while (true);
-  }
+  const bool randomizeIDs = config.d_randomizeIDsToBackend;
+  /* when IDs are randomized, if the state is already in use we will retry,
+     up to 5 five times. The last selected one is used
+     even if it was already in use */
+  size_t remainingAttempts = 5;
 
   do {
-    uint16_t selectedID = (idOffset++) % idStates.size();
+    uint16_t selectedID = randomizeIDs ? dnsdist::getRandomValue(std::numeric_limits<uint16_t>::max()) : (idOffset++) % idStates.size();
     IDState& ids = idStates[selectedID];
     auto guard = ids.acquire();
     if (!guard) {
       continue;
     }
     if (ids.isInUse()) {
+      if (randomizeIDs) {
+        remainingAttempts--;
+        if (remainingAttempts > 0) {
+          continue;
+        }
+      }
+
       /* we are reusing a state, no change in outstanding but if there was an existing DOHUnit we need
          to handle it because it's about to be overwritten. */
       auto oldDU = std::move(ids.internal.du);
       ++reuseds;
       ++dnsdist::metrics::g_stats.downstreamTimeouts;
       DOHUnitInterface::handleTimeout(std::move(oldDU));
+      handleCoalescingLeaderFailure(ids.internal, this);
     }
     else {
       ++outstanding;
@@ -599,24 +609,6 @@ uint16_t DownstreamState::saveState(InternalQueryState&& state)
 
 void DownstreamState::restoreState(uint16_t id, InternalQueryState&& state)
 {
-  const auto& config = dnsdist::configuration::getImmutableConfiguration();
-  if (config.d_randomizeIDsToBackend) {
-    auto map = d_idStatesMap.lock();
-
-    auto [it, inserted] = map->emplace(id, IDState());
-    if (!inserted) {
-      /* already used */
-      ++reuseds;
-      ++dnsdist::metrics::g_stats.downstreamTimeouts;
-      DOHUnitInterface::handleTimeout(std::move(state.du));
-    }
-    else {
-      it->second.internal = std::move(state);
-      ++outstanding;
-    }
-    return;
-  }
-
   auto& ids = idStates[id];
   auto guard = ids.acquire();
   if (!guard) {
@@ -624,6 +616,7 @@ void DownstreamState::restoreState(uint16_t id, InternalQueryState&& state)
     ++reuseds;
     ++dnsdist::metrics::g_stats.downstreamTimeouts;
     DOHUnitInterface::handleTimeout(std::move(state.du));
+    handleCoalescingLeaderFailure(state, this);
     return;
   }
   if (ids.isInUse()) {
@@ -631,6 +624,7 @@ void DownstreamState::restoreState(uint16_t id, InternalQueryState&& state)
     ++reuseds;
     ++dnsdist::metrics::g_stats.downstreamTimeouts;
     DOHUnitInterface::handleTimeout(std::move(state.du));
+    handleCoalescingLeaderFailure(state, this);
     return;
   }
   ids.internal = std::move(state);
@@ -641,22 +635,7 @@ void DownstreamState::restoreState(uint16_t id, InternalQueryState&& state)
 std::optional<InternalQueryState> DownstreamState::getState(uint16_t id)
 {
   std::optional<InternalQueryState> result = std::nullopt;
-  const auto& config = dnsdist::configuration::getImmutableConfiguration();
-  if (config.d_randomizeIDsToBackend) {
-    auto map = d_idStatesMap.lock();
-
-    auto it = map->find(id);
-    if (it == map->end()) {
-      return result;
-    }
-
-    result = std::move(it->second.internal);
-    map->erase(it);
-    --outstanding;
-    return result;
-  }
-
-  if (id > idStates.size()) {
+  if (id >= idStates.size()) {
     return result;
   }
 
@@ -1070,6 +1049,7 @@ void ServerPool::addServer(std::shared_ptr<DownstreamState>& server)
   }
 
   updateConsistency();
+  rebuildHashRing();
 }
 
 void ServerPool::removeServer(shared_ptr<DownstreamState>& server)
@@ -1095,6 +1075,17 @@ void ServerPool::removeServer(shared_ptr<DownstreamState>& server)
   if (found && !d_isConsistent) {
     updateConsistency();
   }
+  if (found) {
+    rebuildHashRing();
+  }
+}
+
+void ServerPool::rebuildHashRing()
+{
+  if (!dnsdist::configuration::isImmutableConfigurationDone()) {
+    return;
+  }
+  d_hashRing = std::make_shared<const ConsistentHashRing>(d_servers);
 }
 
 void ServerPool::updateConsistency()
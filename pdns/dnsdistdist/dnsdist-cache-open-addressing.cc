@@ -0,0 +1,338 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#include "dnsdist-cache-open-addressing.hh"
+
+namespace dnsdist::cache
+{
+static size_t getNumberOfBuckets(size_t maxEntries, size_t waysPerBucket)
+{
+  /* keep the load factor under 75% so that probe sequences stay short */
+  const size_t wanted = std::max(static_cast<size_t>(1), ((maxEntries * 4 / 3) + waysPerBucket - 1) / waysPerBucket);
+  size_t count = 1;
+  while (count < wanted) {
+    count <<= 1;
+  }
+  return count;
+}
+
+OpenAddressingShard::OpenAddressingShard(size_t maxEntries, size_t maximumEntrySize) :
+  d_buckets(getNumberOfBuckets(maxEntries, s_waysPerBucket)), d_bucketsMask(d_buckets.size() - 1), d_maxEntries(maxEntries)
+{
+  /* we need one more slot than the number of entries, since replacing an entry
+     allocates the new slot before releasing the old one */
+  const size_t slotsPerClass = maxEntries + 1;
+  if (slotsPerClass >= (std::numeric_limits<uint32_t>::max() >> s_classBits)) {
+    throw std::runtime_error("Too many entries requested for an open-addressing packet cache shard (" + std::to_string(maxEntries) + ")");
+  }
+
+  /* size classes go 128, 192, 256, 384, 512, 768, ... until the largest one can hold
+     a qname of the maximum size and a response of the maximum entry size */
+  const size_t largest = sizeof(EntryHeader) + 255 + std::min(maximumEntrySize, static_cast<size_t>(std::numeric_limits<uint16_t>::max()));
+  static constexpr size_t slabSize{65536};
+  size_t slotSize = 128;
+  while (true) {
+    SizeClass sizeClass;
+    sizeClass.d_slotSize = slotSize;
+    sizeClass.d_slotsPerSlab = std::min(std::max(static_cast<size_t>(1), slabSize / slotSize), slotsPerClass);
+    sizeClass.d_slabsCount = (slotsPerClass + sizeClass.d_slotsPerSlab - 1) / sizeClass.d_slotsPerSlab;
+    sizeClass.d_slabs = std::make_unique<std::atomic<char*>[]>(sizeClass.d_slabsCount);
+    for (size_t idx = 0; idx < sizeClass.d_slabsCount; idx++) {
+      sizeClass.d_slabs[idx].store(nullptr);
+    }
+    d_classes.push_back(std::move(sizeClass));
+
+    if (slotSize >= largest) {
+      break;
+    }
+    if ((slotSize & (slotSize - 1)) == 0) {
+      slotSize += slotSize / 2;
+    }
+    else {
+      slotSize = (slotSize / 3) * 4;
+    }
+  }
+
+  d_writer.lock()->d_classes.resize(d_classes.size());
+}
+
+size_t OpenAddressingShard::getHomeBucket(uint32_t key) const
+{
+  /* the keys of a given shard share the same remainder modulo the number of shards,
+     so we cannot use their lowest bits directly */
+  return static_cast<size_t>((static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ULL) >> 32) & d_bucketsMask;
+}
+
+const char* OpenAddressingShard::getSlotData(uint32_t slotRef) const
+{
+  const uint32_t classIdx = slotRef & ((1U << s_classBits) - 1);
+  if (classIdx >= d_classes.size() || (slotRef >> s_classBits) == 0) {
+    return nullptr;
+  }
+  const auto& sizeClass = d_classes[classIdx];
+  const size_t index = (slotRef >> s_classBits) - 1;
+  const size_t slabIdx = index / sizeClass.d_slotsPerSlab;
+  if (slabIdx >= sizeClass.d_slabsCount) {
+    return nullptr;
+  }
+  const char* slab = sizeClass.d_slabs[slabIdx].load(std::memory_order_acquire);
+  if (slab == nullptr) {
+    return nullptr;
+  }
+  return slab + ((index % sizeClass.d_slotsPerSlab) * sizeClass.d_slotSize);
+}
+
+uint32_t OpenAddressingShard::allocateSlot(WriterState& state, size_t neededSize)
+{
+  for (size_t classIdx = 0; classIdx < d_classes.size(); classIdx++) {
+    auto& sizeClass = d_classes[classIdx];
+    if (sizeClass.d_slotSize < neededSize) {
+      continue;
+    }
+
+    auto& classState = state.d_classes[classIdx];
+    size_t index = 0;
+    if (!classState.d_freeSlots.empty()) {
+      index = classState.d_freeSlots.back();
+      classState.d_freeSlots.pop_back();
+    }
+    else {
+      if (classState.d_nextSlot >= (sizeClass.d_slabsCount * sizeClass.d_slotsPerSlab)) {
+        return 0;
+      }
+      index = classState.d_nextSlot++;
+      const size_t slabIdx = index / sizeClass.d_slotsPerSlab;
+      if (sizeClass.d_slabs[slabIdx].load(std::memory_order_relaxed) == nullptr) {
+        auto slab = std::make_unique<char[]>(sizeClass.d_slotsPerSlab * sizeClass.d_slotSize);
+        sizeClass.d_slabs[slabIdx].store(slab.get(), std::memory_order_release);
+        classState.d_ownedSlabs.push_back(std::move(slab));
+      }
+    }
+    return static_cast<uint32_t>(((index + 1) << s_classBits) | classIdx);
+  }
+  return 0;
+}
+
+void OpenAddressingShard::releaseSlot(WriterState& state, uint32_t slotRef)
+{
+  const uint32_t classIdx = slotRef & ((1U << s_classBits) - 1);
+  state.d_classes.at(classIdx).d_freeSlots.push_back((slotRef >> s_classBits) - 1);
+}
+
+uint32_t OpenAddressingShard::storeEntry(WriterState& state, const EntryHeader& header, std::string_view qname, const PacketBuffer& response)
+{
+  if (qname.size() > std::numeric_limits<uint16_t>::max() || response.size() > std::numeric_limits<uint16_t>::max()) {
+    return 0;
+  }
+
+  auto slotRef = allocateSlot(state, sizeof(EntryHeader) + qname.size() + response.size());
+  if (slotRef == 0) {
+    return 0;
+  }
+
+  EntryHeader stored(header);
+  stored.qnameLen = static_cast<uint16_t>(qname.size());
+  stored.responseLen = static_cast<uint16_t>(response.size());
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-const-cast): we are the only writer, and the slot is not published yet
+  auto* slot = const_cast<char*>(getSlotData(slotRef));
+  memcpy(slot, &stored, sizeof(stored));
+  memcpy(slot + sizeof(stored), qname.data(), qname.size());
+  memcpy(slot + sizeof(stored) + qname.size(), response.data(), response.size());
+  return slotRef;
+}
+
+void OpenAddressingShard::publish(Bucket& bucket, size_t way, uint32_t key, uint32_t slotRef)
+{
+  const auto sequence = bucket.d_sequence.load(std::memory_order_relaxed);
+  bucket.d_sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  bucket.d_keys.at(way).store(key, std::memory_order_relaxed);
+  bucket.d_slots.at(way).store(slotRef, std::memory_order_relaxed);
+  bucket.d_sequence.store(sequence + 2, std::memory_order_release);
+}
+
+OpenAddressingShard::LookupResult OpenAddressingShard::tryLookup(uint32_t key, EntryHeader& header, PacketBuffer& data) const
+{
+  size_t bucketIdx = getHomeBucket(key);
+  for (size_t probes = 0; probes < d_buckets.size(); probes++) {
+    const auto& bucket = d_buckets[bucketIdx];
+    const auto sequence = bucket.d_sequence.load(std::memory_order_acquire);
+    if ((sequence & 1) != 0) {
+      return LookupResult::Busy;
+    }
+
+    uint32_t slotRef = 0;
+    for (size_t way = 0; way < s_waysPerBucket; way++) {
+      if (bucket.d_keys[way].load(std::memory_order_relaxed) == key) {
+        slotRef = bucket.d_slots[way].load(std::memory_order_relaxed);
+        if (slotRef != 0) {
+          break;
+        }
+      }
+    }
+    const bool displaced = bucket.d_displaced.load(std::memory_order_relaxed) > 0;
+
+    bool consistent = true;
+    if (slotRef != 0) {
+      /* the content of the slot might be modified while we copy it, in which case
+         the sequence will have changed and we will discard what we read */
+      const char* slot = getSlotData(slotRef);
+      if (slot == nullptr) {
+        consistent = false;
+      }
+      else {
+        memcpy(&header, slot, sizeof(header));
+        const size_t slotSize = d_classes[slotRef & ((1U << s_classBits) - 1)].d_slotSize;
+        const size_t dataSize = static_cast<size_t>(header.qnameLen) + header.responseLen;
+        if ((sizeof(header) + dataSize) > slotSize) {
+          consistent = false;
+        }
+        else {
+          data.resize(dataSize);
+          memcpy(data.data(), slot + sizeof(header), dataSize);
+        }
+      }
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (bucket.d_sequence.load(std::memory_order_relaxed) != sequence) {
+      return LookupResult::Busy;
+    }
+    if (slotRef != 0) {
+      return consistent ? LookupResult::Found : LookupResult::NotFound;
+    }
+    if (!displaced) {
+      return LookupResult::NotFound;
+    }
+    bucketIdx = (bucketIdx + 1) & d_bucketsMask;
+  }
+  return LookupResult::NotFound;
+}
+
+OpenAddressingShard::LookupResult OpenAddressingShard::lookup(uint32_t key, EntryHeader& header, PacketBuffer& data) const
+{
+  for (size_t attempt = 0; attempt < s_maxReadAttempts; attempt++) {
+    auto result = tryLookup(key, header, data);
+    if (result != LookupResult::Busy) {
+      return result;
+    }
+  }
+  return LookupResult::Busy;
+}
+
+size_t OpenAddressingShard::size(const WriteLock& lock) const
+{
+  return lock->d_entries;
+}
+
+std::optional<OpenAddressingShard::Position> OpenAddressingShard::find(const WriteLock& /* lock */, uint32_t key) const
+{
+  size_t bucketIdx = getHomeBucket(key);
+  for (size_t probes = 0; probes < d_buckets.size(); probes++) {
+    const auto& bucket = d_buckets[bucketIdx];
+    for (size_t way = 0; way < s_waysPerBucket; way++) {
+      if (bucket.d_slots[way].load(std::memory_order_relaxed) != 0 && bucket.d_keys[way].load(std::memory_order_relaxed) == key) {
+        return Position{bucketIdx, way};
+      }
+    }
+    if (bucket.d_displaced.load(std::memory_order_relaxed) == 0) {
+      break;
+    }
+    bucketIdx = (bucketIdx + 1) & d_bucketsMask;
+  }
+  return std::nullopt;
+}
+
+OpenAddressingShard::EntryView OpenAddressingShard::getEntry(const WriteLock& /* lock */, const Position& position) const
+{
+  EntryView view;
+  const char* slot = getSlotData(d_buckets.at(position.bucket).d_slots.at(position.way).load(std::memory_order_relaxed));
+  memcpy(&view.header, slot, sizeof(view.header));
+  view.qname = slot + sizeof(view.header);
+  view.response = view.qname + view.header.qnameLen;
+  return view;
+}
+
+bool OpenAddressingShard::insert(WriteLock& lock, uint32_t key, const EntryHeader& header, std::string_view qname, const PacketBuffer& response)
+{
+  auto& state = *lock;
+  if (state.d_entries >= d_maxEntries) {
+    return false;
+  }
+
+  const size_t homeIdx = getHomeBucket(key);
+  size_t bucketIdx = homeIdx;
+  for (size_t probes = 0; probes < d_buckets.size(); probes++) {
+    auto& bucket = d_buckets[bucketIdx];
+    for (size_t way = 0; way < s_waysPerBucket; way++) {
+      if (bucket.d_slots[way].load(std::memory_order_relaxed) != 0) {
+        continue;
+      }
+
+      auto slotRef = storeEntry(state, header, qname, response);
+      if (slotRef == 0) {
+        return false;
+      }
+      /* let readers know they need to look further than the buckets we skipped */
+      for (size_t idx = homeIdx; idx != bucketIdx; idx = (idx + 1) & d_bucketsMask) {
+        d_buckets[idx].d_displaced.fetch_add(1, std::memory_order_relaxed);
+      }
+      publish(bucket, way, key, slotRef);
+      ++state.d_entries;
+      return true;
+    }
+    bucketIdx = (bucketIdx + 1) & d_bucketsMask;
+  }
+  return false;
+}
+
+void OpenAddressingShard::replace(WriteLock& lock, const Position& position, const EntryHeader& header, std::string_view qname, const PacketBuffer& response)
+{
+  auto& state = *lock;
+  auto& bucket = d_buckets.at(position.bucket);
+  const auto oldRef = bucket.d_slots.at(position.way).load(std::memory_order_relaxed);
+  auto newRef = storeEntry(state, header, qname, response);
+  if (newRef == 0) {
+    return;
+  }
+  publish(bucket, position.way, bucket.d_keys.at(position.way).load(std::memory_order_relaxed), newRef);
+  releaseSlot(state, oldRef);
+}
+
+void OpenAddressingShard::erase(WriteLock& lock, const Position& position)
+{
+  auto& state = *lock;
+  auto& bucket = d_buckets.at(position.bucket);
+  const auto key = bucket.d_keys.at(position.way).load(std::memory_order_relaxed);
+  const auto slotRef = bucket.d_slots.at(position.way).load(std::memory_order_relaxed);
+  publish(bucket, position.way, key, 0);
+  for (size_t idx = getHomeBucket(key); idx != position.bucket; idx = (idx + 1) & d_bucketsMask) {
+    d_buckets[idx].d_displaced.fetch_sub(1, std::memory_order_relaxed);
+  }
+  releaseSlot(state, slotRef);
+  --state.d_entries;
+}
+}
@@ -0,0 +1,212 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "iputils.hh"
+#include "lock.hh"
+#include "noinitvector.hh"
+
+namespace dnsdist::cache
+{
+/* Storage engine for one shard of the packet cache, using open addressing over
+   cache-line sized buckets of several entries each.
+   Lookups do not take any lock: every bucket is protected by a sequence lock, and a
+   reader simply retries if the bucket was modified while it was looking at it.
+   Writers are serialized by a per-shard lock, which also protects the arena the entries
+   are stored in. The arena is made of slabs of fixed-size slots, with size classes going
+   up to the maximum entry size, so that neither lookups nor insertions touch the heap
+   once the arena is warm. */
+class OpenAddressingShard
+{
+public:
+  /* everything we need to know about an entry, stored in front of its qname (wire format)
+     and response in the slot */
+  struct EntryHeader
+  {
+    time_t added{0};
+    time_t validity{0};
+    ComboAddress subnetNetwork;
+    uint16_t qtype{0};
+    uint16_t qclass{0};
+    uint16_t queryFlags{0};
+    uint16_t responseLen{0};
+    uint16_t qnameLen{0};
+    uint8_t subnetBits{0};
+    bool hasSubnet{false};
+    bool receivedOverUDP{false};
+    bool dnssecOK{false};
+  };
+
+  /* an entry as seen by a writer, pointing directly into the arena, so only valid
+     as long as the write lock is held and the entry is not modified */
+  struct EntryView
+  {
+    std::string_view getQName() const
+    {
+      return {qname, header.qnameLen};
+    }
+    std::string_view getResponse() const
+    {
+      return {response, header.responseLen};
+    }
+
+    EntryHeader header;
+    const char* qname{nullptr};
+    const char* response{nullptr};
+  };
+
+  struct Position
+  {
+    size_t bucket{0};
+    size_t way{0};
+  };
+
+  enum class LookupResult : uint8_t
+  {
+    Found,
+    NotFound,
+    Busy
+  };
+
+  OpenAddressingShard(size_t maxEntries, size_t maximumEntrySize);
+  ~OpenAddressingShard() = default;
+  OpenAddressingShard(const OpenAddressingShard&) = delete;
+  OpenAddressingShard(OpenAddressingShard&&) = delete;
+  OpenAddressingShard& operator=(const OpenAddressingShard&) = delete;
+  OpenAddressingShard& operator=(OpenAddressingShard&&) = delete;
+
+  /* Lock-free lookup. On success the header of the entry is copied into 'header' and its qname
+     followed by its response are copied into 'data'. Busy means that the bucket kept being
+     modified while we were reading it */
+  LookupResult lookup(uint32_t key, EntryHeader& header, PacketBuffer& data) const;
+
+  /* only accessed by writers, under the write lock */
+  struct WriterState
+  {
+    struct SizeClassState
+    {
+      std::vector<std::unique_ptr<char[]>> d_ownedSlabs;
+      std::vector<uint32_t> d_freeSlots;
+      uint32_t d_nextSlot{0};
+    };
+    std::vector<SizeClassState> d_classes;
+    size_t d_entries{0};
+  };
+
+  /* everything below requires holding the write lock */
+  using WriteLock = LockGuardedTryHolder<WriterState>;
+  WriteLock tryWriteLock()
+  {
+    return d_writer.try_lock();
+  }
+
+  size_t size(const WriteLock& lock) const;
+  std::optional<Position> find(const WriteLock& lock, uint32_t key) const;
+  EntryView getEntry(const WriteLock& lock, const Position& position) const;
+  /* store a new entry for a key that is not present yet, returning false if there is no room left */
+  bool insert(WriteLock& lock, uint32_t key, const EntryHeader& header, std::string_view qname, const PacketBuffer& response);
+  void replace(WriteLock& lock, const Position& position, const EntryHeader& header, std::string_view qname, const PacketBuffer& response);
+  void erase(WriteLock& lock, const Position& position);
+
+  /* call visitor(key, entryView) for every entry, removing the entry if the visitor returns true */
+  template <typename Visitor>
+  size_t removeIf(WriteLock& lock, const Visitor& visitor)
+  {
+    size_t removed = 0;
+    for (size_t bucketIdx = 0; bucketIdx < d_buckets.size(); bucketIdx++) {
+      for (size_t way = 0; way < s_waysPerBucket; way++) {
+        const Position position{bucketIdx, way};
+        if (d_buckets[bucketIdx].d_slots[way].load(std::memory_order_relaxed) == 0) {
+          continue;
+        }
+        if (visitor(d_buckets[bucketIdx].d_keys[way].load(std::memory_order_relaxed), getEntry(lock, position))) {
+          erase(lock, position);
+          ++removed;
+        }
+      }
+    }
+    return removed;
+  }
+
+  template <typename Visitor>
+  void forEach(const WriteLock& lock, const Visitor& visitor) const
+  {
+    for (size_t bucketIdx = 0; bucketIdx < d_buckets.size(); bucketIdx++) {
+      for (size_t way = 0; way < s_waysPerBucket; way++) {
+        if (d_buckets[bucketIdx].d_slots[way].load(std::memory_order_relaxed) == 0) {
+          continue;
+        }
+        visitor(d_buckets[bucketIdx].d_keys[way].load(std::memory_order_relaxed), getEntry(lock, {bucketIdx, way}));
+      }
+    }
+  }
+
+  static constexpr size_t s_waysPerBucket{7};
+
+private:
+  /* one cache line: the sequence, the displacement counter and 7 (key, slot) pairs.
+     A slot reference of 0 means that the way is empty */
+  struct alignas(64) Bucket
+  {
+    std::atomic<uint32_t> d_sequence{0};
+    /* number of entries stored in a later bucket because this one was full when they
+       were inserted, readers need to keep probing past this bucket when it is not 0 */
+    std::atomic<uint32_t> d_displaced{0};
+    std::array<std::atomic<uint32_t>, s_waysPerBucket> d_keys{};
+    std::array<std::atomic<uint32_t>, s_waysPerBucket> d_slots{};
+  };
+  static_assert(sizeof(Bucket) == 64, "A bucket should fit in a single cache line");
+
+  struct SizeClass
+  {
+    size_t d_slotSize{0};
+    size_t d_slotsPerSlab{0};
+    /* fixed-size table, filled by the writer as slabs get allocated and read by lock-free readers */
+    std::unique_ptr<std::atomic<char*>[]> d_slabs;
+    size_t d_slabsCount{0};
+  };
+
+  static constexpr uint32_t s_classBits{5};
+  static constexpr size_t s_maxReadAttempts{3};
+
+  size_t getHomeBucket(uint32_t key) const;
+  const char* getSlotData(uint32_t slotRef) const;
+  uint32_t allocateSlot(WriterState& state, size_t neededSize);
+  void releaseSlot(WriterState& state, uint32_t slotRef);
+  uint32_t storeEntry(WriterState& state, const EntryHeader& header, std::string_view qname, const PacketBuffer& response);
+  void publish(Bucket& bucket, size_t way, uint32_t key, uint32_t slotRef);
+  LookupResult tryLookup(uint32_t key, EntryHeader& header, PacketBuffer& data) const;
+
+  std::vector<Bucket> d_buckets;
+  std::vector<SizeClass> d_classes;
+  size_t d_bucketsMask{0};
+  size_t d_maxEntries{0};
+  LockGuarded<WriterState> d_writer;
+};
+}
@@ -0,0 +1,345 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <limits>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+
+#include "dnsdist-cache-shared.hh"
+#include "gettime.hh"
+#include "misc.hh"
+
+namespace dnsdist::cache
+{
+struct alignas(64) SharedSegment::SegmentHeader
+{
+  static constexpr uint64_t s_magic{0x646e73646973744dULL};
+  static constexpr uint32_t s_version{2};
+
+  uint64_t d_magic{0};
+  uint32_t d_version{0};
+  uint32_t d_entryHeaderSize{0};
+  uint64_t d_slotsCount{0};
+  uint64_t d_slotSize{0};
+  uint64_t d_waysPerSet{0};
+  /* set by the process creating the segment once the fields above have been filled */
+  std::atomic<uint32_t> d_ready;
+};
+
+static std::string getSegmentName(const std::string& name)
+{
+  if (name.empty()) {
+    throw std::runtime_error("The name of a shared packet cache segment cannot be empty");
+  }
+  if (name.at(0) == '/') {
+    return name;
+  }
+  return "/" + name;
+}
+
+static size_t getNumberOfSets(size_t entries, size_t waysPerSet)
+{
+  const size_t wanted = std::max(static_cast<size_t>(1), (entries + waysPerSet - 1) / waysPerSet);
+  size_t count = 1;
+  while (count < wanted) {
+    count <<= 1;
+  }
+  return count;
+}
+
+SharedSegment::SharedSegment(const std::string& name, size_t entries, size_t slotSize, uint32_t abandonedLockDelay) :
+  d_abandonedLockDelay(abandonedLockDelay)
+{
+  static constexpr size_t cacheLineSize{64};
+  const size_t minimumSlotSize = sizeof(Slot) + sizeof(EntryHeader) + cacheLineSize;
+  slotSize = std::max(slotSize, minimumSlotSize);
+  slotSize = (slotSize + cacheLineSize - 1) & ~(cacheLineSize - 1);
+  const size_t setsCount = getNumberOfSets(entries, s_waysPerSet);
+  if (setsCount > (std::numeric_limits<uint32_t>::max() / s_waysPerSet)) {
+    throw std::runtime_error("Too many entries requested for a shared packet cache segment (" + std::to_string(entries) + ")");
+  }
+  d_slotsCount = setsCount * s_waysPerSet;
+  d_slotSize = slotSize;
+  d_setsMask = setsCount - 1;
+  d_mappingSize = sizeof(SegmentHeader) + (d_slotsCount * d_slotSize);
+
+  const auto segmentName = getSegmentName(name);
+  bool creator = true;
+  FDWrapper desc(shm_open(segmentName.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR));
+  if (desc.getHandle() < 0) {
+    if (errno != EEXIST) {
+      throw std::runtime_error("Unable to create the shared packet cache segment '" + segmentName + "': " + stringerror());
+    }
+    creator = false;
+    desc = FDWrapper(shm_open(segmentName.c_str(), O_RDWR | O_CLOEXEC, 0));
+    if (desc.getHandle() < 0) {
+      throw std::runtime_error("Unable to open the shared packet cache segment '" + segmentName + "': " + stringerror());
+    }
+  }
+
+  if (creator) {
+    if (ftruncate(desc.getHandle(), static_cast<off_t>(d_mappingSize)) != 0) {
+      int err = errno;
+      shm_unlink(segmentName.c_str());
+      throw std::runtime_error("Unable to set the size of the shared packet cache segment '" + segmentName + "': " + stringerror(err));
+    }
+  }
+  else {
+    /* the process creating the segment might not have set its size yet */
+    struct stat fileStat{};
+    for (size_t attempt = 0; attempt < 100; attempt++) {
+      if (fstat(desc.getHandle(), &fileStat) != 0) {
+        throw std::runtime_error("Unable to get the size of the shared packet cache segment '" + segmentName + "': " + stringerror());
+      }
+      if (fileStat.st_size != 0) {
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    if (static_cast<size_t>(fileStat.st_size) != d_mappingSize) {
+      throw std::runtime_error("The existing shared packet cache segment '" + segmentName + "' has a size of " + std::to_string(fileStat.st_size) + " bytes, but " + std::to_string(d_mappingSize) + " were expected, it was likely created with different settings");
+    }
+  }
+
+  d_mapping = mmap(nullptr, d_mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, desc.getHandle(), 0);
+  if (d_mapping == MAP_FAILED) {
+    d_mapping = nullptr;
+    int err = errno;
+    if (creator) {
+      shm_unlink(segmentName.c_str());
+    }
+    throw std::runtime_error("Unable to map the shared packet cache segment '" + segmentName + "': " + stringerror(err));
+  }
+
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  auto* header = reinterpret_cast<SegmentHeader*>(d_mapping);
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast,cppcoreguidelines-pro-bounds-pointer-arithmetic)
+  d_slots = reinterpret_cast<char*>(d_mapping) + sizeof(SegmentHeader);
+
+  if (creator) {
+    /* the memory of a new segment is zero-filled, which is an empty slot */
+    header->d_magic = SegmentHeader::s_magic;
+    header->d_version = SegmentHeader::s_version;
+    header->d_entryHeaderSize = sizeof(EntryHeader);
+    header->d_slotsCount = d_slotsCount;
+    header->d_slotSize = d_slotSize;
+    header->d_waysPerSet = s_waysPerSet;
+    header->d_ready.store(1, std::memory_order_release);
+    return;
+  }
+
+  for (size_t attempt = 0; attempt < 100 && header->d_ready.load(std::memory_order_acquire) == 0; attempt++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  std::string error;
+  if (header->d_ready.load(std::memory_order_acquire) == 0) {
+    error = "has not been initialized by the process that created it";
+  }
+  else if (header->d_magic != SegmentHeader::s_magic || header->d_version != SegmentHeader::s_version || header->d_entryHeaderSize != sizeof(EntryHeader) || header->d_waysPerSet != s_waysPerSet) {
+    error = "has been created by an incompatible version";
+  }
+  else if (header->d_slotsCount != d_slotsCount || header->d_slotSize != d_slotSize) {
+    error = "has been created with " + std::to_string(header->d_slotsCount) + " entries of " + std::to_string(header->d_slotSize) + " bytes instead of " + std::to_string(d_slotsCount) + " entries of " + std::to_string(d_slotSize) + " bytes";
+  }
+  if (!error.empty()) {
+    munmap(d_mapping, d_mappingSize);
+    d_mapping = nullptr;
+    throw std::runtime_error("The existing shared packet cache segment '" + segmentName + "' " + error);
+  }
+}
+
+SharedSegment::~SharedSegment()
+{
+  if (d_mapping != nullptr) {
+    munmap(d_mapping, d_mappingSize);
+  }
+}
+
+void SharedSegment::unlink(const std::string& name)
+{
+  shm_unlink(getSegmentName(name).c_str());
+}
+
+SharedSegment::Slot& SharedSegment::getSlot(size_t idx) const
+{
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast,cppcoreguidelines-pro-bounds-pointer-arithmetic)
+  return *reinterpret_cast<Slot*>(d_slots + (idx * d_slotSize));
+}
+
+size_t SharedSegment::getMaximumPayloadSize() const
+{
+  return d_slotSize - sizeof(Slot) - sizeof(EntryHeader);
+}
+
+static uint32_t getSequence(uint64_t lockWord)
+{
+  return static_cast<uint32_t>(lockWord);
+}
+
+static uint32_t getLockedSince(uint64_t lockWord)
+{
+  return static_cast<uint32_t>(lockWord >> 32);
+}
+
+static uint64_t makeLockWord(uint32_t lockedSince, uint32_t sequence)
+{
+  return (static_cast<uint64_t>(lockedSince) << 32) | sequence;
+}
+
+uint32_t SharedSegment::getLockTime()
+{
+  /* the monotonic clock is the same for every process of the system */
+  timespec now{};
+  gettime(&now);
+  return static_cast<uint32_t>(now.tv_sec);
+}
+
+bool SharedSegment::lockSlot(Slot& slot, uint64_t& locked, uint32_t now) const
+{
+  auto current = slot.d_sequence.load(std::memory_order_relaxed);
+  const auto sequence = getSequence(current);
+  if ((sequence & 1) != 0) {
+    /* a writer holding the lock for that long has most likely died while modifying the slot,
+       so we take the lock over, keeping the sequence odd, and empty the slot since its
+       content cannot be trusted */
+    const auto lockedSince = getLockedSince(current);
+    if (now < lockedSince || (now - lockedSince) < d_abandonedLockDelay) {
+      return false;
+    }
+    locked = makeLockWord(now, sequence + 2);
+    if (!slot.d_sequence.compare_exchange_strong(current, locked, std::memory_order_acquire, std::memory_order_relaxed)) {
+      return false;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.d_validity.store(0, std::memory_order_relaxed);
+    return true;
+  }
+
+  locked = makeLockWord(now, sequence + 1);
+  if (!slot.d_sequence.compare_exchange_strong(current, locked, std::memory_order_acquire, std::memory_order_relaxed)) {
+    return false;
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+  return true;
+}
+
+void SharedSegment::unlockSlot(Slot& slot, uint64_t locked)
+{
+  /* if the lock has been taken over, because we have been stalled for far too long,
+     the new owner has already emptied the slot and will release it */
+  slot.d_sequence.compare_exchange_strong(locked, makeLockWord(getLockedSince(locked), getSequence(locked) + 1), std::memory_order_release, std::memory_order_relaxed);
+}
+
+SharedSegment::LookupResult SharedSegment::lookup(uint32_t key, EntryHeader& header, PacketBuffer& data) const
+{
+  const size_t first = (key & d_setsMask) * s_waysPerSet;
+  const size_t maximumPayloadSize = getMaximumPayloadSize();
+  bool busy = false;
+  for (size_t idx = first; idx < first + s_waysPerSet; idx++) {
+    const auto& slot = getSlot(idx);
+    const auto sequence = slot.d_sequence.load(std::memory_order_acquire);
+    if ((sequence & 1) != 0) {
+      busy = true;
+      continue;
+    }
+    if (slot.d_key.load(std::memory_order_relaxed) != key || slot.d_validity.load(std::memory_order_relaxed) == 0) {
+      continue;
+    }
+
+    /* the slot might be modified while we copy it, in which case the sequence
+       will have changed and we will discard what we read */
+    memcpy(&header, getPayload(slot), sizeof(header));
+    const size_t dataSize = static_cast<size_t>(header.qnameLen) + header.responseLen;
+    const bool fits = dataSize <= maximumPayloadSize;
+    if (fits) {
+      data.resize(dataSize);
+      // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+      memcpy(data.data(), getPayload(slot) + sizeof(header), dataSize);
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.d_sequence.load(std::memory_order_relaxed) != sequence) {
+      busy = true;
+      continue;
+    }
+    if (fits) {
+      return LookupResult::Found;
+    }
+  }
+  return busy ? LookupResult::Busy : LookupResult::NotFound;
+}
+
+bool SharedSegment::store(uint32_t key, const EntryHeader& header, std::string_view qname, const PacketBuffer& response)
+{
+  if ((qname.size() + response.size()) > getMaximumPayloadSize()) {
+    return false;
+  }
+
+  /* pick the slot already holding this key, otherwise an empty or expired one,
+     otherwise the one expiring first */
+  const size_t first = (key & d_setsMask) * s_waysPerSet;
+  size_t target = first;
+  int64_t targetValidity = std::numeric_limits<int64_t>::max();
+  for (size_t idx = first; idx < first + s_waysPerSet; idx++) {
+    const auto& slot = getSlot(idx);
+    const auto validity = slot.d_validity.load(std::memory_order_relaxed);
+    if (validity != 0 && slot.d_key.load(std::memory_order_relaxed) == key) {
+      target = idx;
+      break;
+    }
+    const auto effective = validity <= header.added ? 0 : validity;
+    if (effective < targetValidity) {
+      target = idx;
+      targetValidity = effective;
+    }
+  }
+
+  auto& slot = getSlot(target);
+  SlotLock lock(*this, slot, getLockTime());
+  if (!lock.owns()) {
+    return false;
+  }
+  EntryHeader stored = header;
+  stored.qnameLen = static_cast<uint16_t>(qname.size());
+  stored.responseLen = static_cast<uint16_t>(response.size());
+  auto* payload = getPayload(slot);
+  memcpy(payload, &stored, sizeof(stored));
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+  memcpy(payload + sizeof(header), qname.data(), qname.size());
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+  memcpy(payload + sizeof(header) + qname.size(), response.data(), response.size());
+  slot.d_key.store(key, std::memory_order_relaxed);
+  slot.d_validity.store(std::max(static_cast<int64_t>(header.validity), static_cast<int64_t>(1)), std::memory_order_relaxed);
+  return true;
+}
+
+size_t SharedSegment::clear()
+{
+  return removeIf([](uint32_t /* key */, const OpenAddressingShard::EntryView& /* entry */) {
+    return true;
+  });
+}
+}
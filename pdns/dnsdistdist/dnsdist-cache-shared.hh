@@ -0,0 +1,200 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include "dnsdist-cache-open-addressing.hh"
+#include "noinitvector.hh"
+
+namespace dnsdist::cache
+{
+/* Second tier of the packet cache, living in a named POSIX shared memory segment so that
+   several dnsdist processes, or a restarted one, can attach to it and share its entries.
+   The segment is a table of fixed-size slots grouped in sets of a few ways, indexed by the
+   cache key. Every slot is protected by its own sequence lock: readers never take a lock and
+   simply give up if the slot was modified while they were copying it, and writers never wait
+   either, skipping the insertion if another writer, possibly in a different process, is busy
+   with the same slot. The lock word also holds the time at which the lock was taken, so that
+   a slot left locked by a process that died while modifying it is taken over, and emptied,
+   by the next writer once s_abandonedLockDelay seconds, by default, have passed. Nothing in the segment
+   is a pointer, so it can be mapped at a different address in every process. */
+class SharedSegment
+{
+public:
+  using EntryHeader = OpenAddressingShard::EntryHeader;
+  using LookupResult = OpenAddressingShard::LookupResult;
+
+  /* attach to the segment named 'name', creating it if it does not exist yet. An existing
+     segment must have been created with the same number of entries and slot size, otherwise
+     an exception is raised. A slot locked for more than 'abandonedLockDelay' seconds is taken over */
+  SharedSegment(const std::string& name, size_t entries, size_t slotSize, uint32_t abandonedLockDelay = s_abandonedLockDelay);
+  ~SharedSegment();
+  SharedSegment(const SharedSegment&) = delete;
+  SharedSegment(SharedSegment&&) = delete;
+  SharedSegment& operator=(const SharedSegment&) = delete;
+  SharedSegment& operator=(SharedSegment&&) = delete;
+
+  /* Lock-free lookup. On success the header of the entry is copied into 'header' and its qname
+     followed by its response are copied into 'data' */
+  LookupResult lookup(uint32_t key, EntryHeader& header, PacketBuffer& data) const;
+  /* store an entry, replacing an existing one for the same key, an empty or expired slot, or
+     the slot expiring first in the set. Returns false if the entry does not fit in a slot or
+     if the slot was being modified by someone else */
+  bool store(uint32_t key, const EntryHeader& header, std::string_view qname, const PacketBuffer& response);
+
+  /* call visitor(key, entryView) for every entry, removing the entry if the visitor returns true.
+     Slots being modified concurrently are skipped. If the visitor throws, the slot it was
+     visiting is released untouched */
+  template <typename Visitor>
+  size_t removeIf(const Visitor& visitor)
+  {
+    size_t removed = 0;
+    const auto now = getLockTime();
+    const size_t maximumPayloadSize = getMaximumPayloadSize();
+    for (size_t idx = 0; idx < d_slotsCount; idx++) {
+      auto& slot = getSlot(idx);
+      if (slot.d_validity.load(std::memory_order_relaxed) == 0 && (slot.d_sequence.load(std::memory_order_relaxed) & 1) == 0) {
+        continue;
+      }
+      SlotLock lock(*this, slot, now);
+      if (!lock.owns()) {
+        continue;
+      }
+      bool remove = false;
+      if (slot.d_validity.load(std::memory_order_relaxed) != 0) {
+        OpenAddressingShard::EntryView view;
+        memcpy(&view.header, getPayload(slot), sizeof(view.header));
+        if ((static_cast<size_t>(view.header.qnameLen) + view.header.responseLen) > maximumPayloadSize) {
+          /* this entry has been damaged, by a process that died while writing it for example */
+          remove = true;
+        }
+        else {
+          view.qname = getPayload(slot) + sizeof(EntryHeader);
+          view.response = view.qname + view.header.qnameLen;
+          remove = visitor(slot.d_key.load(std::memory_order_relaxed), view);
+        }
+      }
+      if (remove) {
+        slot.d_validity.store(0, std::memory_order_relaxed);
+        ++removed;
+      }
+    }
+    return removed;
+  }
+
+  /* remove every entry, from every process */
+  size_t clear();
+
+  /* the number of slots, which is the maximum number of entries */
+  size_t getSlotsCount() const
+  {
+    return d_slotsCount;
+  }
+  size_t getSlotSize() const
+  {
+    return d_slotSize;
+  }
+  /* largest qname + response that fits in a slot */
+  size_t getMaximumPayloadSize() const;
+
+  /* remove the segment name from the system, processes already attached keep their mapping */
+  static void unlink(const std::string& name);
+
+  static constexpr size_t s_waysPerSet{4};
+  /* a slot locked for longer than this, in seconds, is considered abandoned by a writer that died */
+  static constexpr uint32_t s_abandonedLockDelay{10};
+
+private:
+  /* header of a slot, the EntryHeader, qname and response follow it */
+  struct Slot
+  {
+    /* the lower 32 bits are the sequence, odd while the slot is locked, the upper 32 bits
+       the time at which the slot was last locked */
+    std::atomic<uint64_t> d_sequence;
+    /* a validity of 0 means that the slot is empty */
+    std::atomic<int64_t> d_validity;
+    std::atomic<uint32_t> d_key;
+  };
+  static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free && std::atomic<int64_t>::is_always_lock_free, "The atomics stored in the shared segment need to be lock-free to be shared between processes");
+
+  struct SegmentHeader;
+
+  /* holds the lock of a slot, if it could be acquired, until destroyed */
+  class SlotLock
+  {
+  public:
+    SlotLock(const SharedSegment& segment, Slot& slot, uint32_t now) :
+      d_slot(slot)
+    {
+      d_owned = segment.lockSlot(slot, d_locked, now);
+    }
+    ~SlotLock()
+    {
+      if (d_owned) {
+        unlockSlot(d_slot, d_locked);
+      }
+    }
+    SlotLock(const SlotLock&) = delete;
+    SlotLock(SlotLock&&) = delete;
+    SlotLock& operator=(const SlotLock&) = delete;
+    SlotLock& operator=(SlotLock&&) = delete;
+
+    [[nodiscard]] bool owns() const
+    {
+      return d_owned;
+    }
+
+  private:
+    Slot& d_slot;
+    uint64_t d_locked{0};
+    bool d_owned{false};
+  };
+
+  Slot& getSlot(size_t idx) const;
+  static const char* getPayload(const Slot& slot)
+  {
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast,cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    return reinterpret_cast<const char*>(&slot) + sizeof(Slot);
+  }
+  static char* getPayload(Slot& slot)
+  {
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast,cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    return reinterpret_cast<char*>(&slot) + sizeof(Slot);
+  }
+  /* a monotonic time, in seconds, shared by all the processes of the system */
+  static uint32_t getLockTime();
+  bool lockSlot(Slot& slot, uint64_t& locked, uint32_t now) const;
+  static void unlockSlot(Slot& slot, uint64_t locked);
+
+  char* d_slots{nullptr};
+  void* d_mapping{nullptr};
+  size_t d_mappingSize{0};
+  size_t d_slotsCount{0};
+  size_t d_slotSize{0};
+  size_t d_setsMask{0};
+  uint32_t d_abandonedLockDelay{s_abandonedLockDelay};
+};
+}
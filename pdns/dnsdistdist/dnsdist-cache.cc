@@ -20,6 +20,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 #include <cinttypes>
+#include <thread>
 
 #include "dnsdist.hh"
 #include "dolog.hh"
@@ -30,6 +31,14 @@
 #include "packetcache.hh"
 #include "base64.hh"
 
+static DNSName getQNameFromEntry(const dnsdist::cache::OpenAddressingShard::EntryView& entry)
+{
+  if (entry.header.qnameLen == 0) {
+    return {};
+  }
+  return DNSName(entry.qname, entry.header.qnameLen, 0, false);
+}
+
 // NOLINTNEXTLINE(bugprone-easily-swappable-parameters): too cumbersome to change at this point
 DNSDistPacketCache::DNSDistPacketCache(CacheSettings settings) :
   d_settings(std::move(settings))
@@ -44,6 +53,17 @@ DNSDistPacketCache::DNSDistPacketCache(CacheSettings settings) :
 
   d_shards.resize(d_settings.d_shardCount);
 
+  if (!d_settings.d_sharedSegmentName.empty()) {
+    d_sharedSegment = std::make_unique<dnsdist::cache::SharedSegment>(d_settings.d_sharedSegmentName, d_settings.d_sharedSegmentEntries > 0 ? d_settings.d_sharedSegmentEntries : d_settings.d_maxEntries, d_settings.d_sharedSegmentSlotSize);
+  }
+
+  if (d_settings.d_engine == Engine::OpenAddressing) {
+    for (auto& shard : d_shards) {
+      shard.setOpenAddressing(d_settings.d_maxEntries / d_settings.d_shardCount, d_settings.d_maximumEntrySize);
+    }
+    return;
+  }
+
   /* we reserve maxEntries + 1 to avoid rehashing from occurring
      when we get to maxEntries, as it means a load factor of 1 */
   for (auto& shard : d_shards) {
@@ -51,6 +71,17 @@ DNSDistPacketCache::DNSDistPacketCache(CacheSettings settings) :
   }
 }
 
+std::optional<DNSDistPacketCache::Engine> DNSDistPacketCache::getEngineFromName(const std::string& name)
+{
+  if (name == "unordered-map") {
+    return Engine::UnorderedMap;
+  }
+  if (name == "open-addressing") {
+    return Engine::OpenAddressing;
+  }
+  return std::nullopt;
+}
+
 bool DNSDistPacketCache::getClientSubnet(const PacketBuffer& packet, size_t qnameWireLength, boost::optional<Netmask>& subnet)
 {
   uint16_t optRDPosition = 0;
@@ -92,6 +123,66 @@ bool DNSDistPacketCache::cachedValueMatches(const CacheValue& cachedValue, uint1
   return true;
 }
 
+bool DNSDistPacketCache::cachedValueMatches(const OpenAddressingShard::EntryHeader& cachedValue, std::string_view cachedQName, uint16_t queryFlags, const DNSName::string_t& qname, uint16_t qtype, uint16_t qclass, bool receivedOverUDP, bool dnssecOK, const boost::optional<Netmask>& subnet) const
+{
+  if (cachedValue.queryFlags != queryFlags || cachedValue.dnssecOK != dnssecOK || cachedValue.receivedOverUDP != receivedOverUDP || cachedValue.qtype != qtype || cachedValue.qclass != qclass || cachedQName.size() != qname.size() || !pdns::dnsname_simd::iequals(cachedQName.data(), qname.data(), qname.size())) {
+    return false;
+  }
+
+  if (d_settings.d_parseECS) {
+    if (cachedValue.hasSubnet != static_cast<bool>(subnet)) {
+      return false;
+    }
+    if (subnet && Netmask(cachedValue.subnetNetwork, cachedValue.subnetBits) != *subnet) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+DNSDistPacketCache::OpenAddressingShard::WriteLock DNSDistPacketCache::lockOpenAddressingShard(CacheShard& shard, bool deferrable)
+{
+  auto lock = shard.d_openAddressing->tryWriteLock();
+  if (!lock.owns_lock() && !deferrable) {
+    lock.lock();
+  }
+  return lock;
+}
+
+bool DNSDistPacketCache::insertLocked(OpenAddressingShard& shard, OpenAddressingShard::WriteLock& lock, uint32_t key, const OpenAddressingShard::EntryHeader& newValue, const DNSName::string_t& qname, const PacketBuffer& response)
+{
+  /* same logic as the unordered map version below */
+  if (shard.size(lock) >= (d_settings.d_maxEntries / d_settings.d_shardCount)) {
+    return false;
+  }
+
+  const std::string_view qnameView(qname.data(), qname.size());
+  auto position = shard.find(lock, key);
+  if (!position) {
+    return shard.insert(lock, key, newValue, qnameView, response);
+  }
+
+  const auto existing = shard.getEntry(lock, *position);
+  bool wasExpired = existing.header.validity <= newValue.added;
+  boost::optional<Netmask> subnet;
+  if (newValue.hasSubnet) {
+    subnet = Netmask(newValue.subnetNetwork, newValue.subnetBits);
+  }
+
+  if (!wasExpired && !cachedValueMatches(existing.header, existing.getQName(), newValue.queryFlags, qname, newValue.qtype, newValue.qclass, newValue.receivedOverUDP, newValue.dnssecOK, subnet)) {
+    ++d_insertCollisions;
+    return false;
+  }
+
+  if (newValue.validity <= existing.header.validity) {
+    return false;
+  }
+
+  shard.replace(lock, *position, newValue, qnameView, response);
+  return false;
+}
+
 bool DNSDistPacketCache::insertLocked(std::unordered_map<uint32_t, CacheValue>& map, uint32_t key, CacheValue& newValue)
 {
   /* check again now that we hold the lock to prevent a race */
@@ -177,13 +268,53 @@ void DNSDistPacketCache::insert(uint32_t key, const boost::optional<Netmask>& su
   }
 
   uint32_t shardIndex = getShardIndex(key);
+  const time_t now = time(nullptr);
+  time_t newValidity = now + minTTL;
+
+  auto makeHeader = [&]() {
+    OpenAddressingShard::EntryHeader header;
+    header.added = now;
+    header.validity = newValidity;
+    header.qtype = qtype;
+    header.qclass = qclass;
+    header.queryFlags = queryFlags;
+    header.receivedOverUDP = receivedOverUDP;
+    header.dnssecOK = dnssecOK;
+    if (subnet) {
+      header.hasSubnet = true;
+      header.subnetNetwork = subnet->getNetwork();
+      header.subnetBits = subnet->getBits();
+    }
+    return header;
+  };
+
+  if (d_sharedSegment) {
+    /* the shared segment is usually larger than this cache, so it gets the entry even if we are full */
+    const auto& qnameStorage = qname.getStorage();
+    if (d_sharedSegment->store(key, makeHeader(), std::string_view(qnameStorage.data(), qnameStorage.size()), response)) {
+      ++d_sharedSegmentInserts;
+    }
+  }
 
   if (d_shards.at(shardIndex).d_entriesCount >= (d_settings.d_maxEntries / d_settings.d_shardCount)) {
     return;
   }
 
-  const time_t now = time(nullptr);
-  time_t newValidity = now + minTTL;
+  auto& shard = d_shards.at(shardIndex);
+
+  if (shard.d_openAddressing) {
+    const auto newValue = makeHeader();
+    auto lock = lockOpenAddressingShard(shard, d_settings.d_deferrableInsertLock);
+    if (!lock.owns_lock()) {
+      ++d_deferredInserts;
+      return;
+    }
+    if (insertLocked(*shard.d_openAddressing, lock, key, newValue, qname.getStorage(), response)) {
+      ++shard.d_entriesCount;
+    }
+    return;
+  }
+
   CacheValue newValue;
   newValue.qname = qname;
   newValue.qtype = qtype;
@@ -197,8 +328,6 @@ void DNSDistPacketCache::insert(uint32_t key, const boost::optional<Netmask>& su
   newValue.value = std::string(response.begin(), response.end());
   newValue.subnet = subnet;
 
-  auto& shard = d_shards.at(shardIndex);
-
   bool inserted = false;
   if (d_settings.d_deferrableInsertLock) {
     auto lock = shard.d_map.try_write_lock();
@@ -219,6 +348,110 @@ void DNSDistPacketCache::insert(uint32_t key, const boost::optional<Netmask>& su
   }
 }
 
+template <typename Matcher>
+bool DNSDistPacketCache::fillResponseFromCachedValue(DNSQuestion& dnsQuestion, uint16_t queryId, const uint8_t* cachedResponse, uint16_t cachedLen, time_t added, time_t validity, time_t now, uint32_t allowExpired, bool truncatedOK, bool recordMiss, const Matcher& matches, bool& headerOnly, bool& stale, time_t& age)
+{
+  if (validity <= now) {
+    if ((now - validity) >= static_cast<time_t>(allowExpired)) {
+      if (recordMiss) {
+        ++d_misses;
+      }
+      return false;
+    }
+    stale = true;
+  }
+
+  if (cachedLen < sizeof(dnsheader)) {
+    return false;
+  }
+
+  /* check for collision */
+  if (!matches()) {
+    ++d_lookupCollisions;
+    return false;
+  }
+
+  if (!truncatedOK) {
+    dnsheader_aligned dh_aligned(cachedResponse);
+    if (dh_aligned->tc != 0) {
+      return false;
+    }
+  }
+
+  auto& response = dnsQuestion.getMutableData();
+  response.resize(cachedLen);
+  memcpy(&response.at(0), &queryId, sizeof(queryId));
+  memcpy(&response.at(sizeof(queryId)), cachedResponse + sizeof(queryId), sizeof(dnsheader) - sizeof(queryId));
+
+  if (cachedLen == sizeof(dnsheader)) {
+    headerOnly = true;
+    return true;
+  }
+
+  const auto& dnsQName = dnsQuestion.ids.qname.getStorage();
+  const size_t dnsQNameLen = dnsQName.length();
+  if (cachedLen < (sizeof(dnsheader) + dnsQNameLen)) {
+    return false;
+  }
+
+  memcpy(&response.at(sizeof(dnsheader)), dnsQName.c_str(), dnsQNameLen);
+  if (cachedLen > (sizeof(dnsheader) + dnsQNameLen)) {
+    memcpy(&response.at(sizeof(dnsheader) + dnsQNameLen), cachedResponse + sizeof(dnsheader) + dnsQNameLen, cachedLen - (sizeof(dnsheader) + dnsQNameLen));
+  }
+
+  if (!stale) {
+    age = now - added;
+  }
+  else {
+    age = (validity - added) - d_settings.d_staleTTL;
+    dnsQuestion.ids.staleCacheHit = true;
+  }
+
+  return true;
+}
+
+bool DNSDistPacketCache::getFromSharedSegment(DNSQuestion& dnsQuestion, uint16_t queryId, uint32_t key, uint16_t queryFlags, bool receivedOverUDP, bool dnssecOK, const boost::optional<Netmask>& subnet, time_t now, uint32_t allowExpired, bool truncatedOK, bool recordMiss, bool& headerOnly, bool& stale, time_t& age)
+{
+  if (!d_sharedSegment) {
+    if (recordMiss) {
+      ++d_misses;
+    }
+    return false;
+  }
+
+  thread_local PacketBuffer t_sharedEntry;
+  OpenAddressingShard::EntryHeader value;
+  auto result = d_sharedSegment->lookup(key, value, t_sharedEntry);
+  if (result == OpenAddressingShard::LookupResult::Busy) {
+    ++d_deferredLookups;
+    return false;
+  }
+  if (result == OpenAddressingShard::LookupResult::NotFound) {
+    if (recordMiss) {
+      ++d_misses;
+    }
+    return false;
+  }
+
+  const auto& dnsQName = dnsQuestion.ids.qname.getStorage();
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  const std::string_view cachedQName(reinterpret_cast<const char*>(t_sharedEntry.data()), value.qnameLen);
+  auto matches = [&]() {
+    return cachedValueMatches(value, cachedQName, queryFlags, dnsQName, dnsQuestion.ids.qtype, dnsQuestion.ids.qclass, receivedOverUDP, dnssecOK, subnet);
+  };
+  if (!fillResponseFromCachedValue(dnsQuestion, queryId, t_sharedEntry.data() + value.qnameLen, value.responseLen, value.added, value.validity, now, allowExpired, truncatedOK, recordMiss, matches, headerOnly, stale, age)) {
+    return false;
+  }
+  ++d_sharedSegmentHits;
+
+  /* keep a copy in this process, as long as it is still fresh */
+  if (!stale) {
+    const PacketBuffer response(t_sharedEntry.begin() + value.qnameLen, t_sharedEntry.end());
+    insertEntry(key, value, dnsQuestion.ids.qname, response, true);
+  }
+  return true;
+}
+
 bool DNSDistPacketCache::get(DNSQuestion& dnsQuestion, uint16_t queryId, uint32_t* keyOut, boost::optional<Netmask>& subnet, bool dnssecOK, bool receivedOverUDP, uint32_t allowExpired, bool skipAging, bool truncatedOK, bool recordMiss)
 {
   if (dnsQuestion.ids.qtype == QType::AXFR || dnsQuestion.ids.qtype == QType::IXFR) {
@@ -241,78 +474,68 @@ bool DNSDistPacketCache::get(DNSQuestion& dnsQuestion, uint16_t queryId, uint32_
   time_t now = time(nullptr);
   time_t age{0};
   bool stale = false;
+  bool headerOnly = false;
   auto& response = dnsQuestion.getMutableData();
   auto& shard = d_shards.at(shardIndex);
-  {
-    auto map = shard.d_map.try_read_lock();
-    if (!map.owns_lock()) {
+  const uint16_t queryFlags = *(getFlagsFromDNSHeader(dnsQuestion.getHeader().get()));
+  if (shard.d_openAddressing) {
+    /* the entry is copied during the lookup, since it might be modified or removed as soon as we are done */
+    thread_local PacketBuffer t_entry;
+    OpenAddressingShard::EntryHeader value;
+    auto result = shard.d_openAddressing->lookup(key, value, t_entry);
+    if (result == OpenAddressingShard::LookupResult::Busy) {
       ++d_deferredLookups;
       return false;
     }
-
-    auto mapIt = map->find(key);
-    if (mapIt == map->end()) {
-      if (recordMiss) {
-        ++d_misses;
+    if (result == OpenAddressingShard::LookupResult::NotFound) {
+      if (!getFromSharedSegment(dnsQuestion, queryId, key, queryFlags, receivedOverUDP, dnssecOK, subnet, now, allowExpired, truncatedOK, recordMiss, headerOnly, stale, age)) {
+        return false;
       }
-      return false;
     }
-
-    const CacheValue& value = mapIt->second;
-    if (value.validity <= now) {
-      if ((now - value.validity) >= static_cast<time_t>(allowExpired)) {
-        if (recordMiss) {
-          ++d_misses;
-        }
+    else {
+      // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+      const std::string_view cachedQName(reinterpret_cast<const char*>(t_entry.data()), value.qnameLen);
+      auto matches = [&]() {
+        return cachedValueMatches(value, cachedQName, queryFlags, dnsQName, dnsQuestion.ids.qtype, dnsQuestion.ids.qclass, receivedOverUDP, dnssecOK, subnet);
+      };
+      if (!fillResponseFromCachedValue(dnsQuestion, queryId, t_entry.data() + value.qnameLen, value.responseLen, value.added, value.validity, now, allowExpired, truncatedOK, recordMiss, matches, headerOnly, stale, age)) {
         return false;
       }
-      stale = true;
-    }
-
-    if (value.len < sizeof(dnsheader)) {
-      return false;
-    }
-
-    /* check for collision */
-    if (!cachedValueMatches(value, *(getFlagsFromDNSHeader(dnsQuestion.getHeader().get())), dnsQuestion.ids.qname, dnsQuestion.ids.qtype, dnsQuestion.ids.qclass, receivedOverUDP, dnssecOK, subnet)) {
-      ++d_lookupCollisions;
-      return false;
     }
-
-    if (!truncatedOK) {
-      dnsheader_aligned dh_aligned(value.value.data());
-      if (dh_aligned->tc != 0) {
+  }
+  else {
+    bool found = false;
+    {
+      auto map = shard.d_map.try_read_lock();
+      if (!map.owns_lock()) {
+        ++d_deferredLookups;
         return false;
       }
-    }
-
-    response.resize(value.len);
-    memcpy(&response.at(0), &queryId, sizeof(queryId));
-    memcpy(&response.at(sizeof(queryId)), &value.value.at(sizeof(queryId)), sizeof(dnsheader) - sizeof(queryId));
 
-    if (value.len == sizeof(dnsheader)) {
-      /* DNS header only, our work here is done */
-      ++d_hits;
-      return true;
+      auto mapIt = map->find(key);
+      if (mapIt != map->end()) {
+        found = true;
+        const CacheValue& value = mapIt->second;
+        auto matches = [&]() {
+          return cachedValueMatches(value, queryFlags, dnsQuestion.ids.qname, dnsQuestion.ids.qtype, dnsQuestion.ids.qclass, receivedOverUDP, dnssecOK, subnet);
+        };
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+        if (!fillResponseFromCachedValue(dnsQuestion, queryId, reinterpret_cast<const uint8_t*>(value.value.data()), value.len, value.added, value.validity, now, allowExpired, truncatedOK, recordMiss, matches, headerOnly, stale, age)) {
+          return false;
+        }
+      }
     }
 
-    const size_t dnsQNameLen = dnsQName.length();
-    if (value.len < (sizeof(dnsheader) + dnsQNameLen)) {
+    /* the lock on the shard has been released, since a hit in the shared segment inserts the entry into it */
+    if (!found && !getFromSharedSegment(dnsQuestion, queryId, key, queryFlags, receivedOverUDP, dnssecOK, subnet, now, allowExpired, truncatedOK, recordMiss, headerOnly, stale, age)) {
       return false;
     }
+  }
 
-    memcpy(&response.at(sizeof(dnsheader)), dnsQName.c_str(), dnsQNameLen);
-    if (value.len > (sizeof(dnsheader) + dnsQNameLen)) {
-      memcpy(&response.at(sizeof(dnsheader) + dnsQNameLen), &value.value.at(sizeof(dnsheader) + dnsQNameLen), value.len - (sizeof(dnsheader) + dnsQNameLen));
-    }
-
-    if (!stale) {
-      age = now - value.added;
-    }
-    else {
-      age = (value.validity - value.added) - d_settings.d_staleTTL;
-      dnsQuestion.ids.staleCacheHit = true;
-    }
+  if (headerOnly) {
+    /* DNS header only, our work here is done */
+    ++d_hits;
+    return true;
   }
 
   if (!d_settings.d_dontAge && !skipAging) {
@@ -346,6 +569,26 @@ size_t DNSDistPacketCache::purgeExpired(size_t upTo, const time_t now)
 
   ++d_cleanupCount;
   for (auto& shard : d_shards) {
+    if (shard.d_openAddressing) {
+      auto lock = lockOpenAddressingShard(shard, false);
+      auto size = shard.d_openAddressing->size(lock);
+      if (size <= maxPerShard) {
+        continue;
+      }
+
+      size_t toRemove = size - maxPerShard;
+      auto removedFromShard = shard.d_openAddressing->removeIf(lock, [&toRemove, now](uint32_t /* key */, const OpenAddressingShard::EntryView& value) {
+        if (toRemove == 0 || value.header.validity > now) {
+          return false;
+        }
+        --toRemove;
+        return true;
+      });
+      shard.d_entriesCount -= removedFromShard;
+      removed += removedFromShard;
+      continue;
+    }
+
     auto map = shard.d_map.write_lock();
     if (map->size() <= maxPerShard) {
       continue;
@@ -368,6 +611,14 @@ size_t DNSDistPacketCache::purgeExpired(size_t upTo, const time_t now)
     }
   }
 
+  /* the shared segment has no notion of size, so every expired entry is removed from it. These
+     entries are not counted since they might have been inserted by another process */
+  if (d_sharedSegment) {
+    d_sharedSegment->removeIf([now](uint32_t /* key */, const OpenAddressingShard::EntryView& value) {
+      return value.header.validity <= now;
+    });
+  }
+
   return removed;
 }
 
@@ -383,6 +634,26 @@ size_t DNSDistPacketCache::expunge(size_t upTo)
   size_t removed = 0;
 
   for (auto& shard : d_shards) {
+    if (shard.d_openAddressing) {
+      auto lock = lockOpenAddressingShard(shard, false);
+      auto size = shard.d_openAddressing->size(lock);
+      if (size <= maxPerShard) {
+        continue;
+      }
+
+      size_t toRemove = size - maxPerShard;
+      auto removedFromShard = shard.d_openAddressing->removeIf(lock, [&toRemove](uint32_t /* key */, const OpenAddressingShard::EntryView& /* value */) {
+        if (toRemove == 0) {
+          return false;
+        }
+        --toRemove;
+        return true;
+      });
+      shard.d_entriesCount -= removedFromShard;
+      removed += removedFromShard;
+      continue;
+    }
+
     auto map = shard.d_map.write_lock();
 
     if (map->size() <= maxPerShard) {
@@ -407,6 +678,12 @@ size_t DNSDistPacketCache::expunge(size_t upTo)
     }
   }
 
+  /* the shared segment has no notion of size, so it is only cleared when the whole cache is.
+     The entries removed from it are not counted since they might be present in this process as well */
+  if (d_sharedSegment && upTo == 0) {
+    d_sharedSegment->clear();
+  }
+
   return removed;
 }
 
@@ -415,6 +692,20 @@ size_t DNSDistPacketCache::expungeByName(const DNSName& name, uint16_t qtype, bo
   size_t removed = 0;
 
   for (auto& shard : d_shards) {
+    if (shard.d_openAddressing) {
+      auto lock = lockOpenAddressingShard(shard, false);
+      auto removedFromShard = shard.d_openAddressing->removeIf(lock, [&name, qtype, suffixMatch](uint32_t /* key */, const OpenAddressingShard::EntryView& value) {
+        if (qtype != QType::ANY && qtype != value.header.qtype) {
+          return false;
+        }
+        const auto qname = getQNameFromEntry(value);
+        return qname == name || (suffixMatch && qname.isPartOf(name));
+      });
+      shard.d_entriesCount -= removedFromShard;
+      removed += removedFromShard;
+      continue;
+    }
+
     auto map = shard.d_map.write_lock();
 
     for (auto it = map->begin(); it != map->end();) {
@@ -431,6 +722,16 @@ size_t DNSDistPacketCache::expungeByName(const DNSName& name, uint16_t qtype, bo
     }
   }
 
+  if (d_sharedSegment) {
+    d_sharedSegment->removeIf([&name, qtype, suffixMatch](uint32_t /* key */, const OpenAddressingShard::EntryView& value) {
+      if (qtype != QType::ANY && qtype != value.header.qtype) {
+        return false;
+      }
+      const auto qname = getQNameFromEntry(value);
+      return qname == name || (suffixMatch && qname.isPartOf(name));
+    });
+  }
+
   return removed;
 }
 
@@ -499,6 +800,38 @@ uint64_t DNSDistPacketCache::getEntriesCount()
   return getSize();
 }
 
+template <typename Visitor>
+void DNSDistPacketCache::visitShard(CacheShard& shard, const Visitor& visitor)
+{
+  if (shard.d_openAddressing) {
+    auto lock = lockOpenAddressingShard(shard, false);
+    shard.d_openAddressing->forEach(lock, [&visitor](uint32_t key, const OpenAddressingShard::EntryView& entry) {
+      /* this is only used for inspection purposes, so converting to a CacheValue is fine */
+      CacheValue value;
+      value.value = std::string(entry.getResponse());
+      value.qname = getQNameFromEntry(entry);
+      if (entry.header.hasSubnet) {
+        value.subnet = Netmask(entry.header.subnetNetwork, entry.header.subnetBits);
+      }
+      value.qtype = entry.header.qtype;
+      value.qclass = entry.header.qclass;
+      value.queryFlags = entry.header.queryFlags;
+      value.added = entry.header.added;
+      value.validity = entry.header.validity;
+      value.len = entry.header.responseLen;
+      value.receivedOverUDP = entry.header.receivedOverUDP;
+      value.dnssecOK = entry.header.dnssecOK;
+      visitor(key, value);
+    });
+    return;
+  }
+
+  auto map = shard.d_map.read_lock();
+  for (const auto& entry : *map) {
+    visitor(entry.first, entry.second);
+  }
+}
+
 uint64_t DNSDistPacketCache::dump(int fileDesc, bool rawResponse)
 {
   auto fileDescDuplicated = dup(fileDesc);
@@ -515,10 +848,7 @@ uint64_t DNSDistPacketCache::dump(int fileDesc, bool rawResponse)
   uint64_t count = 0;
   time_t now = time(nullptr);
   for (auto& shard : d_shards) {
-    auto map = shard.d_map.read_lock();
-
-    for (const auto& entry : *map) {
-      const CacheValue& value = entry.second;
+    visitShard(shard, [&](uint32_t key, const CacheValue& value) {
       count++;
 
       try {
@@ -529,7 +859,7 @@ uint64_t DNSDistPacketCache::dump(int fileDesc, bool rawResponse)
           rcode = dnsHeader.rcode;
         }
 
-        fprintf(filePtr.get(), "%s %" PRId64 " %s %s ; ecs %s, rcode %" PRIu8 ", key %" PRIu32 ", length %" PRIu16 ", received over UDP %d, added %" PRId64 ", dnssecOK %d, raw query flags %" PRIu16, value.qname.toString().c_str(), static_cast<int64_t>(value.validity - now), QClass(value.qclass).toString().c_str(), QType(value.qtype).toString().c_str(), value.subnet ? value.subnet.get().toString().c_str() : "empty", rcode, entry.first, value.len, value.receivedOverUDP ? 1 : 0, static_cast<int64_t>(value.added), value.dnssecOK ? 1 : 0, value.queryFlags);
+        fprintf(filePtr.get(), "%s %" PRId64 " %s %s ; ecs %s, rcode %" PRIu8 ", key %" PRIu32 ", length %" PRIu16 ", received over UDP %d, added %" PRId64 ", dnssecOK %d, raw query flags %" PRIu16, value.qname.toString().c_str(), static_cast<int64_t>(value.validity - now), QClass(value.qclass).toString().c_str(), QType(value.qtype).toString().c_str(), value.subnet ? value.subnet.get().toString().c_str() : "empty", rcode, key, value.len, value.receivedOverUDP ? 1 : 0, static_cast<int64_t>(value.added), value.dnssecOK ? 1 : 0, value.queryFlags);
 
         if (rawResponse) {
           std::string rawDataResponse = Base64Encode(value.value);
@@ -540,7 +870,7 @@ uint64_t DNSDistPacketCache::dump(int fileDesc, bool rawResponse)
       catch (...) {
         fprintf(filePtr.get(), "; error printing '%s'\n", value.qname.empty() ? "EMPTY" : value.qname.toString().c_str());
       }
-    }
+    });
   }
 
   return count;
@@ -551,19 +881,15 @@ std::set<DNSName> DNSDistPacketCache::getDomainsContainingRecords(const ComboAdd
   std::set<DNSName> domains;
 
   for (auto& shard : d_shards) {
-    auto map = shard.d_map.read_lock();
-
-    for (const auto& entry : *map) {
-      const CacheValue& value = entry.second;
-
+    visitShard(shard, [&addr, &domains](uint32_t /* key */, const CacheValue& value) {
       try {
         if (value.len < sizeof(dnsheader)) {
-          continue;
+          return;
         }
 
         dnsheader_aligned dnsHeader(value.value.data());
         if (dnsHeader->rcode != RCode::NoError || (dnsHeader->ancount == 0 && dnsHeader->nscount == 0 && dnsHeader->arcount == 0)) {
-          continue;
+          return;
         }
 
         bool found = false;
@@ -595,9 +921,9 @@ std::set<DNSName> DNSDistPacketCache::getDomainsContainingRecords(const ComboAdd
         }
       }
       catch (...) {
-        continue;
+        return;
       }
-    }
+    });
   }
 
   return domains;
@@ -608,23 +934,19 @@ std::set<ComboAddress> DNSDistPacketCache::getRecordsForDomain(const DNSName& do
   std::set<ComboAddress> addresses;
 
   for (auto& shard : d_shards) {
-    auto map = shard.d_map.read_lock();
-
-    for (const auto& entry : *map) {
-      const CacheValue& value = entry.second;
-
+    visitShard(shard, [&domain, &addresses](uint32_t /* key */, const CacheValue& value) {
       try {
         if (value.qname != domain) {
-          continue;
+          return;
         }
 
         if (value.len < sizeof(dnsheader)) {
-          continue;
+          return;
         }
 
         dnsheader_aligned dnsHeader(value.value.data());
         if (dnsHeader->rcode != RCode::NoError || (dnsHeader->ancount == 0 && dnsHeader->nscount == 0 && dnsHeader->arcount == 0)) {
-          continue;
+          return;
         }
 
         visitDNSPacket(value.value, [&addresses](uint8_t /* section */, uint16_t qclass, uint16_t qtype, uint32_t /* ttl */, uint16_t rdatalength, const char* rdata) {
@@ -645,10 +967,440 @@ std::set<ComboAddress> DNSDistPacketCache::getRecordsForDomain(const DNSName& do
         });
       }
       catch (...) {
-        continue;
+        return;
       }
-    }
+    });
   }
 
   return addresses;
 }
+
+/* Binary snapshot format, all integers being stored in network byte order:
+   - a header made of a magic value, a version, the number of sections and, for every section,
+     its offset in the file and the number of entries it contains ;
+   - one section per shard of the cache the snapshot was taken from, each entry being made
+     of a fixed-size part followed by the qname (wire format) and the response.
+   Sections are independent, so that they can be loaded in parallel.
+*/
+static constexpr std::array<char, 8> s_snapshotMagic{'D', 'D', 'P', 'C', 'S', 'N', 'A', 'P'};
+static constexpr uint16_t s_snapshotVersion{1};
+static constexpr size_t s_snapshotHeaderSize{s_snapshotMagic.size() + sizeof(uint16_t) + sizeof(uint16_t) + sizeof(uint32_t)};
+static constexpr size_t s_snapshotSectionDescriptionSize{sizeof(uint64_t) + sizeof(uint64_t)};
+/* key, added, validity, qtype, qclass, query flags, flags, subnet bits, subnet family, subnet address, qname length, response length */
+static constexpr size_t s_snapshotEntryFixedSize{sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint64_t) + sizeof(uint16_t) + sizeof(uint16_t) + sizeof(uint16_t) + sizeof(uint8_t) + sizeof(uint8_t) + sizeof(uint8_t) + 16 + sizeof(uint16_t) + sizeof(uint16_t)};
+static constexpr uint8_t s_snapshotFlagReceivedOverUDP{1};
+static constexpr uint8_t s_snapshotFlagDNSSECOK{2};
+static constexpr uint8_t s_snapshotFlagSubnet{4};
+/* we flush the entries of a shard to the file once we have that many bytes buffered */
+static constexpr size_t s_snapshotWriteBufferSize{1024 * 1024};
+
+template <typename T>
+static void appendSnapshotInteger(PacketBuffer& buffer, T value)
+{
+  for (size_t idx = sizeof(T); idx > 0; idx--) {
+    buffer.push_back(static_cast<uint8_t>((static_cast<uint64_t>(value) >> ((idx - 1) * 8)) & 0xff));
+  }
+}
+
+template <typename T>
+static T readSnapshotInteger(const uint8_t* data, size_t& pos)
+{
+  uint64_t value = 0;
+  for (size_t idx = 0; idx < sizeof(T); idx++) {
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    value = (value << 8) | data[pos++];
+  }
+  return static_cast<T>(value);
+}
+
+static void appendSnapshotEntry(PacketBuffer& buffer, uint32_t key, const dnsdist::cache::OpenAddressingShard::EntryHeader& header, std::string_view qname, std::string_view response)
+{
+  uint8_t flags = 0;
+  if (header.receivedOverUDP) {
+    flags |= s_snapshotFlagReceivedOverUDP;
+  }
+  if (header.dnssecOK) {
+    flags |= s_snapshotFlagDNSSECOK;
+  }
+  if (header.hasSubnet) {
+    flags |= s_snapshotFlagSubnet;
+  }
+
+  appendSnapshotInteger<uint32_t>(buffer, key);
+  appendSnapshotInteger<uint64_t>(buffer, static_cast<uint64_t>(header.added));
+  appendSnapshotInteger<uint64_t>(buffer, static_cast<uint64_t>(header.validity));
+  appendSnapshotInteger<uint16_t>(buffer, header.qtype);
+  appendSnapshotInteger<uint16_t>(buffer, header.qclass);
+  appendSnapshotInteger<uint16_t>(buffer, header.queryFlags);
+  appendSnapshotInteger<uint8_t>(buffer, flags);
+  appendSnapshotInteger<uint8_t>(buffer, header.hasSubnet ? header.subnetBits : 0);
+  std::array<uint8_t, 16> address{};
+  uint8_t family = 0;
+  if (header.hasSubnet && header.subnetNetwork.isIPv4()) {
+    family = 4;
+    memcpy(address.data(), &header.subnetNetwork.sin4.sin_addr.s_addr, sizeof(header.subnetNetwork.sin4.sin_addr.s_addr));
+  }
+  else if (header.hasSubnet && header.subnetNetwork.isIPv6()) {
+    family = 6;
+    memcpy(address.data(), &header.subnetNetwork.sin6.sin6_addr.s6_addr, sizeof(header.subnetNetwork.sin6.sin6_addr.s6_addr));
+  }
+  appendSnapshotInteger<uint8_t>(buffer, family);
+  buffer.insert(buffer.end(), address.begin(), address.end());
+  appendSnapshotInteger<uint16_t>(buffer, static_cast<uint16_t>(qname.size()));
+  appendSnapshotInteger<uint16_t>(buffer, static_cast<uint16_t>(response.size()));
+  buffer.insert(buffer.end(), qname.begin(), qname.end());
+  buffer.insert(buffer.end(), response.begin(), response.end());
+}
+
+static void readFromSnapshot(FILE* file, void* data, size_t size)
+{
+  if (size > 0 && fread(data, size, 1, file) != 1) {
+    throw std::runtime_error(feof(file) != 0 ? "unexpected end of file" : "read error: " + stringerror());
+  }
+}
+
+static void writeToSnapshot(FILE* file, const PacketBuffer& buffer)
+{
+  if (!buffer.empty() && fwrite(buffer.data(), buffer.size(), 1, file) != 1) {
+    throw std::runtime_error("Error writing packet cache snapshot: " + stringerror());
+  }
+}
+
+uint64_t DNSDistPacketCache::saveSnapshot(const std::string& fileName)
+{
+  /* write to a temporary file first so that an existing snapshot is only replaced once the new one is complete */
+  const auto tmpFileName = fileName + ".tmp";
+  unlink(tmpFileName.c_str());
+  auto filePtr = pdns::openFileForWriting(tmpFileName, 0660, true);
+  if (!filePtr) {
+    throw std::runtime_error("Unable to open '" + tmpFileName + "' to save the packet cache snapshot: " + stringerror());
+  }
+
+  try {
+    PacketBuffer buffer;
+    buffer.insert(buffer.end(), s_snapshotMagic.begin(), s_snapshotMagic.end());
+    appendSnapshotInteger<uint16_t>(buffer, s_snapshotVersion);
+    appendSnapshotInteger<uint16_t>(buffer, 0);
+    appendSnapshotInteger<uint32_t>(buffer, static_cast<uint32_t>(d_shards.size()));
+    /* the section descriptions are filled once all sections have been written */
+    buffer.resize(buffer.size() + (d_shards.size() * s_snapshotSectionDescriptionSize), 0);
+    writeToSnapshot(filePtr.get(), buffer);
+    uint64_t offset = buffer.size();
+    buffer.clear();
+
+    std::vector<std::pair<uint64_t, uint64_t>> sections;
+    sections.reserve(d_shards.size());
+    const time_t now = time(nullptr);
+    uint64_t total = 0;
+
+    for (auto& shard : d_shards) {
+      uint64_t sectionStart = offset;
+      uint64_t count = 0;
+      auto save = [&](uint32_t key, const OpenAddressingShard::EntryHeader& header, std::string_view qname, std::string_view response) {
+        if (header.validity <= now && !d_settings.d_keepStaleData) {
+          return;
+        }
+        appendSnapshotEntry(buffer, key, header, qname, response);
+        ++count;
+        if (buffer.size() >= s_snapshotWriteBufferSize) {
+          writeToSnapshot(filePtr.get(), buffer);
+          offset += buffer.size();
+          buffer.clear();
+        }
+      };
+
+      if (shard.d_openAddressing) {
+        auto lock = lockOpenAddressingShard(shard, false);
+        shard.d_openAddressing->forEach(lock, [&save](uint32_t key, const OpenAddressingShard::EntryView& entry) {
+          save(key, entry.header, entry.getQName(), entry.getResponse());
+        });
+      }
+      else {
+        auto map = shard.d_map.read_lock();
+        for (const auto& [key, value] : *map) {
+          OpenAddressingShard::EntryHeader header;
+          header.added = value.added;
+          header.validity = value.validity;
+          header.qtype = value.qtype;
+          header.qclass = value.qclass;
+          header.queryFlags = value.queryFlags;
+          header.receivedOverUDP = value.receivedOverUDP;
+          header.dnssecOK = value.dnssecOK;
+          if (value.subnet) {
+            header.hasSubnet = true;
+            header.subnetNetwork = value.subnet->getNetwork();
+            header.subnetBits = value.subnet->getBits();
+          }
+          const auto& qname = value.qname.getStorage();
+          save(key, header, std::string_view(qname.data(), qname.size()), std::string_view(value.value.data(), value.len));
+        }
+      }
+
+      writeToSnapshot(filePtr.get(), buffer);
+      offset += buffer.size();
+      buffer.clear();
+      sections.emplace_back(sectionStart, count);
+      total += count;
+    }
+
+    for (const auto& [sectionOffset, count] : sections) {
+      appendSnapshotInteger<uint64_t>(buffer, sectionOffset);
+      appendSnapshotInteger<uint64_t>(buffer, count);
+    }
+    if (fseeko(filePtr.get(), s_snapshotHeaderSize, SEEK_SET) != 0) {
+      throw std::runtime_error("Error seeking in packet cache snapshot: " + stringerror());
+    }
+    writeToSnapshot(filePtr.get(), buffer);
+
+    if (fflush(filePtr.get()) != 0 || fsync(fileno(filePtr.get())) != 0) {
+      throw std::runtime_error("Error writing packet cache snapshot: " + stringerror());
+    }
+    filePtr.reset();
+
+    if (rename(tmpFileName.c_str(), fileName.c_str()) != 0) {
+      throw std::runtime_error("Unable to rename '" + tmpFileName + "' to '" + fileName + "': " + stringerror());
+    }
+    return total;
+  }
+  catch (...) {
+    filePtr.reset();
+    unlink(tmpFileName.c_str());
+    throw;
+  }
+}
+
+bool DNSDistPacketCache::insertEntry(uint32_t key, const OpenAddressingShard::EntryHeader& header, const DNSName& qname, const PacketBuffer& response, bool deferrable)
+{
+  auto& shard = d_shards.at(getShardIndex(key));
+  if (shard.d_openAddressing) {
+    auto lock = lockOpenAddressingShard(shard, deferrable);
+    if (!lock.owns_lock()) {
+      ++d_deferredInserts;
+      return false;
+    }
+    if (!insertLocked(*shard.d_openAddressing, lock, key, header, qname.getStorage(), response)) {
+      return false;
+    }
+  }
+  else {
+    CacheValue value;
+    value.qname = qname;
+    value.qtype = header.qtype;
+    value.qclass = header.qclass;
+    value.queryFlags = header.queryFlags;
+    value.len = response.size();
+    value.validity = header.validity;
+    value.added = header.added;
+    value.receivedOverUDP = header.receivedOverUDP;
+    value.dnssecOK = header.dnssecOK;
+    value.value = std::string(response.begin(), response.end());
+    if (header.hasSubnet) {
+      value.subnet = Netmask(header.subnetNetwork, header.subnetBits);
+    }
+
+    if (deferrable) {
+      auto map = shard.d_map.try_write_lock();
+      if (!map.owns_lock()) {
+        ++d_deferredInserts;
+        return false;
+      }
+      if (!insertLocked(*map, key, value)) {
+        return false;
+      }
+    }
+    else {
+      auto map = shard.d_map.write_lock();
+      if (!insertLocked(*map, key, value)) {
+        return false;
+      }
+    }
+  }
+
+  ++shard.d_entriesCount;
+  return true;
+}
+
+uint64_t DNSDistPacketCache::loadSnapshotSection(FILE* file, uint64_t offset, uint64_t entries, time_t now)
+{
+  if (fseeko(file, static_cast<off_t>(offset), SEEK_SET) != 0) {
+    throw std::runtime_error("error seeking to offset " + std::to_string(offset) + ": " + stringerror());
+  }
+
+  uint64_t inserted = 0;
+  std::array<uint8_t, s_snapshotEntryFixedSize> fixed{};
+  std::string qnameStorage;
+  PacketBuffer response;
+  for (uint64_t idx = 0; idx < entries; idx++) {
+    readFromSnapshot(file, fixed.data(), fixed.size());
+    size_t pos = 0;
+    OpenAddressingShard::EntryHeader header;
+    auto key = readSnapshotInteger<uint32_t>(fixed.data(), pos);
+    header.added = static_cast<time_t>(readSnapshotInteger<uint64_t>(fixed.data(), pos));
+    header.validity = static_cast<time_t>(readSnapshotInteger<uint64_t>(fixed.data(), pos));
+    header.qtype = readSnapshotInteger<uint16_t>(fixed.data(), pos);
+    header.qclass = readSnapshotInteger<uint16_t>(fixed.data(), pos);
+    header.queryFlags = readSnapshotInteger<uint16_t>(fixed.data(), pos);
+    auto flags = readSnapshotInteger<uint8_t>(fixed.data(), pos);
+    header.subnetBits = readSnapshotInteger<uint8_t>(fixed.data(), pos);
+    auto family = readSnapshotInteger<uint8_t>(fixed.data(), pos);
+    const auto* address = &fixed.at(pos);
+    pos += 16;
+    header.qnameLen = readSnapshotInteger<uint16_t>(fixed.data(), pos);
+    header.responseLen = readSnapshotInteger<uint16_t>(fixed.data(), pos);
+    header.receivedOverUDP = (flags & s_snapshotFlagReceivedOverUDP) != 0;
+    header.dnssecOK = (flags & s_snapshotFlagDNSSECOK) != 0;
+    header.hasSubnet = (flags & s_snapshotFlagSubnet) != 0;
+    if (header.hasSubnet) {
+      if (family == 4 && header.subnetBits <= 32) {
+        header.subnetNetwork.sin4.sin_family = AF_INET;
+        memcpy(&header.subnetNetwork.sin4.sin_addr.s_addr, address, sizeof(header.subnetNetwork.sin4.sin_addr.s_addr));
+      }
+      else if (family == 6 && header.subnetBits <= 128) {
+        header.subnetNetwork.sin6.sin6_family = AF_INET6;
+        memcpy(&header.subnetNetwork.sin6.sin6_addr.s6_addr, address, sizeof(header.subnetNetwork.sin6.sin6_addr.s6_addr));
+      }
+      else {
+        throw std::runtime_error("invalid client subnet for entry " + std::to_string(idx));
+      }
+    }
+    if (header.qnameLen > 255 || header.responseLen < sizeof(dnsheader)) {
+      throw std::runtime_error("invalid entry " + std::to_string(idx));
+    }
+
+    qnameStorage.resize(header.qnameLen);
+    readFromSnapshot(file, qnameStorage.data(), qnameStorage.size());
+    response.resize(header.responseLen);
+    readFromSnapshot(file, response.data(), response.size());
+
+    if (header.validity <= now && !d_settings.d_keepStaleData) {
+      continue;
+    }
+    if (response.size() > getMaximumEntrySize()) {
+      continue;
+    }
+
+    DNSName qname;
+    if (!qnameStorage.empty()) {
+      qname = DNSName(qnameStorage.data(), qnameStorage.size(), 0, false);
+    }
+    if (insertEntry(key, header, qname, response, false)) {
+      ++inserted;
+    }
+  }
+
+  return inserted;
+}
+
+uint64_t DNSDistPacketCache::loadSnapshot(const std::string& fileName, size_t threads)
+{
+  auto filePtr = pdns::UniqueFilePtr(fopen(fileName.c_str(), "r"));
+  if (!filePtr) {
+    throw std::runtime_error("Unable to open packet cache snapshot '" + fileName + "': " + stringerror());
+  }
+
+  std::vector<std::pair<uint64_t, uint64_t>> sections;
+  try {
+    std::array<uint8_t, s_snapshotHeaderSize> header{};
+    readFromSnapshot(filePtr.get(), header.data(), header.size());
+    if (memcmp(header.data(), s_snapshotMagic.data(), s_snapshotMagic.size()) != 0) {
+      throw std::runtime_error("not a packet cache snapshot");
+    }
+    size_t pos = s_snapshotMagic.size();
+    auto version = readSnapshotInteger<uint16_t>(header.data(), pos);
+    if (version != s_snapshotVersion) {
+      throw std::runtime_error("unsupported version " + std::to_string(version));
+    }
+    pos += sizeof(uint16_t);
+    auto sectionsCount = readSnapshotInteger<uint32_t>(header.data(), pos);
+
+    PacketBuffer descriptions(static_cast<size_t>(sectionsCount) * s_snapshotSectionDescriptionSize);
+    readFromSnapshot(filePtr.get(), descriptions.data(), descriptions.size());
+    pos = 0;
+    sections.reserve(sectionsCount);
+    for (uint32_t idx = 0; idx < sectionsCount; idx++) {
+      auto offset = readSnapshotInteger<uint64_t>(descriptions.data(), pos);
+      auto entries = readSnapshotInteger<uint64_t>(descriptions.data(), pos);
+      sections.emplace_back(offset, entries);
+    }
+  }
+  catch (const std::exception& exp) {
+    throw std::runtime_error("Error loading packet cache snapshot '" + fileName + "': " + exp.what());
+  }
+  filePtr.reset();
+
+  if (threads == 0) {
+    threads = std::max(1U, std::thread::hardware_concurrency());
+  }
+  threads = std::max(static_cast<size_t>(1), std::min(threads, sections.size()));
+
+  const time_t now = time(nullptr);
+  std::atomic<size_t> nextSection{0};
+  std::atomic<uint64_t> inserted{0};
+  LockGuarded<std::string> error;
+  auto loader = [&]() {
+    try {
+      /* every loader reads the file through its own handle */
+      auto sectionFilePtr = pdns::UniqueFilePtr(fopen(fileName.c_str(), "r"));
+      if (!sectionFilePtr) {
+        throw std::runtime_error("unable to open: " + stringerror());
+      }
+      for (size_t idx = nextSection++; idx < sections.size(); idx = nextSection++) {
+        inserted += loadSnapshotSection(sectionFilePtr.get(), sections.at(idx).first, sections.at(idx).second, now);
+      }
+    }
+    catch (const std::exception& exp) {
+      auto lock = error.lock();
+      if (lock->empty()) {
+        *lock = exp.what();
+      }
+    }
+  };
+
+  std::vector<std::thread> loaders;
+  loaders.reserve(threads - 1);
+  for (size_t idx = 1; idx < threads; idx++) {
+    loaders.emplace_back(loader);
+  }
+  loader();
+  for (auto& thread : loaders) {
+    thread.join();
+  }
+
+  if (auto lock = error.lock(); !lock->empty()) {
+    throw std::runtime_error("Error loading packet cache snapshot '" + fileName + "' (" + std::to_string(inserted.load()) + " entries loaded so far): " + *lock);
+  }
+  return inserted.load();
+}
+
+namespace dnsdist::cache
+{
+static LockGuarded<std::vector<std::pair<std::shared_ptr<DNSDistPacketCache>, std::string>>> s_snapshotsToSaveOnExit;
+
+void loadSnapshotAndSaveOnExit(const std::shared_ptr<DNSDistPacketCache>& cache, const std::string& fileName)
+{
+  if (access(fileName.c_str(), F_OK) == 0) {
+    try {
+      auto loaded = cache->loadSnapshot(fileName);
+      infolog("Loaded %d entries from packet cache snapshot '%s'", loaded, fileName);
+    }
+    catch (const std::exception& exp) {
+      warnlog("%s", exp.what());
+    }
+  }
+  s_snapshotsToSaveOnExit.lock()->emplace_back(cache, fileName);
+}
+
+void saveSnapshotsOnExit()
+{
+  auto snapshots = s_snapshotsToSaveOnExit.lock();
+  for (const auto& [cache, fileName] : *snapshots) {
+    try {
+      auto saved = cache->saveSnapshot(fileName);
+      infolog("Saved %d entries to packet cache snapshot '%s'", saved, fileName);
+    }
+    catch (const std::exception& exp) {
+      warnlog("Error saving packet cache snapshot '%s': %s", fileName, exp.what());
+    }
+  }
+}
+}
@@ -22,8 +22,11 @@
 #pragma once
 
 #include <atomic>
+#include <optional>
 #include <unordered_map>
 
+#include "dnsdist-cache-open-addressing.hh"
+#include "dnsdist-cache-shared.hh"
 #include "iputils.hh"
 #include "lock.hh"
 #include "noinitvector.hh"
@@ -35,6 +38,16 @@ struct DNSQuestion;
 class DNSDistPacketCache : boost::noncopyable
 {
 public:
+  /* how the entries of a shard are stored */
+  enum class Engine : uint8_t
+  {
+    /* a std::unordered_map protected by a read-write lock */
+    UnorderedMap,
+    /* lock-free lookups in cache-line sized buckets, responses stored in a slab arena */
+    OpenAddressing
+  };
+  static std::optional<Engine> getEngineFromName(const std::string& name);
+
   struct CacheSettings
   {
     std::unordered_set<uint16_t> d_optionsToSkip{EDNSOptionCode::COOKIE, EDNSOptionCode::PADDING};
@@ -48,10 +61,21 @@ public:
     uint32_t d_truncatedTTL{0};
     uint32_t d_staleTTL{60};
     uint32_t d_shardCount{1};
+    size_t d_maxCoalescedQueries{100};
     bool d_dontAge{false};
     bool d_deferrableInsertLock{true};
     bool d_parseECS{false};
     bool d_keepStaleData{false};
+    /* park queries missing the cache behind an identical one already in flight, see QueryCoalescer */
+    bool d_coalesceQueries{false};
+    Engine d_engine{Engine::UnorderedMap};
+    /* name of a shared memory segment used as a second tier behind this cache, that other
+       processes can attach to as well. Empty means no second tier */
+    std::string d_sharedSegmentName{};
+    /* number of entries of the shared segment, 0 meaning d_maxEntries */
+    size_t d_sharedSegmentEntries{0};
+    /* size of a slot of the shared segment, larger entries are only kept in this process */
+    size_t d_sharedSegmentSlotSize{1024};
   };
 
   DNSDistPacketCache(CacheSettings settings);
@@ -73,8 +97,17 @@ public:
   uint64_t getMaxEntries() const { return d_settings.d_maxEntries; }
   uint64_t getTTLTooShorts() const { return d_ttlTooShorts.load(); }
   uint64_t getCleanupCount() const { return d_cleanupCount.load(); }
+  uint64_t getSharedSegmentHits() const { return d_sharedSegmentHits.load(); }
+  uint64_t getSharedSegmentInserts() const { return d_sharedSegmentInserts.load(); }
   uint64_t getEntriesCount();
   uint64_t dump(int fileDesc, bool rawResponse = false);
+  /* write a binary snapshot of the entries that have not expired yet, that can be loaded
+     back via loadSnapshot(), for example after a restart. Returns the number of entries saved */
+  uint64_t saveSnapshot(const std::string& fileName);
+  /* insert the entries of a snapshot that have not expired in the meantime, reading the sections
+     of the snapshot in parallel using up to 'threads' threads (0 meaning one per CPU).
+     Returns the number of entries inserted */
+  uint64_t loadSnapshot(const std::string& fileName, size_t threads = 0);
 
   /* get the list of domains (qnames) that contains the given address in an A or AAAA record */
   std::set<DNSName> getDomainsContainingRecords(const ComboAddress& addr);
@@ -88,7 +121,11 @@ public:
     return d_settings.d_keepStaleData;
   }
 
+  bool isQueryCoalescingEnabled() const { return d_settings.d_coalesceQueries; }
+  size_t getMaximumCoalescedQueries() const { return d_settings.d_maxCoalescedQueries; }
+
   size_t getMaximumEntrySize() const { return d_settings.d_maximumEntrySize; }
+  Engine getEngine() const { return d_settings.d_engine; }
 
   uint32_t getKey(const DNSName::string_t& qname, size_t qnameWireLength, const PacketBuffer& packet, bool receivedOverUDP);
 
@@ -127,15 +164,37 @@ private:
       d_map.write_lock()->reserve(maxSize);
     }
 
+    void setOpenAddressing(size_t maxSize, size_t maximumEntrySize)
+    {
+      d_openAddressing = std::make_unique<dnsdist::cache::OpenAddressingShard>(maxSize, maximumEntrySize);
+    }
+
     SharedLockGuarded<std::unordered_map<uint32_t, CacheValue>> d_map;
+    /* only set when the open-addressing engine is used, in which case d_map is unused */
+    std::unique_ptr<dnsdist::cache::OpenAddressingShard> d_openAddressing;
     std::atomic<uint64_t> d_entriesCount{0};
   };
 
+  using OpenAddressingShard = dnsdist::cache::OpenAddressingShard;
+
   bool cachedValueMatches(const CacheValue& cachedValue, uint16_t queryFlags, const DNSName& qname, uint16_t qtype, uint16_t qclass, bool receivedOverUDP, bool dnssecOK, const boost::optional<Netmask>& subnet) const;
+  bool cachedValueMatches(const OpenAddressingShard::EntryHeader& cachedValue, std::string_view cachedQName, uint16_t queryFlags, const DNSName::string_t& qname, uint16_t qtype, uint16_t qclass, bool receivedOverUDP, bool dnssecOK, const boost::optional<Netmask>& subnet) const;
   uint32_t getShardIndex(uint32_t key) const;
   bool insertLocked(std::unordered_map<uint32_t, CacheValue>& map, uint32_t key, CacheValue& newValue);
+  bool insertLocked(OpenAddressingShard& shard, OpenAddressingShard::WriteLock& lock, uint32_t key, const OpenAddressingShard::EntryHeader& newValue, const DNSName::string_t& qname, const PacketBuffer& response);
+  template <typename Matcher>
+  bool fillResponseFromCachedValue(DNSQuestion& dnsQuestion, uint16_t queryId, const uint8_t* cachedResponse, uint16_t cachedLen, time_t added, time_t validity, time_t now, uint32_t allowExpired, bool truncatedOK, bool recordMiss, const Matcher& matches, bool& headerOnly, bool& stale, time_t& age);
+  /* insert an entry that has already been validated, from a snapshot or from the shared segment */
+  bool insertEntry(uint32_t key, const OpenAddressingShard::EntryHeader& header, const DNSName& qname, const PacketBuffer& response, bool deferrable);
+  bool getFromSharedSegment(DNSQuestion& dnsQuestion, uint16_t queryId, uint32_t key, uint16_t queryFlags, bool receivedOverUDP, bool dnssecOK, const boost::optional<Netmask>& subnet, time_t now, uint32_t allowExpired, bool truncatedOK, bool recordMiss, bool& headerOnly, bool& stale, time_t& age);
+  uint64_t loadSnapshotSection(FILE* file, uint64_t offset, uint64_t entries, time_t now);
+  static OpenAddressingShard::WriteLock lockOpenAddressingShard(CacheShard& shard, bool deferrable);
+  /* call visitor(key, value) for every entry of the shard, whatever the engine */
+  template <typename Visitor>
+  static void visitShard(CacheShard& shard, const Visitor& visitor);
 
   std::vector<CacheShard> d_shards;
+  std::unique_ptr<dnsdist::cache::SharedSegment> d_sharedSegment;
 
   pdns::stat_t d_deferredLookups{0};
   pdns::stat_t d_deferredInserts{0};
@@ -145,6 +204,16 @@ private:
   pdns::stat_t d_lookupCollisions{0};
   pdns::stat_t d_ttlTooShorts{0};
   pdns::stat_t d_cleanupCount{0};
+  pdns::stat_t d_sharedSegmentHits{0};
+  pdns::stat_t d_sharedSegmentInserts{0};
 
   CacheSettings d_settings;
 };
+
+namespace dnsdist::cache
+{
+/* restore the content of the cache from this snapshot file if it exists, and save the
+   content of the cache to it when dnsdist exits */
+void loadSnapshotAndSaveOnExit(const std::shared_ptr<DNSDistPacketCache>& cache, const std::string& fileName);
+void saveSnapshotsOnExit();
+}
@@ -0,0 +1,230 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <map>
+#include <set>
+#include <typeinfo>
+
+#include "dnsdist-compiled-rule-chain.hh"
+#include "dnsdist.hh"
+#include "dnsdist-rules-factory.hh"
+#include "lock.hh"
+
+namespace dnsdist::rules
+{
+static void mergeIndexes(CompiledRuleChain::Indexes& target, const CompiledRuleChain::Indexes& source)
+{
+  target.insert(target.end(), source.begin(), source.end());
+}
+
+static void sortIndexes(CompiledRuleChain::Indexes& indexes)
+{
+  std::sort(indexes.begin(), indexes.end());
+  indexes.erase(std::unique(indexes.begin(), indexes.end()), indexes.end());
+}
+
+CompiledRuleChain::CompiledRuleChain(const std::vector<RuleAction>& rules) :
+  d_rulesCount(rules.size())
+{
+  std::map<DNSName, Indexes> suffixes;
+  std::vector<std::pair<uint32_t, NetmaskTree<bool>>> netmaskRules;
+  std::set<Netmask> netmasks;
+
+  for (size_t idx = 0; idx < rules.size(); idx++) {
+    const auto position = static_cast<uint32_t>(idx);
+    const auto* rule = rules.at(idx).d_rule.get();
+    /* we look for the exact types, a derived class might very well look at something else */
+    if (typeid(*rule) == typeid(SuffixMatchNodeRule)) {
+      const auto& smnRule = static_cast<const SuffixMatchNodeRule&>(*rule); // NOLINT(cppcoreguidelines-pro-type-static-cast-downcast): we just checked the type
+      for (const auto& name : smnRule.getSuffixMatchNode().d_tree.getNodes()) {
+        /* the root is returned as an empty name */
+        suffixes[name.empty() ? g_rootdnsname : name].push_back(position);
+      }
+      d_indexedRules++;
+    }
+    else if (typeid(*rule) == typeid(NetmaskGroupRule) && static_cast<const NetmaskGroupRule&>(*rule).isSource()) { // NOLINT(cppcoreguidelines-pro-type-static-cast-downcast): we just checked the type
+      const auto& nmgRule = static_cast<const NetmaskGroupRule&>(*rule); // NOLINT(cppcoreguidelines-pro-type-static-cast-downcast): we just checked the type
+      NetmaskTree<bool> tree;
+      for (const auto& entry : nmgRule.getNetmaskGroup().toStringVector()) {
+        const bool negated = !entry.empty() && entry.at(0) == '!';
+        Netmask netmask(negated ? entry.substr(1) : entry);
+        tree.insert(netmask).second = !negated;
+        netmasks.insert(std::move(netmask));
+      }
+      netmaskRules.emplace_back(position, std::move(tree));
+      d_indexedRules++;
+    }
+    else if (typeid(*rule) == typeid(QTypeRule)) {
+      const auto& qtypeRule = static_cast<const QTypeRule&>(*rule); // NOLINT(cppcoreguidelines-pro-type-static-cast-downcast): we just checked the type
+      d_qtypes[qtypeRule.getQType()].push_back(position);
+      d_indexedRules++;
+    }
+    else {
+      d_others.push_back(position);
+    }
+  }
+
+  /* a name matches the rules of its longest suffix but also the ones of all the shorter suffixes */
+  for (const auto& [name, indexes] : suffixes) {
+    Indexes matching = indexes;
+    DNSName parent(name);
+    while (parent.chopOff()) {
+      const auto parentIt = suffixes.find(parent);
+      if (parentIt != suffixes.end()) {
+        mergeIndexes(matching, parentIt->second);
+      }
+    }
+    sortIndexes(matching);
+    d_suffixes.add(name, std::move(matching));
+    d_hasSuffixes = true;
+  }
+
+  /* an address whose longest match in the merged tree is that netmask matches a given rule
+     if the longest match for that netmask in the netmasks of the rule is a positive one */
+  for (const auto& netmask : netmasks) {
+    Indexes matching;
+    for (const auto& [position, tree] : netmaskRules) {
+      const auto* node = tree.lookup(netmask);
+      if (node != nullptr && node->second) {
+        matching.push_back(position);
+      }
+    }
+    d_netmasks.insert(netmask).second = std::move(matching);
+    d_hasNetmasks = true;
+  }
+}
+
+std::shared_ptr<const CompiledRuleChain> CompiledRuleChain::compile(const std::vector<RuleAction>& rules, size_t minimumIndexedRules)
+{
+  auto compiled = std::make_shared<const CompiledRuleChain>(rules);
+  if (compiled->getIndexedRulesCount() < minimumIndexedRules) {
+    return nullptr;
+  }
+  return compiled;
+}
+
+CompiledRuleChain::Matches::Matches(const CompiledRuleChain& compiled, const std::vector<RuleAction>& rules, const DNSQuestion& dnsQuestion) :
+  d_compiled(compiled), d_rules(rules), d_dnsQuestion(dnsQuestion)
+{
+  lookup(0);
+}
+
+void CompiledRuleChain::Matches::lookup(size_t from)
+{
+  static const Indexes s_empty;
+  const auto& ids = d_dnsQuestion.ids;
+  const auto start = [from](const Indexes* indexes) {
+    return Cursor{indexes, static_cast<size_t>(std::lower_bound(indexes->begin(), indexes->end(), from) - indexes->begin())};
+  };
+
+  const Indexes* suffixes = &s_empty;
+  if (d_compiled.d_hasSuffixes) {
+    d_qname = ids.qname;
+    if (const auto* matching = d_compiled.d_suffixes.lookup(ids.qname)) {
+      suffixes = matching;
+    }
+  }
+  d_suffixes = start(suffixes);
+
+  const Indexes* netmasks = &s_empty;
+  if (d_compiled.d_hasNetmasks) {
+    d_remote = ids.origRemote;
+    if (const auto* node = d_compiled.d_netmasks.lookup(ids.origRemote)) {
+      netmasks = &node->second;
+    }
+  }
+  d_netmasks = start(netmasks);
+
+  d_qtype = ids.qtype;
+  const auto qtypeIt = d_compiled.d_qtypes.find(ids.qtype);
+  d_qtypes = start(qtypeIt != d_compiled.d_qtypes.end() ? &qtypeIt->second : &s_empty);
+
+  d_others = start(&d_compiled.d_others);
+  d_next = from;
+}
+
+void CompiledRuleChain::Matches::refresh()
+{
+  const auto& ids = d_dnsQuestion.ids;
+  if ((d_compiled.d_hasSuffixes && ids.qname != d_qname) || (d_compiled.d_hasNetmasks && ids.origRemote != d_remote) || ids.qtype != d_qtype) {
+    lookup(d_next);
+  }
+}
+
+std::optional<size_t> CompiledRuleChain::Matches::next()
+{
+  while (true) {
+    Cursor* lowest = nullptr;
+    for (auto* cursor : {&d_suffixes, &d_netmasks, &d_qtypes, &d_others}) {
+      if (cursor->d_position < cursor->d_indexes->size() && (lowest == nullptr || cursor->d_indexes->at(cursor->d_position) < lowest->d_indexes->at(lowest->d_position))) {
+        lowest = cursor;
+      }
+    }
+    if (lowest == nullptr) {
+      return std::nullopt;
+    }
+
+    const size_t position = lowest->d_indexes->at(lowest->d_position);
+    lowest->d_position++;
+    d_next = position + 1;
+    /* the merged selectors are known to match, the other ones have to be evaluated */
+    if (lowest != &d_others || d_rules.at(position).d_rule->matches(&d_dnsQuestion)) {
+      return position;
+    }
+  }
+}
+
+struct CompiledRuleChainHolder
+{
+  std::shared_ptr<const CompiledRuleChain> d_compiled{nullptr};
+  uint64_t d_generation{0};
+  bool d_set{false};
+};
+
+/* one per RuleChain */
+static constexpr size_t s_ruleChainsCount{2};
+static LockGuarded<std::array<CompiledRuleChainHolder, s_ruleChainsCount>> s_compiledRuleChains;
+
+const CompiledRuleChain* getCompiledRuleChain(const RuleChains& chains, RuleChain chain)
+{
+  static thread_local std::array<CompiledRuleChainHolder, s_ruleChainsCount> t_compiledRuleChains;
+  const auto chainIndex = static_cast<size_t>(chain);
+  auto& local = t_compiledRuleChains.at(chainIndex);
+  if (local.d_set && local.d_generation == chains.d_generation) {
+    return local.d_compiled.get();
+  }
+
+  {
+    /* one thread compiles the chain, the other ones reuse it */
+    auto shared = s_compiledRuleChains.lock();
+    auto& holder = shared->at(chainIndex);
+    if (!holder.d_set || holder.d_generation != chains.d_generation) {
+      holder.d_compiled = CompiledRuleChain::compile(getRuleChain(chains, chain));
+      holder.d_generation = chains.d_generation;
+      holder.d_set = true;
+    }
+    local = holder;
+  }
+
+  return local.d_compiled.get();
+}
+}
@@ -0,0 +1,121 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "dnsdist-rule-chains.hh"
+#include "dnsname.hh"
+#include "iputils.hh"
+
+struct DNSQuestion;
+
+namespace dnsdist::rules
+{
+/* A rule chain in which the selectors that only look at the qname (SuffixMatchNodeRule),
+   the source address (NetmaskGroupRule) or the qtype (QTypeRule) have been merged into
+   one suffix tree, one netmask tree and one qtype index, giving for a query the ordered
+   list of the rules of each kind that match it with a single lookup. The other selectors
+   are still evaluated one by one, in order, so the rules are still considered in the same
+   order as with the plain chain and the first-match semantics are preserved. */
+class CompiledRuleChain
+{
+public:
+  /* rules are indexed by their position in the chain */
+  using Indexes = std::vector<uint32_t>;
+
+  CompiledRuleChain(const std::vector<RuleAction>& rules);
+
+  /* returns nullptr if the chain does not have enough rules that can be merged to be worth it */
+  static std::shared_ptr<const CompiledRuleChain> compile(const std::vector<RuleAction>& rules, size_t minimumIndexedRules = s_minimumIndexedRules);
+
+  size_t getIndexedRulesCount() const
+  {
+    return d_indexedRules;
+  }
+
+  size_t getRulesCount() const
+  {
+    return d_rulesCount;
+  }
+
+  /* Iterates, in order, over the rules whose selector matches a query. 'rules' has to be the
+     chain the compiled one has been built from, see getRulesCount() */
+  class Matches
+  {
+  public:
+    Matches(const CompiledRuleChain& compiled, const std::vector<RuleAction>& rules, const DNSQuestion& dnsQuestion);
+
+    /* position of the next matching rule, if any */
+    std::optional<size_t> next();
+    /* to be called after an action has been executed, since it might have altered the
+       qname, qtype or source address of the query */
+    void refresh();
+
+  private:
+    struct Cursor
+    {
+      const Indexes* d_indexes{nullptr};
+      size_t d_position{0};
+    };
+
+    void lookup(size_t from);
+
+    const CompiledRuleChain& d_compiled;
+    const std::vector<RuleAction>& d_rules;
+    const DNSQuestion& d_dnsQuestion;
+    /* what the lookups have been done for */
+    DNSName d_qname;
+    ComboAddress d_remote;
+    uint16_t d_qtype{0};
+    Cursor d_suffixes;
+    Cursor d_netmasks;
+    Cursor d_qtypes;
+    Cursor d_others;
+    /* position of the next rule to consider */
+    size_t d_next{0};
+  };
+
+private:
+  static constexpr size_t s_minimumIndexedRules{16};
+
+  /* for every suffix, the rules matching all names below it, including the rules
+     set on its parents, so that only the longest match has to be looked up */
+  SuffixMatchTree<Indexes> d_suffixes;
+  /* the same for netmasks, taking negated entries into account */
+  NetmaskTree<Indexes> d_netmasks;
+  std::unordered_map<uint16_t, Indexes> d_qtypes;
+  /* rules that cannot be merged */
+  Indexes d_others;
+  size_t d_rulesCount{0};
+  size_t d_indexedRules{0};
+  bool d_hasSuffixes{false};
+  bool d_hasNetmasks{false};
+};
+
+/* the compiled version of the query rule chain for these chains, shared between threads
+   and only rebuilt when the chains have been modified. nullptr if it is not worth it */
+const CompiledRuleChain* getCompiledRuleChain(const RuleChains& chains, RuleChain chain);
+}
@@ -36,6 +36,7 @@
 #include "dnsdist-rules.hh"
 #include "dnsdist-rules-factory.hh"
 #include "dnsdist-kvs.hh"
+#include "dnsdist-lua-per-thread.hh"
 #include "dnsdist-web.hh"
 #include "dnsdist-xsk.hh"
 #include "doh.hh"
@@ -80,6 +81,12 @@ static void registerType(const std::shared_ptr<T>& entry, const ::rust::string&
   if (!inserted) {
     throw std::runtime_error("Trying to register a type named '" + name + "' while one already exists");
   }
+  if constexpr (std::is_same_v<T, KeyValueStore> || std::is_same_v<T, DNSDistPacketCache>) {
+    /* named key-value stores and packet caches are also available to the per-thread Lua states */
+    if (!rustName.empty()) {
+      dnsdist::lua::perthread::addSharedObject(name, entry);
+    }
+  }
 }
 
 template <class T>
@@ -208,6 +215,36 @@ static bool getLuaFunctionFromConfiguration(FuncType& destination, const ::rust:
   return false;
 }
 
+/* same as above, also returning the bytecode of the function if it can be instantiated in per-thread Lua states and these are enabled */
+template <class FuncType>
+static bool getLuaFunctionFromConfiguration(FuncType& destination, std::optional<std::string>& perThreadCode, const ::rust::string& functionName, const ::rust::string& functionCode, const ::rust::string& functionFile, const std::string& context)
+{
+  if (!dnsdist::lua::perthread::isEnabled()) {
+    return getLuaFunctionFromConfiguration(destination, functionName, functionCode, functionFile, context);
+  }
+
+  auto lua = g_lua.lock();
+  LuaContext::LuaObject object;
+  if (!functionName.empty()) {
+    object = lua->readVariable<LuaContext::LuaObject>(std::string(functionName));
+  }
+  else if (!functionCode.empty()) {
+    object = lua->executeCode<LuaContext::LuaObject>(std::string(functionCode));
+  }
+  else if (!functionFile.empty()) {
+    auto content = loadContentFromConfigurationFile(std::string(functionFile));
+    if (!content) {
+      throw std::runtime_error("Unable to load content of lua-file's '" + std::string(functionFile) + "' in " + context + " context");
+    }
+    object = lua->executeCode<LuaContext::LuaObject>(*content);
+  }
+  else {
+    return false;
+  }
+  std::tie(destination, perThreadCode) = dnsdist::lua::perthread::getFunctionAndCode<FuncType>(*lua, object, context);
+  return true;
+}
+
 static std::set<int> getCPUPiningFromStr(const std::string& context, const std::string& cpuStr)
 {
   std::set<int> cpus;
@@ -416,6 +453,11 @@ static std::shared_ptr<DownstreamState> createBackendFromConfiguration(const dns
   std::shared_ptr<TLSCtx> tlsCtx;
 
   backendConfig.d_numberOfSockets = config.sockets;
+  backendConfig.d_responderBatchSize = config.responder_batch_size;
+  if (backendConfig.d_responderBatchSize == 0 || backendConfig.d_responderBatchSize > std::numeric_limits<uint16_t>::max()) {
+    warnlog("Dismissing invalid responder batch size '%d' for backend %s, using 1 instead", backendConfig.d_responderBatchSize, std::string(config.address));
+    backendConfig.d_responderBatchSize = 1;
+  }
   backendConfig.d_qpsLimit = config.queries_per_second;
   backendConfig.order = config.order;
   backendConfig.d_weight = config.weight;
@@ -625,6 +667,7 @@ static void loadDynamicBlockConfiguration(const dnsdist::rust::settings::Dynamic
   for (const auto& dbrg : dynamicRules) {
     auto dbrgObj = std::make_shared<DynBlockRulesGroup>();
     dbrgObj->setMasks(dbrg.mask_ipv4, dbrg.mask_ipv6, dbrg.mask_port);
+    dbrgObj->setIncremental(dbrg.incremental, dbrg.incremental_max_clients);
     for (const auto& range : dbrg.exclude_ranges) {
       dbrgObj->excludeRange(Netmask(std::string(range)));
     }
@@ -893,10 +936,14 @@ static void loadCustomPolicies(const ::rust::Vec<dnsdist::rust::settings::Custom
     }
     else {
       ServerPolicy::policyfunc_t function;
-      if (!getLuaFunctionFromConfiguration(function, policy.function_name, policy.function_code, policy.function_file, "load-balancing policy")) {
+      std::optional<std::string> perThreadCode;
+      if (!getLuaFunctionFromConfiguration(function, perThreadCode, policy.function_name, policy.function_code, policy.function_file, "load-balancing policy")) {
         throw std::runtime_error("Custom load-balancing policy '" + std::string(policy.name) + "' could not be created: no valid function name, Lua code or Lua file");
       }
       auto policyObj = std::make_shared<ServerPolicy>(std::string(policy.name), std::move(function), true);
+      if (perThreadCode) {
+        policyObj->setPerThreadLuaCode(std::move(*perThreadCode));
+      }
       registerType<ServerPolicy>(policyObj, policy.name);
     }
   }
@@ -984,7 +1031,7 @@ static void handleConsoleConfiguration(const dnsdist::rust::settings::ConsoleCon
   }
 }
 
-static void handlePacketCacheConfiguration(const ::rust::Vec<dnsdist::rust::settings::PacketCacheConfiguration>& caches)
+static void handlePacketCacheConfiguration(const ::rust::Vec<dnsdist::rust::settings::PacketCacheConfiguration>& caches, bool configCheck)
 {
   for (const auto& cache : caches) {
     DNSDistPacketCache::CacheSettings settings{
@@ -999,7 +1046,9 @@ static void handlePacketCacheConfiguration(const ::rust::Vec<dnsdist::rust::sett
       .d_deferrableInsertLock = cache.deferrable_insert_lock,
       .d_parseECS = cache.parse_ecs,
       .d_keepStaleData = cache.keep_stale_data,
+      .d_coalesceQueries = cache.coalesce_queries,
     };
+    settings.d_maxCoalescedQueries = cache.max_coalesced_queries;
     std::unordered_set<uint16_t> ranks;
     if (!cache.options_to_skip.empty()) {
       settings.d_optionsToSkip.clear();
@@ -1024,7 +1073,20 @@ static void handlePacketCacheConfiguration(const ::rust::Vec<dnsdist::rust::sett
       settings.d_payloadRanks.assign(ranks.begin(), ranks.end());
       std::sort(settings.d_payloadRanks.begin(), settings.d_payloadRanks.end());
     }
+    auto engine = DNSDistPacketCache::getEngineFromName(std::string(cache.engine));
+    if (!engine) {
+      throw std::runtime_error("Invalid packet cache engine '" + std::string(cache.engine) + "' for packet cache " + std::string(cache.name));
+    }
+    settings.d_engine = *engine;
+    if (!configCheck) {
+      settings.d_sharedSegmentName = std::string(cache.shared_segment);
+    }
+    settings.d_sharedSegmentEntries = cache.shared_segment_entries;
+    settings.d_sharedSegmentSlotSize = cache.shared_segment_slot_size;
     auto packetCacheObj = std::make_shared<DNSDistPacketCache>(settings);
+    if (!configCheck && !cache.snapshot_file.empty()) {
+      dnsdist::cache::loadSnapshotAndSaveOnExit(packetCacheObj, std::string(cache.snapshot_file));
+    }
 
     registerType<DNSDistPacketCache>(packetCacheObj, cache.name);
   }
@@ -1203,7 +1265,7 @@ bool loadConfigurationFromFile(const std::string& fileName, [[maybe_unused]] boo
       });
     }
 
-    handlePacketCacheConfiguration(globalConfig.packet_caches);
+    handlePacketCacheConfiguration(globalConfig.packet_caches, configCheck);
 
     loadCustomPolicies(globalConfig.load_balancing_policies.custom_policies);
 
@@ -1384,10 +1446,11 @@ static std::vector<::SVCRecordParameters> convertSVCRecordParameters(const ::rus
 std::shared_ptr<DNSActionWrapper> getLuaAction(const LuaActionConfiguration& config)
 {
   dnsdist::actions::LuaActionFunction function;
-  if (!dnsdist::configuration::yaml::getLuaFunctionFromConfiguration(function, config.function_name, config.function_code, config.function_file, "Lua action")) {
+  std::optional<std::string> perThreadCode;
+  if (!dnsdist::configuration::yaml::getLuaFunctionFromConfiguration(function, perThreadCode, config.function_name, config.function_code, config.function_file, "Lua action")) {
     throw std::runtime_error("Lua action '" + std::string(config.name) + "' could not be created: no valid function name, Lua code or Lua file");
   }
-  auto action = dnsdist::actions::getLuaAction(std::move(function));
+  auto action = dnsdist::actions::getLuaAction(std::move(function), std::move(perThreadCode));
   return newDNSActionWrapper(std::move(action), config.name);
 }
 
@@ -1462,10 +1525,11 @@ std::shared_ptr<DNSActionWrapper> getSpoofRawAction(const SpoofRawActionConfigur
 std::shared_ptr<DNSResponseActionWrapper> getLuaResponseAction(const LuaResponseActionConfiguration& config)
 {
   dnsdist::actions::LuaResponseActionFunction function;
-  if (!dnsdist::configuration::yaml::getLuaFunctionFromConfiguration(function, config.function_name, config.function_code, config.function_file, "Lua action")) {
+  std::optional<std::string> perThreadCode;
+  if (!dnsdist::configuration::yaml::getLuaFunctionFromConfiguration(function, perThreadCode, config.function_name, config.function_code, config.function_file, "Lua action")) {
     throw std::runtime_error("Lua response action '" + std::string(config.name) + "' could not be created: no valid function name, Lua code or Lua file");
   }
-  auto action = dnsdist::actions::getLuaResponseAction(std::move(function));
+  auto action = dnsdist::actions::getLuaResponseAction(std::move(function), std::move(perThreadCode));
   return newDNSResponseActionWrapper(std::move(action), config.name);
 }
 
@@ -1530,6 +1594,16 @@ std::shared_ptr<DNSSelector> getQNameSetSelector(const QNameSetSelectorConfigura
   return newDNSSelector(dnsdist::selectors::getQNameSetSelector(qnames), config.name);
 }
 
+std::shared_ptr<DNSSelector> getRegexSetSelector(const RegexSetSelectorConfiguration& config)
+{
+  std::vector<std::string> expressions;
+  expressions.reserve(config.expressions.size());
+  for (const auto& expression : config.expressions) {
+    expressions.emplace_back(expression);
+  }
+  return newDNSSelector(dnsdist::selectors::getRegexSetSelector(expressions, std::string(config.tag)), config.name);
+}
+
 std::shared_ptr<DNSSelector> getQNameSelector(const QNameSelectorConfiguration& config)
 {
   return newDNSSelector(dnsdist::selectors::getQNameSelector(DNSName(std::string(config.qname))), config.name);
@@ -1860,10 +1934,11 @@ void registerNMGObjects(const ::rust::Vec<NetmaskGroupConfiguration>& nmgs)
 std::shared_ptr<DNSSelector> getLuaSelector(const LuaSelectorConfiguration& config)
 {
   dnsdist::selectors::LuaSelectorFunction function;
-  if (!dnsdist::configuration::yaml::getLuaFunctionFromConfiguration(function, config.function_name, config.function_code, config.function_file, "Lua selector")) {
+  std::optional<std::string> perThreadCode;
+  if (!dnsdist::configuration::yaml::getLuaFunctionFromConfiguration(function, perThreadCode, config.function_name, config.function_code, config.function_file, "Lua selector")) {
     throw std::runtime_error("Unable to create a Lua selector: no valid function name, Lua code or Lua file");
   }
-  auto selector = dnsdist::selectors::getLuaSelector(function);
+  auto selector = dnsdist::selectors::getLuaSelector(function, std::move(perThreadCode));
   return newDNSSelector(std::move(selector), config.name);
 }
 
@@ -61,6 +61,8 @@ struct ImmutableConfiguration
   std::vector<uint32_t> d_tcpFastOpenKey;
   std::vector<std::shared_ptr<ClientState>> d_frontends;
   std::string d_snmpDaemonSocketPath;
+  std::string d_tcpMultiplexer;
+  std::string d_udpResponderMultiplexer;
 #ifdef __linux__
   // On Linux this gives us 128k pending queries (default is 8192 queries),
   // which should be enough to deal with huge spikes
@@ -90,20 +92,27 @@ struct ImmutableConfiguration
   size_t d_ringsCapacity{10000};
   size_t d_ringsNumberOfShards{10};
   size_t d_ringsNbLockTries{5};
+  size_t d_ringsPerThreadBufferSize{0};
+  size_t d_heavyHittersCapacity{0};
   uint32_t d_socketUDPSendBuffer{0};
   uint32_t d_socketUDPRecvBuffer{0};
   uint32_t d_hashPerturbation{0};
   uint32_t d_maxTCPReadIOsPerQuery{50};
   uint32_t d_tcpBanDurationForExceedingMaxReadIOsPerQuery{60};
   uint32_t d_tcpBanDurationForExceedingTCPTLSRate{10};
+  uint32_t d_heavyHittersHalfLife{60};
   uint16_t d_maxUDPOutstanding{std::numeric_limits<uint16_t>::max()};
   uint8_t d_udpTimeout{2};
   uint8_t d_tcpConnectionsOverloadThreshold{90};
   uint8_t d_tcpConnectionsMaskV4{32};
   uint8_t d_tcpConnectionsMaskV6{128};
   uint8_t d_tcpConnectionsMaskV4Port{0};
+  uint8_t d_heavyHittersMaskV4{32};
+  uint8_t d_heavyHittersMaskV6{64};
+  uint8_t d_heavyHittersSuffixLabels{2};
   bool d_randomizeUDPSocketsToBackend{false};
   bool d_randomizeIDsToBackend{false};
+  bool d_luaPerThreadStates{false};
   bool d_ringsRecordQueries{true};
   bool d_ringsRecordResponses{true};
   bool d_snmpEnabled{false};
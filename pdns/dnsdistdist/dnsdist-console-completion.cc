@@ -55,6 +55,7 @@ static std::vector<dnsdist::console::completion::ConsoleKeyword> s_consoleKeywor
   {"addDynBlocks", true, "addresses, message[, seconds[, action]]", "block the set of addresses with message `msg`, for `seconds` seconds (10 by default), applying `action` (default to the one set with `setDynBlocksAction()`)"},
   {"addDynBlockSMT", true, "names, message[, seconds [, action]]", "block the set of names with message `msg`, for `seconds` seconds (10 by default), applying `action` (default to the one set with `setDynBlocksAction()`)"},
   {"addLocal", true, R"(addr [, {doTCP=true, reusePort=false, tcpFastOpenQueueSize=0, interface="", cpus={}}])", "add `addr` to the list of addresses we listen on"},
+  {"addLuaSharedObject", true, "name, object", "make a key-value store or packet cache available, as a global variable named `name`, in the per-thread Lua states"},
   {"addMaintenanceCallback", true, "callback", "register a function to be called as part of the maintenance hook, every second"},
   {"addExitCallback", true, "callback", "register a function to be called when DNSdist exits"},
   {"addServerStateChangeCallback", true, "callback", "register a function to be called when state changed for a given server"},
@@ -111,6 +112,7 @@ static std::vector<dnsdist::console::completion::ConsoleKeyword> s_consoleKeywor
   {"getDOH3FrontendCount", true, "", "returns the number of DoH3 listeners"},
   {"getDOQFrontend", true, "n", "returns the DoQ frontend with index n"},
   {"getDOQFrontendCount", true, "", "returns the number of DoQ listeners"},
+  {"getHeavyHitters", true, "[top]", "returns the `top` clients, query name suffixes and response code and query name suffix pairs seen the most often recently, as tracked by the heavy hitters tracker"},
   {"getListOfAddressesOfNetworkInterface", true, "itf", "returns the list of addresses configured on a given network interface, as strings"},
   {"getListOfNetworkInterfaces", true, "", "returns the list of network interfaces present on the system, as strings"},
   {"getListOfRangesOfNetworkInterface", true, "itf", "returns the list of network ranges configured on a given network interface, as strings"},
@@ -169,7 +171,7 @@ static std::vector<dnsdist::console::completion::ConsoleKeyword> s_consoleKeywor
 #endif /* HAVE_IPCIPHER */
   {"makeKey", true, "", "generate a new server access key, emit configuration line ready for pasting"},
   {"makeRule", true, "rule", "Make a NetmaskGroupRule() or a SuffixMatchNodeRule(), depending on how it is called"},
-  {"MaxQPSIPRule", true, "qps, [v4Mask=32 [, v6Mask=64 [, burst=qps [, expiration=300 [, cleanupDelay=60 [, scanFraction=10 [, shards=10]]]]]]]", "matches traffic exceeding the qps limit per subnet"},
+  {"MaxQPSIPRule", true, "qps, [v4Mask=32 [, v6Mask=64 [, burst=qps [, expiration=300 [, cleanupDelay=60 [, scanFraction=10 [, shards=10 [, tableSize=0]]]]]]]]", "matches traffic exceeding the qps limit per subnet"},
   {"MaxQPSRule", true, "qps", "matches traffic **not** exceeding this qps limit"},
   {"NetmaskGroupRule", true, "nmg[, src]", "Matches traffic from/to the network range specified in nmg. Set the src parameter to false to match nmg against destination address instead of source address. This can be used to differentiate between clients"},
   {"newBPFFilter", true, "{ipv4MaxItems=int, ipv4PinnedPath=string, ipv6MaxItems=int, ipv6PinnedPath=string, cidr4MaxItems=int, cidr4PinnedPath=string, cidr6MaxItems=int, cidr6PinnedPath=string, qnamesMaxItems=int, qnamesPinnedPath=string, external=bool}", "Return a new eBPF socket filter with specified options."},
@@ -190,7 +192,7 @@ static std::vector<dnsdist::console::completion::ConsoleKeyword> s_consoleKeywor
   {"newQPSLimiter", true, "rate, burst", "configure a QPS limiter with that rate and that burst capacity"},
   {"newRemoteLogger", true, "address:port [, timeout=2, maxQueuedEntries=100, reconnectWaitTime=1]", "create a Remote Logger object, to use with `RemoteLogAction()` and `RemoteLogResponseAction()`"},
   {"newRuleAction", true, R"(DNS rule, DNS action [, {uuid="UUID", name="name"}])", "return a pair of DNS Rule and DNS Action, to be used with `setRules()`"},
-  {"newServer", true, R"({address="ip:port", qps=1000, order=1, weight=10, pool="abuse", retries=5, udpTimeout=0, tcpConnectTimeout=5, tcpSendTimeout=30, tcpRecvTimeout=30, checkName="a.root-servers.net.", checkType="A", maxCheckFailures=1, mustResolve=false, useClientSubnet=true, source="address|interface name|address@interface", sockets=1, reconnectOnUp=false})", "instantiate a server"},
+  {"newServer", true, R"({address="ip:port", qps=1000, order=1, weight=10, pool="abuse", retries=5, udpTimeout=0, tcpConnectTimeout=5, tcpSendTimeout=30, tcpRecvTimeout=30, checkName="a.root-servers.net.", checkType="A", maxCheckFailures=1, mustResolve=false, useClientSubnet=true, source="address|interface name|address@interface", sockets=1, responderBatchSize=1, reconnectOnUp=false})", "instantiate a server"},
   {"newServerPolicy", true, "name, function", "create a policy object from a Lua function"},
   {"newSuffixMatchNode", true, "", "returns a new SuffixMatchNode"},
   {"newSVCRecordParameters", true, "priority, target, mandatoryParams, alpns, noDefaultAlpn [, port [, ech [, ipv4hints [, ipv6hints [, additionalParameters ]]]]]", "return a new SVCRecordParameters object, to use with SpoofSVCAction"},
@@ -202,6 +204,7 @@ static std::vector<dnsdist::console::completion::ConsoleKeyword> s_consoleKeywor
   {"PoolAction", true, "poolname [, stop]", "set the packet into the specified pool"},
   {"PoolAvailableRule", true, "poolname", "Check whether a pool has any servers available to handle queries"},
   {"PoolOutstandingRule", true, "poolname, limit", "Check whether a pool has outstanding queries above limit"},
+  {"powerOfTwoLatency", false, "", "Send traffic to the cheaper of two random servers, based on their recent latency and outstanding queries"},
   {"printDNSCryptProviderFingerprint", true, R"("/path/to/providerPublic.key")", "display the fingerprint of the provided resolver public key"},
   {"ProbaRule", true, "probability", "Matches queries with a given probability. 1.0 means always"},
   {"ProxyProtocolValueRule", true, "type [, value]", "matches queries with a specified Proxy Protocol TLV value of that type, optionally matching the content of the option as well"},
@@ -219,6 +222,7 @@ static std::vector<dnsdist::console::completion::ConsoleKeyword> s_consoleKeywor
   {"RecordsCountRule", true, "section, minCount, maxCount", "Matches if there is at least minCount and at most maxCount records in the section section. section can be specified as an integer or as a DNS Packet Sections"},
   {"RecordsTypeCountRule", true, "section, qtype, minCount, maxCount", "Matches if there is at least minCount and at most maxCount records of type type in the section section"},
   {"RegexRule", true, "regex", "matches the query name against the supplied regex"},
+  {"RegexSetRule", true, "regexes [, tagName]", "matches the query name against all the supplied regexes at once, storing the position of the first one that matched into the tag 'tagName' if set"},
   {"registerDynBPFFilter", true, "DynBPFFilter", "register this dynamic BPF filter into the web interface so that its counters are displayed"},
   {"reloadAllCertificates", true, "", "reload all DNSCrypt and TLS certificates, along with their associated keys"},
   {"RemoteLogAction", true, "RemoteLogger [, alterFunction [, serverID]]", "send the content of this query to a remote logger via Protocol Buffer. `alterFunction` is a callback, receiving a DNSQuestion and a DNSDistProtoBufMessage, that can be used to modify the Protocol Buffer content, for example for anonymization purposes. `serverID` is the server identifier."},
@@ -253,6 +257,7 @@ static std::vector<dnsdist::console::completion::ConsoleKeyword> s_consoleKeywor
   {"setECSSourcePrefixV6", true, "prefix-length", "the EDNS Client Subnet prefix-length used for IPv6 queries"},
   {"setKey", true, "key", "set access key to that key"},
   {"setLocal", true, R"(addr [, {doTCP=true, reusePort=false, tcpFastOpenQueueSize=0, interface="", cpus={}}])", "reset the list of addresses we listen on to this address"},
+  {"setLuaPerThreadStates", true, "bool", "whether the regular Lua functions used by actions, selectors and load-balancing policies should be instantiated in a Lua state per thread"},
   {"setMaxCachedDoHConnectionsPerDownstream", true, "max", "Set the maximum number of inactive DoH connections to a backend cached by each worker DoH thread"},
   {"setMaxCachedTCPConnectionsPerDownstream", true, "max", "Set the maximum number of inactive TCP connections to a backend cached by each worker TCP thread"},
   {"setMaxTCPClientThreads", true, "n", "set the maximum of TCP client threads, handling TCP connections"},
@@ -301,9 +306,11 @@ static std::vector<dnsdist::console::completion::ConsoleKeyword> s_consoleKeywor
   {"setTCPConnectionsOverloadThreshold", true, "n", "Set a threshold as a percentage to the maximum number of incoming TCP connections per frontend or per client. When this threshold is reached, new incoming TCP connections are restricted: only query per connection is allowed (no out-of-order processing, no idle time allowed), the receive timeout is reduced to 500 milliseconds and the total duration of the TCP connection is limited to 5 seconds"},
   {"setTCPFastOpenKey", true, "string", "TCP Fast Open Key"},
   {"setTCPInternalPipeBufferSize", true, "size", "Set the size in bytes of the internal buffer of the pipes used internally to distribute connections to TCP (and DoT) workers threads"},
+  {"setTCPMultiplexer", true, "name", "Use the opt-in event multiplexer 'name', for example 'io_uring', in the TCP acceptor and worker threads"},
   {"setTCPRecvTimeout", true, "n", "set the read timeout on TCP connections from the client, in seconds"},
   {"setTCPSendTimeout", true, "n", "set the write timeout on TCP connections from the client, in seconds"},
   {"setUDPMultipleMessagesVectorSize", true, "n", "set the size of the vector passed to recvmmsg() to receive UDP messages. Default to 1 which means that the feature is disabled and recvmsg() is used instead"},
+  {"setUDPResponderMultiplexer", true, "name", "Use the opt-in event multiplexer 'name', for example 'io_uring', to receive the responses from the backends over UDP"},
   {"setUDPSocketBufferSizes", true, "recv, send", "Set the size of the receive (SO_RCVBUF) and send (SO_SNDBUF) buffers for incoming UDP sockets"},
   {"setUDPTimeout", true, "n", "set the maximum time dnsdist will wait for a response from a backend over UDP, in seconds"},
   {"setVerbose", true, "bool", "set whether log messages at the verbose level will be logged"},
@@ -322,6 +329,7 @@ static std::vector<dnsdist::console::completion::ConsoleKeyword> s_consoleKeywor
   {"showDOHResponseCodes", true, "", "show the HTTP response code statistics for the DoH frontends"},
   {"showDOQFrontends", true, "", "list all the available DOQ frontends"},
   {"showDynBlocks", true, "", "show dynamic blocks in force"},
+  {"showHeavyHitters", true, "[top]", "show the `top` clients, query name suffixes and response code and query name suffix pairs seen the most often recently, as tracked by the heavy hitters tracker"},
   {"showPools", true, "", "show the available pools"},
   {"showPoolServerPolicy", true, "pool", "show server selection policy for this pool"},
   {"showResponseLatency", true, "", "show a plot of the response time latency distribution"},
@@ -7,21 +7,53 @@
 static GlobalStateHolder<ClientAddressDynamicRules> s_dynblockNMG;
 static GlobalStateHolder<SuffixDynamicRules> s_dynblockSMT;
 
+DynBlockRulesGroup::~DynBlockRulesGroup()
+{
+  if (d_incrementalCounters) {
+    g_rings.removeObserver(d_incrementalCounters.get());
+  }
+}
+
+void DynBlockRulesGroup::setIncremental(bool incremental, size_t maxClients)
+{
+  if (incremental == isIncremental() && (!incremental || maxClients == d_incrementalMaxClients)) {
+    return;
+  }
+  if (d_incrementalCounters) {
+    g_rings.removeObserver(d_incrementalCounters.get());
+    d_incrementalCounters.reset();
+  }
+  if (incremental) {
+    d_incrementalCounters = std::make_shared<IncrementalCounters>(getIncrementalLayout(), maxClients);
+    d_incrementalMaxClients = maxClients;
+    g_rings.addObserver(d_incrementalCounters);
+  }
+}
+
 void DynBlockRulesGroup::apply(const timespec& now)
 {
   counts_t counts;
   StatNode statNodeRoot;
 
-  size_t entriesCount = 0;
-  if (hasQueryRules()) {
-    entriesCount += g_rings.getNumberOfQueryEntries();
-  }
-  if (hasResponseRules()) {
-    entriesCount += g_rings.getNumberOfResponseEntries();
+  /* make sure we see the entries still sitting in the per-thread rings, if any:
+     the merge also feeds the ring observers, including the incremental counters */
+  g_rings.mergePerThreadRings();
+
+  if (isIncremental()) {
+    processIncrementalCounters(counts, now);
   }
-  counts.reserve(entriesCount);
+  else {
+    size_t entriesCount = 0;
+    if (hasQueryRules()) {
+      entriesCount += g_rings.getNumberOfQueryEntries();
+    }
+    if (hasResponseRules()) {
+      entriesCount += g_rings.getNumberOfResponseEntries();
+    }
+    counts.reserve(entriesCount);
 
-  processQueryRules(counts, now);
+    processQueryRules(counts, now);
+  }
   processResponseRules(counts, statNodeRoot, now);
 
   if (counts.empty() && statNodeRoot.empty()) {
@@ -409,43 +441,48 @@ void DynBlockRulesGroup::processQueryRules(counts_t& counts, const struct timesp
 
 void DynBlockRulesGroup::processResponseRules(counts_t& counts, StatNode& root, const struct timespec& now)
 {
-  if (!hasResponseRules() && !hasSuffixMatchRules()) {
+  /* in incremental mode the counters are already up-to-date, and we only need to look
+     at the response ring for the names needed by the suffix match rule */
+  const bool countResponses = !isIncremental() && hasResponseRules();
+  if (!countResponses && !hasSuffixMatchRules()) {
     return;
   }
 
   struct timespec responseCutOff = now;
 
-  d_respRateRule.d_cutOff = d_respRateRule.d_minTime = now;
-  d_respRateRule.d_cutOff.tv_sec -= d_respRateRule.d_seconds;
-  if (d_respRateRule.d_cutOff < responseCutOff) {
-    responseCutOff = d_respRateRule.d_cutOff;
-  }
-
   d_suffixMatchRule.d_cutOff = d_suffixMatchRule.d_minTime = now;
   d_suffixMatchRule.d_cutOff.tv_sec -= d_suffixMatchRule.d_seconds;
   if (d_suffixMatchRule.d_cutOff < responseCutOff) {
     responseCutOff = d_suffixMatchRule.d_cutOff;
   }
 
-  d_respCacheMissRatioRule.d_cutOff = d_respCacheMissRatioRule.d_minTime = now;
-  d_respCacheMissRatioRule.d_cutOff.tv_sec -= d_respCacheMissRatioRule.d_seconds;
-  if (d_respCacheMissRatioRule.d_cutOff < responseCutOff) {
-    responseCutOff = d_respCacheMissRatioRule.d_cutOff;
-  }
+  if (countResponses) {
+    d_respRateRule.d_cutOff = d_respRateRule.d_minTime = now;
+    d_respRateRule.d_cutOff.tv_sec -= d_respRateRule.d_seconds;
+    if (d_respRateRule.d_cutOff < responseCutOff) {
+      responseCutOff = d_respRateRule.d_cutOff;
+    }
 
-  for (auto& rule : d_rcodeRules) {
-    rule.second.d_cutOff = rule.second.d_minTime = now;
-    rule.second.d_cutOff.tv_sec -= rule.second.d_seconds;
-    if (rule.second.d_cutOff < responseCutOff) {
-      responseCutOff = rule.second.d_cutOff;
+    d_respCacheMissRatioRule.d_cutOff = d_respCacheMissRatioRule.d_minTime = now;
+    d_respCacheMissRatioRule.d_cutOff.tv_sec -= d_respCacheMissRatioRule.d_seconds;
+    if (d_respCacheMissRatioRule.d_cutOff < responseCutOff) {
+      responseCutOff = d_respCacheMissRatioRule.d_cutOff;
     }
-  }
 
-  for (auto& rule : d_rcodeRatioRules) {
-    rule.second.d_cutOff = rule.second.d_minTime = now;
-    rule.second.d_cutOff.tv_sec -= rule.second.d_seconds;
-    if (rule.second.d_cutOff < responseCutOff) {
-      responseCutOff = rule.second.d_cutOff;
+    for (auto& rule : d_rcodeRules) {
+      rule.second.d_cutOff = rule.second.d_minTime = now;
+      rule.second.d_cutOff.tv_sec -= rule.second.d_seconds;
+      if (rule.second.d_cutOff < responseCutOff) {
+        responseCutOff = rule.second.d_cutOff;
+      }
+    }
+
+    for (auto& rule : d_rcodeRatioRules) {
+      rule.second.d_cutOff = rule.second.d_minTime = now;
+      rule.second.d_cutOff.tv_sec -= rule.second.d_seconds;
+      if (rule.second.d_cutOff < responseCutOff) {
+        responseCutOff = rule.second.d_cutOff;
+      }
     }
   }
 
@@ -460,25 +497,26 @@ void DynBlockRulesGroup::processResponseRules(counts_t& counts, StatNode& root,
         continue;
       }
 
-      auto& entry = counts[AddressAndPortRange(ringEntry.requestor, ringEntry.requestor.isIPv4() ? d_v4Mask : d_v6Mask, d_portMask)];
-      ++entry.responses;
+      if (countResponses) {
+        auto& entry = counts[AddressAndPortRange(ringEntry.requestor, ringEntry.requestor.isIPv4() ? d_v4Mask : d_v6Mask, d_portMask)];
+        ++entry.responses;
 
-      bool respRateMatches = d_respRateRule.matches(ringEntry.when);
-      bool suffixMatchRuleMatches = d_suffixMatchRule.matches(ringEntry.when);
-      bool rcodeRuleMatches = checkIfResponseCodeMatches(ringEntry);
-      bool respCacheMissRatioRuleMatches = d_respCacheMissRatioRule.matches(ringEntry.when);
+        bool respRateMatches = d_respRateRule.matches(ringEntry.when);
+        bool rcodeRuleMatches = checkIfResponseCodeMatches(ringEntry);
+        bool respCacheMissRatioRuleMatches = d_respCacheMissRatioRule.matches(ringEntry.when);
 
-      if (respRateMatches) {
-        entry.respBytes += ringEntry.size;
-      }
-      if (rcodeRuleMatches) {
-        ++entry.d_rcodeCounts[ringEntry.dh.rcode];
-      }
-      if (respCacheMissRatioRuleMatches && !ringEntry.isACacheHit()) {
-        ++entry.cacheMisses;
+        if (respRateMatches) {
+          entry.respBytes += ringEntry.size;
+        }
+        if (rcodeRuleMatches) {
+          ++entry.d_rcodeCounts[ringEntry.dh.rcode];
+        }
+        if (respCacheMissRatioRuleMatches && !ringEntry.isACacheHit()) {
+          ++entry.cacheMisses;
+        }
       }
 
-      if (suffixMatchRuleMatches) {
+      if (d_suffixMatchRule.matches(ringEntry.when)) {
         const bool hit = ringEntry.isACacheHit();
         root.submit(ringEntry.name, ((ringEntry.dh.rcode == 0 && ringEntry.usec == std::numeric_limits<unsigned int>::max()) ? -1 : ringEntry.dh.rcode), ringEntry.size, hit, std::nullopt);
       }
@@ -486,6 +524,324 @@ void DynBlockRulesGroup::processResponseRules(counts_t& counts, StatNode& root,
   }
 }
 
+void DynBlockRulesGroup::updateIncrementalLayout()
+{
+  if (d_incrementalCounters) {
+    d_incrementalCounters->setLayout(getIncrementalLayout());
+  }
+}
+
+DynBlockRulesGroup::IncrementalCounters::Layout DynBlockRulesGroup::getIncrementalLayout() const
+{
+  IncrementalCounters::Layout layout;
+  layout.d_v4Mask = d_v4Mask;
+  layout.d_v6Mask = d_v6Mask;
+  layout.d_portMask = d_portMask;
+
+  time_t window = 0;
+  auto updateWindow = [&window](const DynBlockRule& rule) {
+    if (rule.isEnabled()) {
+      window = std::max(window, static_cast<time_t>(rule.d_seconds));
+    }
+  };
+  updateWindow(d_queryRateRule);
+  updateWindow(d_respRateRule);
+  updateWindow(d_respCacheMissRatioRule);
+  for (const auto& [qtype, rule] : d_qtypeRules) {
+    layout.d_qtypes.push_back(qtype);
+    updateWindow(rule);
+  }
+  for (const auto& [rcode, rule] : d_rcodeRules) {
+    layout.d_rcodes.push_back(rcode);
+    updateWindow(rule);
+  }
+  for (const auto& [rcode, rule] : d_rcodeRatioRules) {
+    if (d_rcodeRules.count(rcode) == 0) {
+      layout.d_rcodes.push_back(rcode);
+    }
+    updateWindow(rule);
+  }
+  std::sort(layout.d_rcodes.begin(), layout.d_rcodes.end());
+  /* rules without a number of seconds consider everything we have, so keep a reasonable history for them */
+  static constexpr time_t defaultWindow{60};
+  layout.d_windowSeconds = window > 0 ? window : defaultWindow;
+  return layout;
+}
+
+void DynBlockRulesGroup::processIncrementalCounters(counts_t& counts, const struct timespec& now)
+{
+  if (!hasRules()) {
+    /* nothing to check, but we still need to forget about inactive clients */
+    d_incrementalCounters->visitActive(now.tv_sec, [](const AddressAndPortRange&, const IncrementalCounters::ClientCounters&, const IncrementalCounters::Layout&) {});
+    return;
+  }
+
+  /* the rules might have been updated since the last pass */
+  auto layout = getIncrementalLayout();
+  const auto fullWindow = layout.d_windowSeconds;
+  d_incrementalCounters->setLayout(std::move(layout));
+
+  auto getWindow = [now, fullWindow](DynBlockRule& rule) -> time_t {
+    if (!rule.isEnabled()) {
+      return 0;
+    }
+    /* rateExceeded() relies on d_minTime for rules without a number of seconds */
+    rule.d_minTime = now;
+    rule.d_minTime.tv_sec -= fullWindow;
+    return rule.d_seconds > 0 ? static_cast<time_t>(rule.d_seconds) : fullWindow;
+  };
+
+  const auto queriesWindow = getWindow(d_queryRateRule);
+  const auto responseBytesWindow = getWindow(d_respRateRule);
+  const auto cacheMissesWindow = getWindow(d_respCacheMissRatioRule);
+  /* ratios are computed over all the responses seen during the longest window, like in the ring-based mode */
+  auto responsesWindow = std::max(responseBytesWindow, cacheMissesWindow);
+  std::map<uint16_t, time_t> qtypeWindows;
+  for (auto& [qtype, rule] : d_qtypeRules) {
+    qtypeWindows[qtype] = getWindow(rule);
+  }
+  std::map<uint8_t, time_t> rcodeWindows;
+  for (auto& [rcode, rule] : d_rcodeRules) {
+    rcodeWindows[rcode] = getWindow(rule);
+    responsesWindow = std::max(responsesWindow, rcodeWindows[rcode]);
+  }
+  for (auto& [rcode, rule] : d_rcodeRatioRules) {
+    rcodeWindows[rcode] = std::max(rcodeWindows[rcode], getWindow(rule));
+    responsesWindow = std::max(responsesWindow, rcodeWindows[rcode]);
+  }
+
+  d_incrementalCounters->visitActive(now.tv_sec, [&](const AddressAndPortRange& requestor, const IncrementalCounters::ClientCounters& client, const IncrementalCounters::Layout& currentLayout) {
+    Counts entry;
+    if (queriesWindow > 0) {
+      entry.queries = client.sum(currentLayout, IncrementalCounters::Queries, queriesWindow, now.tv_sec);
+    }
+    if (responseBytesWindow > 0) {
+      entry.respBytes = client.sum(currentLayout, IncrementalCounters::ResponseBytes, responseBytesWindow, now.tv_sec);
+    }
+    if (cacheMissesWindow > 0) {
+      entry.cacheMisses = client.sum(currentLayout, IncrementalCounters::CacheMisses, cacheMissesWindow, now.tv_sec);
+    }
+    if (responsesWindow > 0) {
+      entry.responses = client.sum(currentLayout, IncrementalCounters::Responses, responsesWindow, now.tv_sec);
+    }
+    for (size_t idx = 0; idx < currentLayout.d_qtypes.size(); idx++) {
+      const auto qtype = currentLayout.d_qtypes.at(idx);
+      if (auto count = client.sum(currentLayout, IncrementalCounters::s_fixedCounters + idx, qtypeWindows[qtype], now.tv_sec); count > 0) {
+        entry.d_qtypeCounts[qtype] = count;
+      }
+    }
+    for (size_t idx = 0; idx < currentLayout.d_rcodes.size(); idx++) {
+      const auto rcode = currentLayout.d_rcodes.at(idx);
+      if (auto count = client.sum(currentLayout, IncrementalCounters::s_fixedCounters + currentLayout.d_qtypes.size() + idx, rcodeWindows[rcode], now.tv_sec); count > 0) {
+        entry.d_rcodeCounts[rcode] = count;
+      }
+    }
+
+    if (entry.queries > 0 || entry.responses > 0 || !entry.d_qtypeCounts.empty()) {
+      counts.emplace(requestor, std::move(entry));
+    }
+  });
+}
+
+DynBlockRulesGroup::IncrementalCounters::IncrementalCounters(Layout&& layout, size_t maxClients, size_t numberOfShards) :
+  d_shards(numberOfShards), d_maxClientsPerShard(std::max(maxClients / numberOfShards, static_cast<size_t>(1)))
+{
+  setLayout(std::move(layout));
+}
+
+void DynBlockRulesGroup::IncrementalCounters::Shard::clear()
+{
+  d_clients.clear();
+  d_values.clear();
+  d_seconds.clear();
+  d_freeSlots.clear();
+}
+
+uint32_t DynBlockRulesGroup::IncrementalCounters::Shard::allocateSlot()
+{
+  const auto buckets = d_layout->d_windowSeconds + 1;
+  const auto countersPerBucket = d_layout->getCountersPerBucket();
+  uint32_t slot = 0;
+  if (!d_freeSlots.empty()) {
+    slot = d_freeSlots.back();
+    d_freeSlots.pop_back();
+  }
+  else if (d_clients.size() < d_maxClients) {
+    /* within the reserved capacity, so the existing buckets are not moved */
+    slot = static_cast<uint32_t>(d_seconds.size() / buckets);
+    d_seconds.resize(d_seconds.size() + buckets, 0);
+    d_values.resize(d_values.size() + (buckets * countersPerBucket), 0);
+    return slot;
+  }
+  else {
+    auto& sidx = d_clients.get<SequencedTag>();
+    slot = sidx.back().d_slot;
+    sidx.pop_back();
+  }
+
+  std::fill_n(d_seconds.begin() + static_cast<ptrdiff_t>(slot * buckets), buckets, 0);
+  std::fill_n(d_values.begin() + static_cast<ptrdiff_t>(slot * buckets * countersPerBucket), buckets * countersPerBucket, 0);
+  return slot;
+}
+
+void DynBlockRulesGroup::IncrementalCounters::setLayout(Layout&& layout)
+{
+  {
+    auto shard = d_shards.at(0).lock();
+    if (shard->d_layout && *shard->d_layout == layout) {
+      return;
+    }
+  }
+
+  d_v4Mask = layout.d_v4Mask;
+  d_v6Mask = layout.d_v6Mask;
+  d_portMask = layout.d_portMask;
+  auto newLayout = std::make_shared<const Layout>(std::move(layout));
+  const auto buckets = newLayout->d_windowSeconds + 1;
+  const auto countersPerBucket = newLayout->getCountersPerBucket();
+  for (auto& lockedShard : d_shards) {
+    auto shard = lockedShard.lock();
+    shard->clear();
+    shard->d_layout = newLayout;
+    shard->d_maxClients = d_maxClientsPerShard;
+    /* only the pages that are actually used will be backed by memory */
+    shard->d_seconds.reserve(d_maxClientsPerShard * buckets);
+    shard->d_values.reserve(d_maxClientsPerShard * buckets * countersPerBucket);
+  }
+}
+
+AddressAndPortRange DynBlockRulesGroup::IncrementalCounters::getKey(const ComboAddress& requestor) const
+{
+  return AddressAndPortRange(requestor, requestor.isIPv4() ? d_v4Mask.load() : d_v6Mask.load(), d_portMask.load());
+}
+
+void DynBlockRulesGroup::IncrementalCounters::record(const struct timespec& when, const ComboAddress& requestor, const Event& event)
+{
+  const auto key = getKey(requestor);
+  auto shard = d_shards.at(AddressAndPortRange::hash()(key) % d_shards.size()).lock();
+  const auto& layout = *shard->d_layout;
+  /* one more bucket than the window, since the oldest second is partially covered */
+  const auto buckets = layout.d_windowSeconds + 1;
+  const auto countersPerBucket = layout.getCountersPerBucket();
+
+  auto& clients = shard->d_clients;
+  auto clientIt = clients.find(key);
+  if (clientIt == clients.end()) {
+    ClientEntry entry{key, shard->allocateSlot()};
+    clientIt = clients.insert(std::move(entry)).first;
+  }
+  /* most recently seen first, so that the least recently seen client is evicted when the shard is full */
+  auto& sidx = clients.get<SequencedTag>();
+  sidx.relocate(sidx.begin(), clients.project<SequencedTag>(clientIt));
+  const auto& client = *clientIt;
+
+  const auto bucketIdx = static_cast<size_t>(when.tv_sec % buckets);
+  auto& slotSecond = shard->d_seconds.at((client.d_slot * buckets) + bucketIdx);
+  const auto valuesOffset = ((client.d_slot * buckets) + bucketIdx) * countersPerBucket;
+  if (slotSecond != when.tv_sec) {
+    if (when.tv_sec < slotSecond) {
+      /* too old to be accounted for */
+      return;
+    }
+    std::fill_n(shard->d_values.begin() + static_cast<ptrdiff_t>(valuesOffset), countersPerBucket, 0);
+    slotSecond = when.tv_sec;
+  }
+
+  auto* bucket = &shard->d_values.at(valuesOffset);
+  if (event.d_response) {
+    ++bucket[Responses];
+    bucket[ResponseBytes] += event.d_size;
+    if (!event.d_cacheHit) {
+      ++bucket[CacheMisses];
+    }
+    if (auto rcodeIt = std::find(layout.d_rcodes.begin(), layout.d_rcodes.end(), event.d_rcode); rcodeIt != layout.d_rcodes.end()) {
+      ++bucket[s_fixedCounters + layout.d_qtypes.size() + std::distance(layout.d_rcodes.begin(), rcodeIt)];
+    }
+  }
+  else {
+    ++bucket[Queries];
+    if (auto qtypeIt = std::find(layout.d_qtypes.begin(), layout.d_qtypes.end(), event.d_qtype); qtypeIt != layout.d_qtypes.end()) {
+      ++bucket[s_fixedCounters + std::distance(layout.d_qtypes.begin(), qtypeIt)];
+    }
+  }
+
+  client.d_lastSeen = std::max(client.d_lastSeen, when.tv_sec);
+}
+
+void DynBlockRulesGroup::IncrementalCounters::onQuery(const struct timespec& when, const ComboAddress& requestor, [[maybe_unused]] const DNSName& name, uint16_t qtype)
+{
+  Event event;
+  event.d_qtype = qtype;
+  record(when, requestor, event);
+}
+
+void DynBlockRulesGroup::IncrementalCounters::onResponse(const struct timespec& when, const ComboAddress& requestor, [[maybe_unused]] const DNSName& name, const struct dnsheader& dh, unsigned int size, bool cacheHit)
+{
+  Event event;
+  event.d_size = size;
+  event.d_rcode = dh.rcode;
+  event.d_cacheHit = cacheHit;
+  event.d_response = true;
+  record(when, requestor, event);
+}
+
+void DynBlockRulesGroup::IncrementalCounters::onClear()
+{
+  for (auto& lockedShard : d_shards) {
+    lockedShard.lock()->clear();
+  }
+}
+
+uint64_t DynBlockRulesGroup::IncrementalCounters::ClientCounters::sum(const Layout& layout, size_t counter, time_t seconds, time_t now) const
+{
+  uint64_t result = 0;
+  const auto countersPerBucket = layout.getCountersPerBucket();
+  for (size_t slot = 0; slot < d_buckets; slot++) {
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic): d_seconds and d_values point into the pool of the shard
+    const auto second = d_seconds[slot];
+    if (second <= now && second >= (now - seconds)) {
+      // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+      result += d_values[(slot * countersPerBucket) + counter];
+    }
+  }
+  return result;
+}
+
+void DynBlockRulesGroup::IncrementalCounters::visitActive(time_t now, const std::function<void(const AddressAndPortRange&, const ClientCounters&, const Layout&)>& visitor)
+{
+  for (auto& lockedShard : d_shards) {
+    auto shard = lockedShard.lock();
+    const auto& layout = *shard->d_layout;
+    const auto buckets = layout.d_windowSeconds + 1;
+    const auto countersPerBucket = layout.getCountersPerBucket();
+    auto& sidx = shard->d_clients.get<SequencedTag>();
+    for (auto clientIt = sidx.begin(); clientIt != sidx.end();) {
+      /* forget about the clients we have not seen during the whole window */
+      if (clientIt->d_lastSeen < (now - layout.d_windowSeconds)) {
+        shard->d_freeSlots.push_back(clientIt->d_slot);
+        clientIt = sidx.erase(clientIt);
+        continue;
+      }
+      ClientCounters counters;
+      counters.d_seconds = &shard->d_seconds.at(clientIt->d_slot * buckets);
+      counters.d_values = &shard->d_values.at(clientIt->d_slot * buckets * countersPerBucket);
+      counters.d_buckets = buckets;
+      counters.d_lastSeen = clientIt->d_lastSeen;
+      visitor(clientIt->d_key, counters, layout);
+      ++clientIt;
+    }
+  }
+}
+
+size_t DynBlockRulesGroup::IncrementalCounters::size()
+{
+  size_t result = 0;
+  for (auto& shard : d_shards) {
+    result += shard.lock()->d_clients.size();
+  }
+  return result;
+}
+
 void DynBlockMaintenance::purgeExpired(const struct timespec& now)
 {
   // we need to increase the dynBlocked counter when removing
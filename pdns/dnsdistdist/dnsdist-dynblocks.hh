@@ -24,6 +24,11 @@
 #ifndef DISABLE_DYNBLOCKS
 #include <unordered_set>
 
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/member.hpp>
+#include <boost/multi_index/sequenced_index.hpp>
+
 #include "dolog.hh"
 #include "dnsdist-rings.hh"
 #include "gettime.hh"
@@ -209,6 +214,132 @@ public:
     double d_minimumGlobalCacheHitRatio{0.0};
   };
 
+  /* Per-client counters, updated by the rings as queries and responses are recorded
+     and kept in one-second buckets covering the longest window of the group's rules.
+     This way apply() only has to look at the clients that have been active during
+     that window, instead of scanning every entry of the rings.
+     The number of clients is bounded, so that a flood of spoofed source addresses cannot
+     make the counters grow without limit: when a shard is full, the client that has been
+     seen least recently is evicted. The buckets are taken from a pool reserved per shard
+     for the maximum number of clients, and recycled when clients are evicted. */
+  class IncrementalCounters : public Rings::Observer
+  {
+  public:
+    /* what is counted, derived from the rules of the group */
+    struct Layout
+    {
+      bool operator==(const Layout& rhs) const
+      {
+        return d_qtypes == rhs.d_qtypes && d_rcodes == rhs.d_rcodes && d_windowSeconds == rhs.d_windowSeconds && d_v4Mask == rhs.d_v4Mask && d_v6Mask == rhs.d_v6Mask && d_portMask == rhs.d_portMask;
+      }
+
+      size_t getCountersPerBucket() const
+      {
+        return s_fixedCounters + d_qtypes.size() + d_rcodes.size();
+      }
+
+      std::vector<uint16_t> d_qtypes;
+      std::vector<uint8_t> d_rcodes;
+      time_t d_windowSeconds{1};
+      uint8_t d_v4Mask{32};
+      uint8_t d_v6Mask{128};
+      uint8_t d_portMask{0};
+    };
+
+    enum Counter : uint8_t
+    {
+      Queries = 0,
+      Responses = 1,
+      ResponseBytes = 2,
+      CacheMisses = 3,
+    };
+    static constexpr size_t s_fixedCounters{4};
+
+    /* a view of the counters of a client, which live in the pool of its shard */
+    struct ClientCounters
+    {
+      /* sum of the given counter from 'now - seconds' to 'now', included */
+      uint64_t sum(const Layout& layout, size_t counter, time_t seconds, time_t now) const;
+
+      /* d_windowSeconds + 1 buckets of counters, the second each bucket is for is stored in d_seconds */
+      const uint32_t* d_values{nullptr};
+      const time_t* d_seconds{nullptr};
+      size_t d_buckets{0};
+      time_t d_lastSeen{0};
+    };
+
+    static constexpr size_t s_defaultMaxClients{65536};
+
+    IncrementalCounters(Layout&& layout, size_t maxClients = s_defaultMaxClients, size_t numberOfShards = 16);
+
+    void onQuery(const struct timespec& when, const ComboAddress& requestor, const DNSName& name, uint16_t qtype) override;
+    void onResponse(const struct timespec& when, const ComboAddress& requestor, const DNSName& name, const struct dnsheader& dh, unsigned int size, bool cacheHit) override;
+    void onClear() override;
+
+    /* existing counters are discarded if the layout is different from the current one */
+    void setLayout(Layout&& layout);
+    /* calls visitor(requestor, counters, layout) for every client that has been active during the window,
+       and forgets about the other ones */
+    void visitActive(time_t now, const std::function<void(const AddressAndPortRange&, const ClientCounters&, const Layout&)>& visitor);
+    size_t size();
+
+  private:
+    struct ClientEntry
+    {
+      AddressAndPortRange d_key;
+      /* index of the buckets of this client in the pool of the shard */
+      uint32_t d_slot{0};
+      mutable time_t d_lastSeen{0};
+    };
+
+    struct KeyTag
+    {
+    };
+    struct SequencedTag
+    {
+    };
+
+    using ClientsContainer = boost::multi_index_container<
+      ClientEntry,
+      boost::multi_index::indexed_by<
+        boost::multi_index::hashed_unique<boost::multi_index::tag<KeyTag>, boost::multi_index::member<ClientEntry, AddressAndPortRange, &ClientEntry::d_key>, AddressAndPortRange::hash>,
+        /* most recently seen clients first */
+        boost::multi_index::sequenced<boost::multi_index::tag<SequencedTag>>>>;
+
+    struct Shard
+    {
+      /* get the slot of a new client from the pool, evicting the least recently seen client if needed */
+      uint32_t allocateSlot();
+      void clear();
+
+      ClientsContainer d_clients;
+      /* d_maxClients * (d_windowSeconds + 1) buckets, reserved when the layout is set */
+      std::vector<uint32_t> d_values;
+      std::vector<time_t> d_seconds;
+      std::vector<uint32_t> d_freeSlots;
+      std::shared_ptr<const Layout> d_layout;
+      size_t d_maxClients{0};
+    };
+
+    struct Event
+    {
+      uint32_t d_size{0};
+      uint16_t d_qtype{0};
+      uint8_t d_rcode{0};
+      bool d_cacheHit{false};
+      bool d_response{false};
+    };
+
+    void record(const struct timespec& when, const ComboAddress& requestor, const Event& event);
+    AddressAndPortRange getKey(const ComboAddress& requestor) const;
+
+    std::vector<LockGuarded<Shard>> d_shards;
+    const size_t d_maxClientsPerShard;
+    std::atomic<uint8_t> d_v4Mask{32};
+    std::atomic<uint8_t> d_v6Mask{128};
+    std::atomic<uint8_t> d_portMask{0};
+  };
+
 private:
   struct Counts
   {
@@ -225,36 +356,47 @@ public:
   DynBlockRulesGroup()
   {
   }
+  ~DynBlockRulesGroup();
+  DynBlockRulesGroup(const DynBlockRulesGroup&) = delete;
+  DynBlockRulesGroup(DynBlockRulesGroup&&) = delete;
+  DynBlockRulesGroup& operator=(const DynBlockRulesGroup&) = delete;
+  DynBlockRulesGroup& operator=(DynBlockRulesGroup&&) = delete;
 
   void setQueryRate(DynBlockRule&& rule)
   {
     d_queryRateRule = std::move(rule);
+    updateIncrementalLayout();
   }
 
   /* rate is in bytes per second */
   void setResponseByteRate(DynBlockRule&& rule)
   {
     d_respRateRule = std::move(rule);
+    updateIncrementalLayout();
   }
 
   void setRCodeRate(uint8_t rcode, DynBlockRule&& rule)
   {
     d_rcodeRules[rcode] = std::move(rule);
+    updateIncrementalLayout();
   }
 
   void setRCodeRatio(uint8_t rcode, DynBlockRatioRule&& rule)
   {
     d_rcodeRatioRules[rcode] = std::move(rule);
+    updateIncrementalLayout();
   }
 
   void setQTypeRate(uint16_t qtype, DynBlockRule&& rule)
   {
     d_qtypeRules[qtype] = std::move(rule);
+    updateIncrementalLayout();
   }
 
   void setCacheMissRatio(DynBlockCacheMissRatioRule&& rule)
   {
     d_respCacheMissRatioRule = std::move(rule);
+    updateIncrementalLayout();
   }
 
   using smtVisitor_t = std::function<std::tuple<bool, boost::optional<std::string>, boost::optional<int>>(const StatNode&, const StatNode::Stat&, const StatNode::Stat&)>;
@@ -281,6 +423,7 @@ public:
     d_v4Mask = v4;
     d_v6Mask = v6;
     d_portMask = port;
+    updateIncrementalLayout();
   }
 
   void apply()
@@ -349,6 +492,7 @@ public:
     }
     result << "Excluded Subnets: " << d_excludedSubnets.toString() << std::endl;
     result << "Excluded Domains: " << d_excludedDomains.toString() << std::endl;
+    result << "Incremental counters: " << (isIncremental() ? "yes, up to " + std::to_string(d_incrementalMaxClients) + " clients" : "no") << std::endl;
 
     return result.str();
   }
@@ -358,6 +502,16 @@ public:
     d_beQuiet = quiet;
   }
 
+  /* maintain per-client counters as queries and responses are recorded instead of scanning
+     the rings on every pass, for at most maxClients clients. Suffix match rules still need to
+     scan the response ring */
+  void setIncremental(bool incremental, size_t maxClients = IncrementalCounters::s_defaultMaxClients);
+
+  bool isIncremental() const
+  {
+    return d_incrementalCounters != nullptr;
+  }
+
 private:
   void applySMT(const struct timespec& now, StatNode& statNodeRoot);
   bool checkIfQueryTypeMatches(const Rings::Query& query);
@@ -395,6 +549,10 @@ private:
     return hasQueryRules() || hasResponseRules();
   }
 
+  IncrementalCounters::Layout getIncrementalLayout() const;
+  /* so that the counters do not get discarded by the next pass when rules are added after enabling the incremental mode */
+  void updateIncrementalLayout();
+  void processIncrementalCounters(counts_t& counts, const struct timespec& now);
   void processQueryRules(counts_t& counts, const struct timespec& now);
   void processResponseRules(counts_t& counts, StatNode& root, const struct timespec& now);
 
@@ -410,6 +568,8 @@ private:
   smtVisitor_t d_smtVisitor;
   dnsdist_ffi_stat_node_visitor_t d_smtVisitorFFI;
   dnsdist_ffi_dynamic_block_inserted_hook d_newBlockHook;
+  std::shared_ptr<IncrementalCounters> d_incrementalCounters;
+  size_t d_incrementalMaxClients{0};
   uint8_t d_v6Mask{128};
   uint8_t d_v4Mask{32};
   uint8_t d_portMask{0};
@@ -0,0 +1,158 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "dnsdist-heavy-hitters.hh"
+#include "gettime.hh"
+
+namespace dnsdist
+{
+static LockGuarded<std::shared_ptr<HeavyHitters>> s_heavyHitters;
+
+std::shared_ptr<HeavyHitters> HeavyHitters::get()
+{
+  return *s_heavyHitters.lock();
+}
+
+void HeavyHitters::init(const Settings& settings)
+{
+  auto current = s_heavyHitters.lock();
+  if (*current) {
+    g_rings.removeObserver(current->get());
+    current->reset();
+  }
+  if (settings.d_capacity == 0) {
+    return;
+  }
+  *current = std::make_shared<HeavyHitters>(settings);
+  g_rings.addObserver(*current);
+}
+
+HeavyHitters::HeavyHitters(const Settings& settings) :
+  d_settings(settings),
+  d_clients(settings.d_capacity, settings.d_numberOfShards),
+  d_names(settings.d_capacity, settings.d_numberOfShards),
+  d_rcodes(settings.d_capacity, settings.d_numberOfShards)
+{
+}
+
+DNSName HeavyHitters::getSuffix(const DNSName& name) const
+{
+  DNSName suffix(name);
+  if (d_settings.d_suffixLabels > 0) {
+    suffix.trimToLabels(d_settings.d_suffixLabels);
+  }
+  return suffix;
+}
+
+void HeavyHitters::onQuery(const struct timespec& when, const ComboAddress& requestor, const DNSName& name, [[maybe_unused]] uint16_t qtype)
+{
+  d_clients.add(AddressAndPortRange(requestor, requestor.isIPv4() ? d_settings.d_v4Mask : d_settings.d_v6Mask, 0), when.tv_sec, d_settings.d_halfLife);
+  d_names.add(getSuffix(name), when.tv_sec, d_settings.d_halfLife);
+}
+
+void HeavyHitters::onResponse(const struct timespec& when, [[maybe_unused]] const ComboAddress& requestor, const DNSName& name, const struct dnsheader& dh, [[maybe_unused]] unsigned int size, [[maybe_unused]] bool cacheHit)
+{
+  d_rcodes.add(RCodeAndName{getSuffix(name), static_cast<uint8_t>(dh.rcode)}, when.tv_sec, d_settings.d_halfLife);
+}
+
+void HeavyHitters::onClear()
+{
+  d_clients.clear();
+  d_names.clear();
+  d_rcodes.clear();
+}
+
+HeavyHitters::Tops HeavyHitters::getTops(size_t count)
+{
+  timespec now{};
+  gettime(&now);
+  Tops tops;
+  tops.d_clients = d_clients.getTop(count, now.tv_sec, d_settings.d_halfLife);
+  tops.d_names = d_names.getTop(count, now.tv_sec, d_settings.d_halfLife);
+  tops.d_rcodes = d_rcodes.getTop(count, now.tv_sec, d_settings.d_halfLife);
+  return tops;
+}
+
+template <typename Key, typename Hash>
+HeavyHitters::Sharded<Key, Hash>::Sharded(size_t capacity, size_t numberOfShards) :
+  d_shards(std::max(numberOfShards, static_cast<size_t>(1)))
+{
+  const size_t perShardCapacity = (capacity + d_shards.size() - 1) / d_shards.size();
+  for (auto& shard : d_shards) {
+    shard.lock()->d_tracker = SpaceSaving<Key, Hash>(perShardCapacity);
+  }
+}
+
+template <typename Key, typename Hash>
+void HeavyHitters::Sharded<Key, Hash>::Shard::decayIfNeeded(time_t now, time_t halfLife)
+{
+  if (halfLife <= 0) {
+    return;
+  }
+  if (d_lastDecay == 0) {
+    d_lastDecay = now;
+    return;
+  }
+  if (now < d_lastDecay + halfLife) {
+    return;
+  }
+  const auto halfLives = (now - d_lastDecay) / halfLife;
+  d_tracker.decay(static_cast<unsigned int>(std::min(halfLives, static_cast<time_t>(64))));
+  d_lastDecay += halfLives * halfLife;
+}
+
+template <typename Key, typename Hash>
+void HeavyHitters::Sharded<Key, Hash>::add(const Key& key, time_t now, time_t halfLife)
+{
+  auto shard = d_shards.at(Hash()(key) % d_shards.size()).lock();
+  shard->decayIfNeeded(now, halfLife);
+  shard->d_tracker.add(key);
+}
+
+template <typename Key, typename Hash>
+std::vector<HeavyHitters::Entry<Key>> HeavyHitters::Sharded<Key, Hash>::getTop(size_t count, time_t now, time_t halfLife)
+{
+  /* a given key is only ever present in one shard, so the global top is in the union of the tops of the shards */
+  std::vector<Entry<Key>> result;
+  for (auto& lockedShard : d_shards) {
+    auto shard = lockedShard.lock();
+    shard->decayIfNeeded(now, halfLife);
+    for (auto& entry : shard->d_tracker.getTop(count)) {
+      result.push_back({std::move(entry.key), entry.count, entry.error});
+    }
+  }
+  count = std::min(count, result.size());
+  std::partial_sort(result.begin(), result.begin() + static_cast<ssize_t>(count), result.end(), [](const Entry<Key>& lhs, const Entry<Key>& rhs) { return lhs.count > rhs.count; });
+  result.resize(count);
+  return result;
+}
+
+template <typename Key, typename Hash>
+void HeavyHitters::Sharded<Key, Hash>::clear()
+{
+  for (auto& lockedShard : d_shards) {
+    auto shard = lockedShard.lock();
+    shard->d_tracker.clear();
+    shard->d_lastDecay = 0;
+  }
+}
+}
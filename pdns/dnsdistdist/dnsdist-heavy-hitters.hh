@@ -0,0 +1,286 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "dnsdist-rings.hh"
+#include "dnsname.hh"
+#include "iputils.hh"
+#include "lock.hh"
+
+namespace dnsdist
+{
+/* Keeps track of the most frequent keys of a stream in bounded memory, using the Space-Saving
+   algorithm: at most 'capacity' counters are kept, and a key that is not tracked yet while all
+   counters are in use replaces the one with the lowest count, inheriting that count, which
+   becomes the maximum over-estimation ('error') of its own count.
+   Every key seen more than total / capacity times is guaranteed to be tracked.
+   The counters are kept in a min-heap so that finding the key to evict is O(1) and updating a
+   counter is O(log capacity). */
+template <typename Key, typename Hash = std::hash<Key>>
+class SpaceSaving
+{
+public:
+  struct Entry
+  {
+    Key key;
+    uint64_t count{0};
+    uint64_t error{0};
+  };
+
+  SpaceSaving(size_t capacity) :
+    d_capacity(std::max(capacity, static_cast<size_t>(1)))
+  {
+    d_heap.reserve(d_capacity);
+    d_positions.reserve(d_capacity);
+  }
+
+  void add(const Key& key, uint64_t weight = 1)
+  {
+    d_total += weight;
+    if (auto position = d_positions.find(key); position != d_positions.end()) {
+      d_heap.at(position->second).count += weight;
+      siftDown(position->second);
+      return;
+    }
+
+    if (d_heap.size() < d_capacity) {
+      d_heap.push_back({key, weight, 0});
+      d_positions.emplace(key, d_heap.size() - 1);
+      siftUp(d_heap.size() - 1);
+      return;
+    }
+
+    /* replace the key with the lowest count */
+    auto& lowest = d_heap.front();
+    d_positions.erase(lowest.key);
+    lowest.key = key;
+    lowest.error = lowest.count;
+    lowest.count += weight;
+    d_positions.emplace(key, 0);
+    siftDown(0);
+  }
+
+  /* divide every count by 2^shift, which does not change their relative order,
+     so that old traffic gradually weighs less than recent traffic */
+  void decay(unsigned int shift)
+  {
+    if (shift >= 64) {
+      clear();
+      return;
+    }
+    for (auto& entry : d_heap) {
+      entry.count >>= shift;
+      entry.error >>= shift;
+    }
+    d_total >>= shift;
+  }
+
+  /* the 'count' entries with the highest count, highest first */
+  std::vector<Entry> getTop(size_t count) const
+  {
+    std::vector<Entry> result;
+    result.reserve(d_heap.size());
+    for (const auto& entry : d_heap) {
+      if (entry.count > 0) {
+        result.push_back(entry);
+      }
+    }
+    count = std::min(count, result.size());
+    std::partial_sort(result.begin(), result.begin() + static_cast<ssize_t>(count), result.end(), [](const Entry& lhs, const Entry& rhs) { return lhs.count > rhs.count; });
+    result.resize(count);
+    return result;
+  }
+
+  void clear()
+  {
+    d_heap.clear();
+    d_positions.clear();
+    d_total = 0;
+  }
+
+  size_t size() const
+  {
+    return d_heap.size();
+  }
+
+  size_t getCapacity() const
+  {
+    return d_capacity;
+  }
+
+  uint64_t getTotal() const
+  {
+    return d_total;
+  }
+
+private:
+  void swapEntries(size_t first, size_t second)
+  {
+    std::swap(d_heap.at(first), d_heap.at(second));
+    d_positions[d_heap.at(first).key] = first;
+    d_positions[d_heap.at(second).key] = second;
+  }
+
+  void siftUp(size_t idx)
+  {
+    while (idx > 0) {
+      const size_t parent = (idx - 1) / 2;
+      if (d_heap.at(parent).count <= d_heap.at(idx).count) {
+        break;
+      }
+      swapEntries(parent, idx);
+      idx = parent;
+    }
+  }
+
+  void siftDown(size_t idx)
+  {
+    const size_t size = d_heap.size();
+    while (true) {
+      const size_t left = (2 * idx) + 1;
+      const size_t right = left + 1;
+      size_t smallest = idx;
+      if (left < size && d_heap.at(left).count < d_heap.at(smallest).count) {
+        smallest = left;
+      }
+      if (right < size && d_heap.at(right).count < d_heap.at(smallest).count) {
+        smallest = right;
+      }
+      if (smallest == idx) {
+        break;
+      }
+      swapEntries(smallest, idx);
+      idx = smallest;
+    }
+  }
+
+  std::vector<Entry> d_heap;
+  std::unordered_map<Key, size_t, Hash> d_positions;
+  uint64_t d_total{0};
+  size_t d_capacity;
+};
+
+/* Streaming tracker of the heaviest clients (per netmask), qname suffixes and (rcode, qname suffix)
+   pairs, fed by the rings as queries and responses are recorded, so that the tops can be retrieved
+   at any time without scanning the rings and in constant memory.
+   Every kind of key is spread over several shards, each one being a Space-Saving tracker with its
+   own lock, and since a given key always goes to the same shard the tops of the shards can simply
+   be merged. Counts are halved every 'halfLife' seconds so that the tops reflect recent traffic. */
+class HeavyHitters : public Rings::Observer
+{
+public:
+  struct Settings
+  {
+    size_t d_capacity{0};
+    time_t d_halfLife{60};
+    uint8_t d_v4Mask{32};
+    uint8_t d_v6Mask{64};
+    uint8_t d_suffixLabels{2};
+    size_t d_numberOfShards{8};
+  };
+
+  struct RCodeAndName
+  {
+    bool operator==(const RCodeAndName& rhs) const
+    {
+      return d_rcode == rhs.d_rcode && d_name == rhs.d_name;
+    }
+
+    struct hash
+    {
+      size_t operator()(const RCodeAndName& key) const
+      {
+        return key.d_name.hash(key.d_rcode);
+      }
+    };
+
+    DNSName d_name;
+    uint8_t d_rcode{0};
+  };
+
+  template <typename Key>
+  struct Entry
+  {
+    Key key;
+    uint64_t count{0};
+    uint64_t error{0};
+  };
+
+  struct Tops
+  {
+    std::vector<Entry<AddressAndPortRange>> d_clients;
+    std::vector<Entry<DNSName>> d_names;
+    std::vector<Entry<RCodeAndName>> d_rcodes;
+  };
+
+  HeavyHitters(const Settings& settings);
+
+  void onQuery(const struct timespec& when, const ComboAddress& requestor, const DNSName& name, uint16_t qtype) override;
+  void onResponse(const struct timespec& when, const ComboAddress& requestor, const DNSName& name, const struct dnsheader& dh, unsigned int size, bool cacheHit) override;
+  void onClear() override;
+
+  Tops getTops(size_t count);
+
+  const Settings& getSettings() const
+  {
+    return d_settings;
+  }
+
+  /* the instance fed by g_rings, if any */
+  static std::shared_ptr<HeavyHitters> get();
+  static void init(const Settings& settings);
+
+private:
+  template <typename Key, typename Hash>
+  class Sharded
+  {
+  public:
+    Sharded(size_t capacity, size_t numberOfShards);
+    void add(const Key& key, time_t now, time_t halfLife);
+    std::vector<Entry<Key>> getTop(size_t count, time_t now, time_t halfLife);
+    void clear();
+
+  private:
+    struct Shard
+    {
+      void decayIfNeeded(time_t now, time_t halfLife);
+
+      SpaceSaving<Key, Hash> d_tracker{1};
+      time_t d_lastDecay{0};
+    };
+
+    std::vector<LockGuarded<Shard>> d_shards;
+  };
+
+  DNSName getSuffix(const DNSName& name) const;
+
+  Settings d_settings;
+  Sharded<AddressAndPortRange, AddressAndPortRange::hash> d_clients;
+  Sharded<DNSName, std::hash<DNSName>> d_names;
+  Sharded<RCodeAndName, RCodeAndName::hash> d_rcodes;
+};
+}
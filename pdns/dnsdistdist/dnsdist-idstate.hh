@@ -205,6 +205,7 @@ public:
   // DoH-only: if we received a TC=1 answer, we had to retry over TCP and thus we need the TCP cache key */
   uint32_t cacheKeyTCP{0}; // 4
   uint32_t ttlCap{0}; // cap the TTL _after_ inserting into the packet cache // 4
+  uint32_t coalescingLeaderID{0}; // Non-zero if identical queries might be parked until this one is answered // 4
   int backendFD{-1}; // 4
   int delayMsec{0};
   uint16_t qtype{0}; // 2
@@ -228,7 +229,9 @@ public:
   bool tracingEnabled{false}; // Whether or not Open Telemetry tracing is enabled for this query
 };
 
-struct IDState
+/* Each state starts on its own cache line, so that threads claiming and
+   releasing neighbouring IDs do not keep invalidating each other's lines */
+struct alignas(64) IDState
 {
   IDState()
   {
@@ -20,10 +20,13 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <bitset>
+
 #include "dnsdist.hh"
 #include "dnsdist-lbpolicies.hh"
 #include "dnsdist-lua.hh"
 #include "dnsdist-lua-ffi.hh"
+#include "dnsdist-lua-per-thread.hh"
 #include "dolog.hh"
 #include "dns_random.hh"
 
@@ -90,6 +93,106 @@ std::optional<ServerPolicy::SelectedServerPosition> firstAvailable(const ServerP
   return leastOutstanding(servers, dnsQuestion);
 }
 
+/* compares the expected cost of sending a query to each server: the latency times the number of outstanding
+   queries plus this one, divided by the weight. A server without any latency sample yet is assumed to be
+   as fast as the other one, so that the choice is made on the outstanding queries alone */
+static bool isCheaperThan(const DownstreamState& server, const DownstreamState& other)
+{
+  auto latency = server.d_policyLatencyUsec.load(std::memory_order_relaxed);
+  auto otherLatency = other.d_policyLatencyUsec.load(std::memory_order_relaxed);
+  if (latency == 0.0) {
+    latency = otherLatency;
+  }
+  else if (otherLatency == 0.0) {
+    otherLatency = latency;
+  }
+  if (latency == 0.0) {
+    latency = otherLatency = 1.0;
+  }
+
+  const auto cost = latency * static_cast<double>(server.outstanding.load() + 1) / server.d_config.d_weight;
+  const auto otherCost = otherLatency * static_cast<double>(other.outstanding.load() + 1) / other.d_config.d_weight;
+  return cost < otherCost;
+}
+
+/* maximum number of random draws to find two servers that are up, before falling back to a full scan */
+static constexpr size_t s_powerOfTwoMaxDraws = 8;
+
+struct PowerOfTwoLastSelected
+{
+  const ServerPolicy::NumberedServerVector* d_servers{nullptr};
+  const DownstreamState* d_server{nullptr};
+  size_t d_position{0};
+};
+
+/* Pick two random servers that are up, and select the one with the lowest latency times outstanding queries.
+   The server selected the last time by this thread for the same list is also considered, which prevents
+   slow servers from getting a share of the queries simply because they were drawn together */
+std::optional<ServerPolicy::SelectedServerPosition> powerOfTwoLatency(const ServerPolicy::NumberedServerVector& servers, [[maybe_unused]] const DNSQuestion* dnsQuestion)
+{
+  static thread_local PowerOfTwoLastSelected t_lastSelected;
+
+  const auto count = servers.size();
+  if (count == 0) {
+    return std::nullopt;
+  }
+  if (count == 1) {
+    if (servers[0].second->isUp()) {
+      return servers[0].first;
+    }
+    return std::nullopt;
+  }
+
+  const ServerPolicy::NumberedServer* first = nullptr;
+  const ServerPolicy::NumberedServer* second = nullptr;
+  for (size_t draw = 0; draw < s_powerOfTwoMaxDraws && second == nullptr; draw++) {
+    const auto& candidate = servers[dns_random(count)];
+    if (&candidate == first || !candidate.second->isUp()) {
+      continue;
+    }
+    if (first == nullptr) {
+      first = &candidate;
+    }
+    else {
+      second = &candidate;
+    }
+  }
+
+  if (first == nullptr) {
+    /* most of the servers are down, or we have been very unlucky */
+    return getLeastOutstanding(servers);
+  }
+
+  if (second == nullptr) {
+    /* the draws kept returning the same server, which is very likely with only two of them,
+       so look for the next one that is up instead of not comparing at all */
+    const auto firstPos = static_cast<size_t>(first - servers.data());
+    for (size_t offset = 1; offset < count && second == nullptr; offset++) {
+      const auto& candidate = servers[(firstPos + offset) % count];
+      if (candidate.second->isUp()) {
+        second = &candidate;
+      }
+    }
+  }
+
+  const auto* best = first;
+  if (second != nullptr && isCheaperThan(*second->second, *best->second)) {
+    best = second;
+  }
+
+  /* the list might have been modified or replaced since, so only consider the last selected server
+     if it is still at the same position */
+  if (t_lastSelected.d_servers == &servers && t_lastSelected.d_position < count) {
+    const auto& last = servers[t_lastSelected.d_position];
+    if (&last != best && last.second.get() == t_lastSelected.d_server && last.second->isUp() && isCheaperThan(*last.second, *best->second)) {
+      best = &last;
+    }
+  }
+
+  t_lastSelected = {&servers, best->second.get(), static_cast<size_t>(best - servers.data())};
+  return best->first;
+}
+
 template <class T> static std::optional<ServerPolicy::SelectedServerPosition> getValRandom(const ServerPolicy::NumberedServerVector& servers, T& poss, const unsigned int val, const double targetLoad)
 {
   constexpr int max = std::numeric_limits<int>::max();
@@ -172,15 +275,9 @@ std::optional<ServerPolicy::SelectedServerPosition> whashed(const ServerPolicy::
   return whashedFromHash(servers, dnsQuestion->ids.qname.hash(hashPerturbation));
 }
 
-std::optional<ServerPolicy::SelectedServerPosition> chashedFromHash(const ServerPolicy::NumberedServerVector& servers, size_t qhash)
+static double getConsistentHashTargetLoad(const ServerPolicy::NumberedServerVector& servers, double consistentHashBalancingFactor)
 {
-  unsigned int sel = std::numeric_limits<unsigned int>::max();
-  unsigned int min = std::numeric_limits<unsigned int>::max();
-  std::optional<ServerPolicy::SelectedServerPosition> ret;
-  std::optional<ServerPolicy::SelectedServerPosition> first;
-
   double targetLoad = std::numeric_limits<double>::max();
-  const auto consistentHashBalancingFactor = dnsdist::configuration::getImmutableConfiguration().d_consistentHashBalancingFactor;
   if (consistentHashBalancingFactor > 0) {
     /* we start with one, representing the query we are currently handling */
     double currentLoad = 1;
@@ -196,9 +293,26 @@ std::optional<ServerPolicy::SelectedServerPosition> chashedFromHash(const Server
       targetLoad = (currentLoad / static_cast<double>(totalWeight)) * consistentHashBalancingFactor;
     }
   }
+  return targetLoad;
+}
+
+static bool isConsistentHashCandidate(const DownstreamState& server, double consistentHashBalancingFactor, double targetLoad)
+{
+  return server.isUp() && (consistentHashBalancingFactor == 0 || static_cast<double>(server.outstanding.load()) <= (targetLoad * server.d_config.d_weight));
+}
+
+std::optional<ServerPolicy::SelectedServerPosition> chashedFromHash(const ServerPolicy::NumberedServerVector& servers, size_t qhash)
+{
+  unsigned int sel = std::numeric_limits<unsigned int>::max();
+  unsigned int min = std::numeric_limits<unsigned int>::max();
+  std::optional<ServerPolicy::SelectedServerPosition> ret;
+  std::optional<ServerPolicy::SelectedServerPosition> first;
+
+  const auto consistentHashBalancingFactor = dnsdist::configuration::getImmutableConfiguration().d_consistentHashBalancingFactor;
+  const double targetLoad = getConsistentHashTargetLoad(servers, consistentHashBalancingFactor);
 
   for (const auto& serverPair: servers) {
-    if (serverPair.second->isUp() && (consistentHashBalancingFactor == 0 || static_cast<double>(serverPair.second->outstanding.load()) <= (targetLoad * serverPair.second->d_config.d_weight))) {
+    if (isConsistentHashCandidate(*serverPair.second, consistentHashBalancingFactor, targetLoad)) {
       // make sure hashes have been computed
       if (!serverPair.second->hashesComputed) {
         serverPair.second->hash();
@@ -232,10 +346,102 @@ std::optional<ServerPolicy::SelectedServerPosition> chashedFromHash(const Server
   return std::nullopt;
 }
 
+ConsistentHashRing::ConsistentHashRing(const ServerPolicy::NumberedServerVector& servers) :
+  d_serversCount(servers.size())
+{
+  size_t totalWeight = 0;
+  for (const auto& serverPair : servers) {
+    totalWeight += serverPair.second->d_config.d_weight;
+  }
+  d_points.reserve(totalWeight);
+
+  for (size_t idx = 0; idx < servers.size(); idx++) {
+    const auto& server = servers.at(idx).second;
+    if (!server->hashesComputed) {
+      server->hash();
+    }
+    auto hashes = server->hashes.read_lock();
+    for (const auto hash : *hashes) {
+      d_points.push_back({hash, static_cast<unsigned int>(idx)});
+    }
+  }
+
+  /* when two servers share the same point, the first one in the pool wins, like in chashedFromHash() */
+  std::sort(d_points.begin(), d_points.end(), [](const Point& lhs, const Point& rhs) {
+    return lhs.d_hash < rhs.d_hash || (lhs.d_hash == rhs.d_hash && lhs.d_index < rhs.d_index);
+  });
+}
+
+std::optional<ServerPolicy::SelectedServerPosition> ConsistentHashRing::select(const ServerPolicy::NumberedServerVector& servers, size_t qhash) const
+{
+  if (d_points.empty() || servers.size() != d_serversCount) {
+    return std::nullopt;
+  }
+
+  const auto consistentHashBalancingFactor = dnsdist::configuration::getImmutableConfiguration().d_consistentHashBalancingFactor;
+  const double targetLoad = getConsistentHashTargetLoad(servers, consistentHashBalancingFactor);
+
+  /* the first point at or after the hash of the query, then the next ones, wrapping around,
+     until we find a server that is up and, if bounded-load is enabled, not overloaded */
+  const auto start = static_cast<size_t>(std::lower_bound(d_points.begin(), d_points.end(), qhash, [](const Point& point, size_t hash) {
+                                           return point.d_hash < hash;
+                                         })
+                                         - d_points.begin());
+  /* a server has many points on the ring, so we remember the ones we already rejected
+     and stop as soon as all of them have been, instead of walking the whole ring.
+     That is a bitset on the stack for most pools, only larger ones need an allocation,
+     and only once a server has been rejected */
+  std::bitset<s_rejectedOnStack> rejectedOnStack;
+  std::vector<bool> rejectedOnHeap;
+  const bool onStack = servers.size() <= s_rejectedOnStack;
+  size_t rejectedCount = 0;
+  for (size_t step = 0; step < d_points.size(); step++) {
+    const auto& point = d_points[(start + step) % d_points.size()];
+    if (onStack ? rejectedOnStack.test(point.d_index) : (!rejectedOnHeap.empty() && rejectedOnHeap[point.d_index])) {
+      continue;
+    }
+    const auto& serverPair = servers[point.d_index];
+    if (isConsistentHashCandidate(*serverPair.second, consistentHashBalancingFactor, targetLoad)) {
+      return serverPair.first;
+    }
+    if (onStack) {
+      rejectedOnStack.set(point.d_index);
+    }
+    else {
+      if (rejectedOnHeap.empty()) {
+        rejectedOnHeap.resize(servers.size(), false);
+      }
+      rejectedOnHeap[point.d_index] = true;
+    }
+    if (++rejectedCount == servers.size()) {
+      break;
+    }
+  }
+
+  return std::nullopt;
+}
+
+std::optional<ServerPolicy::SelectedServerPosition> chashedFromRing(const ConsistentHashRing& ring, const ServerPolicy::NumberedServerVector& servers, size_t qhash)
+{
+  return ring.select(servers, qhash);
+}
+
 std::optional<ServerPolicy::SelectedServerPosition> chashed(const ServerPolicy::NumberedServerVector& servers, const DNSQuestion* dnsQuestion)
 {
   const auto hashPerturbation = dnsdist::configuration::getImmutableConfiguration().d_hashPerturbation;
-  return chashedFromHash(servers, dnsQuestion->ids.qname.hash(hashPerturbation));
+  const auto qhash = dnsQuestion->ids.qname.hash(hashPerturbation);
+
+  /* use the precomputed ring of the pool if we have been handed its servers, which is always the case
+     unless we are called from Lua */
+  const auto& pools = dnsdist::configuration::getCurrentRuntimeConfiguration().d_pools;
+  const auto poolIt = pools.find(dnsQuestion->ids.poolName);
+  if (poolIt != pools.end() && &poolIt->second.getServers() == &servers) {
+    if (const auto& ring = poolIt->second.getHashRing()) {
+      return chashedFromRing(*ring, servers, qhash);
+    }
+  }
+
+  return chashedFromHash(servers, qhash);
 }
 
 std::optional<ServerPolicy::SelectedServerPosition> roundrobin(const ServerPolicy::NumberedServerVector& servers, [[maybe_unused]] const DNSQuestion* dnsQuestion)
@@ -401,6 +607,11 @@ ServerPolicy::ServerPolicy(const std::string& name_, const std::string& code): d
   auto ret = tmpContext.executeCode<ServerPolicy::ffipolicyfunc_t>(code);
 }
 
+void ServerPolicy::setPerThreadLuaCode(std::string code)
+{
+  d_perThreadLuaPolicy = std::make_shared<const dnsdist::lua::perthread::Function<policyfunc_t>>(std::move(code));
+}
+
 struct ServerPolicy::PerThreadState
 {
   LuaContext d_luaContext;
@@ -434,8 +645,16 @@ ServerPolicy::SelectedBackend ServerPolicy::getSelectedBackend(const ServerPolic
   if (d_isLua) {
     if (!d_isFFI) {
       std::optional<SelectedServerPosition> position;
-      {
-        auto lock = g_lua.lock();
+      if (d_perThreadLuaPolicy) {
+        const auto* policy = d_perThreadLuaPolicy->get();
+        if (policy == nullptr) {
+          /* the policy was not properly initialized */
+          return result;
+        }
+        position = (*policy)(servers, &dnsQuestion);
+      }
+      else {
+        auto lock = dnsdist::lua::lockGlobalState();
         position = d_policy(servers, &dnsQuestion);
       }
       if (position && *position > 0 && *position <= servers.size()) {
@@ -449,7 +668,7 @@ ServerPolicy::SelectedBackend ServerPolicy::getSelectedBackend(const ServerPolic
     ServerPolicy::SelectedServerPosition selected = 0;
 
     if (!d_isPerThread) {
-      auto lock = g_lua.lock();
+      auto lock = dnsdist::lua::lockGlobalState();
       selected = d_ffipolicy(&serversList, &dnsq);
     }
     else {
@@ -485,7 +704,25 @@ const std::vector<std::shared_ptr<ServerPolicy>>& getBuiltInPolicies()
     std::make_shared<ServerPolicy>("whashed", whashed, false),
     std::make_shared<ServerPolicy>("chashed", chashed, false),
     std::make_shared<ServerPolicy>("orderedWrandUntag", orderedWrandUntag, false),
-    std::make_shared<ServerPolicy>("leastOutstanding", leastOutstanding, false)};
+    std::make_shared<ServerPolicy>("leastOutstanding", leastOutstanding, false),
+    std::make_shared<ServerPolicy>("powerOfTwoLatency", powerOfTwoLatency, false)};
   return s_policies;
 }
+
+void rebuildHashRings(const DownstreamState* server)
+{
+  if (!dnsdist::configuration::isImmutableConfigurationDone()) {
+    /* the rings will be built once the configuration has been sealed */
+    return;
+  }
+
+  dnsdist::configuration::updateRuntimeConfiguration([server](dnsdist::configuration::RuntimeConfiguration& config) {
+    for (auto& [_, pool] : config.d_pools) {
+      const auto& servers = pool.getServers();
+      if (server == nullptr || std::any_of(servers.begin(), servers.end(), [server](const auto& serverPair) { return serverPair.second.get() == server; })) {
+        pool.rebuildHashRing();
+      }
+    }
+  });
+}
 }
@@ -33,6 +33,12 @@ struct DownstreamState;
 
 struct PerThreadPoliciesState;
 
+namespace dnsdist::lua::perthread
+{
+template <typename FunctionType>
+class Function;
+}
+
 class ServerPolicy
 {
 public:
@@ -59,6 +65,9 @@ public:
   /* create a per-thread FFI policy */
   ServerPolicy(const std::string& name_, const std::string& code);
 
+  /* have this (non-FFI) Lua policy instantiated from its bytecode in the per-thread Lua states */
+  void setPerThreadLuaCode(std::string code);
+
   ServerPolicy()
   {
   }
@@ -123,6 +132,7 @@ public:
 
   policyfunc_t d_policy;
   ffipolicyfunc_t d_ffipolicy;
+  std::shared_ptr<const dnsdist::lua::perthread::Function<policyfunc_t>> d_perThreadLuaPolicy;
 
   bool d_isLua{false};
   bool d_isFFI{false};
@@ -142,11 +152,46 @@ const ServerPolicy::NumberedServerVector& getDownstreamCandidates(const std::str
 
 std::optional<ServerPolicy::SelectedServerPosition> firstAvailable(const ServerPolicy::NumberedServerVector& servers, const DNSQuestion* dnsQuestion);
 std::optional<ServerPolicy::SelectedServerPosition> leastOutstanding(const ServerPolicy::NumberedServerVector& servers, const DNSQuestion* dnsQuestion);
+std::optional<ServerPolicy::SelectedServerPosition> powerOfTwoLatency(const ServerPolicy::NumberedServerVector& servers, const DNSQuestion* dnsQuestion);
 std::optional<ServerPolicy::SelectedServerPosition> wrandom(const ServerPolicy::NumberedServerVector& servers, const DNSQuestion* dnsQuestion);
 std::optional<ServerPolicy::SelectedServerPosition> whashed(const ServerPolicy::NumberedServerVector& servers, const DNSQuestion* dnsQuestion);
 std::optional<ServerPolicy::SelectedServerPosition> whashedFromHash(const ServerPolicy::NumberedServerVector& servers, size_t hash);
 std::optional<ServerPolicy::SelectedServerPosition> chashed(const ServerPolicy::NumberedServerVector& servers, const DNSQuestion* dnsQuestion);
 std::optional<ServerPolicy::SelectedServerPosition> chashedFromHash(const ServerPolicy::NumberedServerVector& servers, size_t hash);
+
+/* The points of all the servers of a pool on the consistent hashing ring, sorted by hash,
+   so that selecting a server for a given hash is a single binary search instead of one per server.
+   It is never modified once built, but replaced when a server is added to or removed from the pool,
+   or when the weight or ID of one of its servers changes. */
+class ConsistentHashRing
+{
+public:
+  ConsistentHashRing(const ServerPolicy::NumberedServerVector& servers);
+
+  /* 'servers' has to be the vector the ring has been built from */
+  std::optional<ServerPolicy::SelectedServerPosition> select(const ServerPolicy::NumberedServerVector& servers, size_t hash) const;
+
+  size_t size() const
+  {
+    return d_points.size();
+  }
+
+private:
+  struct Point
+  {
+    unsigned int d_hash;
+    /* index of the server in the vector, not its position */
+    unsigned int d_index;
+  };
+
+  /* pools up to that size track the servers rejected by select() without allocating */
+  static constexpr size_t s_rejectedOnStack{256};
+
+  std::vector<Point> d_points;
+  size_t d_serversCount{0};
+};
+
+std::optional<ServerPolicy::SelectedServerPosition> chashedFromRing(const ConsistentHashRing& ring, const ServerPolicy::NumberedServerVector& servers, size_t hash);
 std::optional<ServerPolicy::SelectedServerPosition> roundrobin(const ServerPolicy::NumberedServerVector& servers, const DNSQuestion* dnsQuestion);
 std::optional<ServerPolicy::SelectedServerPosition> orderedWrandUntag(const ServerPolicy::NumberedServerVector& servers, const DNSQuestion* dnsQuestion);
 
@@ -155,4 +200,6 @@ std::optional<ServerPolicy::SelectedServerPosition> orderedWrandUntag(const Serv
 namespace dnsdist::lbpolicies
 {
 const std::vector<std::shared_ptr<ServerPolicy>>& getBuiltInPolicies();
+/* rebuild the consistent hashing ring of every pool containing that server, or of all pools if none is supplied */
+void rebuildHashRings(const DownstreamState* server = nullptr);
 }
@@ -25,6 +25,7 @@
 #include "dnsdist-dnsparser.hh"
 #include "dnsdist-lua.hh"
 #include "dnsdist-lua-ffi.hh"
+#include "dnsdist-lua-per-thread.hh"
 #include "dnsdist-protobuf.hh"
 #include "dnsdist-rule-chains.hh"
 #include "dnstap.hh"
@@ -138,16 +139,18 @@ void setupLuaActions(LuaContext& luaCtx)
   luaCtx.registerFunction("reload", &DNSAction::reload);
   luaCtx.registerFunction("reload", &DNSResponseAction::reload);
 
-  luaCtx.writeFunction("LuaAction", [](dnsdist::actions::LuaActionFunction function) {
-    return dnsdist::actions::getLuaAction(std::move(function));
+  luaCtx.writeFunction("LuaAction", [&luaCtx](const LuaContext::LuaObject& object) {
+    auto [function, perThreadCode] = dnsdist::lua::perthread::getFunctionAndCode<dnsdist::actions::LuaActionFunction>(luaCtx, object, "LuaAction");
+    return dnsdist::actions::getLuaAction(std::move(function), std::move(perThreadCode));
   });
 
   luaCtx.writeFunction("LuaFFIAction", [](dnsdist::actions::LuaActionFFIFunction function) {
     return dnsdist::actions::getLuaFFIAction(std::move(function));
   });
 
-  luaCtx.writeFunction("LuaResponseAction", [](dnsdist::actions::LuaResponseActionFunction function) {
-    return dnsdist::actions::getLuaResponseAction(std::move(function));
+  luaCtx.writeFunction("LuaResponseAction", [&luaCtx](const LuaContext::LuaObject& object) {
+    auto [function, perThreadCode] = dnsdist::lua::perthread::getFunctionAndCode<dnsdist::actions::LuaResponseActionFunction>(luaCtx, object, "LuaResponseAction");
+    return dnsdist::actions::getLuaResponseAction(std::move(function), std::move(perThreadCode));
   });
 
   luaCtx.writeFunction("LuaFFIResponseAction", [](dnsdist::actions::LuaResponseActionFFIFunction function) {
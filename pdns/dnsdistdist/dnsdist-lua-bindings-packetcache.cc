@@ -28,10 +28,10 @@
 #include "dnsdist-cache.hh"
 #include "dnsdist-lua.hh"
 
-void setupLuaBindingsPacketCache(LuaContext& luaCtx, bool client)
+void setupLuaBindingsPacketCache(LuaContext& luaCtx, bool client, bool configCheck)
 {
   /* PacketCache */
-  luaCtx.writeFunction("newPacketCache", [client](size_t maxEntries, boost::optional<LuaAssociativeTable<boost::variant<bool, size_t, LuaArray<uint16_t>>>> vars) {
+  luaCtx.writeFunction("newPacketCache", [client, configCheck](size_t maxEntries, boost::optional<LuaAssociativeTable<boost::variant<bool, size_t, std::string, LuaArray<uint16_t>>>> vars) {
 
     DNSDistPacketCache::CacheSettings settings {
       .d_maxEntries = maxEntries,
@@ -42,6 +42,8 @@ void setupLuaBindingsPacketCache(LuaContext& luaCtx, bool client)
     LuaArray<uint16_t> payloadRanks;
     std::unordered_set<uint16_t> ranks;
     size_t maximumEntrySize{4096};
+    std::string engine;
+    std::string snapshotFile;
 
     getOptionalValue<bool>(vars, "deferrableInsertLock", settings.d_deferrableInsertLock);
     getOptionalValue<bool>(vars, "dontAge", settings.d_dontAge);
@@ -56,6 +58,21 @@ void setupLuaBindingsPacketCache(LuaContext& luaCtx, bool client)
     getOptionalValue<size_t>(vars, "truncatedTTL", settings.d_truncatedTTL);
     getOptionalValue<bool>(vars, "cookieHashing", cookieHashing);
     getOptionalValue<size_t>(vars, "maximumEntrySize", maximumEntrySize);
+    getOptionalValue<std::string>(vars, "engine", engine);
+    getOptionalValue<std::string>(vars, "snapshotFile", snapshotFile);
+    getOptionalValue<bool>(vars, "coalesceQueries", settings.d_coalesceQueries);
+    getOptionalValue<size_t>(vars, "maxCoalescedQueries", settings.d_maxCoalescedQueries);
+    getOptionalValue<std::string>(vars, "sharedSegment", settings.d_sharedSegmentName);
+    getOptionalValue<size_t>(vars, "sharedSegmentEntries", settings.d_sharedSegmentEntries);
+    getOptionalValue<size_t>(vars, "sharedSegmentSlotSize", settings.d_sharedSegmentSlotSize);
+
+    if (!engine.empty()) {
+      auto selected = DNSDistPacketCache::getEngineFromName(engine);
+      if (!selected) {
+        throw std::runtime_error("Invalid packet cache engine '" + engine + "' passed to newPacketCache()");
+      }
+      settings.d_engine = *selected;
+    }
 
     if (maximumEntrySize >= sizeof(dnsheader)) {
       settings.d_maximumEntrySize = maximumEntrySize;
@@ -98,8 +115,16 @@ void setupLuaBindingsPacketCache(LuaContext& luaCtx, bool client)
       settings.d_maxEntries = 1;
       settings.d_shardCount = 1;
     }
+    if (client || configCheck) {
+      /* do not create or attach to the segment used by the running instances */
+      settings.d_sharedSegmentName.clear();
+    }
 
-    return std::make_shared<DNSDistPacketCache>(settings);
+    auto cache = std::make_shared<DNSDistPacketCache>(settings);
+    if (!client && !configCheck && !snapshotFile.empty()) {
+      dnsdist::cache::loadSnapshotAndSaveOnExit(cache, snapshotFile);
+    }
+    return cache;
   });
 
 #ifndef DISABLE_PACKETCACHE_BINDINGS
@@ -156,6 +181,8 @@ void setupLuaBindingsPacketCache(LuaContext& luaCtx, bool client)
         g_outputBuffer+="Insert Collisions: " + std::to_string(cache->getInsertCollisions()) + "\n";
         g_outputBuffer+="TTL Too Shorts: " + std::to_string(cache->getTTLTooShorts()) + "\n";
         g_outputBuffer+="Cleanup Count: " + std::to_string(cache->getCleanupCount()) + "\n";
+        g_outputBuffer+="Shared Segment Hits: " + std::to_string(cache->getSharedSegmentHits()) + "\n";
+        g_outputBuffer+="Shared Segment Inserts: " + std::to_string(cache->getSharedSegmentInserts()) + "\n";
       }
     });
   luaCtx.registerFunction<LuaAssociativeTable<uint64_t>(std::shared_ptr<DNSDistPacketCache>::*)()const>("getStats", [](const std::shared_ptr<DNSDistPacketCache>& cache) {
@@ -171,6 +198,8 @@ void setupLuaBindingsPacketCache(LuaContext& luaCtx, bool client)
         stats["insertCollisions"] = cache->getInsertCollisions();
         stats["ttlTooShorts"] = cache->getTTLTooShorts();
         stats["cleanupCount"] = cache->getCleanupCount();
+        stats["sharedSegmentHits"] = cache->getSharedSegmentHits();
+        stats["sharedSegmentInserts"] = cache->getSharedSegmentInserts();
       }
       return stats;
     });
@@ -230,5 +259,19 @@ void setupLuaBindingsPacketCache(LuaContext& luaCtx, bool client)
         g_outputBuffer += "Dumped " + std::to_string(records) + " records\n";
       }
     });
+
+  luaCtx.registerFunction<void(std::shared_ptr<DNSDistPacketCache>::*)(const std::string& fname)const>("saveSnapshot", [](const std::shared_ptr<DNSDistPacketCache>& cache, const std::string& fname) {
+      if (cache) {
+        auto records = cache->saveSnapshot(fname);
+        g_outputBuffer += "Saved " + std::to_string(records) + " records\n";
+      }
+    });
+
+  luaCtx.registerFunction<void(std::shared_ptr<DNSDistPacketCache>::*)(const std::string& fname, boost::optional<size_t> threads)const>("loadSnapshot", [client, configCheck](const std::shared_ptr<DNSDistPacketCache>& cache, const std::string& fname, boost::optional<size_t> threads) {
+      if (cache && !client && !configCheck) {
+        auto records = cache->loadSnapshot(fname, threads ? *threads : 0);
+        g_outputBuffer += "Loaded " + std::to_string(records) + " records\n";
+      }
+    });
 #endif /* DISABLE_PACKETCACHE_BINDINGS */
 }
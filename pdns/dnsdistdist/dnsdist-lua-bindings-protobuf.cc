@@ -202,6 +202,21 @@ void setupLuaBindingsProtoBuf(LuaContext& luaCtx, bool client, bool configCheck)
     }
     return std::string();
   });
+
+  luaCtx.registerFunction<LuaAssociativeTable<uint64_t> (std::shared_ptr<RemoteLoggerInterface>::*)() const>("getStats", [](const std::shared_ptr<RemoteLoggerInterface>& logger) {
+    LuaAssociativeTable<uint64_t> stats;
+    if (logger) {
+      const auto loggerStats = logger->getStats();
+      stats["queued"] = loggerStats.d_queued;
+      stats["pipeFull"] = loggerStats.d_pipeFull;
+      stats["tooLarge"] = loggerStats.d_tooLarge;
+      stats["otherError"] = loggerStats.d_otherError;
+      stats["connectionDrops"] = loggerStats.d_connectionDrops;
+      stats["sent"] = loggerStats.d_sent;
+      stats["queueLatencyUsec"] = loggerStats.d_queueLatencyUsec;
+    }
+    return stats;
+  });
 }
 #else /* DISABLE_PROTOBUF */
 void setupLuaBindingsProtoBuf(LuaContext&, bool, bool)
@@ -27,6 +27,8 @@
 #include "dnsdist-dynbpf.hh"
 #include "dnsdist-frontend.hh"
 #include "dnsdist-lua.hh"
+#include "dnsdist-lua-per-thread.hh"
+#include "dnsdist-metrics.hh"
 #include "dnsdist-resolver.hh"
 #include "dnsdist-svc.hh"
 #include "dnsdist-xsk.hh"
@@ -54,6 +56,94 @@ void setupLuaBindingsLogging(LuaContext& luaCtx)
   });
 }
 
+using update_metric_opts_t = LuaAssociativeTable<boost::variant<uint64_t, LuaAssociativeTable<std::string>>>;
+
+/* 'perThread' is set for the per-thread Lua states, which are not protected by the lock on
+   the global Lua state and thus should not touch g_outputBuffer */
+void setupLuaBindingsCustomMetrics(LuaContext& luaCtx, bool perThread)
+{
+  // NOLINTNEXTLINE(performance-unnecessary-value-param)
+  luaCtx.writeFunction("incMetric", [perThread](const std::string& name, boost::optional<boost::variant<uint64_t, update_metric_opts_t>> opts) {
+    auto incOpts = opts.get_value_or(1);
+    uint64_t step = 1;
+    std::unordered_map<std::string, std::string> labels;
+    if (auto* custom_step = boost::get<uint64_t>(&incOpts)) {
+      step = *custom_step;
+    }
+    else {
+      boost::optional<update_metric_opts_t> vars = {boost::get<update_metric_opts_t>(incOpts)};
+      getOptionalValue<uint64_t>(vars, "step", step);
+      getOptionalValue<LuaAssociativeTable<std::string>>(vars, "labels", labels);
+      checkAllParametersConsumed("incMetric", vars);
+    }
+    auto result = dnsdist::metrics::incrementCustomCounter(name, step, labels);
+    if (const auto* errorStr = std::get_if<dnsdist::metrics::Error>(&result)) {
+      if (!perThread) {
+        g_outputBuffer = *errorStr + "'\n";
+      }
+      errlog("Error in incMetric: %s", *errorStr);
+      return static_cast<uint64_t>(0);
+    }
+    return std::get<uint64_t>(result);
+  });
+  // NOLINTNEXTLINE(performance-unnecessary-value-param)
+  luaCtx.writeFunction("decMetric", [perThread](const std::string& name, boost::optional<boost::variant<uint64_t, update_metric_opts_t>> opts) {
+    auto decOpts = opts.get_value_or(1);
+    uint64_t step = 1;
+    std::unordered_map<std::string, std::string> labels;
+    if (auto* custom_step = boost::get<uint64_t>(&decOpts)) {
+      step = *custom_step;
+    }
+    else {
+      boost::optional<update_metric_opts_t> vars = {boost::get<update_metric_opts_t>(decOpts)};
+      getOptionalValue<uint64_t>(vars, "step", step);
+      getOptionalValue<LuaAssociativeTable<std::string>>(vars, "labels", labels);
+      checkAllParametersConsumed("decMetric", vars);
+    }
+    auto result = dnsdist::metrics::decrementCustomCounter(name, step, labels);
+    if (const auto* errorStr = std::get_if<dnsdist::metrics::Error>(&result)) {
+      if (!perThread) {
+        g_outputBuffer = *errorStr + "'\n";
+      }
+      errlog("Error in decMetric: %s", *errorStr);
+      return static_cast<uint64_t>(0);
+    }
+    return std::get<uint64_t>(result);
+  });
+  luaCtx.writeFunction("setMetric", [perThread](const std::string& name, const double value, boost::optional<update_metric_opts_t> opts) -> double {
+    std::unordered_map<std::string, std::string> labels;
+    if (opts) {
+      getOptionalValue<LuaAssociativeTable<std::string>>(opts, "labels", labels);
+    }
+    checkAllParametersConsumed("setMetric", opts);
+    auto result = dnsdist::metrics::setCustomGauge(name, value, labels);
+    if (const auto* errorStr = std::get_if<dnsdist::metrics::Error>(&result)) {
+      if (!perThread) {
+        g_outputBuffer = *errorStr + "'\n";
+      }
+      errlog("Error in setMetric: %s", *errorStr);
+      return 0.;
+    }
+    return std::get<double>(result);
+  });
+  luaCtx.writeFunction("getMetric", [perThread](const std::string& name, boost::optional<update_metric_opts_t> opts) {
+    std::unordered_map<std::string, std::string> labels;
+    if (opts) {
+      getOptionalValue<LuaAssociativeTable<std::string>>(opts, "labels", labels);
+    }
+    checkAllParametersConsumed("getMetric", opts);
+    auto result = dnsdist::metrics::getCustomMetric(name, labels);
+    if (const auto* errorStr = std::get_if<dnsdist::metrics::Error>(&result)) {
+      if (!perThread) {
+        g_outputBuffer = *errorStr + "'\n";
+      }
+      errlog("Error in getMetric: %s", *errorStr);
+      return 0.;
+    }
+    return std::get<double>(result);
+  });
+}
+
 // NOLINTNEXTLINE(readability-function-cognitive-complexity): this function declares Lua bindings, even with a good refactoring it will likely blow up the threshold
 void setupLuaBindings(LuaContext& luaCtx, bool client, bool configCheck)
 {
@@ -77,7 +167,14 @@ void setupLuaBindings(LuaContext& luaCtx, bool client, bool configCheck)
   });
 #ifndef DISABLE_POLICIES_BINDINGS
   /* ServerPolicy */
-  luaCtx.writeFunction("newServerPolicy", [](const string& name, const ServerPolicy::policyfunc_t& policy) { return std::make_shared<ServerPolicy>(name, policy, true); });
+  luaCtx.writeFunction("newServerPolicy", [&luaCtx](const string& name, const LuaContext::LuaObject& function) {
+    auto [policy, perThreadCode] = dnsdist::lua::perthread::getFunctionAndCode<ServerPolicy::policyfunc_t>(luaCtx, function, "newServerPolicy");
+    auto pol = std::make_shared<ServerPolicy>(name, std::move(policy), true);
+    if (perThreadCode) {
+      pol->setPerThreadLuaCode(std::move(*perThreadCode));
+    }
+    return pol;
+  });
   luaCtx.registerMember("name", &ServerPolicy::d_name);
   luaCtx.registerMember("policy", &ServerPolicy::d_policy);
   luaCtx.registerMember("ffipolicy", &ServerPolicy::d_ffipolicy);
@@ -50,6 +50,10 @@ struct BooleanImmutableConfigurationItems
 {
   const std::function<void(dnsdist::configuration::ImmutableConfiguration& config, bool newValue)> mutator;
 };
+struct StringImmutableConfigurationItems
+{
+  const std::function<void(dnsdist::configuration::ImmutableConfiguration& config, const std::string& value)> mutator;
+};
 struct UnsignedIntegerImmutableConfigurationItems
 {
   const std::function<void(dnsdist::configuration::ImmutableConfiguration& config, uint64_t value)> mutator;
@@ -126,6 +130,12 @@ static const std::map<std::string, StringConfigurationItems> s_stringConfigItems
 static const std::map<std::string, BooleanImmutableConfigurationItems> s_booleanImmutableConfigItems{
   {"setRandomizedOutgoingSockets", {[](dnsdist::configuration::ImmutableConfiguration& config, bool newValue) { config.d_randomizeUDPSocketsToBackend = newValue; }}},
   {"setRandomizedIdsOverUDP", {[](dnsdist::configuration::ImmutableConfiguration& config, bool newValue) { config.d_randomizeIDsToBackend = newValue; }}},
+  {"setLuaPerThreadStates", {[](dnsdist::configuration::ImmutableConfiguration& config, bool newValue) { config.d_luaPerThreadStates = newValue; }}},
+};
+
+static const std::map<std::string, StringImmutableConfigurationItems> s_stringImmutableConfigItems{
+  {"setTCPMultiplexer", {[](dnsdist::configuration::ImmutableConfiguration& config, const std::string& newValue) { config.d_tcpMultiplexer = newValue; }}},
+  {"setUDPResponderMultiplexer", {[](dnsdist::configuration::ImmutableConfiguration& config, const std::string& newValue) { config.d_udpResponderMultiplexer = newValue; }}},
 };
 
 static const std::map<std::string, UnsignedIntegerImmutableConfigurationItems> s_unsignedIntegerImmutableConfigItems{
@@ -215,6 +225,20 @@ void setupConfigurationItems(LuaContext& luaCtx)
     });
   }
 
+  for (const auto& item : s_stringImmutableConfigItems) {
+    luaCtx.writeFunction(item.first, [&name = item.first, &item = item.second](const std::string& value) {
+      try {
+        dnsdist::configuration::updateImmutableConfiguration([&value, &item](dnsdist::configuration::ImmutableConfiguration& config) {
+          item.mutator(config, value);
+        });
+      }
+      catch (const std::exception& exp) {
+        g_outputBuffer = name + " cannot be used at runtime!\n";
+        errlog("%s cannot be used at runtime!", name);
+      }
+    });
+  }
+
   for (const auto& item : s_unsignedIntegerImmutableConfigItems) {
     luaCtx.writeFunction(item.first, [&name = item.first, &item = item.second](uint64_t value) {
       checkParameterBound(name, value, item.maximumValue);
@@ -27,6 +27,7 @@
 #include "dnsdist-console.hh"
 #include "dnsdist-dynblocks.hh"
 #include "dnsdist-frontend.hh"
+#include "dnsdist-heavy-hitters.hh"
 #include "dnsdist-lua.hh"
 #include "dnsdist-nghttp2.hh"
 #include "dnsdist-rings.hh"
@@ -487,6 +488,59 @@ void setupLuaInspection(LuaContext& luaCtx)
 
   luaCtx.executeCode(R"(function topQueries(top, labels) top = top or 10; for k,v in ipairs(getTopQueries(top,labels)) do show(string.format("%4d  %-40s %4d %4.1f%%",k,v[1],v[2], v[3])) end end)");
 
+  luaCtx.writeFunction("getHeavyHitters", [](boost::optional<uint64_t> top) {
+    setLuaNoSideEffect();
+    using entry_t = LuaAssociativeTable<boost::variant<std::string, uint64_t>>;
+    LuaAssociativeTable<LuaArray<entry_t>> result;
+    auto heavyHitters = dnsdist::HeavyHitters::get();
+    if (!heavyHitters) {
+      g_outputBuffer = "Heavy hitters tracking is not enabled, see setRingBuffersOptions()\n";
+      return result;
+    }
+
+    auto tops = heavyHitters->getTops(top ? *top : 10U);
+    auto& clients = result["clients"];
+    for (const auto& entry : tops.d_clients) {
+      clients.emplace_back(clients.size() + 1, entry_t{{"client", entry.key.toString()}, {"count", entry.count}, {"error", entry.error}});
+    }
+    auto& names = result["names"];
+    for (const auto& entry : tops.d_names) {
+      names.emplace_back(names.size() + 1, entry_t{{"name", entry.key.toString()}, {"count", entry.count}, {"error", entry.error}});
+    }
+    auto& rcodes = result["rcodes"];
+    for (const auto& entry : tops.d_rcodes) {
+      rcodes.emplace_back(rcodes.size() + 1, entry_t{{"rcode", RCode::to_short_s(entry.key.d_rcode)}, {"name", entry.key.d_name.toString()}, {"count", entry.count}, {"error", entry.error}});
+    }
+    return result;
+  });
+
+  luaCtx.writeFunction("showHeavyHitters", [](boost::optional<uint64_t> top) {
+    setLuaNoSideEffect();
+    auto heavyHitters = dnsdist::HeavyHitters::get();
+    if (!heavyHitters) {
+      g_outputBuffer = "Heavy hitters tracking is not enabled, see setRingBuffersOptions()\n";
+      return;
+    }
+
+    auto tops = heavyHitters->getTops(top ? *top : 10U);
+    boost::format fmt("%4d  %-50s %10d %10d\n");
+    g_outputBuffer = (boost::format("%4s  %-50s %10s %10s\n") % "#" % "Client" % "Count" % "Error").str();
+    unsigned int position = 1;
+    for (const auto& entry : tops.d_clients) {
+      g_outputBuffer += (fmt % (position++) % entry.key.toString() % entry.count % entry.error).str();
+    }
+    g_outputBuffer += (boost::format("\n%4s  %-50s %10s %10s\n") % "#" % "Name" % "Count" % "Error").str();
+    position = 1;
+    for (const auto& entry : tops.d_names) {
+      g_outputBuffer += (fmt % (position++) % entry.key.toString() % entry.count % entry.error).str();
+    }
+    g_outputBuffer += (boost::format("\n%4s  %-50s %10s %10s\n") % "#" % "RCode and name" % "Count" % "Error").str();
+    position = 1;
+    for (const auto& entry : tops.d_rcodes) {
+      g_outputBuffer += (fmt % (position++) % (RCode::to_short_s(entry.key.d_rcode) + " " + entry.key.d_name.toString()) % entry.count % entry.error).str();
+    }
+  });
+
   luaCtx.writeFunction("getResponseRing", []() {
     setLuaNoSideEffect();
     size_t totalEntries = 0;
@@ -1058,6 +1112,9 @@ void setupLuaInspection(LuaContext& luaCtx)
     group->apply();
   });
   luaCtx.registerFunction("setQuiet", &DynBlockRulesGroup::setQuiet);
+  luaCtx.registerFunction<void (std::shared_ptr<DynBlockRulesGroup>::*)(bool, boost::optional<uint64_t>)>("setIncremental", [](std::shared_ptr<DynBlockRulesGroup>& group, bool incremental, boost::optional<uint64_t> maxClients) {
+    group->setIncremental(incremental, maxClients ? static_cast<size_t>(*maxClients) : DynBlockRulesGroup::IncrementalCounters::s_defaultMaxClients);
+  });
   luaCtx.registerFunction("toString", &DynBlockRulesGroup::toString);
 
   /* DynBlock object accessors */
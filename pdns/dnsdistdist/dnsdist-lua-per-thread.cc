@@ -0,0 +1,173 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <atomic>
+#include <map>
+#include <unordered_set>
+
+#include "dnsdist-lua-per-thread.hh"
+#include "dnsdist-cache.hh"
+#include "dnsdist-configuration.hh"
+#include "dnsdist-kvs.hh"
+#include "dnsdist-metrics.hh"
+
+namespace dnsdist::lua
+{
+RecursiveLockGuardedTryHolder<LuaContext> lockGlobalState()
+{
+  auto lock = g_lua.try_lock();
+  if (!lock.owns_lock()) {
+    StopWatch stopWatch;
+    stopWatch.start();
+    lock.lock();
+    ++dnsdist::metrics::g_stats.luaLockWaits;
+    dnsdist::metrics::g_stats.luaLockWaitTime += static_cast<uint64_t>(stopWatch.udiff());
+  }
+  return lock;
+}
+}
+
+namespace dnsdist::lua::perthread
+{
+/* a Lua function only using global variables can be loaded into a different Lua state,
+   where it will use the global variables of that state. With Lua 5.2+ the global
+   environment is the '_ENV' upvalue, set by load(), with Lua 5.1 and LuaJIT it is not an upvalue */
+static const char* s_functionDumperCode = R"(
+return function(object)
+  if type(object) ~= "function" then
+    return nil, "it is not a function"
+  end
+  if debug.getinfo(object, "S").what == "C" then
+    return nil, "it is not a Lua function"
+  end
+  local idx = 1
+  while true do
+    local name = debug.getupvalue(object, idx)
+    if name == nil then
+      break
+    end
+    if name ~= "_ENV" then
+      return nil, "it captures the local variable '" .. name .. "'"
+    end
+    idx = idx + 1
+  end
+  local ok, code = pcall(string.dump, object)
+  if not ok then
+    return nil, "it cannot be serialized: " .. tostring(code)
+  end
+  return code
+end
+)";
+
+static const char* s_functionLoaderCode = R"(
+return function(code)
+  local func, err = (loadstring or load)(code)
+  if func == nil then
+    error(err)
+  end
+  return func
+end
+)";
+
+static std::atomic<uint64_t> s_functionsCounter{0};
+static std::atomic<uint64_t> s_releasedFunctionsGeneration{0};
+static LockGuarded<std::unordered_set<uint64_t>> s_aliveFunctions;
+static LockGuarded<std::map<std::string, SharedObject>> s_sharedObjects;
+
+bool isEnabled()
+{
+  return dnsdist::configuration::getImmutableConfiguration().d_luaPerThreadStates;
+}
+
+std::optional<std::string> getFunctionCode(LuaContext& context, const LuaContext::LuaObject& object, const std::string& directive)
+{
+  try {
+    auto dumper = context.executeCode<std::function<std::tuple<boost::optional<std::string>, boost::optional<std::string>>(const LuaContext::LuaObject&)>>(s_functionDumperCode);
+    auto [code, error] = dumper(object);
+    if (code) {
+      return *code;
+    }
+    warnlog("The function passed to %s cannot be instantiated in per-thread Lua states because %s, it will be called from the global Lua state instead", directive, error ? *error : "of an unknown error");
+  }
+  catch (const std::exception& exp) {
+    warnlog("The function passed to %s cannot be instantiated in per-thread Lua states because of an error (%s), it will be called from the global Lua state instead", directive, exp.what());
+  }
+  return std::nullopt;
+}
+
+void addSharedObject(const std::string& name, SharedObject object)
+{
+  s_sharedObjects.lock()->insert_or_assign(name, std::move(object));
+}
+
+ThreadState& getThreadState()
+{
+  /* a single thread-local object, so that the destruction of the functions cached by the thread
+     cannot happen after the one of the Lua state they live in */
+  static thread_local ThreadState t_state;
+  return t_state;
+}
+
+LuaContext& getThreadContext()
+{
+  auto& state = getThreadState();
+  if (!state.d_context) {
+    auto context = std::make_unique<LuaContext>();
+    setupLuaLoadBalancingContext(*context);
+    setupLuaBindingsPacketCache(*context, true, false);
+    setupLuaBindingsCustomMetrics(*context, true);
+    for (const auto& [name, object] : *s_sharedObjects.lock()) {
+      context->writeVariable(name, object);
+    }
+    state.d_context = std::move(context);
+  }
+  return *state.d_context;
+}
+
+uint64_t getNewFunctionID()
+{
+  auto functionID = s_functionsCounter++;
+  s_aliveFunctions.lock()->insert(functionID);
+  return functionID;
+}
+
+void releaseFunctionID(uint64_t functionID)
+{
+  s_aliveFunctions.lock()->erase(functionID);
+  ++s_releasedFunctionsGeneration;
+}
+
+uint64_t getReleasedFunctionsGeneration()
+{
+  return s_releasedFunctionsGeneration.load(std::memory_order_relaxed);
+}
+
+bool isFunctionIDAlive(uint64_t functionID)
+{
+  return s_aliveFunctions.lock()->count(functionID) != 0;
+}
+
+const char* getFunctionLoaderCode()
+{
+  return s_functionLoaderCode;
+}
+}
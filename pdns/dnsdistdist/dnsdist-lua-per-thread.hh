@@ -0,0 +1,163 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "dnsdist-lua.hh"
+
+class DNSDistPacketCache;
+class KeyValueStore;
+
+namespace dnsdist::lua
+{
+/* Acquires the lock protecting the global Lua state, accounting for the time spent
+   waiting for it when it is held by a different thread */
+RecursiveLockGuardedTryHolder<LuaContext> lockGlobalState();
+}
+
+namespace dnsdist::lua::perthread
+{
+/* Whether regular (non-FFI) Lua functions used by actions, selectors and load-balancing
+   policies should be instantiated in a Lua state per thread instead of being called
+   from the global Lua state, under its lock */
+bool isEnabled();
+
+/* Returns the bytecode of a Lua function if it can be loaded into a different Lua state,
+   meaning that it is a Lua function that does not capture any local variable (upvalue).
+   Otherwise logs why it cannot and returns std::nullopt.
+   Has to be called with the lock on the global Lua state held */
+std::optional<std::string> getFunctionCode(LuaContext& context, const LuaContext::LuaObject& object, const std::string& directive);
+
+/* Converts a Lua object into a function of the expected type, throwing if it is not one.
+   Has to be called with the lock on the global Lua state held */
+template <typename FunctionType>
+FunctionType getFunction(LuaContext& context, const LuaContext::LuaObject& object, const std::string& directive)
+{
+  try {
+    auto converter = context.executeCode<std::function<FunctionType(const LuaContext::LuaObject&)>>("return function(object) return object end");
+    return converter(object);
+  }
+  catch (const std::exception& exp) {
+    throw std::runtime_error(directive + " expects a Lua function: " + exp.what());
+  }
+}
+
+/* The function to call from the global Lua state, and its bytecode if per-thread states
+   are enabled and the function can be instantiated there */
+template <typename FunctionType>
+std::pair<FunctionType, std::optional<std::string>> getFunctionAndCode(LuaContext& context, const LuaContext::LuaObject& object, const std::string& directive)
+{
+  auto function = getFunction<FunctionType>(context, object, directive);
+  if (!isEnabled()) {
+    return {std::move(function), std::nullopt};
+  }
+  return {std::move(function), getFunctionCode(context, object, directive)};
+}
+
+using SharedObject = boost::variant<std::shared_ptr<KeyValueStore>, std::shared_ptr<DNSDistPacketCache>>;
+/* Makes an object available, as a global variable named 'name', in the per-thread Lua states
+   created from now on. The object itself is shared between all these states */
+void addSharedObject(const std::string& name, SharedObject object);
+
+/* The Lua state of the current thread, created on first use */
+LuaContext& getThreadContext();
+
+/* What each thread keeps for the per-thread functions */
+struct ThreadState
+{
+  /* declared first so that it is destroyed last, once the functions instantiated in it are gone */
+  std::unique_ptr<LuaContext> d_context;
+  /* the functions instantiated in d_context, by function ID, nullptr if the instantiation failed */
+  std::unordered_map<uint64_t, std::shared_ptr<const void>> d_functions;
+  uint64_t d_releasedGeneration{0};
+};
+ThreadState& getThreadState();
+
+uint64_t getNewFunctionID();
+/* the function has been destroyed, the threads will remove it from their Lua state */
+void releaseFunctionID(uint64_t functionID);
+/* incremented every time a function is released */
+uint64_t getReleasedFunctionsGeneration();
+bool isFunctionIDAlive(uint64_t functionID);
+const char* getFunctionLoaderCode();
+
+/* A Lua function instantiated, from its bytecode, in the Lua state of each thread
+   calling it, on first use */
+template <typename FunctionType>
+class Function
+{
+public:
+  Function(std::string code) :
+    d_code(std::move(code)), d_functionID(getNewFunctionID())
+  {
+  }
+  Function(const Function&) = delete;
+  Function(Function&&) = delete;
+  Function& operator=(const Function&) = delete;
+  Function& operator=(Function&&) = delete;
+  ~Function()
+  {
+    releaseFunctionID(d_functionID);
+  }
+
+  /* returns nullptr if the function could not be instantiated in the Lua state of this thread */
+  const FunctionType* get() const
+  {
+    auto& state = getThreadState();
+    if (auto generation = getReleasedFunctionsGeneration(); generation != state.d_releasedGeneration) {
+      /* some functions have been destroyed since we last looked, for example because the
+         rules have been replaced, so remove them from the Lua state of this thread */
+      state.d_releasedGeneration = generation;
+      for (auto entry = state.d_functions.begin(); entry != state.d_functions.end();) {
+        if (isFunctionIDAlive(entry->first)) {
+          ++entry;
+        }
+        else {
+          entry = state.d_functions.erase(entry);
+        }
+      }
+    }
+
+    auto [entry, inserted] = state.d_functions.try_emplace(d_functionID);
+    if (inserted) {
+      /* we only try to instantiate the function once per thread, even if it fails */
+      try {
+        auto loader = getThreadContext().executeCode<std::function<FunctionType(const std::string&)>>(getFunctionLoaderCode());
+        entry->second = std::make_shared<const FunctionType>(loader(d_code));
+      }
+      catch (const std::exception& exp) {
+        warnlog("Error while instantiating a Lua function in a per-thread Lua state: %s", exp.what());
+      }
+    }
+    return static_cast<const FunctionType*>(entry->second.get());
+  }
+
+private:
+  const std::string d_code;
+  const uint64_t d_functionID;
+};
+}
@@ -576,8 +576,9 @@ void setupLuaRules(LuaContext& luaCtx)
     return std::shared_ptr<DNSRule>(new NotRule(rule));
   });
 
-  luaCtx.writeFunction("LuaRule", [](const dnsdist::selectors::LuaSelectorFunction& function) {
-    return std::shared_ptr<DNSRule>(dnsdist::selectors::getLuaSelector(function));
+  luaCtx.writeFunction("LuaRule", [&luaCtx](const LuaContext::LuaObject& object) {
+    auto [function, perThreadCode] = dnsdist::lua::perthread::getFunctionAndCode<dnsdist::selectors::LuaSelectorFunction>(luaCtx, object, "LuaRule");
+    return std::shared_ptr<DNSRule>(dnsdist::selectors::getLuaSelector(function, std::move(perThreadCode)));
   });
 
   luaCtx.writeFunction("LuaFFIRule", [](const dnsdist::selectors::LuaSelectorFFIFunction& function) {
@@ -625,6 +626,16 @@ void setupLuaRules(LuaContext& luaCtx)
     return std::shared_ptr<DNSRule>(new QNameSetRule(names));
   });
 
+  // NOLINTNEXTLINE(performance-unnecessary-value-param): LuaWrapper does not play well with const boost::optional<T>&
+  luaCtx.writeFunction("RegexSetRule", [](const LuaArray<std::string>& expressions, boost::optional<std::string> tagName) {
+    std::vector<std::string> list;
+    list.reserve(expressions.size());
+    for (const auto& expression : expressions) {
+      list.push_back(expression.second);
+    }
+    return std::shared_ptr<DNSRule>(dnsdist::selectors::getRegexSetSelector(list, tagName ? *tagName : ""));
+  });
+
   // NOLINTNEXTLINE(performance-unnecessary-value-param): LuaWrapper does not play well with const boost::optional<T>&
   luaCtx.writeFunction("TagRule", [](const std::string& tag, boost::optional<std::string> value) {
     return std::shared_ptr<DNSRule>(dnsdist::selectors::getTagSelector(tag, boostToStandardOptional(value), !value));
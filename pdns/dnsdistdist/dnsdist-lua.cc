@@ -50,6 +50,7 @@
 #include "dnsdist-healthchecks.hh"
 #include "dnsdist-lua.hh"
 #include "dnsdist-lua-hooks.hh"
+#include "dnsdist-lua-per-thread.hh"
 #include "xsk.hh"
 #ifdef LUAJIT_VERSION
 #include "dnsdist-lua-ffi.hh"
@@ -84,7 +85,6 @@
 
 using std::thread;
 
-using update_metric_opts_t = LuaAssociativeTable<boost::variant<uint64_t, LuaAssociativeTable<std::string>>>;
 using declare_metric_opts_t = LuaAssociativeTable<boost::variant<bool, std::string>>;
 
 static boost::tribool s_noLuaSideEffect;
@@ -441,6 +441,13 @@ static void setupLuaConfig(LuaContext& luaCtx, bool client, bool configCheck)
                            }
                          }
 
+                         if (getOptionalIntegerValue("newServer", vars, "responderBatchSize", config.d_responderBatchSize) > 0) {
+                           if (config.d_responderBatchSize == 0 || config.d_responderBatchSize > std::numeric_limits<uint16_t>::max()) {
+                             warnlog("Dismissing invalid responder batch size '%d', using 1 instead", config.d_responderBatchSize);
+                             config.d_responderBatchSize = 1;
+                           }
+                         }
+
                          getOptionalIntegerValue("newServer", vars, "qps", config.d_qpsLimit);
                          getOptionalIntegerValue("newServer", vars, "order", config.order);
                          getOptionalIntegerValue("newServer", vars, "weight", config.d_weight);
@@ -1974,6 +1981,24 @@ static void setupLuaConfig(LuaContext& luaCtx, bool client, bool configCheck)
         if (options.count("recordResponses") > 0) {
           config.d_ringsRecordResponses = boost::get<bool>(options.at("recordResponses"));
         }
+        if (options.count("perThreadBufferSize") > 0) {
+          config.d_ringsPerThreadBufferSize = boost::get<uint64_t>(options.at("perThreadBufferSize"));
+        }
+        if (options.count("heavyHittersCapacity") > 0) {
+          config.d_heavyHittersCapacity = boost::get<uint64_t>(options.at("heavyHittersCapacity"));
+        }
+        if (options.count("heavyHittersHalfLife") > 0) {
+          config.d_heavyHittersHalfLife = boost::get<uint64_t>(options.at("heavyHittersHalfLife"));
+        }
+        if (options.count("heavyHittersIPv4Mask") > 0) {
+          config.d_heavyHittersMaskV4 = boost::get<uint64_t>(options.at("heavyHittersIPv4Mask"));
+        }
+        if (options.count("heavyHittersIPv6Mask") > 0) {
+          config.d_heavyHittersMaskV6 = boost::get<uint64_t>(options.at("heavyHittersIPv6Mask"));
+        }
+        if (options.count("heavyHittersSuffixLabels") > 0) {
+          config.d_heavyHittersSuffixLabels = boost::get<uint64_t>(options.at("heavyHittersSuffixLabels"));
+        }
       });
     }
     catch (const std::exception& exp) {
@@ -2024,9 +2049,13 @@ static void setupLuaConfig(LuaContext& luaCtx, bool client, bool configCheck)
     });
   });
 
-  luaCtx.writeFunction("setServerPolicyLua", [](const string& name, ServerPolicy::policyfunc_t policy) {
+  luaCtx.writeFunction("setServerPolicyLua", [&luaCtx](const string& name, const LuaContext::LuaObject& function) {
     setLuaSideEffect();
+    auto [policy, perThreadCode] = dnsdist::lua::perthread::getFunctionAndCode<ServerPolicy::policyfunc_t>(luaCtx, function, "setServerPolicyLua");
     auto pol = std::make_shared<ServerPolicy>(name, std::move(policy), true);
+    if (perThreadCode) {
+      pol->setPerThreadLuaCode(std::move(*perThreadCode));
+    }
     dnsdist::configuration::updateRuntimeConfiguration([&pol](dnsdist::configuration::RuntimeConfiguration& config) {
       config.d_lbPolicy = std::move(pol);
     });
@@ -2058,9 +2087,14 @@ static void setupLuaConfig(LuaContext& luaCtx, bool client, bool configCheck)
     setPoolPolicy(pool, policy);
   });
 
-  luaCtx.writeFunction("setPoolServerPolicyLua", [](const string& name, ServerPolicy::policyfunc_t policy, const string& pool) {
+  luaCtx.writeFunction("setPoolServerPolicyLua", [&luaCtx](const string& name, const LuaContext::LuaObject& function, const string& pool) {
     setLuaSideEffect();
-    setPoolPolicy(pool, std::make_shared<ServerPolicy>(ServerPolicy{name, std::move(policy), true}));
+    auto [policy, perThreadCode] = dnsdist::lua::perthread::getFunctionAndCode<ServerPolicy::policyfunc_t>(luaCtx, function, "setPoolServerPolicyLua");
+    auto pol = std::make_shared<ServerPolicy>(ServerPolicy{name, std::move(policy), true});
+    if (perThreadCode) {
+      pol->setPerThreadLuaCode(std::move(*perThreadCode));
+    }
+    setPoolPolicy(pool, std::move(pol));
   });
 
   luaCtx.writeFunction("setPoolServerPolicyLuaFFI", [](const string& name, ServerPolicy::ffipolicyfunc_t policy, const string& pool) {
@@ -3087,6 +3121,13 @@ static void setupLuaConfig(LuaContext& luaCtx, bool client, bool configCheck)
     newThread.detach();
   });
 
+  luaCtx.writeFunction("addLuaSharedObject", [](const std::string& name, dnsdist::lua::perthread::SharedObject object) {
+    if (!checkConfigurationTime("addLuaSharedObject")) {
+      return;
+    }
+    dnsdist::lua::perthread::addSharedObject(name, std::move(object));
+  });
+
   luaCtx.writeFunction("declareMetric", [](const std::string& name, const std::string& type, const std::string& description, boost::optional<boost::variant<std::string, declare_metric_opts_t>> opts) {
     bool withLabels = false;
     std::optional<std::string> customName = std::nullopt;
@@ -3110,78 +3151,7 @@ static void setupLuaConfig(LuaContext& luaCtx, bool client, bool configCheck)
     }
     return true;
   });
-  // NOLINTNEXTLINE(performance-unnecessary-value-param)
-  luaCtx.writeFunction("incMetric", [](const std::string& name, boost::optional<boost::variant<uint64_t, update_metric_opts_t>> opts) {
-    auto incOpts = opts.get_value_or(1);
-    uint64_t step = 1;
-    std::unordered_map<std::string, std::string> labels;
-    if (auto* custom_step = boost::get<uint64_t>(&incOpts)) {
-      step = *custom_step;
-    }
-    else {
-      boost::optional<update_metric_opts_t> vars = {boost::get<update_metric_opts_t>(incOpts)};
-      getOptionalValue<uint64_t>(vars, "step", step);
-      getOptionalValue<LuaAssociativeTable<std::string>>(vars, "labels", labels);
-      checkAllParametersConsumed("incMetric", vars);
-    }
-    auto result = dnsdist::metrics::incrementCustomCounter(name, step, labels);
-    if (const auto* errorStr = std::get_if<dnsdist::metrics::Error>(&result)) {
-      g_outputBuffer = *errorStr + "'\n";
-      errlog("Error in incMetric: %s", *errorStr);
-      return static_cast<uint64_t>(0);
-    }
-    return std::get<uint64_t>(result);
-  });
-  // NOLINTNEXTLINE(performance-unnecessary-value-param)
-  luaCtx.writeFunction("decMetric", [](const std::string& name, boost::optional<boost::variant<uint64_t, update_metric_opts_t>> opts) {
-    auto decOpts = opts.get_value_or(1);
-    uint64_t step = 1;
-    std::unordered_map<std::string, std::string> labels;
-    if (auto* custom_step = boost::get<uint64_t>(&decOpts)) {
-      step = *custom_step;
-    }
-    else {
-      boost::optional<update_metric_opts_t> vars = {boost::get<update_metric_opts_t>(decOpts)};
-      getOptionalValue<uint64_t>(vars, "step", step);
-      getOptionalValue<LuaAssociativeTable<std::string>>(vars, "labels", labels);
-      checkAllParametersConsumed("decMetric", vars);
-    }
-    auto result = dnsdist::metrics::decrementCustomCounter(name, step, labels);
-    if (const auto* errorStr = std::get_if<dnsdist::metrics::Error>(&result)) {
-      g_outputBuffer = *errorStr + "'\n";
-      errlog("Error in decMetric: %s", *errorStr);
-      return static_cast<uint64_t>(0);
-    }
-    return std::get<uint64_t>(result);
-  });
-  luaCtx.writeFunction("setMetric", [](const std::string& name, const double value, boost::optional<update_metric_opts_t> opts) -> double {
-    std::unordered_map<std::string, std::string> labels;
-    if (opts) {
-      getOptionalValue<LuaAssociativeTable<std::string>>(opts, "labels", labels);
-    }
-    checkAllParametersConsumed("setMetric", opts);
-    auto result = dnsdist::metrics::setCustomGauge(name, value, labels);
-    if (const auto* errorStr = std::get_if<dnsdist::metrics::Error>(&result)) {
-      g_outputBuffer = *errorStr + "'\n";
-      errlog("Error in setMetric: %s", *errorStr);
-      return 0.;
-    }
-    return std::get<double>(result);
-  });
-  luaCtx.writeFunction("getMetric", [](const std::string& name, boost::optional<update_metric_opts_t> opts) {
-    std::unordered_map<std::string, std::string> labels;
-    if (opts) {
-      getOptionalValue<LuaAssociativeTable<std::string>>(opts, "labels", labels);
-    }
-    checkAllParametersConsumed("getMetric", opts);
-    auto result = dnsdist::metrics::getCustomMetric(name, labels);
-    if (const auto* errorStr = std::get_if<dnsdist::metrics::Error>(&result)) {
-      g_outputBuffer = *errorStr + "'\n";
-      errlog("Error in getMetric: %s", *errorStr);
-      return 0.;
-    }
-    return std::get<double>(result);
-  });
+  setupLuaBindingsCustomMetrics(luaCtx, false);
 }
 
 namespace dnsdist::lua
@@ -3207,7 +3177,7 @@ void setupLuaBindingsOnly(LuaContext& luaCtx, bool client, bool configCheck)
   setupLuaBindingsKVS(luaCtx, client);
   setupLuaBindingsLogging(luaCtx);
   setupLuaBindingsNetwork(luaCtx, client);
-  setupLuaBindingsPacketCache(luaCtx, client);
+  setupLuaBindingsPacketCache(luaCtx, client, configCheck);
   setupLuaBindingsProtoBuf(luaCtx, client, configCheck);
   setupLuaBindingsRings(luaCtx, client);
   setupLuaInspection(luaCtx);
@@ -27,6 +27,7 @@
 #include "dnsdist-metrics.hh"
 #include "dnsdist.hh"
 #include "dnsdist-dynblocks.hh"
+#include "dnsdist-rings.hh"
 #include "dnsdist-web.hh"
 
 namespace dnsdist::metrics
@@ -146,6 +147,8 @@ Stats::Stats() :
     {"empty-queries", "", &emptyQueries},
     {"cache-hits", "", &cacheHits},
     {"cache-misses", "", &cacheMisses},
+    {"cache-coalesced-queries", "", &cacheCoalescedQueries},
+    {"cache-coalesced-failed", "", &cacheCoalescedFailed},
     {"cpu-iowait", "", getCPUIOWait},
     {"cpu-steal", "", getCPUSteal},
     {"cpu-sys-msec", "", getCPUTimeSystem},
@@ -155,6 +158,10 @@ Stats::Stats() :
 #ifndef DISABLE_DYNBLOCKS
     {"dyn-block-nmg-size", "", [](const std::string&) { return dnsdist::DynamicBlocks::getClientAddressDynamicRules().size(); }},
 #endif /* DISABLE_DYNBLOCKS */
+    {"rings-dropped-queries", "", [](const std::string&) { return g_rings.d_droppedQueryInserts.load(); }},
+    {"rings-dropped-responses", "", [](const std::string&) { return g_rings.d_droppedResponseInserts.load(); }},
+    {"rings-overwritten-queries", "", [](const std::string&) { return g_rings.d_overwrittenQueryEntries.load(); }},
+    {"rings-overwritten-responses", "", [](const std::string&) { return g_rings.d_overwrittenResponseEntries.load(); }},
     {"security-status", "", &securityStatus},
     {"doh-query-pipe-full", "", &dohQueryPipeFull},
     {"doh-response-pipe-full", "", &dohResponsePipeFull},
@@ -164,6 +171,8 @@ Stats::Stats() :
     {"tcp-query-pipe-full", "", &tcpQueryPipeFull},
     {"tcp-cross-protocol-query-pipe-full", "", &tcpCrossProtocolQueryPipeFull},
     {"tcp-cross-protocol-response-pipe-full", "", &tcpCrossProtocolResponsePipeFull},
+    {"lua-lock-waits", "", &luaLockWaits},
+    {"lua-lock-wait-usec", "", &luaLockWaitTime},
     // Latency histogram
     {"latency-sum", "", &latencySum},
     {"latency-count", "", &latencyCount},
@@ -0,0 +1,224 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "dnsdist-query-coalescing.hh"
+#include "dnsdist.hh"
+#include "dnsdist-cache.hh"
+#include "dnsdist-dnsparser.hh"
+#include "dnsparser.hh"
+#include "dnswriter.hh"
+
+namespace dnsdist
+{
+QueryCoalescer& QueryCoalescer::get()
+{
+  static QueryCoalescer coalescer;
+  return coalescer;
+}
+
+QueryCoalescer::QueryCoalescer(size_t numberOfShards) :
+  d_shards(std::max(numberOfShards, static_cast<size_t>(1)))
+{
+}
+
+bool QueryCoalescer::isEligible(const InternalQueryState& ids)
+{
+  /* the response sent to a parked query is a copy of the one sent to the leader, so only
+     plain UDP queries, whose response is not encrypted or wrapped, are coalesced */
+  return ids.packetCache && ids.packetCache->isQueryCoalescingEnabled() && !ids.skipCache && !ids.cacheHit && ids.protocol == dnsdist::Protocol::DoUDP && !ids.dnsCryptQuery && !ids.du && !ids.isXSK();
+}
+
+bool QueryCoalescer::Key::operator==(const Key& rhs) const
+{
+  return d_cacheKey == rhs.d_cacheKey && d_cache == rhs.d_cache && d_qtype == rhs.d_qtype && d_qclass == rhs.d_qclass && d_cacheFlags == rhs.d_cacheFlags && d_dnssecOK == rhs.d_dnssecOK && d_ednsAdded == rhs.d_ednsAdded && d_ecsAdded == rhs.d_ecsAdded && d_subnet == rhs.d_subnet && d_qname == rhs.d_qname;
+}
+
+QueryCoalescer::Key QueryCoalescer::getKey(const InternalQueryState& ids)
+{
+  /* the cache key is only a hash, so we also compare everything the packet cache
+     compares to detect collisions, plus whether we altered the EDNS content of the query */
+  return Key{
+    .d_qname = ids.qname,
+    .d_subnet = ids.subnet,
+    .d_cache = ids.packetCache.get(),
+    .d_cacheKey = ids.cacheKey,
+    .d_qtype = ids.qtype,
+    .d_qclass = ids.qclass,
+    .d_cacheFlags = ids.cacheFlags,
+    .d_dnssecOK = ids.dnssecOK ? *ids.dnssecOK : false,
+    .d_ednsAdded = ids.ednsAdded,
+    .d_ecsAdded = ids.ecsAdded,
+  };
+}
+
+LockGuarded<std::unordered_map<QueryCoalescer::Key, QueryCoalescer::Entry, QueryCoalescer::Key::hash>>& QueryCoalescer::getShard(const Key& key)
+{
+  return d_shards.at(key.d_cacheKey % d_shards.size());
+}
+
+QueryCoalescer::Result QueryCoalescer::park(InternalQueryState& ids, const DownstreamState* backend, size_t maxParked, time_t now, time_t maxAge)
+{
+  ids.coalescingLeaderID = 0;
+  auto key = getKey(ids);
+  auto shard = getShard(key).lock();
+  auto [entry, inserted] = shard->try_emplace(std::move(key));
+  if (inserted || entry->second.d_leaderSince + entry->second.d_leaderMaxAge < now) {
+    /* we are either the first one, or the leader has been lost: the queries that are
+       already parked, if any, will be answered by whichever response arrives first */
+    uint32_t leaderID = 0;
+    do {
+      /* 0 means 'not a leader' */
+      leaderID = ++d_nextLeaderID;
+    } while (leaderID == 0);
+    ids.coalescingLeaderID = leaderID;
+    entry->second.d_leaderID = leaderID;
+    entry->second.d_leaderBackend = backend;
+    entry->second.d_leaderSince = now;
+    entry->second.d_leaderMaxAge = maxAge;
+    return Result::Leader;
+  }
+
+  if (entry->second.d_parked.size() >= maxParked) {
+    return Result::NotCoalesced;
+  }
+
+  entry->second.d_parked.push_back(std::move(ids));
+  return Result::Parked;
+}
+
+size_t QueryCoalescer::answer(const InternalQueryState& leader, const DownstreamState* backend, const PacketBuffer& response, const Sender& sender)
+{
+  std::vector<InternalQueryState> parked;
+  {
+    const auto key = getKey(leader);
+    auto shard = getShard(key).lock();
+    auto entry = shard->find(key);
+    if (entry == shard->end()) {
+      return 0;
+    }
+    parked = std::move(entry->second.d_parked);
+    entry->second.d_parked.clear();
+    /* a late response to a lost leader can still answer the queries parked so far,
+       but the entry belongs to the newer leader still in flight */
+    if (entry->second.isLeader(leader, backend)) {
+      shard->erase(entry);
+    }
+  }
+
+  if (response.size() < sizeof(dnsheader)) {
+    return 0;
+  }
+
+  PacketBuffer copy;
+  for (auto& ids : parked) {
+    copy = response;
+    dnsdist::PacketMangling::editDNSHeaderFromPacket(copy, [&ids](dnsheader& header) {
+      header.id = ids.origID;
+      /* restore the RD and CD bits of that query, like we do for the leader */
+      static const uint16_t restoredMask = (1 << FLAGS_RD_OFFSET) | (1 << FLAGS_CD_OFFSET);
+      uint16_t* flags = getFlagsFromDNSHeader(&header);
+      *flags = (*flags & ~restoredMask) | (ids.origFlags & restoredMask);
+      return true;
+    });
+    /* and the case of the qname, like we do for a cache hit */
+    const auto& qname = ids.qname.getStorage();
+    if (dnsheader_aligned(copy.data())->qdcount != 0 && copy.size() >= sizeof(dnsheader) + qname.size()) {
+      memcpy(&copy.at(sizeof(dnsheader)), qname.data(), qname.size());
+    }
+    sender(ids, copy);
+  }
+  return parked.size();
+}
+
+static void sendServFail(std::vector<InternalQueryState>& parked, const QueryCoalescer::Sender& sender)
+{
+  PacketBuffer response;
+  for (auto& ids : parked) {
+    response.clear();
+    GenericDNSPacketWriter<PacketBuffer> packetWriter(response, ids.qname, ids.qtype, ids.qclass, 0);
+    auto* header = packetWriter.getHeader();
+    header->id = ids.origID;
+    *getFlagsFromDNSHeader(header) = ids.origFlags;
+    header->qr = true;
+    header->ra = header->rd;
+    header->rcode = RCode::ServFail;
+    packetWriter.commit();
+    sender(ids, response);
+  }
+}
+
+size_t QueryCoalescer::fail(const InternalQueryState& leader, const DownstreamState* backend, const Sender& sender)
+{
+  std::vector<InternalQueryState> parked;
+  {
+    const auto key = getKey(leader);
+    auto shard = getShard(key).lock();
+    auto entry = shard->find(key);
+    if (entry == shard->end() || !entry->second.isLeader(leader, backend)) {
+      /* a newer leader has taken over, the parked queries will be answered by it */
+      return 0;
+    }
+    parked = std::move(entry->second.d_parked);
+    shard->erase(entry);
+  }
+
+  sendServFail(parked, sender);
+  return parked.size();
+}
+
+size_t QueryCoalescer::expire(time_t now, const Sender& sender)
+{
+  size_t answered = 0;
+  std::vector<InternalQueryState> expired;
+  for (auto& lockedShard : d_shards) {
+    {
+      auto shard = lockedShard.lock();
+      for (auto entry = shard->begin(); entry != shard->end();) {
+        if (entry->second.d_leaderSince + entry->second.d_leaderMaxAge < now) {
+          std::move(entry->second.d_parked.begin(), entry->second.d_parked.end(), std::back_inserter(expired));
+          entry = shard->erase(entry);
+        }
+        else {
+          ++entry;
+        }
+      }
+    }
+    /* do not send while holding the lock */
+    sendServFail(expired, sender);
+    answered += expired.size();
+    expired.clear();
+  }
+  return answered;
+}
+
+size_t QueryCoalescer::getParkedCount()
+{
+  size_t count = 0;
+  for (auto& lockedShard : d_shards) {
+    auto shard = lockedShard.lock();
+    for (const auto& entry : *shard) {
+      count += entry.second.d_parked.size();
+    }
+  }
+  return count;
+}
+}
@@ -0,0 +1,127 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include "dnsdist-idstate.hh"
+#include "lock.hh"
+
+struct DownstreamState;
+
+namespace dnsdist
+{
+/* Coalesces identical queries missing the packet cache while a query for the same cache key
+   is already in flight: the first query (the 'leader') is forwarded to a backend as usual,
+   and the next ones are parked until the response to the leader arrives, at which point a
+   copy of that response, with the ID, flags and qname case of the parked query, is sent to
+   each of them. If the leader times out or fails, the parked queries get a ServFail response
+   instead. If the leader is not answered in time, the next identical query becomes the new
+   leader: a late response to the previous one still answers the queries parked so far, but
+   only the new leader can complete or fail the entry. */
+class QueryCoalescer
+{
+public:
+  enum class Result : uint8_t
+  {
+    /* no identical query in flight, this one should be forwarded */
+    Leader,
+    /* the query has been parked behind an identical one */
+    Parked,
+    /* the query cannot be coalesced and should be forwarded */
+    NotCoalesced
+  };
+  using Sender = std::function<void(InternalQueryState& ids, PacketBuffer& response)>;
+
+  QueryCoalescer(size_t numberOfShards = 16);
+
+  /* the state is moved from only if Result::Parked is returned. If Result::Leader is returned,
+     ids.coalescingLeaderID is set and has to be passed back, along with the same backend, to
+     answer() or fail(). 'maxAge' is the number of seconds after which that leader, which is
+     going to be sent to 'backend', is considered lost */
+  Result park(InternalQueryState& ids, const DownstreamState* backend, size_t maxParked, time_t now, time_t maxAge);
+  /* send a copy of the response to the leader, which is not modified, to every query
+     parked behind it. Returns the number of parked queries that have been answered */
+  size_t answer(const InternalQueryState& leader, const DownstreamState* backend, const PacketBuffer& response, const Sender& sender);
+  /* the leader will not be answered: send a ServFail response to every query parked behind it,
+     unless a newer leader has taken over. Returns the number of parked queries that have been answered */
+  size_t fail(const InternalQueryState& leader, const DownstreamState* backend, const Sender& sender);
+  /* remove the entries whose leader has not been answered in time, sending a ServFail response
+     to the queries parked behind them. Returns the number of parked queries that have been answered */
+  size_t expire(time_t now, const Sender& sender);
+  size_t getParkedCount();
+
+  static bool isEligible(const InternalQueryState& ids);
+  /* the coalescer used for the queries received over UDP */
+  static QueryCoalescer& get();
+
+private:
+  struct Key
+  {
+    bool operator==(const Key& rhs) const;
+
+    struct hash
+    {
+      size_t operator()(const Key& key) const
+      {
+        return key.d_cacheKey;
+      }
+    };
+
+    DNSName d_qname;
+    boost::optional<Netmask> d_subnet;
+    /* only used as an identifier, never dereferenced */
+    const void* d_cache{nullptr};
+    uint32_t d_cacheKey{0};
+    uint16_t d_qtype{0};
+    uint16_t d_qclass{0};
+    uint16_t d_cacheFlags{0};
+    bool d_dnssecOK{false};
+    bool d_ednsAdded{false};
+    bool d_ecsAdded{false};
+  };
+
+  struct Entry
+  {
+    bool isLeader(const InternalQueryState& ids, const DownstreamState* backend) const
+    {
+      return ids.coalescingLeaderID == d_leaderID && backend == d_leaderBackend;
+    }
+
+    std::vector<InternalQueryState> d_parked;
+    /* only used as an identifier, never dereferenced */
+    const DownstreamState* d_leaderBackend{nullptr};
+    time_t d_leaderSince{0};
+    time_t d_leaderMaxAge{0};
+    uint32_t d_leaderID{0};
+  };
+
+  static Key getKey(const InternalQueryState& ids);
+  LockGuarded<std::unordered_map<Key, Entry, Key::hash>>& getShard(const Key& key);
+
+  std::vector<LockGuarded<std::unordered_map<Key, Entry, Key::hash>>> d_shards;
+  std::atomic<uint32_t> d_nextLeaderID{0};
+};
+}
@@ -0,0 +1,215 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "dnsdist-rate-limit-table.hh"
+#include "gettime.hh"
+
+namespace dnsdist
+{
+static size_t getBucketsCount(size_t entries)
+{
+  size_t count = 1;
+  while (count * 4 < entries) {
+    count *= 2;
+  }
+  return count;
+}
+
+RateLimitTable::RateLimitTable(size_t entries, uint32_t expirationSeconds, bool sweep) :
+  d_buckets(getBucketsCount(entries)), d_bucketsMask(d_buckets.size() - 1), d_expirationMS(std::min(static_cast<uint64_t>(expirationSeconds) * 1000U, static_cast<uint64_t>(std::numeric_limits<int32_t>::max()))), d_sweep(sweep)
+{
+  static_assert(s_entriesPerBucket == 4, "getBucketsCount() assumes four entries per bucket");
+  gettime(&d_start, true);
+}
+
+static uint64_t mix(uint64_t value)
+{
+  /* the finalizer of splitmix64 */
+  value ^= value >> 30;
+  value *= 0xbf58476d1ce4e5b9ULL;
+  value ^= value >> 27;
+  value *= 0x94d049bb133111ebULL;
+  value ^= value >> 31;
+  return value;
+}
+
+uint64_t RateLimitTable::getKey(const ComboAddress& client)
+{
+  uint64_t high{0};
+  uint64_t low{0};
+  if (client.isIPv4()) {
+    low = client.sin4.sin_addr.s_addr;
+  }
+  else {
+    memcpy(&high, &client.sin6.sin6_addr.s6_addr[0], sizeof(high));
+    memcpy(&low, &client.sin6.sin6_addr.s6_addr[sizeof(high)], sizeof(low));
+  }
+  const auto key = mix(high ^ mix(low + client.sin4.sin_family));
+  /* 0 marks a free entry */
+  return key != 0 ? key : 1;
+}
+
+bool RateLimitTable::release(Entry& entry, uint64_t key)
+{
+  if (!entry.d_key.compare_exchange_strong(key, 0)) {
+    return false;
+  }
+  entry.d_state.store(0, std::memory_order_relaxed);
+  --d_entriesCount;
+  return true;
+}
+
+RateLimitTable::Entry& RateLimitTable::findOrInsert(uint64_t key, uint32_t nowMS)
+{
+  const std::array<Bucket*, 2> buckets{&d_buckets[key & d_bucketsMask], &d_buckets[(key >> 32) & d_bucketsMask]};
+  while (true) {
+    for (auto* bucket : buckets) {
+      for (auto& entry : bucket->d_entries) {
+        if (entry.d_key.load() == key) {
+          return entry;
+        }
+      }
+    }
+
+    /* not there, take a free entry in the least loaded of the two buckets. Two threads
+       inserting the same client at the same time might both succeed, the duplicate
+       entry will then expire since only the first one is ever looked up */
+    Entry* freeEntry = nullptr;
+    size_t mostFree = 0;
+    for (auto* bucket : buckets) {
+      size_t freeCount = 0;
+      Entry* firstFree = nullptr;
+      for (auto& entry : bucket->d_entries) {
+        if (entry.d_key.load() == 0) {
+          ++freeCount;
+          if (firstFree == nullptr) {
+            firstFree = &entry;
+          }
+        }
+      }
+      if (freeCount > mostFree) {
+        mostFree = freeCount;
+        freeEntry = firstFree;
+      }
+    }
+    if (freeEntry != nullptr) {
+      uint64_t current = 0;
+      if (freeEntry->d_key.compare_exchange_strong(current, key)) {
+        freeEntry->d_state.store(0, std::memory_order_relaxed);
+        ++d_entriesCount;
+        return *freeEntry;
+      }
+      if (current == key) {
+        return *freeEntry;
+      }
+      continue;
+    }
+
+    /* otherwise an expired entry, or the least recently seen one */
+    Entry* oldest = nullptr;
+    uint64_t oldestKey = 0;
+    uint32_t oldestAge = 0;
+    for (auto* bucket : buckets) {
+      for (auto& entry : bucket->d_entries) {
+        auto current = entry.d_key.load();
+        if (current == 0) {
+          /* freed in the meantime */
+          continue;
+        }
+        const auto state = entry.d_state.load(std::memory_order_relaxed);
+        if (d_sweep && isExpired(state, nowMS)) {
+          if (entry.d_key.compare_exchange_strong(current, key)) {
+            entry.d_state.store(0, std::memory_order_relaxed);
+            return entry;
+          }
+          continue;
+        }
+        const uint32_t age = state != 0 ? getElapsed(state, nowMS) : 0;
+        if (oldest == nullptr || age > oldestAge) {
+          oldest = &entry;
+          oldestKey = current;
+          oldestAge = age;
+        }
+      }
+    }
+
+    if (oldest != nullptr && oldest->d_key.compare_exchange_strong(oldestKey, key)) {
+      oldest->d_state.store(0, std::memory_order_relaxed);
+      return *oldest;
+    }
+    /* the buckets have been modified under us, try again */
+  }
+}
+
+void RateLimitTable::sweepIfNeeded(uint32_t nowMS)
+{
+  static thread_local uint32_t t_queries{0};
+  if (++t_queries % s_queriesBetweenSweeps != 0) {
+    return;
+  }
+
+  const auto start = d_sweepPosition.fetch_add(s_sweptEntries, std::memory_order_relaxed);
+  for (size_t position = start; position < start + s_sweptEntries; position++) {
+    auto& entry = d_buckets[(position / s_entriesPerBucket) & d_bucketsMask].d_entries[position % s_entriesPerBucket];
+    const auto key = entry.d_key.load();
+    if (key != 0 && isExpired(entry.d_state.load(std::memory_order_relaxed), nowMS)) {
+      release(entry, key);
+    }
+  }
+}
+
+size_t RateLimitTable::expire(const timespec& cutOff, size_t* scanned)
+{
+  const auto cutOffMS = getMilliseconds(cutOff);
+  size_t removed = 0;
+  size_t lookedAt = 0;
+  for (auto& bucket : d_buckets) {
+    for (auto& entry : bucket.d_entries) {
+      const auto key = entry.d_key.load();
+      if (key == 0) {
+        continue;
+      }
+      ++lookedAt;
+      const auto state = entry.d_state.load(std::memory_order_relaxed);
+      /* a signed difference since the cut-off might be before the creation of the table */
+      if (state != 0 && static_cast<int32_t>(getLastUpdate(state) - cutOffMS) <= 0 && release(entry, key)) {
+        ++removed;
+      }
+    }
+  }
+  if (scanned != nullptr) {
+    *scanned = lookedAt;
+  }
+  return removed;
+}
+
+void RateLimitTable::clear()
+{
+  for (auto& bucket : d_buckets) {
+    for (auto& entry : bucket.d_entries) {
+      entry.d_key.store(0);
+      entry.d_state.store(0, std::memory_order_relaxed);
+    }
+  }
+  d_entriesCount.store(0);
+}
+}
@@ -0,0 +1,182 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "iputils.hh"
+
+namespace dnsdist
+{
+/* Per-client token buckets stored in a flat open-addressing table, updated without
+   any lock. Every entry is 16 bytes: a 64-bit hash of the (truncated) client address,
+   and the bucket itself packed into 64 bits (the time of the last update, in
+   milliseconds, and the remaining tokens as a float), updated with a compare-and-swap.
+   A client can live in one of two buckets of four entries (one cache line each), picked
+   from different bits of its hash, so a lookup touches at most two cache lines.
+   Expired entries are reclaimed when a new client needs a slot in their bucket, and by
+   a sweep advancing a few entries at a time as queries are processed, so there is never
+   a full scan of the table. When both buckets of a new client are full of active entries,
+   the least recently seen one is evicted.
+   The table never grows, so its size should be at least twice the number of clients
+   expected to be tracked at the same time: with 2^21 entries (32 MiB), one million
+   clients keep it under 50% full. */
+class RateLimitTable
+{
+public:
+  RateLimitTable(size_t entries, uint32_t expirationSeconds, bool sweep);
+
+  /* consumes a token from the bucket of that (already truncated) client, returning
+     false if there was none left. 'now' is the real time, usually the time the query was received */
+  bool check(const ComboAddress& client, const timespec& now, unsigned int rate, unsigned int burst)
+  {
+    const auto key = getKey(client);
+    const auto nowMS = getMilliseconds(now);
+    if (d_sweep) {
+      sweepIfNeeded(nowMS);
+    }
+    auto& entry = findOrInsert(key, nowMS);
+    auto state = entry.d_state.load(std::memory_order_relaxed);
+    while (true) {
+      auto tokens = static_cast<float>(burst);
+      if (state != 0) {
+        tokens = getTokens(state);
+        const auto elapsed = getElapsed(state, nowMS);
+        tokens += static_cast<float>(rate) * static_cast<float>(elapsed) / 1000.0F;
+        if (tokens > static_cast<float>(burst)) {
+          tokens = static_cast<float>(burst);
+        }
+      }
+      const bool allowed = tokens >= 1.0F;
+      if (allowed) {
+        tokens -= 1.0F;
+      }
+      /* another thread might have updated the entry with a slightly more recent time */
+      const auto lastUpdate = (state != 0 && getElapsed(state, nowMS) == 0) ? getLastUpdate(state) : nowMS;
+      if (entry.d_state.compare_exchange_weak(state, getState(lastUpdate, tokens), std::memory_order_relaxed)) {
+        return allowed;
+      }
+    }
+  }
+
+  /* removes the entries that have not been seen since 'cutOff', scanning the whole table.
+     'scanned' is set to the number of entries looked at */
+  size_t expire(const timespec& cutOff, size_t* scanned = nullptr);
+  void clear();
+
+  size_t getEntriesCount() const
+  {
+    return d_entriesCount.load();
+  }
+
+  size_t getCapacity() const
+  {
+    return d_buckets.size() * s_entriesPerBucket;
+  }
+
+private:
+  struct Entry
+  {
+    /* 0 means that the entry is free */
+    std::atomic<uint64_t> d_key{0};
+    /* the last update time (high 32 bits) and the remaining tokens (low 32 bits),
+       0 for a bucket that is still full */
+    std::atomic<uint64_t> d_state{0};
+  };
+  static_assert(sizeof(Entry) == 16, "Entries should be packed into 16 bytes");
+
+  static constexpr size_t s_entriesPerBucket{4};
+  static constexpr size_t s_sweptEntries{8};
+  static constexpr uint32_t s_queriesBetweenSweeps{16};
+  static constexpr uint32_t s_maximumSkewMS{1000};
+
+  struct alignas(64) Bucket
+  {
+    std::array<Entry, s_entriesPerBucket> d_entries;
+  };
+
+  static uint64_t getKey(const ComboAddress& client);
+
+  uint32_t getMilliseconds(const timespec& now) const
+  {
+    /* truncated to 32 bits, wrapping every 49 days */
+    return static_cast<uint32_t>((now.tv_sec - d_start.tv_sec) * 1000 + (now.tv_nsec - d_start.tv_nsec) / 1000000);
+  }
+
+  static uint32_t getLastUpdate(uint64_t state)
+  {
+    return static_cast<uint32_t>(state >> 32);
+  }
+
+  static float getTokens(uint64_t state)
+  {
+    float tokens{0};
+    const auto bits = static_cast<uint32_t>(state);
+    memcpy(&tokens, &bits, sizeof(tokens));
+    return tokens;
+  }
+
+  static uint64_t getState(uint32_t lastUpdate, float tokens)
+  {
+    uint32_t bits{0};
+    memcpy(&bits, &tokens, sizeof(bits));
+    const auto state = (static_cast<uint64_t>(lastUpdate) << 32) | bits;
+    /* 0 means a full bucket, use the smallest positive float instead of no token at all */
+    return state != 0 ? state : 1;
+  }
+
+  /* the time elapsed since the last update, as an unsigned difference so that a wrap of
+     the 32-bit clock is fine. Threads do not update entries in the order they got the time,
+     so a last update slightly in the future counts as now. After a larger step back of the
+     real time clock, entries look expired and their clients get a full bucket again */
+  static uint32_t getElapsed(uint64_t state, uint32_t nowMS)
+  {
+    const uint32_t elapsed = nowMS - getLastUpdate(state);
+    if (elapsed > std::numeric_limits<uint32_t>::max() - s_maximumSkewMS) {
+      return 0;
+    }
+    return elapsed;
+  }
+
+  bool isExpired(uint64_t state, uint32_t nowMS) const
+  {
+    return state != 0 && getElapsed(state, nowMS) > d_expirationMS;
+  }
+
+  Entry& findOrInsert(uint64_t key, uint32_t nowMS);
+  void sweepIfNeeded(uint32_t nowMS);
+  bool release(Entry& entry, uint64_t key);
+
+  std::vector<Bucket> d_buckets;
+  timespec d_start{};
+  std::atomic<size_t> d_entriesCount{0};
+  alignas(64) std::atomic<size_t> d_sweepPosition{0};
+  const uint64_t d_bucketsMask;
+  const uint32_t d_expirationMS;
+  const bool d_sweep;
+};
+}
@@ -20,11 +20,14 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <algorithm>
 #include <fstream>
 
 #include "dnsdist-rings.hh"
 
-void Rings::init(size_t capacity, size_t numberOfShards, size_t nbLockRetries, bool recordQueries, bool recordResponses)
+std::atomic<uint64_t> Rings::s_nextInstanceId{0};
+
+void Rings::init(size_t capacity, size_t numberOfShards, size_t nbLockRetries, bool recordQueries, bool recordResponses, size_t perThreadCapacity)
 {
   if (d_initialized.exchange(true)) {
     throw std::runtime_error("Rings::init() should only be called once");
@@ -35,6 +38,7 @@ void Rings::init(size_t capacity, size_t numberOfShards, size_t nbLockRetries, b
   d_nbLockTries = nbLockRetries;
   d_recordQueries = recordQueries;
   d_recordResponses = recordResponses;
+  d_perThreadCapacity = perThreadCapacity;
   if (d_numberOfShards <= 1) {
     d_nbLockTries = 0;
   }
@@ -57,6 +61,203 @@ void Rings::init(size_t capacity, size_t numberOfShards, size_t nbLockRetries, b
   d_nbResponseEntries = 0;
 }
 
+void Rings::CompactName::set(const DNSName& name)
+{
+  const auto& wire = name.getStorage();
+  length = static_cast<uint16_t>(std::min(wire.size(), storage.size()));
+  memcpy(storage.data(), wire.data(), length);
+}
+
+DNSName Rings::CompactName::get() const
+{
+  if (length == 0) {
+    return DNSName();
+  }
+  return DNSName(storage.data(), length, 0, false);
+}
+
+Rings::Query Rings::CompactQuery::toQuery() const
+{
+#if defined(DNSDIST_RINGS_WITH_MACADDRESS)
+  return {requestor, name.get(), when, dh, size, qtype, protocol, macaddress, hasmac};
+#else
+  return {requestor, name.get(), when, dh, size, qtype, protocol};
+#endif
+}
+
+Rings::Response Rings::CompactResponse::toResponse() const
+{
+  return {requestor, ds, name.get(), when, dh, usec, size, qtype, protocol};
+}
+
+void Rings::addObserver(std::shared_ptr<Observer> observer)
+{
+  d_observers.modify([&observer](ObserverList& observers) {
+    observers.push_back(std::move(observer));
+  });
+  d_hasObservers.store(true);
+}
+
+void Rings::removeObserver(const Observer* observer)
+{
+  bool empty = false;
+  d_observers.modify([observer, &empty](ObserverList& observers) {
+    observers.erase(std::remove_if(observers.begin(), observers.end(), [observer](const std::shared_ptr<Observer>& entry) { return entry.get() == observer; }), observers.end());
+    empty = observers.empty();
+  });
+  d_hasObservers.store(!empty);
+}
+
+const Rings::ObserverList& Rings::getObservers()
+{
+  /* keyed by the unique ID of the object, see getPerThreadRings(). Only the generation of the
+     list is checked on every call, the list itself is copied, under a lock, when it has changed */
+  thread_local std::vector<std::pair<uint64_t, LocalStateHolder<ObserverList>>> t_observers;
+  for (auto& [instanceId, observers] : t_observers) {
+    if (instanceId == d_instanceId) {
+      return *observers;
+    }
+  }
+
+  t_observers.emplace_back(d_instanceId, d_observers.getLocal());
+  return *t_observers.back().second;
+}
+
+Rings::PerThreadRings& Rings::getPerThreadRings()
+{
+  /* a thread might record into more than one Rings object (in the unit tests, mostly),
+     so we key the rings by the unique ID of the object */
+  thread_local std::vector<std::pair<uint64_t, std::shared_ptr<PerThreadRings>>> t_perThreadRings;
+  for (const auto& [instanceId, perThread] : t_perThreadRings) {
+    if (instanceId == d_instanceId) {
+      return *perThread;
+    }
+  }
+
+  auto perThread = std::make_shared<PerThreadRings>(shouldRecordQueries() ? d_perThreadCapacity : 1, shouldRecordResponses() ? d_perThreadCapacity : 1);
+  d_perThreadRings.lock()->push_back(perThread);
+  t_perThreadRings.emplace_back(d_instanceId, perThread);
+  return *perThread;
+}
+
+void Rings::insertPerThreadQuery(const struct timespec& when, const ComboAddress& requestor, const DNSName& name, uint16_t qtype, uint16_t size, const struct dnsheader& dh, dnsdist::Protocol protocol)
+{
+  CompactQuery query;
+  query.requestor = requestor;
+  query.name.set(name);
+  query.when = when;
+  query.dh = dh;
+  query.size = size;
+  query.qtype = qtype;
+  query.protocol = protocol;
+#if defined(DNSDIST_RINGS_WITH_MACADDRESS)
+  if (dnsdist::MacAddressesCache::get(requestor, query.macaddress.data(), query.macaddress.size()) == 0) {
+    query.hasmac = true;
+  }
+#endif
+  if (!getPerThreadRings().queries.push(query)) {
+    ++d_droppedQueryInserts;
+  }
+}
+
+void Rings::insertPerThreadResponse(const struct timespec& when, const ComboAddress& requestor, const DNSName& name, uint16_t qtype, unsigned int usec, unsigned int size, const struct dnsheader& dh, const ComboAddress& backend, dnsdist::Protocol protocol)
+{
+  CompactResponse response;
+  response.requestor = requestor;
+  response.ds = backend;
+  response.name.set(name);
+  response.when = when;
+  response.dh = dh;
+  response.usec = usec;
+  response.size = static_cast<uint16_t>(size);
+  response.qtype = qtype;
+  response.protocol = protocol;
+  if (!getPerThreadRings().responses.push(response)) {
+    ++d_droppedResponseInserts;
+  }
+}
+
+/* the entries are converted and passed to the observers before taking the lock of the shard */
+template <typename Compact, typename Entry, typename Converter, typename Notifier>
+static size_t mergeIntoShard(boost::lockfree::spsc_queue<Compact>& queue, LockGuarded<boost::circular_buffer<Entry>>& shardRing, size_t maxEntriesPerBatch, std::atomic<size_t>& nbEntries, pdns::stat_t& overwritten, std::vector<Entry>& batch, Converter convert, Notifier notify)
+{
+  batch.clear();
+  while (batch.size() < maxEntriesPerBatch && queue.consume_one([&](const Compact& entry) {
+    batch.push_back(convert(entry));
+  })) {
+  }
+
+  for (const auto& entry : batch) {
+    notify(entry);
+  }
+
+  auto ring = shardRing.lock();
+  for (auto& entry : batch) {
+    if (ring->full()) {
+      ++overwritten;
+    }
+    else {
+      nbEntries++;
+    }
+    ring->push_back(std::move(entry));
+  }
+  return batch.size();
+}
+
+size_t Rings::mergePerThreadRings()
+{
+  if (!hasPerThreadRings()) {
+    return 0;
+  }
+
+  std::lock_guard<std::mutex> mergeLock(d_mergeMutex);
+  /* take a snapshot of the registered rings so that new threads can register while we merge */
+  auto perThreadRings = *d_perThreadRings.lock();
+  /* cap the number of entries moved while holding a shard lock, so that readers
+     are not kept waiting, and so that the entries of a busy thread get spread over the shards */
+  const size_t maxEntriesPerBatch = std::clamp(d_capacity / d_numberOfShards / 4, static_cast<size_t>(1), static_cast<size_t>(64));
+  /* the observers are notified from here, instead of by the threads recording the entries */
+  const ObserverList* observers = d_hasObservers.load() ? &getObservers() : nullptr;
+  auto notifyQuery = [observers](const Query& query) {
+    if (observers != nullptr) {
+      for (const auto& observer : *observers) {
+        observer->onQuery(query.when, query.requestor, query.name, query.qtype);
+      }
+    }
+  };
+  auto notifyResponse = [observers](const Response& response) {
+    if (observers != nullptr) {
+      const bool cacheHit = response.isACacheHit();
+      for (const auto& observer : *observers) {
+        observer->onResponse(response.when, response.requestor, response.name, response.dh, response.size, cacheHit);
+      }
+    }
+  };
+  std::vector<Query> queriesBatch;
+  std::vector<Response> responsesBatch;
+  queriesBatch.reserve(maxEntriesPerBatch);
+  responsesBatch.reserve(maxEntriesPerBatch);
+
+  size_t merged = 0;
+  for (const auto& perThread : perThreadRings) {
+    while (perThread->queries.read_available() > 0) {
+      auto moved = mergeIntoShard(perThread->queries, getOneShard()->queryRing, maxEntriesPerBatch, d_nbQueryEntries, d_overwrittenQueryEntries, queriesBatch, [](const CompactQuery& entry) { return entry.toQuery(); }, notifyQuery);
+      if (moved == 0) {
+        break;
+      }
+      merged += moved;
+    }
+    while (perThread->responses.read_available() > 0) {
+      auto moved = mergeIntoShard(perThread->responses, getOneShard()->respRing, maxEntriesPerBatch, d_nbResponseEntries, d_overwrittenResponseEntries, responsesBatch, [](const CompactResponse& entry) { return entry.toResponse(); }, notifyResponse);
+      if (moved == 0) {
+        break;
+      }
+      merged += moved;
+    }
+  }
+  return merged;
+}
+
 size_t Rings::numDistinctRequestors()
 {
   std::set<ComboAddress, ComboAddress::addressOnlyLessThan> requestors;
@@ -194,8 +395,13 @@ size_t Rings::loadFromFile(const std::string& filepath, const struct timespec& n
 
 bool Rings::Response::isACacheHit() const
 {
-  bool hit = ds.sin4.sin_family == 0;
-  if (!hit && ds.isIPv4() && ds.sin4.sin_addr.s_addr == 0 && ds.sin4.sin_port == 0) {
+  return isACacheHit(ds);
+}
+
+bool Rings::Response::isACacheHit(const ComboAddress& backend)
+{
+  bool hit = backend.sin4.sin_family == 0;
+  if (!hit && backend.isIPv4() && backend.sin4.sin_addr.s_addr == 0 && backend.sin4.sin_port == 0) {
     hit = true;
   }
   return hit;
@@ -21,15 +21,18 @@
  */
 #pragma once
 
+#include <mutex>
 #include <time.h>
 #include <unordered_map>
 
+#include <boost/lockfree/spsc_queue.hpp>
 #include <boost/variant.hpp>
 
 #include "circular_buffer.hh"
 #include "dnsname.hh"
 #include "iputils.hh"
 #include "lock.hh"
+#include "sholder.hh"
 #include "stat_t.hh"
 #include "dnsdist-protocols.hh"
 #include "dnsdist-mac-address.hh"
@@ -65,6 +68,7 @@ struct Rings
     dnsdist::Protocol protocol;
 
     bool isACacheHit() const;
+    static bool isACacheHit(const ComboAddress& backend);
   };
 
   struct Shard
@@ -73,11 +77,94 @@ struct Rings
     LockGuarded<boost::circular_buffer<Response>> respRing;
   };
 
+  /* fixed-size name in wire format, so that recording an entry into a per-thread ring
+     does not require any allocation */
+  struct CompactName
+  {
+    void set(const DNSName& name);
+    DNSName get() const;
+
+    std::array<char, 255> storage;
+    uint16_t length{0};
+  };
+
+  /* trivially copyable versions of Query and Response, used by the per-thread rings */
+  struct CompactQuery
+  {
+    Query toQuery() const;
+
+    ComboAddress requestor;
+    CompactName name;
+    struct timespec when;
+    struct dnsheader dh;
+    uint16_t size;
+    uint16_t qtype;
+    dnsdist::Protocol protocol;
+#if defined(DNSDIST_RINGS_WITH_MACADDRESS)
+    dnsdist::MacAddress macaddress;
+    bool hasmac{false};
+#endif
+  };
+  struct CompactResponse
+  {
+    Response toResponse() const;
+
+    ComboAddress requestor;
+    ComboAddress ds;
+    CompactName name;
+    struct timespec when;
+    struct dnsheader dh;
+    unsigned int usec;
+    uint16_t size;
+    uint16_t qtype;
+    dnsdist::Protocol protocol;
+  };
+
+  /* one single-producer, single-consumer ring per worker thread, drained into the shards
+     by mergePerThreadRings() */
+  struct PerThreadRings
+  {
+    PerThreadRings(size_t queriesCapacity, size_t responsesCapacity) :
+      queries(queriesCapacity), responses(responsesCapacity)
+    {
+    }
+
+    boost::lockfree::spsc_queue<CompactQuery> queries;
+    boost::lockfree::spsc_queue<CompactResponse> responses;
+  };
+
+  /* notified of every query and response as it is inserted, so that consumers like the
+     incremental counters of dynamic block groups or the heavy hitters tracker do not have
+     to scan the rings. When per-thread rings are used, the observers are instead notified
+     by mergePerThreadRings(), off the path of the queries, and do not see the entries that
+     were dropped because a per-thread ring was full */
+  class Observer
+  {
+  public:
+    virtual ~Observer() = default;
+    virtual void onQuery(const struct timespec& when, const ComboAddress& requestor, const DNSName& name, uint16_t qtype) = 0;
+    virtual void onResponse(const struct timespec& when, const ComboAddress& requestor, const DNSName& name, const struct dnsheader& dh, unsigned int size, bool cacheHit) = 0;
+    /* the content of the rings has been discarded */
+    virtual void onClear() = 0;
+  };
+
+  void addObserver(std::shared_ptr<Observer> observer);
+  void removeObserver(const Observer* observer);
+
   std::unordered_map<int, vector<boost::variant<string, double>>> getTopBandwidth(unsigned int numentries);
   size_t numDistinctRequestors();
 
   /* This function should only be called at configuration time before any query or response has been inserted */
-  void init(size_t capacity, size_t numberOfShards, size_t nbLockRetries = 5, bool recordQueries = true, bool recordResponses = true);
+  void init(size_t capacity, size_t numberOfShards, size_t nbLockRetries = 5, bool recordQueries = true, bool recordResponses = true, size_t perThreadCapacity = 0);
+
+  bool hasPerThreadRings() const
+  {
+    return d_perThreadCapacity > 0;
+  }
+
+  /* move the entries recorded in the per-thread rings, if any, to the shards.
+     Returns the number of entries that have been moved */
+  size_t mergePerThreadRings();
 
   size_t getNumberOfShards() const
   {
@@ -96,6 +183,17 @@ struct Rings
 
   void insertQuery(const struct timespec& when, const ComboAddress& requestor, const DNSName& name, uint16_t qtype, uint16_t size, const struct dnsheader& dh, dnsdist::Protocol protocol)
   {
+    if (hasPerThreadRings()) {
+      insertPerThreadQuery(when, requestor, name, qtype, size, dh, protocol);
+      return;
+    }
+
+    if (d_hasObservers.load(std::memory_order_relaxed)) {
+      for (const auto& observer : getObservers()) {
+        observer->onQuery(when, requestor, name, qtype);
+      }
+    }
+
     auto ourName = DNSName(name);
 #if defined(DNSDIST_RINGS_WITH_MACADDRESS)
     dnsdist::MacAddress macaddress;
@@ -125,6 +223,9 @@ struct Rings
       if (!wasFull) {
         d_nbQueryEntries++;
       }
+      else {
+        ++d_overwrittenQueryEntries;
+      }
       return;
     }
 
@@ -145,10 +246,25 @@ struct Rings
     if (!wasFull) {
       d_nbQueryEntries++;
     }
+    else {
+      ++d_overwrittenQueryEntries;
+    }
   }
 
   void insertResponse(const struct timespec& when, const ComboAddress& requestor, const DNSName& name, uint16_t qtype, unsigned int usec, unsigned int size, const struct dnsheader& dh, const ComboAddress& backend, dnsdist::Protocol protocol)
   {
+    if (hasPerThreadRings()) {
+      insertPerThreadResponse(when, requestor, name, qtype, usec, size, dh, backend, protocol);
+      return;
+    }
+
+    if (d_hasObservers.load(std::memory_order_relaxed)) {
+      const bool cacheHit = Response::isACacheHit(backend);
+      for (const auto& observer : getObservers()) {
+        observer->onResponse(when, requestor, name, dh, size, cacheHit);
+      }
+    }
+
     auto ourName = DNSName(name);
     for (size_t idx = 0; idx < d_nbLockTries; idx++) {
       auto& shard = getOneShard();
@@ -166,6 +282,9 @@ struct Rings
       if (!wasFull) {
         d_nbResponseEntries++;
       }
+      else {
+        ++d_overwrittenResponseEntries;
+      }
       return;
     }
 
@@ -182,10 +301,21 @@ struct Rings
     if (!wasFull) {
       d_nbResponseEntries++;
     }
+    else {
+      ++d_overwrittenResponseEntries;
+    }
   }
 
   void clear()
   {
+    {
+      std::lock_guard<std::mutex> lock(d_mergeMutex);
+      for (const auto& perThread : *d_perThreadRings.lock()) {
+        /* we are the consumer side, so we can safely discard whatever is still pending */
+        perThread->queries.consume_all([](const CompactQuery&) {});
+        perThread->responses.consume_all([](const CompactResponse&) {});
+      }
+    }
     for (auto& shard : d_shards) {
       shard->queryRing.lock()->clear();
       shard->respRing.lock()->clear();
@@ -198,6 +328,14 @@ struct Rings
     d_blockingResponseInserts.store(0);
     d_deferredQueryInserts.store(0);
     d_deferredResponseInserts.store(0);
+    d_droppedQueryInserts.store(0);
+    d_droppedResponseInserts.store(0);
+    d_overwrittenQueryEntries.store(0);
+    d_overwrittenResponseEntries.store(0);
+
+    for (const auto& observer : getObservers()) {
+      observer->onClear();
+    }
   }
 
   /* this should be called in the unit tests, and never at runtime */
@@ -226,8 +364,22 @@ struct Rings
   pdns::stat_t d_blockingResponseInserts{0};
   pdns::stat_t d_deferredQueryInserts{0};
   pdns::stat_t d_deferredResponseInserts{0};
+  /* entries that could not be recorded because the per-thread ring was full */
+  pdns::stat_t d_droppedQueryInserts{0};
+  pdns::stat_t d_droppedResponseInserts{0};
+  /* entries that were evicted from a full shard to make room for a newer one */
+  pdns::stat_t d_overwrittenQueryEntries{0};
+  pdns::stat_t d_overwrittenResponseEntries{0};
 
 private:
+  using ObserverList = std::vector<std::shared_ptr<Observer>>;
+
+  PerThreadRings& getPerThreadRings();
+  /* the current list of observers, as seen by this thread */
+  const ObserverList& getObservers();
+  void insertPerThreadQuery(const struct timespec& when, const ComboAddress& requestor, const DNSName& name, uint16_t qtype, uint16_t size, const struct dnsheader& dh, dnsdist::Protocol protocol);
+  void insertPerThreadResponse(const struct timespec& when, const ComboAddress& requestor, const DNSName& name, uint16_t qtype, unsigned int usec, unsigned int size, const struct dnsheader& dh, const ComboAddress& backend, dnsdist::Protocol protocol);
+
   size_t getShardId()
   {
     return (d_currentShardId++ % d_numberOfShards);
@@ -271,9 +423,21 @@ private:
   std::atomic<size_t> d_currentShardId{0};
   std::atomic<bool> d_initialized{false};
 
+  /* published to the threads recording entries without any lock, see getObservers() */
+  GlobalStateHolder<ObserverList> d_observers;
+  std::atomic<bool> d_hasObservers{false};
+
+  /* every thread that records into this object gets its own ring, registered here */
+  LockGuarded<std::vector<std::shared_ptr<PerThreadRings>>> d_perThreadRings;
+  /* only one merge can run at any given time since it is the consumer side of the per-thread rings */
+  std::mutex d_mergeMutex;
+  const uint64_t d_instanceId{s_nextInstanceId++};
+  static std::atomic<uint64_t> s_nextInstanceId;
+
   size_t d_capacity{10000};
   size_t d_numberOfShards{10};
   size_t d_nbLockTries{5};
+  size_t d_perThreadCapacity{0};
   bool d_recordQueries{true};
   bool d_recordResponses{true};
 };
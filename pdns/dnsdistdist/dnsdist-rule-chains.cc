@@ -20,10 +20,14 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <atomic>
+
 #include "dnsdist-rule-chains.hh"
 
 namespace dnsdist::rules
 {
+static std::atomic<uint64_t> s_generation{0};
+
 static const std::vector<ResponseRuleChainDescription> s_responseRuleChains{
   {"", "response", "response-rules", ResponseRuleChain::ResponseRules},
   {"CacheHit", "cache hit", "cache-hit-response-rules", ResponseRuleChain::CacheHitResponseRules},
@@ -50,6 +54,8 @@ const std::vector<RuleChainDescription>& getRuleChainDescriptions()
 
 std::vector<RuleAction>& getRuleChain(RuleChains& chains, RuleChain chain)
 {
+  /* the caller might be about to modify that chain */
+  chains.d_generation = ++s_generation;
   switch (chain) {
   case RuleChain::Rules:
     return chains.d_ruleActions;
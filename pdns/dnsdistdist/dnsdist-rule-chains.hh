@@ -93,6 +93,9 @@ struct RuleChains
   std::vector<ResponseRuleAction> d_cacheInsertedRespRuleActions;
   std::vector<ResponseRuleAction> d_XFRRespRuleActions;
   std::vector<ResponseRuleAction> d_TimeoutRespRuleActions;
+  /* changed every time the chains are accessed for modification, so that the
+     compiled version of a chain can be reused as long as this value is the same */
+  uint64_t d_generation{0};
 };
 
 const std::vector<RuleChainDescription>& getRuleChainDescriptions();
@@ -31,6 +31,8 @@
 #include "dnsdist-kvs.hh"
 #include "dnsdist-lua.hh"
 #include "dnsdist-lua-ffi.hh"
+#include "dnsdist-lua-per-thread.hh"
+#include "dnsdist-rate-limit-table.hh"
 #include "dnsdist-rules.hh"
 #include "dolog.hh"
 #include "dnsparser.hh"
@@ -46,15 +48,23 @@ using LuaSelectorFFIFunction = std::function<bool(dnsdist_ffi_dnsquestion_t* dq)
 class MaxQPSIPRule : public DNSRule
 {
 public:
-  MaxQPSIPRule(unsigned int qps, unsigned int ipv4trunc = 32, unsigned int ipv6trunc = 64, unsigned int burst = 0, unsigned int expiration = 300, unsigned int cleanupDelay = 60, unsigned int scanFraction = 10, size_t shardsCount = 10) :
-    d_shards(shardsCount), d_qps(qps), d_burst(burst == 0 ? qps : burst), d_ipv4trunc(ipv4trunc), d_ipv6trunc(ipv6trunc), d_cleanupDelay(cleanupDelay), d_expiration(expiration), d_scanFraction(scanFraction)
+  MaxQPSIPRule(unsigned int qps, unsigned int ipv4trunc = 32, unsigned int ipv6trunc = 64, unsigned int burst = 0, unsigned int expiration = 300, unsigned int cleanupDelay = 60, unsigned int scanFraction = 10, size_t shardsCount = 10, size_t tableSize = 0) :
+    d_shards(tableSize == 0 ? shardsCount : 0), d_qps(qps), d_burst(burst == 0 ? qps : burst), d_ipv4trunc(ipv4trunc), d_ipv6trunc(ipv6trunc), d_cleanupDelay(cleanupDelay), d_expiration(expiration), d_scanFraction(scanFraction)
   {
     d_cleaningUp.clear();
     gettime(&d_lastCleanup, true);
+    if (tableSize > 0) {
+      /* expired entries are then reclaimed as we go instead of being cleaned up regularly */
+      d_table = std::make_unique<dnsdist::RateLimitTable>(tableSize, expiration, cleanupDelay > 0);
+    }
   }
 
   void clear()
   {
+    if (d_table) {
+      d_table->clear();
+      return;
+    }
     for (auto& shard : d_shards) {
       shard.lock()->clear();
     }
@@ -62,6 +72,10 @@ public:
 
   size_t cleanup(const struct timespec& cutOff, size_t* scannedCount = nullptr) const
   {
+    if (d_table) {
+      return d_table->expire(cutOff, scannedCount);
+    }
+
     size_t removed = 0;
     if (scannedCount != nullptr) {
       *scannedCount = 0;
@@ -124,11 +138,14 @@ public:
 
   bool matches(const DNSQuestion* dq) const override
   {
-    cleanupIfNeeded(dq->getQueryRealTime());
-
     ComboAddress zeroport(dq->ids.origRemote);
     zeroport.sin4.sin_port = 0;
     zeroport.truncate(zeroport.sin4.sin_family == AF_INET ? d_ipv4trunc : d_ipv6trunc);
+    if (d_table) {
+      return !d_table->check(zeroport, dq->getQueryRealTime(), d_qps, d_burst);
+    }
+
+    cleanupIfNeeded(dq->getQueryRealTime());
     auto hash = ComboAddress::addressOnlyHash()(zeroport);
     auto& shard = d_shards[hash % d_shards.size()];
     {
@@ -151,6 +168,9 @@ public:
 
   size_t getEntriesCount() const
   {
+    if (d_table) {
+      return d_table->getEntriesCount();
+    }
     size_t count = 0;
     for (auto& shard : d_shards) {
       count += shard.lock()->size();
@@ -187,6 +207,8 @@ private:
       sequenced<tag<SequencedTag>>>>;
 
   mutable std::vector<LockGuarded<qpsContainer_t>> d_shards;
+  /* used instead of the shards when a table size has been set */
+  std::unique_ptr<dnsdist::RateLimitTable> d_table;
   mutable struct timespec d_lastCleanup;
   const unsigned int d_qps, d_burst, d_ipv4trunc, d_ipv6trunc, d_cleanupDelay, d_expiration;
   const unsigned int d_scanFraction{10};
@@ -250,6 +272,16 @@ public:
     return ret + d_nmg.toString();
   }
 
+  const NetmaskGroup& getNetmaskGroup() const
+  {
+    return d_nmg;
+  }
+
+  bool isSource() const
+  {
+    return d_src;
+  }
+
 private:
   NetmaskGroup d_nmg;
   bool d_src;
@@ -521,6 +553,8 @@ private:
 
 #if defined(HAVE_RE2)
 #include <re2/re2.h>
+#include <re2/set.h>
+
 class RE2Rule : public DNSRule
 {
 public:
@@ -542,6 +576,64 @@ private:
   RE2 d_re2;
   string d_visual;
 };
+
+/* all the expressions are compiled into a single automaton, so the query name is only
+   scanned once whatever the number of expressions. If a tag name is set, the 1-based
+   index of the first matching expression is stored in that tag */
+class RegexSetRule : public DNSRule
+{
+public:
+  RegexSetRule(const std::vector<std::string>& expressions, const std::string& tagName) :
+    d_set(getOptions(), RE2::ANCHOR_BOTH), d_tagName(tagName), d_count(expressions.size())
+  {
+    for (const auto& expression : expressions) {
+      std::string error;
+      if (d_set.Add(expression, &error) < 0) {
+        throw std::runtime_error("Invalid regular expression '" + expression + "' passed to RegexSetRule" + (error.empty() ? "" : ": " + error));
+      }
+    }
+    if (!d_set.Compile()) {
+      throw std::runtime_error("Unable to compile the " + std::to_string(d_count) + " regular expressions passed to RegexSetRule");
+    }
+  }
+  bool matches(const DNSQuestion* dq) const override
+  {
+    thread_local std::string t_qname;
+    thread_local std::vector<int> t_matched;
+    t_qname.clear();
+    dq->ids.qname.toString(t_qname, ".", false);
+    t_matched.clear();
+    if (!d_set.Match(t_qname, &t_matched) || t_matched.empty()) {
+      return false;
+    }
+    if (!d_tagName.empty()) {
+      const auto first = *std::min_element(t_matched.begin(), t_matched.end());
+      if (!dq->ids.qTag) {
+        dq->ids.qTag = std::make_unique<QTag>();
+      }
+      dq->ids.qTag->insert_or_assign(d_tagName, std::to_string(first + 1));
+    }
+    return true;
+  }
+
+  string toString() const override
+  {
+    return "RE2 set match: " + std::to_string(d_count) + " expressions" + (d_tagName.empty() ? "" : ", tag '" + d_tagName + "'");
+  }
+
+private:
+  static RE2::Options getOptions()
+  {
+    RE2::Options options;
+    options.set_encoding(RE2::Options::EncodingLatin1);
+    options.set_log_errors(false);
+    return options;
+  }
+
+  RE2::Set d_set;
+  std::string d_tagName;
+  size_t d_count;
+};
 #else /* HAVE_RE2 */
 class RE2Rule : public DNSRule
 {
@@ -560,6 +652,24 @@ public:
     return "Unsupported RE2";
   }
 };
+
+class RegexSetRule : public DNSRule
+{
+public:
+  RegexSetRule(const std::vector<std::string>& /* expressions */, const std::string& /* tagName */)
+  {
+    throw std::runtime_error("RE2 support is disabled");
+  }
+  bool matches(const DNSQuestion* /* dq */) const override
+  {
+    return false;
+  }
+
+  string toString() const override
+  {
+    return "Unsupported RE2 set";
+  }
+};
 #endif /* HAVE_RE2 */
 
 class HTTPHeaderRule : public DNSRule
@@ -637,6 +747,11 @@ public:
       return "qname in " + d_smn.toString();
   }
 
+  const SuffixMatchNode& getSuffixMatchNode() const
+  {
+    return d_smn;
+  }
+
 private:
   SuffixMatchNode d_smn;
   bool d_quiet;
@@ -702,6 +817,11 @@ public:
     return "qtype==" + qt.toString();
   }
 
+  uint16_t getQType() const
+  {
+    return d_qtype;
+  }
+
 private:
   uint16_t d_qtype;
 };
@@ -1278,14 +1398,23 @@ private:
 class LuaRule : public DNSRule
 {
 public:
-  LuaRule(const dnsdist::selectors::LuaSelectorFunction& func) :
+  LuaRule(const dnsdist::selectors::LuaSelectorFunction& func, std::optional<std::string> perThreadCode) :
     d_func(func)
-  {}
+  {
+    if (perThreadCode) {
+      d_perThreadFunc.emplace(std::move(*perThreadCode));
+    }
+  }
 
   bool matches(const DNSQuestion* dq) const override
   {
     try {
-      auto lock = g_lua.lock();
+      if (d_perThreadFunc) {
+        const auto* func = d_perThreadFunc->get();
+        /* the function might not have been properly initialized */
+        return func != nullptr && (*func)(dq);
+      }
+      auto lock = dnsdist::lua::lockGlobalState();
       return d_func(dq);
     }
     catch (const std::exception& e) {
@@ -1299,11 +1428,12 @@ public:
 
   string toString() const override
   {
-    return "Lua script";
+    return d_perThreadFunc ? "Lua per-thread script" : "Lua script";
   }
 
 private:
   dnsdist::selectors::LuaSelectorFunction d_func;
+  std::optional<dnsdist::lua::perthread::Function<dnsdist::selectors::LuaSelectorFunction>> d_perThreadFunc;
 };
 
 class LuaFFIRule : public DNSRule
@@ -1317,7 +1447,7 @@ public:
   {
     dnsdist_ffi_dnsquestion_t dqffi(const_cast<DNSQuestion*>(dq));
     try {
-      auto lock = g_lua.lock();
+      auto lock = dnsdist::lua::lockGlobalState();
       return d_func(&dqffi);
     }
     catch (const std::exception& e) {
@@ -1528,10 +1658,11 @@ namespace dnsdist::selectors
 std::shared_ptr<AndRule> getAndSelector(const std::vector<std::shared_ptr<DNSRule>>& rules);
 std::shared_ptr<OrRule> getOrSelector(const std::vector<std::shared_ptr<DNSRule>>& rules);
 std::shared_ptr<NotRule> getNotSelector(const std::shared_ptr<DNSRule>& rule);
-std::shared_ptr<LuaRule> getLuaSelector(const dnsdist::selectors::LuaSelectorFunction& func);
+std::shared_ptr<LuaRule> getLuaSelector(const dnsdist::selectors::LuaSelectorFunction& func, std::optional<std::string> perThreadCode = std::nullopt);
 std::shared_ptr<LuaFFIRule> getLuaFFISelector(const dnsdist::selectors::LuaSelectorFFIFunction& func);
 std::shared_ptr<QNameRule> getQNameSelector(const DNSName& qname);
 std::shared_ptr<QNameSetRule> getQNameSetSelector(const DNSNameSet& qnames);
+std::shared_ptr<RegexSetRule> getRegexSetSelector(const std::vector<std::string>& expressions, const std::string& tagName);
 std::shared_ptr<SuffixMatchNodeRule> getQNameSuffixSelector(const SuffixMatchNode& suffixes, bool quiet);
 std::shared_ptr<QTypeRule> getQTypeSelector(const std::string& qtypeStr, uint16_t qtypeCode);
 std::shared_ptr<QClassRule> getQClassSelector(const std::string& qclassStr, uint16_t qclassCode);
@@ -155,6 +155,11 @@ std::shared_ptr<QNameSetRule> getQNameSetSelector(const DNSNameSet& qnames)
   return std::make_shared<QNameSetRule>(qnames);
 }
 
+std::shared_ptr<RegexSetRule> getRegexSetSelector(const std::vector<std::string>& expressions, const std::string& tagName)
+{
+  return std::make_shared<RegexSetRule>(expressions, tagName);
+}
+
 std::shared_ptr<QNameRule> getQNameSelector(const DNSName& qname)
 {
   return std::make_shared<QNameRule>(qname);
@@ -190,9 +195,9 @@ std::shared_ptr<NotRule> getNotSelector(const std::shared_ptr<DNSRule>& rule)
   return std::make_shared<NotRule>(rule);
 }
 
-std::shared_ptr<LuaRule> getLuaSelector(const dnsdist::selectors::LuaSelectorFunction& func)
+std::shared_ptr<LuaRule> getLuaSelector(const dnsdist::selectors::LuaSelectorFunction& func, std::optional<std::string> perThreadCode)
 {
-  return std::make_shared<LuaRule>(func);
+  return std::make_shared<LuaRule>(func, std::move(perThreadCode));
 }
 
 std::shared_ptr<LuaFFIRule> getLuaFFISelector(const dnsdist::selectors::LuaSelectorFFIFunction& func)
@@ -67,6 +67,12 @@ struct ServerPool
   const ServerPolicy::NumberedServerVector& getServers() const;
   void addServer(std::shared_ptr<DownstreamState>& server);
   void removeServer(std::shared_ptr<DownstreamState>& server);
+  /* not set until the configuration has been sealed, as the hash perturbation might still change */
+  const std::shared_ptr<const ConsistentHashRing>& getHashRing() const
+  {
+    return d_hashRing;
+  }
+  void rebuildHashRing();
   bool isTCPOnly() const
   {
     // coverity[missing_lock]
@@ -80,6 +86,7 @@ private:
   void updateConsistency();
 
   ServerPolicy::NumberedServerVector d_servers;
+  std::shared_ptr<const ConsistentHashRing> d_hashRing{nullptr};
   bool d_useECS{false};
   bool d_zeroScope{true};
   bool d_tcpOnly{false};
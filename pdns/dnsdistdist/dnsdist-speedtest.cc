@@ -0,0 +1,181 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Micro-benchmarks for dnsdist's hot paths, in the spirit of pdns' speedtest.cc.
+   Each test reports the cost of a single operation (query, lookup, ...) in
+   addition to the cost of a run. Code that needs the rest of dnsdist to be
+   linked in, like the backend ID states, is benchmarked from the unit tests
+   instead (see BENCH_ID_STATES in test-dnsdistbackend_cc.cc). */
+
+#include "config.h"
+
+#include <algorithm>
+#include <array>
+#include <iostream>
+#include <vector>
+
+#include <boost/format.hpp>
+
+#include "dnsname.hh"
+#include "dnsname-simd.hh"
+#include "misc.hh"
+
+/* make sure the optimizer does not get too smart */
+static volatile uint64_t g_sink{0};
+
+template <typename C>
+static void doRun(const C& cmd, unsigned int mseconds = 100)
+{
+  CPUTime cpuTime;
+  cpuTime.start();
+  uint64_t runs = 0;
+  double elapsed = 0;
+  do {
+    cmd();
+    runs++;
+    elapsed = static_cast<double>(cpuTime.ndiff()) / 1000.0;
+  } while (elapsed < mseconds * 1000.0);
+
+  const double delta = elapsed / 1000000.0;
+  const double operations = static_cast<double>(runs) * static_cast<double>(cmd.getOperationsPerRun());
+  boost::format fmt("'%s' %.02f seconds: %.1f runs/s, %.02f us/run, %.02f ns/operation");
+  std::cerr << (fmt % cmd.getName() % delta % (runs / delta) % (delta * 1000000.0 / runs) % (delta * 1000000000.0 / operations)) << std::endl;
+}
+
+/* small, fast and good enough PRNG, we do not want to benchmark the random generator */
+class XorShift
+{
+public:
+  XorShift(uint64_t seed) :
+    d_state(seed != 0 ? seed : 0x9E3779B97F4A7C15ULL)
+  {
+  }
+
+  uint64_t next()
+  {
+    d_state ^= d_state << 13;
+    d_state ^= d_state >> 7;
+    d_state ^= d_state << 17;
+    return d_state;
+  }
+
+private:
+  uint64_t d_state;
+};
+
+/* Case-insensitive operations on the wire format of a set of realistic, mixed-case, names:
+   comparing two names (DNSName::operator== and the packet cache's qname check) and ordering
+   labels (SuffixMatchNode lookups), using either the vectorized routines from dnsname-simd.hh
+   or the byte-per-byte versions they replaced */
+struct DNSNameCaseTest
+{
+  enum class Operation : uint8_t
+  {
+    Equals,
+    LabelCompare,
+  };
+
+  DNSNameCaseTest(Operation operation, bool vectorized) :
+    d_operation(operation), d_vectorized(vectorized)
+  {
+    static const std::vector<std::string> labels{"www", "Mail", "api", "CDN-edge-01", "static", "EU-West-1", "images", "s3", "login", "powerdns", "Example", "com", "NET", "org", "co", "uk"};
+    XorShift random(42);
+    d_names.reserve(s_names);
+    d_uppercased.reserve(s_names);
+    for (size_t idx = 0; idx < s_names; idx++) {
+      DNSName name;
+      DNSName uppercased;
+      const auto labelsCount = 2 + (random.next() % 4);
+      for (size_t label = 0; label < labelsCount; label++) {
+        const auto& chosen = labels.at(random.next() % labels.size());
+        name.appendRawLabel(chosen);
+        std::string upper(chosen);
+        std::transform(upper.begin(), upper.end(), upper.begin(), dns_toupper);
+        uppercased.appendRawLabel(upper);
+      }
+      d_names.push_back(name.getStorage());
+      d_uppercased.push_back(uppercased.getStorage());
+      d_labels.push_back(name.getRawLabels());
+    }
+  }
+
+  [[nodiscard]] std::string getName() const
+  {
+    static const std::array<const char*, 2> operations{"qname equality", "label comparison"};
+    return (boost::format("%s, %s") % operations.at(static_cast<uint8_t>(d_operation)) % (d_vectorized ? pdns::dnsname_simd::implementation() : "byte-per-byte")).str();
+  }
+
+  [[nodiscard]] size_t getOperationsPerRun() const
+  {
+    return s_names;
+  }
+
+  void operator()() const
+  {
+    uint64_t result = 0;
+    for (size_t idx = 0; idx < s_names; idx++) {
+      const auto& name = d_names[idx];
+      switch (d_operation) {
+      case Operation::Equals:
+        result += d_vectorized ? pdns::dnsname_simd::iequals(name.data(), d_uppercased[idx].data(), name.size()) : pdns::dnsname_simd::scalar::iequals(name.data(), d_uppercased[idx].data(), name.size());
+        break;
+      case Operation::LabelCompare:
+        /* what SuffixMatchTree does for every node it visits */
+        for (const auto& label : d_labels[idx]) {
+          const auto& other = d_labels[(idx + 1) % s_names].front();
+          if (d_vectorized) {
+            result += pdns::dnsname_simd::icompare(label, other) < 0;
+          }
+          else {
+            result += strncasecmp(label.data(), other.data(), std::min(label.size(), other.size())) < 0;
+          }
+        }
+        break;
+      }
+    }
+    g_sink = g_sink + result;
+  }
+
+private:
+  static constexpr size_t s_names{1000};
+
+  std::vector<DNSName::string_t> d_names;
+  std::vector<DNSName::string_t> d_uppercased;
+  std::vector<std::vector<std::string>> d_labels;
+  Operation d_operation;
+  bool d_vectorized;
+};
+
+int main()
+{
+  try {
+    for (const auto operation : {DNSNameCaseTest::Operation::Equals, DNSNameCaseTest::Operation::LabelCompare}) {
+      doRun(DNSNameCaseTest(operation, false));
+      doRun(DNSNameCaseTest(operation, true));
+    }
+  }
+  catch (const std::exception& e) {
+    std::cerr << "Fatal: " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
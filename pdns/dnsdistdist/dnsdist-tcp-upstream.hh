@@ -10,7 +10,7 @@ class TCPClientThreadData
 {
 public:
   TCPClientThreadData():
-    mplexer(std::unique_ptr<FDMultiplexer>(FDMultiplexer::getMultiplexerSilent()))
+    mplexer(std::unique_ptr<FDMultiplexer>(FDMultiplexer::getMultiplexerSilent(dnsdist::configuration::getImmutableConfiguration().d_tcpMultiplexer)))
   {
   }
 
@@ -1664,6 +1664,9 @@ static void tcpClientThread(pdns::channel::Receiver<ConnectionInfo>&& queryRecei
 
   try {
     TCPClientThreadData data;
+    if (const auto& multiplexer = dnsdist::configuration::getImmutableConfiguration().d_tcpMultiplexer; !multiplexer.empty() && data.mplexer->getName() != multiplexer) {
+      warnlog("The '%s' multiplexer is not available, using '%s' in the TCP worker thread instead", multiplexer, data.mplexer->getName());
+    }
     data.crossProtocolResponseSender = std::move(crossProtocolResponseSender);
     data.queryReceiver = std::move(queryReceiver);
     data.crossProtocolQueryReceiver = std::move(crossProtocolQueryReceiver);
@@ -1864,7 +1867,7 @@ void tcpAcceptorThread(const std::vector<ClientState*>& states)
       acceptNewConnection(*acceptorParam, nullptr);
     };
 
-    auto mplexer = std::unique_ptr<FDMultiplexer>(FDMultiplexer::getMultiplexerSilent(params.size()));
+    auto mplexer = std::unique_ptr<FDMultiplexer>(FDMultiplexer::getMultiplexerSilent(dnsdist::configuration::getImmutableConfiguration().d_tcpMultiplexer, params.size()));
     for (const auto& param : params) {
       mplexer->addReadFD(param.socket, acceptCallback, &param);
     }
@@ -38,6 +38,7 @@
 #include "dnsdist-dynbpf.hh"
 #include "dnsdist-frontend.hh"
 #include "dnsdist-healthchecks.hh"
+#include "dnsdist-heavy-hitters.hh"
 #include "dnsdist-lua.hh"
 #include "dnsdist-metrics.hh"
 #include "dnsdist-prometheus.hh"
@@ -105,6 +106,8 @@ std::map<std::string, MetricDefinition> MetricDefinitionStorage::metrics{
   {"empty-queries", MetricDefinition(PrometheusMetricType::counter, "Number of empty queries received from clients")},
   {"cache-hits", MetricDefinition(PrometheusMetricType::counter, "Number of times an answer was retrieved from cache")},
   {"cache-misses", MetricDefinition(PrometheusMetricType::counter, "Number of times an answer not found in the cache")},
+  {"cache-coalesced-queries", MetricDefinition(PrometheusMetricType::counter, "Number of queries that missed the cache and were parked behind an identical query already in flight")},
+  {"cache-coalesced-failed", MetricDefinition(PrometheusMetricType::counter, "Number of parked queries answered with a ServFail because the identical query in flight failed or was not answered in time")},
   {"cpu-iowait", MetricDefinition(PrometheusMetricType::counter, "Time waiting for I/O to complete by the whole system, in units of USER_HZ")},
   {"cpu-user-msec", MetricDefinition(PrometheusMetricType::counter, "Milliseconds spent by dnsdist in the user state")},
   {"cpu-steal", MetricDefinition(PrometheusMetricType::counter, "Stolen time, which is the time spent by the whole system in other operating systems when running in a virtualized environment, in units of USER_HZ")},
@@ -119,6 +122,8 @@ std::map<std::string, MetricDefinition> MetricDefinitionStorage::metrics{
   {"tcp-query-pipe-full", MetricDefinition(PrometheusMetricType::counter, "Number of TCP queries dropped because the internal pipe used to distribute queries was full")},
   {"tcp-cross-protocol-query-pipe-full", MetricDefinition(PrometheusMetricType::counter, "Number of TCP cross-protocol queries dropped because the internal pipe used to distribute queries was full")},
   {"tcp-cross-protocol-response-pipe-full", MetricDefinition(PrometheusMetricType::counter, "Number of TCP cross-protocol responses dropped because the internal pipe used to distribute queries was full")},
+  {"lua-lock-waits", MetricDefinition(PrometheusMetricType::counter, "Number of times a thread had to wait for the lock on the global Lua state to run a Lua action, selector or load-balancing policy")},
+  {"lua-lock-wait-usec", MetricDefinition(PrometheusMetricType::counter, "Total time spent waiting for the lock on the global Lua state to run a Lua action, selector or load-balancing policy, in microseconds")},
   {"udp-in-errors", MetricDefinition(PrometheusMetricType::counter, "From /proc/net/snmp InErrors")},
   {"udp-noport-errors", MetricDefinition(PrometheusMetricType::counter, "From /proc/net/snmp NoPorts")},
   {"udp-recvbuf-errors", MetricDefinition(PrometheusMetricType::counter, "From /proc/net/snmp RcvbufErrors")},
@@ -131,6 +136,10 @@ std::map<std::string, MetricDefinition> MetricDefinitionStorage::metrics{
   {"udp6-in-csum-errors", MetricDefinition(PrometheusMetricType::counter, "From /proc/net/snmp6 Udp6InCsumErrors")},
   {"tcp-listen-overflows", MetricDefinition(PrometheusMetricType::counter, "From /proc/net/netstat ListenOverflows")},
   {"proxy-protocol-invalid", MetricDefinition(PrometheusMetricType::counter, "Number of queries dropped because of an invalid Proxy Protocol header")},
+  {"rings-dropped-queries", MetricDefinition(PrometheusMetricType::counter, "Number of queries that could not be recorded into the ring buffers because a per-thread ring was full")},
+  {"rings-dropped-responses", MetricDefinition(PrometheusMetricType::counter, "Number of responses that could not be recorded into the ring buffers because a per-thread ring was full")},
+  {"rings-overwritten-queries", MetricDefinition(PrometheusMetricType::counter, "Number of queries evicted from the ring buffers to make room for newer ones")},
+  {"rings-overwritten-responses", MetricDefinition(PrometheusMetricType::counter, "Number of responses evicted from the ring buffers to make room for newer ones")},
 };
 #endif /* DISABLE_PROMETHEUS */
 
@@ -463,6 +472,50 @@ static void addRulesToPrometheusOutput(std::ostringstream& output, const std::ve
   }
 }
 
+/* query names are chosen by clients and may contain characters that are not valid in a label value */
+static std::string escapePrometheusLabelValue(const std::string& value)
+{
+  std::string escaped;
+  escaped.reserve(value.size());
+  for (const auto chr : value) {
+    if (chr == '\\' || chr == '"') {
+      escaped.push_back('\\');
+    }
+    else if (chr == '\n') {
+      escaped.append("\\n");
+      continue;
+    }
+    escaped.push_back(chr);
+  }
+  return escaped;
+}
+
+static void addHeavyHittersToPrometheusOutput(std::ostringstream& output)
+{
+  auto heavyHitters = dnsdist::HeavyHitters::get();
+  if (!heavyHitters) {
+    return;
+  }
+
+  static const size_t maxEntries = 10;
+  auto tops = heavyHitters->getTops(maxEntries);
+  output << "# HELP dnsdist_heavy_hitters_clients " << "Number of queries recently received from the clients (netmasks) sending the most queries, halved every half-life" << "\n";
+  output << "# TYPE dnsdist_heavy_hitters_clients " << "gauge" << "\n";
+  for (const auto& entry : tops.d_clients) {
+    output << "dnsdist_heavy_hitters_clients{client=\"" << entry.key.toString() << "\"} " << entry.count << "\n";
+  }
+  output << "# HELP dnsdist_heavy_hitters_names " << "Number of queries recently received for the most queried name suffixes, halved every half-life" << "\n";
+  output << "# TYPE dnsdist_heavy_hitters_names " << "gauge" << "\n";
+  for (const auto& entry : tops.d_names) {
+    output << "dnsdist_heavy_hitters_names{name=\"" << escapePrometheusLabelValue(entry.key.toString()) << "\"} " << entry.count << "\n";
+  }
+  output << "# HELP dnsdist_heavy_hitters_rcodes " << "Number of responses recently sent for the most frequent response code and name suffix pairs, halved every half-life" << "\n";
+  output << "# TYPE dnsdist_heavy_hitters_rcodes " << "gauge" << "\n";
+  for (const auto& entry : tops.d_rcodes) {
+    output << "dnsdist_heavy_hitters_rcodes{rcode=\"" << RCode::to_short_s(entry.key.d_rcode) << "\",name=\"" << escapePrometheusLabelValue(entry.key.d_name.toString()) << "\"} " << entry.count << "\n";
+  }
+}
+
 static void handlePrometheus(const YaHTTP::Request& req, YaHTTP::Response& resp)
 {
   handleCORS(req, resp);
@@ -919,6 +972,8 @@ static void handlePrometheus(const YaHTTP::Request& req, YaHTTP::Response& resp)
   }
 #endif /* DISABLE_DYNBLOCKS */
 
+  addHeavyHittersToPrometheusOutput(output);
+
   output << "# HELP dnsdist_info " << "Info from dnsdist, value is always 1" << "\n";
   output << "# TYPE dnsdist_info " << "gauge" << "\n";
   output << "dnsdist_info{version=\"" << VERSION << "\"} " << "1" << "\n";
@@ -1717,6 +1772,64 @@ static void handleRings(const YaHTTP::Request& req, YaHTTP::Response& resp)
   resp.headers["Content-Type"] = "application/json";
 }
 
+static void handleHeavyHitters(const YaHTTP::Request& req, YaHTTP::Response& resp)
+{
+  handleCORS(req, resp);
+
+  size_t count = 10;
+  const auto countParam = req.getvars.find("count");
+  if (countParam != req.getvars.end()) {
+    try {
+      count = pdns::checked_stoi<size_t>(countParam->second);
+    }
+    catch (const std::exception& exp) {
+      vinfolog("Error parsing the 'count' value from heavy hitters HTTP GET query: %s", exp.what());
+    }
+  }
+
+  auto heavyHitters = dnsdist::HeavyHitters::get();
+  if (!heavyHitters) {
+    resp.status = 404;
+    return;
+  }
+
+  auto tops = heavyHitters->getTops(count);
+  Json::array clients;
+  for (const auto& entry : tops.d_clients) {
+    clients.emplace_back(Json::object{
+      {"client", entry.key.toString()},
+      {"count", static_cast<double>(entry.count)},
+      {"error", static_cast<double>(entry.error)},
+    });
+  }
+  Json::array names;
+  for (const auto& entry : tops.d_names) {
+    names.emplace_back(Json::object{
+      {"name", entry.key.toString()},
+      {"count", static_cast<double>(entry.count)},
+      {"error", static_cast<double>(entry.error)},
+    });
+  }
+  Json::array rcodes;
+  for (const auto& entry : tops.d_rcodes) {
+    rcodes.emplace_back(Json::object{
+      {"rcode", RCode::to_short_s(entry.key.d_rcode)},
+      {"name", entry.key.d_name.toString()},
+      {"count", static_cast<double>(entry.count)},
+      {"error", static_cast<double>(entry.error)},
+    });
+  }
+
+  resp.status = 200;
+  Json my_json = Json::object{
+    {"clients", std::move(clients)},
+    {"names", std::move(names)},
+    {"rcodes", std::move(rcodes)},
+  };
+  resp.body = my_json.dump();
+  resp.headers["Content-Type"] = "application/json";
+}
+
 using WebHandler = std::function<void(const YaHTTP::Request&, YaHTTP::Response&)>;
 struct WebHandlerContext
 {
@@ -1796,6 +1909,7 @@ void registerBuiltInWebHandlers()
   registerWebHandler("/api/v1/servers/localhost/pool", handlePoolStats);
   registerWebHandler("/api/v1/servers/localhost/statistics", handleStatsOnly);
   registerWebHandler("/api/v1/servers/localhost/rings", handleRings);
+  registerWebHandler("/api/v1/servers/localhost/heavy-hitters", handleHeavyHitters);
 #ifndef DISABLE_WEB_CONFIG
   registerWebHandler("/api/v1/servers/localhost/config", handleConfigDump);
   registerWebHandler("/api/v1/servers/localhost/config/allow-from", handleAllowFrom);
@@ -40,6 +40,8 @@ void XskResponderThread(std::shared_ptr<DownstreamState> dss, std::shared_ptr<Xs
   try {
     setThreadName("dnsdist/XskResp");
     auto pollfds = getPollFdsForWorker(*xskInfo);
+    /* reused for every response, so that we do not need to allocate memory for each packet */
+    PacketBuffer response;
     while (!dss->isStopped()) {
       poll(pollfds.data(), pollfds.size(), -1);
       dnsdist::configuration::refreshLocalRuntimeConfiguration();
@@ -55,17 +57,19 @@ void XskResponderThread(std::shared_ptr<DownstreamState> dss, std::shared_ptr<Xs
           const dnsheader_aligned dnsHeader(packet.getPayloadData());
           const auto queryId = dnsHeader->id;
           auto ids = dss->getState(queryId);
-          if (ids) {
-            if (!ids->isXSK()) {
-              dss->restoreState(queryId, std::move(*ids));
-              ids = std::nullopt;
-            }
-          }
           if (!ids) {
             xskInfo->markAsFree(packet);
             return;
           }
-          auto response = packet.clonePacketBuffer();
+          packet.copyPayloadTo(response);
+          if (!ids->isXSK()) {
+            /* the query was received over a regular socket (or DoH, for example) but the response was
+               routed to us, so the regular responder thread will never see it: process it here, the
+               response is sent over the regular socket of the frontend and the frame can be released */
+            processResponderPacket(dss, response, std::move(*ids));
+            xskInfo->markAsFree(packet);
+            return;
+          }
           if (response.size() > packet.getCapacity()) {
             /* fallback to sending the packet via normal socket */
             ids->xskPacketHeader.clear();
@@ -82,6 +86,8 @@ void XskResponderThread(std::shared_ptr<DownstreamState> dss, std::shared_ptr<Xs
             xskInfo->markAsFree(packet);
             return;
           }
+          /* turn the frame we received from the backend into the response to the client, restoring the
+             headers of the initial query so the frame can go back out without being copied to a new one */
           packet.setHeader(ids->xskPacketHeader);
           if (!packet.setPayload(response)) {
             infolog("Unable to set XSK payload !");
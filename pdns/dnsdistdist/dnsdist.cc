@@ -48,6 +48,7 @@
 #include "dnsdist-async.hh"
 #include "dnsdist-cache.hh"
 #include "dnsdist-carbon.hh"
+#include "dnsdist-compiled-rule-chain.hh"
 #include "dnsdist-configuration.hh"
 #include "dnsdist-configuration-yaml.hh"
 #include "dnsdist-console.hh"
@@ -59,11 +60,14 @@
 #include "dnsdist-edns.hh"
 #include "dnsdist-frontend.hh"
 #include "dnsdist-healthchecks.hh"
+#include "dnsdist-heavy-hitters.hh"
 #include "dnsdist-lua.hh"
 #include "dnsdist-lua-hooks.hh"
+#include "dnsdist-lua-per-thread.hh"
 #include "dnsdist-nghttp2.hh"
 #include "dnsdist-nghttp2-in.hh"
 #include "dnsdist-proxy-protocol.hh"
+#include "dnsdist-query-coalescing.hh"
 #include "dnsdist-random.hh"
 #include "dnsdist-rings.hh"
 #include "dnsdist-rules.hh"
@@ -620,6 +624,11 @@ static size_t getInitialUDPPacketBufferSize(bool expectProxyProtocol)
   return s_initialUDPPacketBufferSize + runtimeConfig.d_proxyProtocolMaximumSize;
 }
 
+size_t getUDPResponseReceiveSize()
+{
+  return getInitialUDPPacketBufferSize(false) + 1;
+}
+
 static size_t getMaximumIncomingPacketSize(const ClientState& clientState)
 {
   if (clientState.dnscryptCtx) {
@@ -695,7 +704,154 @@ static void handleResponseTC4UDPClient(DNSQuestion& dnsQuestion, uint16_t udpPay
   }
 }
 
-static void handleResponseForUDPClient(InternalQueryState& ids, PacketBuffer& response, const std::shared_ptr<DownstreamState>& backend, bool isAsync, bool selfGenerated)
+#if !defined(DISABLE_RECVMMSG) && defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+/* Responses received from a backend in a single recvmmsg() call, waiting to be sent
+   to their clients. Responses are grouped per frontend socket when the batch is flushed
+   so that a single sendmmsg() call is needed per frontend. The packet buffers are NOT
+   copied, so they need to stay valid until flush() has been called. */
+class UDPResponderBatch
+{
+public:
+  UDPResponderBatch(size_t maxSize) :
+    d_entries(maxSize), d_order(maxSize), d_msgs(maxSize)
+  {
+  }
+
+  bool queue(int frontendFD, const PacketBuffer& response, const ComboAddress& from, const ComboAddress& dest)
+  {
+    if (d_queued >= d_entries.size()) {
+      return false;
+    }
+
+    auto& entry = d_entries.at(d_queued);
+    entry.frontendFD = frontendFD;
+    entry.from = from;
+    entry.dest = dest;
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-const-cast,cppcoreguidelines-pro-type-reinterpret-cast): API
+    fillMSGHdr(&entry.msg.msg_hdr, &entry.iov, nullptr, 0, const_cast<char*>(reinterpret_cast<const char*>(response.data())), response.size(), &entry.dest);
+    if (entry.from.sin4.sin_family == 0) {
+      entry.msg.msg_hdr.msg_control = nullptr;
+    }
+    else {
+      addCMsgSrcAddr(&entry.msg.msg_hdr, &entry.cbuf, &entry.from, 0);
+    }
+    d_order.at(d_queued) = d_queued;
+    d_queued++;
+    return true;
+  }
+
+  void flush()
+  {
+    if (d_queued == 0) {
+      return;
+    }
+
+    std::stable_sort(d_order.begin(), d_order.begin() + static_cast<ptrdiff_t>(d_queued), [this](size_t lhs, size_t rhs) {
+      return d_entries.at(lhs).frontendFD < d_entries.at(rhs).frontendFD;
+    });
+
+    for (size_t idx = 0; idx < d_queued; idx++) {
+      d_msgs.at(idx) = d_entries.at(d_order.at(idx)).msg;
+    }
+
+    size_t start = 0;
+    while (start < d_queued) {
+      const int frontendFD = d_entries.at(d_order.at(start)).frontendFD;
+      size_t end = start + 1;
+      while (end < d_queued && d_entries.at(d_order.at(end)).frontendFD == frontendFD) {
+        end++;
+      }
+
+      size_t sentSoFar = start;
+      while (sentSoFar < end) {
+        const auto toSend = static_cast<unsigned int>(end - sentSoFar);
+        int sent = sendmmsg(frontendFD, &d_msgs.at(sentSoFar), toSend, 0);
+        if (sent <= 0) {
+          /* sendmmsg() only reports an error when the first message could not be sent:
+             skip that one so that the responses queued after it still go out */
+          vinfolog("Error sending responses with sendmmsg() (%d on %u): %s", sent, toSend, stringerror());
+          sentSoFar++;
+          continue;
+        }
+        sentSoFar += static_cast<size_t>(sent);
+      }
+
+      start = end;
+    }
+
+    d_queued = 0;
+  }
+
+private:
+  struct Entry
+  {
+    mmsghdr msg{};
+    iovec iov{};
+    ComboAddress from;
+    ComboAddress dest;
+    int frontendFD{-1};
+    cmsgbuf_aligned cbuf{};
+  };
+
+  std::vector<Entry> d_entries;
+  std::vector<size_t> d_order;
+  std::vector<mmsghdr> d_msgs;
+  size_t d_queued{0};
+};
+#else
+class UDPResponderBatch;
+#endif /* !defined(DISABLE_RECVMMSG) && defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE) */
+
+/* send the response we just sent to the client of the leader to the identical queries parked behind it */
+static void answerCoalescedQueries(const InternalQueryState& leader, const PacketBuffer& response, const std::shared_ptr<DownstreamState>& backend)
+{
+  dnsdist::QueryCoalescer::get().answer(leader, backend.get(), response, [&backend](InternalQueryState& ids, PacketBuffer& copy) {
+    DNSResponse dnsResponse(ids, copy, backend);
+    handleResponseTC4UDPClient(dnsResponse, ids.udpPayloadSize, copy);
+
+    dnsheader cleartextDH{};
+    memcpy(&cleartextDH, dnsResponse.getHeader().get(), sizeof(cleartextDH));
+
+    ++dnsdist::metrics::g_stats.responses;
+    ++ids.cs->responses;
+    if (!ids.cs->muted) {
+      sendUDPResponse(ids.cs->udpFD, copy, ids.delayMsec, ids.hopLocal, ids.hopRemote);
+    }
+
+    double udiff = ids.queryRealTime.udiff();
+    vinfolog("Got answer from %s for an identical query, relayed to %s (UDP), took %f us", backend->d_config.remote.toStringWithPort(), ids.origRemote.toStringWithPort(), udiff);
+    handleResponseSent(ids, udiff, ids.origRemote, backend->d_config.remote, copy.size(), cleartextDH, backend->getProtocol(), false);
+  });
+}
+
+/* the leader is considered lost once it would have timed out on that backend */
+static time_t getCoalescingLeaderMaxAge(const DownstreamState& backend)
+{
+  return backend.d_config.udpTimeout > 0 ? backend.d_config.udpTimeout : dnsdist::configuration::getImmutableConfiguration().d_udpTimeout;
+}
+
+static void sendServFailToCoalescedQuery(InternalQueryState& ids, PacketBuffer& response)
+{
+  ++dnsdist::metrics::g_stats.cacheCoalescedFailed;
+  ++dnsdist::metrics::g_stats.responses;
+  ++ids.cs->responses;
+  if (!ids.cs->muted) {
+    sendUDPResponse(ids.cs->udpFD, response, ids.delayMsec, ids.hopLocal, ids.hopRemote);
+  }
+
+  double udiff = ids.queryRealTime.udiff();
+  vinfolog("The query in flight for an identical query failed, sent a ServFail to %s (UDP), took %f us", ids.origRemote.toStringWithPort(), udiff);
+  handleResponseSent(ids, udiff, ids.origRemote, ComboAddress(), response.size(), *dnsheader_aligned(response.data()), dnsdist::Protocol::DoUDP, false);
+}
+
+void handleCoalescingLeaderFailure(const InternalQueryState& leader, const DownstreamState* backend)
+{
+  if (leader.coalescingLeaderID != 0) {
+    dnsdist::QueryCoalescer::get().fail(leader, backend, sendServFailToCoalescedQuery);
+  }
+}
+
+static void handleResponseForUDPClient(InternalQueryState& ids, PacketBuffer& response, const std::shared_ptr<DownstreamState>& backend, bool isAsync, bool selfGenerated, [[maybe_unused]] UDPResponderBatch* batch = nullptr)
 {
   DNSResponse dnsResponse(ids, response, backend);
 
@@ -708,6 +864,8 @@ static void handleResponseForUDPClient(InternalQueryState& ids, PacketBuffer& re
 
   if (!isAsync) {
     if (!processResponse(response, dnsResponse, ids.cs != nullptr && ids.cs->muted)) {
+      /* the response has been dropped, or was invalid */
+      handleCoalescingLeaderFailure(ids, backend.get());
       return;
     }
 
@@ -723,7 +881,15 @@ static void handleResponseForUDPClient(InternalQueryState& ids, PacketBuffer& re
 
   bool muted = true;
   if (ids.cs != nullptr && !ids.cs->muted && !ids.isXSK()) {
-    sendUDPResponse(ids.cs->udpFD, response, dnsResponse.ids.delayMsec, ids.hopLocal, ids.hopRemote);
+    bool queued = false;
+#if !defined(DISABLE_RECVMMSG) && defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+    if (batch != nullptr && dnsResponse.ids.delayMsec == 0) {
+      queued = batch->queue(ids.cs->udpFD, response, ids.hopLocal, ids.hopRemote);
+    }
+#endif /* !defined(DISABLE_RECVMMSG) && defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE) */
+    if (!queued) {
+      sendUDPResponse(ids.cs->udpFD, response, dnsResponse.ids.delayMsec, ids.hopLocal, ids.hopRemote);
+    }
     muted = false;
   }
 
@@ -742,15 +908,18 @@ static void handleResponseForUDPClient(InternalQueryState& ids, PacketBuffer& re
     }
 
     handleResponseSent(ids, udiff, dnsResponse.ids.origRemote, backend->d_config.remote, response.size(), cleartextDH, backend->getProtocol(), true);
+
+    if (ids.coalescingLeaderID != 0) {
+      answerCoalescedQueries(ids, response, backend);
+    }
   }
   else {
     handleResponseSent(ids, 0., dnsResponse.ids.origRemote, ComboAddress(), response.size(), cleartextDH, dnsdist::Protocol::DoUDP, false);
   }
 }
 
-bool processResponderPacket(std::shared_ptr<DownstreamState>& dss, PacketBuffer& response, InternalQueryState&& ids)
+static bool processResponderPacket(std::shared_ptr<DownstreamState>& dss, PacketBuffer& response, InternalQueryState&& ids, UDPResponderBatch* batch)
 {
-
   const dnsheader_aligned dnsHeader(response.data());
   auto queryId = dnsHeader->id;
 
@@ -769,6 +938,7 @@ bool processResponderPacket(std::shared_ptr<DownstreamState>& dss, PacketBuffer&
   double udiff = ids.queryRealTime.udiff();
   // do that _before_ the processing, otherwise it's not fair to the backend
   dss->latencyUsec = (127.0 * dss->latencyUsec / 128.0) + udiff / 128.0;
+  dss->updatePolicyLatency(udiff);
   dss->reportResponse(dnsHeader->rcode);
 
   /* don't call processResponse for DOH */
@@ -780,15 +950,216 @@ bool processResponderPacket(std::shared_ptr<DownstreamState>& dss, PacketBuffer&
     return false;
   }
 
-  handleResponseForUDPClient(ids, response, dss, false, false);
+  handleResponseForUDPClient(ids, response, dss, false, false, batch);
   return true;
 }
 
+bool processResponderPacket(std::shared_ptr<DownstreamState>& dss, PacketBuffer& response, InternalQueryState&& ids)
+{
+  return processResponderPacket(dss, response, std::move(ids), nullptr);
+}
+
+static void sendXSKResponse([[maybe_unused]] InternalQueryState& ids, [[maybe_unused]] const PacketBuffer& response)
+{
+#ifdef HAVE_XSK
+  auto& xskInfo = ids.cs->xskInfoResponder;
+  auto xskPacket = xskInfo->getEmptyFrame();
+  if (!xskPacket) {
+    return;
+  }
+  xskPacket->setHeader(ids.xskPacketHeader);
+  if (!xskPacket->setPayload(response)) {
+  }
+  if (ids.delayMsec > 0) {
+    xskPacket->addDelay(ids.delayMsec);
+  }
+  xskPacket->updatePacket();
+  xskInfo->pushToSendQueue(*xskPacket);
+  xskInfo->notifyXskSocket();
+#endif /* HAVE_XSK */
+}
+
+#if !defined(DISABLE_RECVMMSG) && defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+/* same as the regular responder thread, except that responses are read from
+   each backend socket in batches via recvmmsg(), and the corresponding responses
+   sent to the clients in batches via sendmmsg() */
+static void multipleMessagesResponderThread(std::shared_ptr<DownstreamState>& dss)
+{
+  struct MMReceiver
+  {
+    PacketBuffer packet;
+    iovec iov{};
+  };
+  const size_t vectSize = dss->d_config.d_responderBatchSize;
+  const size_t initialBufferSize = getInitialUDPPacketBufferSize(false);
+  auto recvData = std::vector<MMReceiver>(vectSize);
+  auto msgVec = std::vector<mmsghdr>(vectSize);
+  UDPResponderBatch batch(vectSize);
+  uint16_t queryId = 0;
+  std::vector<int> sockets;
+  sockets.reserve(dss->sockets.size());
+
+  for (;;) {
+    try {
+      if (dss->isStopped()) {
+        break;
+      }
+
+      if (!dss->connected) {
+        /* see responderThread() */
+        dss->waitUntilConnected();
+        continue;
+      }
+
+      dss->pickSocketsReadyForReceiving(sockets);
+
+      if (dss->isStopped()) {
+        break;
+      }
+
+      for (const auto& sockDesc : sockets) {
+        for (size_t idx = 0; idx < vectSize; idx++) {
+          auto& receiver = recvData.at(idx);
+          /* allocate one more byte so we can detect truncation */
+          // NOLINTNEXTLINE(bugprone-use-after-move): resizing a vector has no preconditions so it is valid to do so after moving it
+          receiver.packet.resize(initialBufferSize + 1);
+          receiver.iov.iov_base = receiver.packet.data();
+          receiver.iov.iov_len = receiver.packet.size();
+          auto& msgHdr = msgVec.at(idx).msg_hdr;
+          msgHdr = msghdr{};
+          msgHdr.msg_iov = &receiver.iov;
+          msgHdr.msg_iovlen = 1;
+        }
+
+        /* block until we have at least one message ready, but return
+           as many as possible to save the syscall costs */
+        int msgsGot = recvmmsg(sockDesc, msgVec.data(), vectSize, MSG_WAITFORONE, nullptr);
+        if (msgsGot <= 0) {
+          if (dss->isStopped()) {
+            break;
+          }
+          continue;
+        }
+
+        dnsdist::configuration::refreshLocalRuntimeConfiguration();
+
+        for (int msgIdx = 0; msgIdx < msgsGot; msgIdx++) {
+          auto& response = recvData.at(msgIdx).packet;
+          const size_t got = msgVec.at(msgIdx).msg_len;
+
+          if (got == 0 && dss->isStopped()) {
+            break;
+          }
+
+          if (got < sizeof(dnsheader) || got == (initialBufferSize + 1)) {
+            continue;
+          }
+
+          response.resize(got);
+          const dnsheader_aligned dnsHeader(response.data());
+          queryId = dnsHeader->id;
+
+          auto ids = dss->getState(queryId);
+          if (!ids) {
+            continue;
+          }
+
+          if (!ids->isXSK() && sockDesc != ids->backendFD) {
+            dss->restoreState(queryId, std::move(*ids));
+            continue;
+          }
+
+          if (processResponderPacket(dss, response, std::move(*ids), &batch) && ids->isXSK() && ids->cs->xskInfoResponder) {
+            sendXSKResponse(*ids, response);
+          }
+        }
+
+        /* the queued responses are still pointing to our receive buffers,
+           so they need to be sent before we can read again */
+        batch.flush();
+      }
+    }
+    catch (const std::exception& e) {
+      batch.flush();
+      vinfolog("Got an error in UDP responder thread while parsing a response from %s, id %d: %s", dss->d_config.remote.toStringWithPort(), queryId, e.what());
+    }
+  }
+}
+#endif /* !defined(DISABLE_RECVMMSG) && defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE) */
+
+/* the multiplexer reads the responses for us, saving the readiness check and the recv() call per response */
+static void receiveThroughMultiplexerResponderThread(std::shared_ptr<DownstreamState>& dss)
+{
+  const size_t receiveSize = getUDPResponseReceiveSize();
+  PacketBuffer response;
+  uint16_t queryId = 0;
+  std::vector<FDMultiplexer::ReceivedData> received;
+
+  for (;;) {
+    try {
+      if (dss->isStopped()) {
+        break;
+      }
+
+      if (!dss->connected) {
+        /* see responderThread() */
+        dss->waitUntilConnected();
+        continue;
+      }
+
+      dss->receiveResponses(received);
+
+      if (dss->isStopped()) {
+        break;
+      }
+
+      for (const auto& entry : received) {
+        if (entry.d_size < sizeof(dnsheader) || entry.d_size == receiveSize) {
+          continue;
+        }
+
+        // NOLINTNEXTLINE(bugprone-use-after-move): assigning to a vector has no preconditions so it is valid to do so after moving it
+        response.assign(entry.d_data, entry.d_data + entry.d_size); // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic): we need the end of the received data
+        const dnsheader_aligned dnsHeader(response.data());
+        queryId = dnsHeader->id;
+
+        auto ids = dss->getState(queryId);
+        if (!ids) {
+          continue;
+        }
+
+        if (!ids->isXSK() && entry.d_fd != ids->backendFD) {
+          dss->restoreState(queryId, std::move(*ids));
+          continue;
+        }
+
+        dnsdist::configuration::refreshLocalRuntimeConfiguration();
+        if (processResponderPacket(dss, response, std::move(*ids)) && ids->isXSK() && ids->cs->xskInfoResponder) {
+          sendXSKResponse(*ids, response);
+        }
+      }
+    }
+    catch (const std::exception& e) {
+      vinfolog("Got an error in UDP responder thread while parsing a response from %s, id %d: %s", dss->d_config.remote.toStringWithPort(), queryId, e.what());
+    }
+  }
+}
+
 // listens on a dedicated socket, lobs answers from downstream servers to original requestors
 void responderThread(std::shared_ptr<DownstreamState> dss)
 {
   try {
     setThreadName("dnsdist/respond");
+    if (dss->receivesThroughMultiplexer()) {
+      receiveThroughMultiplexerResponderThread(dss);
+      return;
+    }
+#if !defined(DISABLE_RECVMMSG) && defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+    if (dss->d_config.d_responderBatchSize > 1) {
+      multipleMessagesResponderThread(dss);
+      return;
+    }
+#endif /* !defined(DISABLE_RECVMMSG) && defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE) */
     const size_t initialBufferSize = getInitialUDPPacketBufferSize(false);
     /* allocate one more byte so we can detect truncation */
     PacketBuffer response(initialBufferSize + 1);
@@ -849,22 +1220,7 @@ void responderThread(std::shared_ptr<DownstreamState> dss)
 
           dnsdist::configuration::refreshLocalRuntimeConfiguration();
           if (processResponderPacket(dss, response, std::move(*ids)) && ids->isXSK() && ids->cs->xskInfoResponder) {
-#ifdef HAVE_XSK
-            auto& xskInfo = ids->cs->xskInfoResponder;
-            auto xskPacket = xskInfo->getEmptyFrame();
-            if (!xskPacket) {
-              continue;
-            }
-            xskPacket->setHeader(ids->xskPacketHeader);
-            if (!xskPacket->setPayload(response)) {
-            }
-            if (ids->delayMsec > 0) {
-              xskPacket->addDelay(ids->delayMsec);
-            }
-            xskPacket->updatePacket();
-            xskInfo->pushToSendQueue(*xskPacket);
-            xskInfo->notifyXskSocket();
-#endif /* HAVE_XSK */
+            sendXSKResponse(*ids, response);
           }
         }
       }
@@ -1021,8 +1377,9 @@ bool processRulesResult(const DNSAction::Action& action, DNSQuestion& dnsQuestio
   return false;
 }
 
-static bool applyRulesChainToQuery(const std::vector<dnsdist::rules::RuleAction>& rules, DNSQuestion& dnsQuestion)
+static bool applyRulesChainToQuery(const dnsdist::rules::RuleChains& chains, dnsdist::rules::RuleChain chain, DNSQuestion& dnsQuestion)
 {
+  const auto& rules = dnsdist::rules::getRuleChain(chains, chain);
   if (rules.empty()) {
     return true;
   }
@@ -1031,6 +1388,21 @@ static bool applyRulesChainToQuery(const std::vector<dnsdist::rules::RuleAction>
   string ruleresult;
   bool drop = false;
 
+  if (const auto* compiled = dnsdist::rules::getCompiledRuleChain(chains, chain); compiled != nullptr && compiled->getRulesCount() == rules.size()) {
+    dnsdist::rules::CompiledRuleChain::Matches matches(*compiled, rules, dnsQuestion);
+    while (auto position = matches.next()) {
+      const auto& rule = rules[*position];
+      rule.d_rule->d_matches++;
+      action = (*rule.d_action)(&dnsQuestion, &ruleresult);
+      if (processRulesResult(action, dnsQuestion, ruleresult, drop)) {
+        break;
+      }
+      matches.refresh();
+    }
+
+    return !drop;
+  }
+
   for (const auto& rule : rules) {
     if (!rule.d_rule->matches(&dnsQuestion)) {
       continue;
@@ -1062,7 +1434,7 @@ static bool applyRulesToQuery(DNSQuestion& dnsQuestion, const timespec& now)
       string qname = dnsQuestion.ids.qname.toLogString();
       bool countQuery{true};
       if (runtimeConfig.d_queryCountConfig.d_filter) {
-        auto lock = g_lua.lock();
+        auto lock = dnsdist::lua::lockGlobalState();
         std::tie(countQuery, qname) = runtimeConfig.d_queryCountConfig.d_filter(&dnsQuestion);
       }
 
@@ -1238,8 +1610,7 @@ static bool applyRulesToQuery(DNSQuestion& dnsQuestion, const timespec& now)
 #endif /* DISABLE_DYNBLOCKS */
 
   const auto& chains = dnsdist::configuration::getCurrentRuntimeConfiguration().d_ruleChains;
-  const auto& queryRules = dnsdist::rules::getRuleChain(chains, dnsdist::rules::RuleChain::Rules);
-  return applyRulesChainToQuery(queryRules, dnsQuestion);
+  return applyRulesChainToQuery(chains, dnsdist::rules::RuleChain::Rules, dnsQuestion);
 }
 
 ssize_t udpClientSendRequestToBackend(const std::shared_ptr<DownstreamState>& backend, const int socketDesc, const PacketBuffer& request, bool healthCheck)
@@ -1586,9 +1957,8 @@ ProcessQueryResult processQueryAfterRules(DNSQuestion& dnsQuestion, std::shared_
       // coverity[auto_causes_copy]
       const auto existingPool = dnsQuestion.ids.poolName;
       const auto& chains = dnsdist::configuration::getCurrentRuntimeConfiguration().d_ruleChains;
-      const auto& cacheMissRuleActions = dnsdist::rules::getRuleChain(chains, dnsdist::rules::RuleChain::CacheMissRules);
 
-      if (!applyRulesChainToQuery(cacheMissRuleActions, dnsQuestion)) {
+      if (!applyRulesChainToQuery(chains, dnsdist::rules::RuleChain::CacheMissRules, dnsQuestion)) {
         return ProcessQueryResult::Drop;
       }
       if (dnsQuestion.getHeader()->qr) { // something turned it into a response
@@ -1734,9 +2104,10 @@ public:
     return handleResponse(now, std::move(response));
   }
 
-  void notifyIOError([[maybe_unused]] const struct timeval& now, [[maybe_unused]] TCPResponse&& response) override
+  void notifyIOError([[maybe_unused]] const struct timeval& now, TCPResponse&& response) override
   {
-    // nothing to do
+    /* the client will not get an answer, but the identical queries parked behind that one can */
+    handleCoalescingLeaderFailure(response.d_idstate, response.d_ds.get());
   }
 };
 
@@ -1841,6 +2212,7 @@ bool assignOutgoingUDPQueryToBackend(std::shared_ptr<DownstreamState>& downstrea
     }
     catch (const std::exception& e) {
       vinfolog("Adding proxy protocol payload to %s query from %s failed: %s", (dnsQuestion.ids.du ? "DoH" : ""), dnsQuestion.ids.origDest.toStringWithPort(), e.what());
+      handleCoalescingLeaderFailure(dnsQuestion.ids, downstream.get());
       return false;
     }
   }
@@ -1883,6 +2255,7 @@ bool assignOutgoingUDPQueryToBackend(std::shared_ptr<DownstreamState>& downstrea
       auto cleared = downstream->getState(idOffset);
       if (cleared) {
         dnsQuestion.ids.du = std::move(cleared->du);
+        handleCoalescingLeaderFailure(*cleared, downstream.get());
       }
       ++dnsdist::metrics::g_stats.downstreamSendErrors;
       ++downstream->sendErrors;
@@ -2024,6 +2397,18 @@ static void processUDPQuery(ClientState& clientState, const struct msghdr* msgh,
       return;
     }
 
+    if (dnsdist::QueryCoalescer::isEligible(ids)) {
+      ids.origID = dnsHeader->id;
+      /* only used if the query is parked, since the response will then not be tailored to it */
+      ids.udpPayloadSize = udpPayloadSize;
+      auto coalesced = dnsdist::QueryCoalescer::get().park(ids, backend.get(), ids.packetCache->getMaximumCoalescedQueries(), time(nullptr), getCoalescingLeaderMaxAge(*backend));
+      if (coalesced == dnsdist::QueryCoalescer::Result::Parked) {
+        ++dnsdist::metrics::g_stats.cacheCoalescedQueries;
+        return;
+      }
+      ids.udpPayloadSize = 0;
+    }
+
     if (backend->isTCPOnly()) {
       std::string proxyProtocolPayload;
       /* we need to do this _before_ creating the cross protocol query because
@@ -2070,7 +2455,12 @@ bool XskProcessQuery(ClientState& clientState, XskPacket& packet)
       return false;
     }
 
-    auto query = packet.clonePacketBuffer();
+    /* reused for every query processed by this thread so that we do not allocate memory for each packet:
+       the payload is copied out of the frame into this buffer and processed there. It is copied back into the
+       frame we received it in when we answer directly, or when the backend is reached over XSK as well */
+    thread_local PacketBuffer t_query;
+    auto& query = t_query;
+    packet.copyPayloadTo(query);
     std::vector<ProxyProtocolValue> proxyProtocolValues;
     if (expectProxyProtocol && !handleProxyProtocol(remote, false, dnsdist::configuration::getCurrentRuntimeConfiguration().d_ACL, query, ids.origRemote, ids.origDest, proxyProtocolValues)) {
       return false;
@@ -2422,6 +2812,9 @@ static void maintThread()
       }
     }
 
+    /* identical queries parked behind one that has not been answered in time */
+    dnsdist::QueryCoalescer::get().expire(time(nullptr), sendServFailToCoalescedQuery);
+
     counter++;
     if (counter >= dnsdist::configuration::getCurrentRuntimeConfiguration().d_cacheCleaningDelay) {
       /* keep track, for each cache, of whether we should keep
@@ -2477,6 +2870,16 @@ static void dynBlockMaintenanceThread()
 }
 #endif
 
+static void ringsMergeThread()
+{
+  setThreadName("dnsdist/ringMrg");
+
+  for (;;) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    g_rings.mergePerThreadRings();
+  }
+}
+
 #ifndef DISABLE_SECPOLL
 static void secPollThread()
 {
@@ -2985,6 +3388,10 @@ void doExitNicely(int exitCode)
   }
 #endif
 
+  if (exitCode == EXIT_SUCCESS) {
+    dnsdist::cache::saveSnapshotsOnExit();
+  }
+
   {
     auto lock = g_lua.lock();
     dnsdist::lua::hooks::runExitCallbacks(*lock);
@@ -3665,6 +4072,8 @@ int main(int argc, char** argv)
     }
 
     dnsdist::configuration::setImmutableConfigurationDone();
+    /* now that the hash perturbation is known */
+    dnsdist::lbpolicies::rebuildHashRings();
 
     {
       const auto& immutableConfig = dnsdist::configuration::getImmutableConfiguration();
@@ -3680,7 +4089,16 @@ int main(int argc, char** argv)
 
     {
       const auto& config = dnsdist::configuration::getImmutableConfiguration();
-      g_rings.init(config.d_ringsCapacity, config.d_ringsNumberOfShards, config.d_ringsNbLockTries, config.d_ringsRecordQueries, config.d_ringsRecordResponses);
+      g_rings.init(config.d_ringsCapacity, config.d_ringsNumberOfShards, config.d_ringsNbLockTries, config.d_ringsRecordQueries, config.d_ringsRecordResponses, config.d_ringsPerThreadBufferSize);
+      if (config.d_heavyHittersCapacity > 0) {
+        dnsdist::HeavyHitters::Settings settings;
+        settings.d_capacity = config.d_heavyHittersCapacity;
+        settings.d_halfLife = config.d_heavyHittersHalfLife;
+        settings.d_v4Mask = config.d_heavyHittersMaskV4;
+        settings.d_v6Mask = config.d_heavyHittersMaskV6;
+        settings.d_suffixLabels = config.d_heavyHittersSuffixLabels;
+        dnsdist::HeavyHitters::init(settings);
+      }
     }
 
     for (const auto& frontend : dnsdist::getFrontends()) {
@@ -3818,6 +4236,11 @@ int main(int argc, char** argv)
 
     thread healththread(healthChecksThread);
 
+    if (g_rings.hasPerThreadRings()) {
+      thread ringsMergeThreadHandle(ringsMergeThread);
+      ringsMergeThreadHandle.detach();
+    }
+
 #ifndef DISABLE_DYNBLOCKS
     thread dynBlockMaintThread(dynBlockMaintenanceThread);
     dynBlockMaintThread.detach();
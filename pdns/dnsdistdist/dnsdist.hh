@@ -568,6 +568,8 @@ struct DownstreamState : public std::enable_shared_from_this<DownstreamState>
     std::array<uint8_t, 6> destMACAddr;
 #endif /* HAVE_XSK */
     size_t d_numberOfSockets{1};
+    /* number of responses read (recvmmsg) and sent (sendmmsg) at once by the responder thread, 1 means no batching */
+    size_t d_responderBatchSize{1};
     size_t d_maxInFlightQueriesPerConn{1};
     size_t d_tcpConcurrentConnectionsLimit{0};
     int order{1};
@@ -689,7 +691,7 @@ struct DownstreamState : public std::enable_shared_from_this<DownstreamState>
   LockGuarded<std::unique_ptr<FDMultiplexer>> mplexer{nullptr};
 
 private:
-  LockGuarded<std::map<uint16_t, IDState>> d_idStatesMap;
+  /* one slot per possible ID, claimed and released without a shared lock, see IDState */
   vector<IDState> idStates;
 
   struct LazyHealthCheckStats
@@ -720,6 +722,9 @@ public:
   size_t socketsOffset{0};
   double latencyUsec{0.0};
   double latencyUsecTCP{0.0};
+  /* faster moving average of the latency over all protocols, including timeouts and errors,
+     used by the powerOfTwoLatency policy and updated without locking from the responder threads */
+  std::atomic<double> d_policyLatencyUsec{0.0};
   unsigned int d_nextCheck{0};
   uint16_t currentCheckFailures{0};
   std::atomic<bool> hashesComputed{false};
@@ -730,6 +735,8 @@ private:
   void handleUDPTimeout(IDState& ids);
   void updateNextLazyHealthCheck(LazyHealthCheckStats& stats, bool checkScheduled, std::optional<time_t> currentTime = std::nullopt);
   void connectUDPSockets();
+  void addSocketToMultiplexer(int fd);
+  void removeSocketFromMultiplexer(int fd);
 #ifdef HAVE_XSK
   void addXSKDestination(int fd);
   void removeXSKDestination(int fd);
@@ -737,6 +744,8 @@ private:
 
   std::mutex connectLock;
   std::condition_variable d_connectedWait;
+  /* the multiplexer reads the responses for us, set before the responder thread is started */
+  bool d_receiveThroughMultiplexer{false};
 #ifdef HAVE_XSK
   SharedLockGuarded<std::vector<ComboAddress>> d_socketSourceAddresses;
 #endif
@@ -780,6 +789,7 @@ public:
     if (!newStatus) {
       latencyUsec = 0.0;
       latencyUsecTCP = 0.0;
+      d_policyLatencyUsec.store(0.0, std::memory_order_relaxed);
     }
   }
   void setDown()
@@ -787,6 +797,7 @@ public:
     d_config.d_availability = Availability::Down;
     latencyUsec = 0.0;
     latencyUsecTCP = 0.0;
+    d_policyLatencyUsec.store(0.0, std::memory_order_relaxed);
   }
   void setAuto()
   {
@@ -858,6 +869,17 @@ public:
   void updateTCPLatency(double udiff)
   {
     latencyUsecTCP = (127.0 * latencyUsecTCP / 128.0) + udiff / 128.0;
+    updatePolicyLatency(udiff);
+  }
+
+  void updatePolicyLatency(double udiff)
+  {
+    auto current = d_policyLatencyUsec.load(std::memory_order_relaxed);
+    double updated{0.0};
+    do {
+      /* the first sample is taken as is, then we move by 1/16th of the difference */
+      updated = current == 0.0 ? udiff : current + ((udiff - current) / 16.0);
+    } while (!d_policyLatencyUsec.compare_exchange_weak(current, updated, std::memory_order_relaxed));
   }
 
   void incQueriesCount()
@@ -888,6 +910,12 @@ public:
   bool passCrossProtocolQuery(std::unique_ptr<CrossProtocolQuery>&& cpq);
   int pickSocketForSending();
   void pickSocketsReadyForReceiving(std::vector<int>& ready);
+  /* only when the responses are received through the multiplexer, see receivesThroughMultiplexer() */
+  void receiveResponses(std::vector<FDMultiplexer::ReceivedData>& received);
+  [[nodiscard]] bool receivesThroughMultiplexer() const
+  {
+    return d_receiveThroughMultiplexer;
+  }
   void handleUDPTimeouts();
   void reportTimeoutOrError();
   void reportResponse(uint8_t rcode);
@@ -928,6 +956,8 @@ public:
 };
 
 void responderThread(std::shared_ptr<DownstreamState> dss);
+/* one more byte than the largest response we accept from a backend over UDP, to detect truncation */
+size_t getUDPResponseReceiveSize();
 
 enum ednsHeaderFlags
 {
@@ -978,5 +1008,7 @@ ssize_t udpClientSendRequestToBackend(const std::shared_ptr<DownstreamState>& ba
 bool sendUDPResponse(int origFD, const PacketBuffer& response, const int delayMsec, const ComboAddress& origDest, const ComboAddress& origRemote);
 void handleResponseSent(const DNSName& qname, const QType& qtype, double udiff, const ComboAddress& client, const ComboAddress& backend, unsigned int size, const dnsheader& cleartextDH, dnsdist::Protocol outgoingProtocol, dnsdist::Protocol incomingProtocol, bool fromBackend);
 void handleResponseSent(const InternalQueryState& ids, double udiff, const ComboAddress& client, const ComboAddress& backend, unsigned int size, const dnsheader& cleartextDH, dnsdist::Protocol outgoingProtocol, bool fromBackend);
+/* answer the queries parked behind that one, if any, with a ServFail since it will not be answered */
+void handleCoalescingLeaderFailure(const InternalQueryState& leader, const DownstreamState* backend);
 bool handleTimeoutResponseRules(const std::vector<dnsdist::rules::ResponseRuleAction>& rules, InternalQueryState& ids, const std::shared_ptr<DownstreamState>& ds, const std::shared_ptr<TCPQuerySender>& sender);
 void handleServerStateChange(const std::string& nameWithAddr, bool newResult);
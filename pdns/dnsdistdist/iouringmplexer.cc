@@ -0,0 +1 @@
+../iouringmplexer.cc
\ No newline at end of file
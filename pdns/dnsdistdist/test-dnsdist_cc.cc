@@ -74,6 +74,12 @@ bool handleTimeoutResponseRules(const std::vector<dnsdist::rules::ResponseRuleAc
   return false;
 }
 
+void handleCoalescingLeaderFailure(const InternalQueryState& leader, const DownstreamState* backend)
+{
+  (void)leader;
+  (void)backend;
+}
+
 void handleServerStateChange(const string& nameWithAddr, bool newResult)
 {
   (void)nameWithAddr;
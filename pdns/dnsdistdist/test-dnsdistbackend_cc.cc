@@ -5,9 +5,101 @@
 
 #define BOOST_TEST_NO_MAIN
 
+#include <set>
+
 #include <boost/test/unit_test.hpp>
 
 #include "dnsdist.hh"
+#include "dnsdist-configuration.hh"
+#include "dnsdist-random.hh"
+
+#if BENCH_ID_STATES
+#include <map>
+#include <thread>
+
+#include "lock.hh"
+
+/* the lock-protected map previously used by DownstreamState for randomized IDs,
+   kept as a baseline for the per-slot ID states */
+class LockedMapIDStates
+{
+public:
+  uint16_t saveState(InternalQueryState&& state)
+  {
+    size_t remainingAttempts = 5;
+    auto map = d_map.lock();
+    do {
+      uint16_t selectedID = dnsdist::getRandomValue(std::numeric_limits<uint16_t>::max());
+      auto [it, inserted] = map->emplace(selectedID, IDState());
+      if (!inserted && --remainingAttempts > 0) {
+        continue;
+      }
+      it->second.internal = std::move(state);
+      it->second.age.store(0);
+      return it->first;
+    } while (true);
+  }
+
+  std::optional<InternalQueryState> getState(uint16_t queryID)
+  {
+    std::optional<InternalQueryState> result = std::nullopt;
+    auto map = d_map.lock();
+    auto it = map->find(queryID);
+    if (it == map->end()) {
+      return result;
+    }
+    result = std::move(it->second.internal);
+    map->erase(it);
+    return result;
+  }
+
+private:
+  LockGuarded<std::map<uint16_t, IDState>> d_map;
+};
+#endif /* BENCH_ID_STATES */
+
+/* N listener threads saving query states while one responder thread retrieves them,
+   the way the UDP listeners and the responder thread of a backend do */
+template <class T>
+static void benchIDStates(T& states, const std::string& name, size_t listeners)
+{
+#if BENCH_ID_STATES
+  const size_t queriesPerListener = 1000000;
+  std::atomic<size_t> remainingListeners{listeners};
+  std::vector<std::thread> threads;
+  threads.reserve(listeners);
+
+  StopWatch stopWatch;
+  stopWatch.start();
+  for (size_t idx = 0; idx < listeners; idx++) {
+    threads.emplace_back([&states, &remainingListeners]() {
+      for (size_t count = 0; count < queriesPerListener; count++) {
+        InternalQueryState ids;
+        ids.origID = static_cast<uint16_t>(count);
+        states.saveState(std::move(ids));
+      }
+      --remainingListeners;
+    });
+  }
+
+  uint64_t found = 0;
+  while (remainingListeners.load() > 0) {
+    auto ids = states.getState(static_cast<uint16_t>(dnsdist::getRandomValue(std::numeric_limits<uint16_t>::max())));
+    if (ids) {
+      found++;
+    }
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  const auto elapsed = stopWatch.udiff();
+  cerr << name << ", " << listeners << " listener(s): " << std::to_string(elapsed) << " us for " << listeners * queriesPerListener << " queries, " << std::to_string(elapsed * 1000.0 / static_cast<double>(listeners * queriesPerListener)) << " ns/query, " << found << " responses retrieved" << endl;
+#else
+  (void)states;
+  (void)name;
+  (void)listeners;
+#endif /* BENCH_ID_STATES */
+}
 
 BOOST_AUTO_TEST_SUITE(dnsdistbackend_cc)
 
@@ -323,4 +415,63 @@ BOOST_AUTO_TEST_CASE(test_CheckAutoRestorePreviousHealthCheckMode)
   BOOST_CHECK(downstream.d_config.d_healthCheckMode == DownstreamState::HealthCheckMode::Active);
 }
 
+BOOST_AUTO_TEST_CASE(test_IDStates)
+{
+  for (const bool randomize : {false, true}) {
+    dnsdist::configuration::updateImmutableConfiguration([randomize](dnsdist::configuration::ImmutableConfiguration& config) {
+      config.d_randomizeIDsToBackend = randomize;
+    });
+
+    DownstreamState::Config config;
+    /* a UDP socket is needed for the ID states to be allocated, but nothing is sent */
+    config.remote = ComboAddress("127.0.0.1:53");
+    DownstreamState downstream(std::move(config), nullptr, true);
+    BOOST_CHECK_EQUAL(downstream.outstanding.load(), 0U);
+
+    std::vector<uint16_t> ids;
+    for (uint16_t origID = 0; origID < 1000; origID++) {
+      InternalQueryState state;
+      state.origID = origID;
+      ids.push_back(downstream.saveState(std::move(state)));
+      if (!randomize) {
+        BOOST_CHECK_EQUAL(ids.back(), origID);
+      }
+    }
+    std::set<uint16_t> distinct(ids.begin(), ids.end());
+    BOOST_CHECK_EQUAL(downstream.outstanding.load(), distinct.size());
+
+    for (uint16_t origID = 0; origID < 1000; origID++) {
+      const auto selectedID = ids.at(origID);
+      if (std::count(ids.begin(), ids.end(), selectedID) > 1) {
+        /* a randomized ID was picked twice, the first state was reused */
+        continue;
+      }
+      auto state = downstream.getState(selectedID);
+      BOOST_REQUIRE(state);
+      BOOST_CHECK_EQUAL(state->origID, origID);
+      /* a state can only be retrieved once */
+      BOOST_CHECK(!downstream.getState(selectedID));
+    }
+
+    /* out of range, only the sequential mode does not cover the whole ID space */
+    if (!randomize) {
+      BOOST_CHECK(!downstream.getState(static_cast<uint16_t>(dnsdist::configuration::getImmutableConfiguration().d_maxUDPOutstanding)));
+    }
+
+    for (const size_t listeners : {1, 2, 4, 8}) {
+      benchIDStates(downstream, randomize ? "randomized IDs" : "sequential IDs", listeners);
+#if BENCH_ID_STATES
+      if (randomize) {
+        LockedMapIDStates lockedMap;
+        benchIDStates(lockedMap, "randomized IDs, locked map", listeners);
+      }
+#endif /* BENCH_ID_STATES */
+    }
+  }
+
+  dnsdist::configuration::updateImmutableConfiguration([](dnsdist::configuration::ImmutableConfiguration& config) {
+    config.d_randomizeIDsToBackend = false;
+  });
+}
+
 BOOST_AUTO_TEST_SUITE_END()
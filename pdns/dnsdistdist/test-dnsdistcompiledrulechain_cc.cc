@@ -0,0 +1,219 @@
+
+#ifndef BOOST_TEST_DYN_LINK
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+#include "dnsdist.hh"
+#include "dnsdist-compiled-rule-chain.hh"
+#include "dnsdist-rules-factory.hh"
+
+#if BENCH_RULE_CHAINS
+#include "gettime.hh"
+#endif /* BENCH_RULE_CHAINS */
+
+BOOST_AUTO_TEST_SUITE(dnsdistcompiledrulechain_cc)
+
+static InternalQueryState getQueryState(const DNSName& qname, uint16_t qtype, const ComboAddress& remote)
+{
+  InternalQueryState ids;
+  ids.origDest = ComboAddress("127.0.0.1:53");
+  ids.origRemote = remote;
+  ids.qname = qname;
+  ids.qtype = qtype;
+  ids.qclass = QClass::IN;
+  ids.protocol = dnsdist::Protocol::DoUDP;
+  return ids;
+}
+
+static std::vector<size_t> getLinearMatches(const std::vector<dnsdist::rules::RuleAction>& rules, const DNSQuestion& dnsQuestion)
+{
+  std::vector<size_t> result;
+  for (size_t idx = 0; idx < rules.size(); idx++) {
+    if (rules.at(idx).d_rule->matches(&dnsQuestion)) {
+      result.push_back(idx);
+    }
+  }
+  return result;
+}
+
+static std::vector<size_t> getCompiledMatches(const dnsdist::rules::CompiledRuleChain& compiled, const std::vector<dnsdist::rules::RuleAction>& rules, const DNSQuestion& dnsQuestion)
+{
+  std::vector<size_t> result;
+  dnsdist::rules::CompiledRuleChain::Matches matches(compiled, rules, dnsQuestion);
+  while (auto position = matches.next()) {
+    result.push_back(*position);
+  }
+  return result;
+}
+
+static void addRule(std::vector<dnsdist::rules::RuleAction>& rules, std::shared_ptr<DNSRule> rule)
+{
+  rules.push_back({std::move(rule), nullptr, "", getUniqueID(), rules.size()});
+}
+
+/* one out of five rules cannot be merged, and another one is a destination NetmaskGroupRule, unless 'mergeableOnly' is set */
+static std::vector<dnsdist::rules::RuleAction> getRules(size_t count, bool mergeableOnly = false)
+{
+  std::vector<dnsdist::rules::RuleAction> rules;
+  for (size_t idx = 0; idx < count; idx++) {
+    switch (mergeableOnly ? idx % 3 : idx % 5) {
+    case 0: {
+      SuffixMatchNode smn;
+      smn.add(DNSName("domain-" + std::to_string(idx % 50) + ".example."));
+      smn.add(DNSName("sub.domain-" + std::to_string((idx + 7) % 50) + ".example."));
+      addRule(rules, std::make_shared<SuffixMatchNodeRule>(smn));
+      break;
+    }
+    case 1: {
+      NetmaskGroup nmg;
+      nmg.addMask("192.0." + std::to_string(idx % 4) + ".0/24");
+      nmg.addMask("10.0.0.0/8");
+      nmg.addMask("10." + std::to_string(idx % 8) + ".0.0/16", false);
+      addRule(rules, std::make_shared<NetmaskGroupRule>(nmg, true));
+      break;
+    }
+    case 2:
+      addRule(rules, std::make_shared<QTypeRule>(idx % 3 == 0 ? QType::AAAA : QType::TXT));
+      break;
+    case 3:
+      addRule(rules, std::make_shared<QNameRule>(DNSName("domain-" + std::to_string(idx % 50) + ".example.")));
+      break;
+    default: {
+      NetmaskGroup nmg;
+      nmg.addMask("127.0.0.0/8");
+      /* destination address, cannot be merged */
+      addRule(rules, std::make_shared<NetmaskGroupRule>(nmg, idx % 2 == 0));
+      break;
+    }
+    }
+  }
+  return rules;
+}
+
+BOOST_AUTO_TEST_CASE(test_SameMatchesAsLinearChain)
+{
+  auto rules = getRules(200);
+  {
+    /* the root matches everything */
+    SuffixMatchNode smn;
+    smn.add(g_rootdnsname);
+    addRule(rules, std::make_shared<SuffixMatchNodeRule>(smn));
+  }
+  const dnsdist::rules::CompiledRuleChain compiled(rules);
+  BOOST_CHECK_EQUAL(compiled.getRulesCount(), rules.size());
+  /* every rule but the QNameRule and destination NetmaskGroupRule ones */
+  BOOST_CHECK_EQUAL(compiled.getIndexedRulesCount(), 141U);
+
+  const std::vector<ComboAddress> remotes{ComboAddress("192.0.2.1"), ComboAddress("192.0.1.1"), ComboAddress("10.1.2.3"), ComboAddress("10.42.2.3"), ComboAddress("198.51.100.1"), ComboAddress("2001:db8::1")};
+  PacketBuffer packet(sizeof(dnsheader));
+  size_t total = 0;
+  for (size_t idx = 0; idx < 60; idx++) {
+    const DNSName qname(idx % 2 == 0 ? "www.sub.domain-" + std::to_string(idx) + ".example." : "domain-" + std::to_string(idx) + ".example.");
+    for (const auto& remote : remotes) {
+      for (const auto qtype : {QType::A, QType::AAAA, QType::TXT}) {
+        auto ids = getQueryState(qname, qtype, remote);
+        DNSQuestion dnsQuestion(ids, packet);
+        auto expected = getLinearMatches(rules, dnsQuestion);
+        auto got = getCompiledMatches(compiled, rules, dnsQuestion);
+        BOOST_CHECK_EQUAL_COLLECTIONS(got.begin(), got.end(), expected.begin(), expected.end());
+        total += got.size();
+      }
+    }
+  }
+  BOOST_CHECK_GT(total, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(test_Refresh)
+{
+  std::vector<dnsdist::rules::RuleAction> rules;
+  SuffixMatchNode first;
+  first.add(DNSName("first.example."));
+  addRule(rules, std::make_shared<SuffixMatchNodeRule>(first));
+  addRule(rules, std::make_shared<QTypeRule>(QType::A));
+  SuffixMatchNode second;
+  second.add(DNSName("second.example."));
+  addRule(rules, std::make_shared<SuffixMatchNodeRule>(second));
+  const dnsdist::rules::CompiledRuleChain compiled(rules);
+
+  PacketBuffer packet(sizeof(dnsheader));
+  auto ids = getQueryState(DNSName("www.first.example."), QType::AAAA, ComboAddress("192.0.2.1"));
+  DNSQuestion dnsQuestion(ids, packet);
+  dnsdist::rules::CompiledRuleChain::Matches matches(compiled, rules, dnsQuestion);
+  auto position = matches.next();
+  BOOST_REQUIRE(position);
+  BOOST_CHECK_EQUAL(*position, 0U);
+
+  /* an action altered the query, the next rules have to be evaluated against the new qname and qtype */
+  dnsQuestion.ids.qname = DNSName("www.second.example.");
+  dnsQuestion.ids.qtype = QType::A;
+  matches.refresh();
+  position = matches.next();
+  BOOST_REQUIRE(position);
+  BOOST_CHECK_EQUAL(*position, 1U);
+  position = matches.next();
+  BOOST_REQUIRE(position);
+  BOOST_CHECK_EQUAL(*position, 2U);
+  BOOST_CHECK(!matches.next());
+}
+
+BOOST_AUTO_TEST_CASE(test_CompileThreshold)
+{
+  auto rules = getRules(10);
+  BOOST_CHECK(dnsdist::rules::CompiledRuleChain::compile(rules) == nullptr);
+  BOOST_CHECK(dnsdist::rules::CompiledRuleChain::compile(rules, 1) != nullptr);
+
+  dnsdist::rules::RuleChains chains;
+  auto& chain = dnsdist::rules::getRuleChain(chains, dnsdist::rules::RuleChain::Rules);
+  chain = getRules(100);
+  const auto* compiled = dnsdist::rules::getCompiledRuleChain(chains, dnsdist::rules::RuleChain::Rules);
+  BOOST_REQUIRE(compiled != nullptr);
+  BOOST_CHECK_EQUAL(compiled->getRulesCount(), 100U);
+  /* not modified, same compiled chain */
+  const auto& constChains = chains;
+  BOOST_CHECK(dnsdist::rules::getCompiledRuleChain(constChains, dnsdist::rules::RuleChain::Rules) == compiled);
+  /* modified */
+  dnsdist::rules::getRuleChain(chains, dnsdist::rules::RuleChain::Rules).resize(50);
+  compiled = dnsdist::rules::getCompiledRuleChain(chains, dnsdist::rules::RuleChain::Rules);
+  BOOST_REQUIRE(compiled != nullptr);
+  BOOST_CHECK_EQUAL(compiled->getRulesCount(), 50U);
+}
+
+#if BENCH_RULE_CHAINS
+BOOST_AUTO_TEST_CASE(bench_RuleChains)
+{
+  /* cost of going through a whole chain, as when no action stops the processing, for an increasing number of rules */
+  PacketBuffer packet(sizeof(dnsheader));
+  std::vector<InternalQueryState> states;
+  for (size_t idx = 0; idx < 1000; idx++) {
+    states.push_back(getQueryState(DNSName("www.domain-" + std::to_string(idx % 100) + ".example."), idx % 2 == 0 ? QType::A : QType::AAAA, ComboAddress("192.0." + std::to_string(idx % 8) + ".1")));
+  }
+
+  for (const bool mergeableOnly : {false, true}) {
+    for (const size_t count : {10, 100, 1000, 10000}) {
+      const auto rules = getRules(count, mergeableOnly);
+      const dnsdist::rules::CompiledRuleChain compiled(rules);
+      size_t matched = 0;
+      StopWatch stopWatch;
+      stopWatch.start();
+      for (auto& ids : states) {
+        DNSQuestion dnsQuestion(ids, packet);
+        matched += getLinearMatches(rules, dnsQuestion).size();
+      }
+      const auto linear = stopWatch.udiff();
+      stopWatch.start();
+      for (auto& ids : states) {
+        DNSQuestion dnsQuestion(ids, packet);
+        matched += getCompiledMatches(compiled, rules, dnsQuestion).size();
+      }
+      const auto merged = stopWatch.udiff();
+      cerr << count << (mergeableOnly ? " mergeable" : " mixed") << " rules: " << static_cast<uint64_t>(linear * 1000 / states.size()) << " ns/query linear, " << static_cast<uint64_t>(merged * 1000 / states.size()) << " ns/query compiled (" << matched / 2 << " matches)" << endl;
+    }
+  }
+}
+#endif /* BENCH_RULE_CHAINS */
+
+BOOST_AUTO_TEST_SUITE_END()
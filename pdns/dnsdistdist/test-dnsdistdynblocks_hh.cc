@@ -1208,6 +1208,263 @@ BOOST_FIXTURE_TEST_CASE(test_DynBlockRulesGroup_Ranges, TestFixture) {
 
 }
 
+BOOST_FIXTURE_TEST_CASE(test_DynBlockRulesGroup_Incremental_QueryRate, TestFixture) {
+  dnsheader dnsHeader{};
+  memset(&dnsHeader, 0, sizeof(dnsHeader));
+  DNSName qname("rings.powerdns.com.");
+  ComboAddress requestor1("192.0.2.1");
+  ComboAddress requestor2("192.0.2.2");
+  uint16_t qtype = QType::AAAA;
+  uint16_t size = 42;
+  dnsdist::Protocol protocol = dnsdist::Protocol::DoUDP;
+  struct timespec now;
+  gettime(&now);
+
+  size_t numberOfSeconds = 10;
+  size_t blockDuration = 60;
+  const auto action = DNSAction::Action::Drop;
+  const std::string reason = "Exceeded query rate";
+
+  DynBlockRulesGroup dbrg;
+  dbrg.setQuiet(true);
+  /* enabled before the rules are set, the counters should not be discarded when they are */
+  dbrg.setIncremental(true);
+  BOOST_CHECK(dbrg.isIncremental());
+
+  {
+    /* block above 50 qps for numberOfSeconds seconds, no warning */
+    DynBlockRulesGroup::DynBlockRule rule(reason, blockDuration, 50, 0, numberOfSeconds, action);
+    dbrg.setQueryRate(std::move(rule));
+  }
+
+  {
+    /* insert 45 qps from a given client in the last 10s
+       this should not trigger the rule */
+    size_t numberOfQueries = 45 * numberOfSeconds;
+    g_rings.clear();
+    dnsdist::DynamicBlocks::clearClientAddressDynamicRules();
+
+    for (size_t idx = 0; idx < numberOfQueries; idx++) {
+      g_rings.insertQuery(now, requestor1, qname, qtype, size, dnsHeader, protocol);
+    }
+
+    dbrg.apply(now);
+    BOOST_CHECK_EQUAL(dnsdist::DynamicBlocks::getClientAddressDynamicRules().size(), 0U);
+  }
+
+  {
+    /* insert more queries than the rings can hold, from a given client over the last 10s:
+       the rings are overwritten but the counters are not, so this should trigger the rule */
+    size_t numberOfQueries = 1500;
+    g_rings.clear();
+    dnsdist::DynamicBlocks::clearClientAddressDynamicRules();
+
+    for (size_t timeIdx = 0; timeIdx < numberOfSeconds; timeIdx++) {
+      for (size_t idx = 0; idx < numberOfQueries; idx++) {
+        struct timespec when = now;
+        when.tv_sec -= static_cast<time_t>(9 - timeIdx);
+        g_rings.insertQuery(when, requestor1, qname, qtype, size, dnsHeader, protocol);
+      }
+    }
+    BOOST_CHECK_LT(g_rings.getNumberOfQueryEntries(), numberOfQueries * numberOfSeconds);
+
+    dbrg.apply(now);
+    BOOST_CHECK_EQUAL(dnsdist::DynamicBlocks::getClientAddressDynamicRules().size(), 1U);
+    BOOST_REQUIRE(dnsdist::DynamicBlocks::getClientAddressDynamicRules().lookup(requestor1) != nullptr);
+    BOOST_CHECK(dnsdist::DynamicBlocks::getClientAddressDynamicRules().lookup(requestor2) == nullptr);
+    const auto& block = dnsdist::DynamicBlocks::getClientAddressDynamicRules().lookup(requestor1)->second;
+    BOOST_CHECK_EQUAL(block.reason, reason);
+    BOOST_CHECK_EQUAL(static_cast<size_t>(block.until.tv_sec), now.tv_sec + blockDuration);
+    BOOST_CHECK(block.action == action);
+  }
+
+  {
+    /* 100 qps from a given client in the last 10s, then the same checks as the ring-based test */
+    size_t numberOfQueries = 100;
+    g_rings.clear();
+    dnsdist::DynamicBlocks::clearClientAddressDynamicRules();
+
+    for (size_t timeIdx = 0; timeIdx < numberOfSeconds; timeIdx++) {
+      for (size_t idx = 0; idx < numberOfQueries; idx++) {
+        struct timespec when = now;
+        when.tv_sec -= static_cast<time_t>(9 - timeIdx);
+        g_rings.insertQuery(when, requestor1, qname, qtype, size, dnsHeader, protocol);
+      }
+    }
+
+    dbrg.apply(now);
+    BOOST_CHECK_EQUAL(dnsdist::DynamicBlocks::getClientAddressDynamicRules().size(), 1U);
+    dnsdist::DynamicBlocks::clearClientAddressDynamicRules();
+
+    /* 100 qps over 5s then 0 qps over 5s is more than 50 qps over 10s */
+    struct timespec later = now;
+    later.tv_sec += 5;
+    dbrg.apply(later);
+    BOOST_CHECK_EQUAL(dnsdist::DynamicBlocks::getClientAddressDynamicRules().size(), 1U);
+    dnsdist::DynamicBlocks::clearClientAddressDynamicRules();
+
+    /* 100 qps over 4s then 0 qps over 6s is not */
+    later = now;
+    later.tv_sec += 6;
+    dbrg.apply(later);
+    BOOST_CHECK_EQUAL(dnsdist::DynamicBlocks::getClientAddressDynamicRules().size(), 0U);
+
+    /* 20s in the future the client has not been seen during the whole window, and is forgotten */
+    later = now;
+    later.tv_sec += 20;
+    dbrg.apply(later);
+    BOOST_CHECK_EQUAL(dnsdist::DynamicBlocks::getClientAddressDynamicRules().size(), 0U);
+  }
+
+  dbrg.setIncremental(false);
+  BOOST_CHECK(!dbrg.isIncremental());
+}
+
+BOOST_FIXTURE_TEST_CASE(test_DynBlockRulesGroup_Incremental_QTypeRCode, TestFixture) {
+  dnsheader dnsHeader{};
+  memset(&dnsHeader, 0, sizeof(dnsHeader));
+  DNSName qname("rings.powerdns.com.");
+  ComboAddress requestor1("192.0.2.1");
+  ComboAddress requestor2("192.0.2.2");
+  ComboAddress backend("192.0.2.42");
+  uint16_t size = 42;
+  dnsdist::Protocol protocol = dnsdist::Protocol::DoUDP;
+  dnsdist::Protocol outgoingProtocol = dnsdist::Protocol::DoUDP;
+  unsigned int responseTime = 100 * 1000; /* 100ms */
+  struct timespec now;
+  gettime(&now);
+
+  time_t numberOfSeconds = 10;
+  unsigned int blockDuration = 60;
+  const auto action = DNSAction::Action::Drop;
+
+  DynBlockRulesGroup dbrg;
+  dbrg.setQuiet(true);
+  {
+    /* block above 5 ANY qps, and above a 0.2 ServFail/Total ratio with at least 51 responses */
+    DynBlockRulesGroup::DynBlockRule rule("Exceeded ANY rate", blockDuration, 5, 0, numberOfSeconds, action);
+    dbrg.setQTypeRate(QType::ANY, std::move(rule));
+    DynBlockRulesGroup::DynBlockRatioRule ratioRule("Exceeded ServFail ratio", blockDuration, 0.2, 0.0, numberOfSeconds, action, 51);
+    dbrg.setRCodeRatio(RCode::ServFail, std::move(ratioRule));
+  }
+  dbrg.setIncremental(true);
+
+  {
+    /* 100 ANY and 100 AAAA queries from requestor1, only AAAA ones from requestor2 */
+    g_rings.clear();
+    dnsdist::DynamicBlocks::clearClientAddressDynamicRules();
+
+    for (size_t idx = 0; idx < 100; idx++) {
+      g_rings.insertQuery(now, requestor1, qname, QType::ANY, size, dnsHeader, protocol);
+      g_rings.insertQuery(now, requestor1, qname, QType::AAAA, size, dnsHeader, protocol);
+      g_rings.insertQuery(now, requestor2, qname, QType::AAAA, size, dnsHeader, protocol);
+    }
+
+    dbrg.apply(now);
+    BOOST_CHECK_EQUAL(dnsdist::DynamicBlocks::getClientAddressDynamicRules().size(), 1U);
+    BOOST_REQUIRE(dnsdist::DynamicBlocks::getClientAddressDynamicRules().lookup(requestor1) != nullptr);
+    BOOST_CHECK_EQUAL(dnsdist::DynamicBlocks::getClientAddressDynamicRules().lookup(requestor1)->second.reason, "Exceeded ANY rate");
+    BOOST_CHECK(dnsdist::DynamicBlocks::getClientAddressDynamicRules().lookup(requestor2) == nullptr);
+  }
+
+  {
+    /* clearing the rings discards the counters as well */
+    g_rings.clear();
+    dnsdist::DynamicBlocks::clearClientAddressDynamicRules();
+    dbrg.apply(now);
+    BOOST_CHECK_EQUAL(dnsdist::DynamicBlocks::getClientAddressDynamicRules().size(), 0U);
+  }
+
+  {
+    /* 20 ServFails and 80 NoErrors for requestor1, 21 ServFails and 79 NoErrors for requestor2 */
+    g_rings.clear();
+    dnsdist::DynamicBlocks::clearClientAddressDynamicRules();
+
+    for (size_t idx = 0; idx < 100; idx++) {
+      dnsHeader.rcode = idx < 20 ? RCode::ServFail : RCode::NoError;
+      g_rings.insertResponse(now, requestor1, qname, QType::AAAA, responseTime, size, dnsHeader, backend, outgoingProtocol);
+      dnsHeader.rcode = idx < 21 ? RCode::ServFail : RCode::NoError;
+      g_rings.insertResponse(now, requestor2, qname, QType::AAAA, responseTime, size, dnsHeader, backend, outgoingProtocol);
+    }
+
+    dbrg.apply(now);
+    BOOST_CHECK_EQUAL(dnsdist::DynamicBlocks::getClientAddressDynamicRules().size(), 1U);
+    BOOST_CHECK(dnsdist::DynamicBlocks::getClientAddressDynamicRules().lookup(requestor1) == nullptr);
+    BOOST_REQUIRE(dnsdist::DynamicBlocks::getClientAddressDynamicRules().lookup(requestor2) != nullptr);
+    BOOST_CHECK_EQUAL(dnsdist::DynamicBlocks::getClientAddressDynamicRules().lookup(requestor2)->second.reason, "Exceeded ServFail ratio");
+  }
+}
+
+BOOST_FIXTURE_TEST_CASE(test_DynBlockRulesGroup_Incremental_MaxClients, TestFixture) {
+  dnsheader dnsHeader{};
+  memset(&dnsHeader, 0, sizeof(dnsHeader));
+  DNSName qname("rings.powerdns.com.");
+  ComboAddress requestor1("192.0.2.1");
+  ComboAddress requestor2("192.0.2.2");
+  uint16_t qtype = QType::AAAA;
+  uint16_t size = 42;
+  dnsdist::Protocol protocol = dnsdist::Protocol::DoUDP;
+  struct timespec now;
+  gettime(&now);
+
+  size_t numberOfSeconds = 10;
+  size_t blockDuration = 60;
+  const auto action = DNSAction::Action::Drop;
+  const std::string reason = "Exceeded query rate";
+  /* 32 clients per shard */
+  const size_t maxClients = 512;
+  const size_t spoofedClients = 2000;
+
+  DynBlockRulesGroup dbrg;
+  dbrg.setQuiet(true);
+  {
+    /* block above 50 qps for numberOfSeconds seconds, no warning */
+    DynBlockRulesGroup::DynBlockRule rule(reason, blockDuration, 50, 0, numberOfSeconds, action);
+    dbrg.setQueryRate(std::move(rule));
+  }
+  dbrg.setIncremental(true, maxClients);
+  BOOST_CHECK(dbrg.isIncremental());
+
+  g_rings.clear();
+  dnsdist::DynamicBlocks::clearClientAddressDynamicRules();
+
+  /* requestor2 sends enough queries to be blocked, but is then quiet
+     while a lot of spoofed addresses send one query each: it should be evicted */
+  for (size_t idx = 0; idx < 600; idx++) {
+    g_rings.insertQuery(now, requestor2, qname, qtype, size, dnsHeader, protocol);
+  }
+
+  /* requestor1 keeps sending queries during the flood, and is never the least recently seen client of its shard */
+  for (size_t idx = 0; idx < spoofedClients; idx++) {
+    ComboAddress spoofed("198.51.100.0");
+    spoofed.sin4.sin_addr.s_addr = htonl(ntohl(spoofed.sin4.sin_addr.s_addr) + idx);
+    g_rings.insertQuery(now, spoofed, qname, qtype, size, dnsHeader, protocol);
+    g_rings.insertQuery(now, requestor1, qname, qtype, size, dnsHeader, protocol);
+  }
+
+  dbrg.apply(now);
+  BOOST_CHECK_EQUAL(dnsdist::DynamicBlocks::getClientAddressDynamicRules().size(), 1U);
+  BOOST_REQUIRE(dnsdist::DynamicBlocks::getClientAddressDynamicRules().lookup(requestor1) != nullptr);
+  BOOST_CHECK_EQUAL(dnsdist::DynamicBlocks::getClientAddressDynamicRules().lookup(requestor1)->second.reason, reason);
+  BOOST_CHECK(dnsdist::DynamicBlocks::getClientAddressDynamicRules().lookup(requestor2) == nullptr);
+
+  /* without the limit, requestor2 is not evicted */
+  dbrg.setIncremental(true, spoofedClients * 16);
+  g_rings.clear();
+  dnsdist::DynamicBlocks::clearClientAddressDynamicRules();
+  for (size_t idx = 0; idx < 600; idx++) {
+    g_rings.insertQuery(now, requestor2, qname, qtype, size, dnsHeader, protocol);
+  }
+  for (size_t idx = 0; idx < spoofedClients; idx++) {
+    ComboAddress spoofed("198.51.100.0");
+    spoofed.sin4.sin_addr.s_addr = htonl(ntohl(spoofed.sin4.sin_addr.s_addr) + idx);
+    g_rings.insertQuery(now, spoofed, qname, qtype, size, dnsHeader, protocol);
+  }
+  dbrg.apply(now);
+  BOOST_CHECK_EQUAL(dnsdist::DynamicBlocks::getClientAddressDynamicRules().size(), 1U);
+  BOOST_CHECK(dnsdist::DynamicBlocks::getClientAddressDynamicRules().lookup(requestor2) != nullptr);
+}
+
 BOOST_FIXTURE_TEST_CASE(test_DynBlockRulesMetricsCache_GetTopN, TestFixture) {
   dnsheader dnsHeader{};
   memset(&dnsHeader, 0, sizeof(dnsHeader));
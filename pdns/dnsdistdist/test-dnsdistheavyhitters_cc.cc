@@ -0,0 +1,194 @@
+
+#ifndef BOOST_TEST_DYN_LINK
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+#include "dnsdist-heavy-hitters.hh"
+#include "gettime.hh"
+
+BOOST_AUTO_TEST_SUITE(dnsdistheavyhitters_cc)
+
+BOOST_AUTO_TEST_CASE(test_SpaceSaving)
+{
+  dnsdist::SpaceSaving<std::string> tracker(10);
+  BOOST_CHECK_EQUAL(tracker.getCapacity(), 10U);
+
+  for (size_t idx = 0; idx < 100; idx++) {
+    tracker.add("heavy");
+    if (idx % 2 == 0) {
+      tracker.add("medium");
+    }
+    /* a lot of keys seen only once, which keep evicting each other */
+    tracker.add("light-" + std::to_string(idx));
+  }
+  BOOST_CHECK_EQUAL(tracker.size(), 10U);
+  BOOST_CHECK_EQUAL(tracker.getTotal(), 250U);
+
+  auto top = tracker.getTop(2);
+  BOOST_REQUIRE_EQUAL(top.size(), 2U);
+  BOOST_CHECK_EQUAL(top.at(0).key, "heavy");
+  BOOST_CHECK_EQUAL(top.at(0).count, 100U);
+  BOOST_CHECK_EQUAL(top.at(0).error, 0U);
+  BOOST_CHECK_EQUAL(top.at(1).key, "medium");
+  BOOST_CHECK_EQUAL(top.at(1).count, 50U);
+
+  /* the count of a key that took over an evicted one is over-estimated by at most its error */
+  for (const auto& entry : tracker.getTop(10)) {
+    if (entry.key.rfind("light-", 0) == 0) {
+      BOOST_CHECK_GE(entry.count, 1U);
+      BOOST_CHECK_EQUAL(entry.count - entry.error, 1U);
+    }
+  }
+
+  tracker.decay(1);
+  top = tracker.getTop(1);
+  BOOST_REQUIRE_EQUAL(top.size(), 1U);
+  BOOST_CHECK_EQUAL(top.at(0).key, "heavy");
+  BOOST_CHECK_EQUAL(top.at(0).count, 50U);
+
+  tracker.clear();
+  BOOST_CHECK_EQUAL(tracker.size(), 0U);
+  BOOST_CHECK_EQUAL(tracker.getTop(10).size(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(test_HeavyHitters)
+{
+  dnsdist::HeavyHitters::Settings settings;
+  settings.d_capacity = 64;
+  settings.d_v4Mask = 24;
+  settings.d_suffixLabels = 2;
+  dnsdist::HeavyHitters heavyHitters(settings);
+
+  timespec now{};
+  gettime(&now);
+  dnsheader dnsHeader{};
+  memset(&dnsHeader, 0, sizeof(dnsHeader));
+
+  for (size_t idx = 0; idx < 1000; idx++) {
+    /* one client sending random subdomains of the same domain, and getting NXDomain */
+    const DNSName name(std::to_string(idx) + ".attack.example.");
+    heavyHitters.onQuery(now, ComboAddress("192.0.2." + std::to_string(idx % 250)), name, QType::A);
+    dnsHeader.rcode = RCode::NXDomain;
+    heavyHitters.onResponse(now, ComboAddress("192.0.2." + std::to_string(idx % 250)), name, dnsHeader, 42, false);
+    if (idx % 10 == 0) {
+      /* legitimate traffic from a lot of different clients */
+      const DNSName legit("www.powerdns.com.");
+      const ComboAddress client("198.51." + std::to_string(idx % 200) + ".1");
+      heavyHitters.onQuery(now, client, legit, QType::AAAA);
+      dnsHeader.rcode = RCode::NoError;
+      heavyHitters.onResponse(now, client, legit, dnsHeader, 42, false);
+    }
+  }
+
+  auto tops = heavyHitters.getTops(2);
+  BOOST_REQUIRE_EQUAL(tops.d_clients.size(), 2U);
+  /* all the addresses of the attacker are in the same /24 */
+  BOOST_CHECK_EQUAL(tops.d_clients.at(0).key.toString(), "192.0.2.0/24");
+  BOOST_CHECK_EQUAL(tops.d_clients.at(0).count, 1000U);
+  BOOST_CHECK_EQUAL(tops.d_clients.at(0).error, 0U);
+
+  BOOST_REQUIRE_EQUAL(tops.d_names.size(), 2U);
+  BOOST_CHECK_EQUAL(tops.d_names.at(0).key, DNSName("attack.example."));
+  BOOST_CHECK_EQUAL(tops.d_names.at(0).count, 1000U);
+  BOOST_CHECK_EQUAL(tops.d_names.at(1).key, DNSName("powerdns.com."));
+  BOOST_CHECK_EQUAL(tops.d_names.at(1).count, 100U);
+
+  BOOST_REQUIRE_EQUAL(tops.d_rcodes.size(), 2U);
+  BOOST_CHECK_EQUAL(tops.d_rcodes.at(0).key.d_rcode, RCode::NXDomain);
+  BOOST_CHECK_EQUAL(tops.d_rcodes.at(0).key.d_name, DNSName("attack.example."));
+  BOOST_CHECK_EQUAL(tops.d_rcodes.at(0).count, 1000U);
+  BOOST_CHECK_EQUAL(tops.d_rcodes.at(1).key.d_rcode, RCode::NoError);
+
+  /* one half-life later, new traffic weighs twice as much as the old one */
+  settings.d_halfLife = 10;
+  dnsdist::HeavyHitters decaying(settings);
+  timespec later = now;
+  later.tv_sec -= 10;
+  for (size_t idx = 0; idx < 100; idx++) {
+    decaying.onQuery(later, ComboAddress("192.0.2.1"), DNSName("old.example."), QType::A);
+  }
+  later.tv_sec += 10;
+  for (size_t idx = 0; idx < 60; idx++) {
+    decaying.onQuery(later, ComboAddress("192.0.2.1"), DNSName("new.example."), QType::A);
+  }
+  tops = decaying.getTops(2);
+  BOOST_REQUIRE_EQUAL(tops.d_names.size(), 2U);
+  BOOST_CHECK_EQUAL(tops.d_names.at(0).key, DNSName("new.example."));
+  BOOST_CHECK_EQUAL(tops.d_names.at(0).count, 60U);
+  BOOST_CHECK_EQUAL(tops.d_names.at(1).count, 50U);
+
+  heavyHitters.onClear();
+  tops = heavyHitters.getTops(10);
+  BOOST_CHECK(tops.d_clients.empty());
+  BOOST_CHECK(tops.d_names.empty());
+  BOOST_CHECK(tops.d_rcodes.empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_HeavyHittersFedByRings)
+{
+  Rings rings;
+  rings.init(1000, 1);
+  dnsdist::HeavyHitters::Settings settings;
+  settings.d_capacity = 16;
+  auto heavyHitters = std::make_shared<dnsdist::HeavyHitters>(settings);
+  rings.addObserver(heavyHitters);
+
+  timespec now{};
+  gettime(&now);
+  dnsheader dnsHeader{};
+  memset(&dnsHeader, 0, sizeof(dnsHeader));
+  const ComboAddress requestor("2001:db8::1");
+  const DNSName name("www.powerdns.com.");
+  for (size_t idx = 0; idx < 10; idx++) {
+    rings.insertQuery(now, requestor, name, QType::A, 42, dnsHeader, dnsdist::Protocol::DoUDP);
+  }
+
+  auto tops = heavyHitters->getTops(10);
+  BOOST_REQUIRE_EQUAL(tops.d_clients.size(), 1U);
+  BOOST_CHECK_EQUAL(tops.d_clients.at(0).key.toString(), "2001:db8::/64");
+  BOOST_CHECK_EQUAL(tops.d_clients.at(0).count, 10U);
+
+  /* clearing the rings clears the tracker as well */
+  rings.clear();
+  BOOST_CHECK(heavyHitters->getTops(10).d_clients.empty());
+
+  rings.removeObserver(heavyHitters.get());
+  rings.insertQuery(now, requestor, name, QType::A, 42, dnsHeader, dnsdist::Protocol::DoUDP);
+  BOOST_CHECK(heavyHitters->getTops(10).d_clients.empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_HeavyHittersFedByPerThreadRings)
+{
+  Rings rings;
+  rings.init(1000, 1, 0, true, true, 50);
+  dnsdist::HeavyHitters::Settings settings;
+  settings.d_capacity = 16;
+  auto heavyHitters = std::make_shared<dnsdist::HeavyHitters>(settings);
+  rings.addObserver(heavyHitters);
+
+  timespec now{};
+  gettime(&now);
+  dnsheader dnsHeader{};
+  memset(&dnsHeader, 0, sizeof(dnsHeader));
+  const ComboAddress requestor("2001:db8::1");
+  const DNSName name("www.powerdns.com.");
+  for (size_t idx = 0; idx < 10; idx++) {
+    rings.insertQuery(now, requestor, name, QType::A, 42, dnsHeader, dnsdist::Protocol::DoUDP);
+  }
+
+  /* the observers are only notified when the per-thread rings are merged */
+  BOOST_CHECK(heavyHitters->getTops(10).d_clients.empty());
+  rings.mergePerThreadRings();
+
+  auto tops = heavyHitters->getTops(10);
+  BOOST_REQUIRE_EQUAL(tops.d_clients.size(), 1U);
+  BOOST_CHECK_EQUAL(tops.d_clients.at(0).key.toString(), "2001:db8::/64");
+  BOOST_CHECK_EQUAL(tops.d_clients.at(0).count, 10U);
+  BOOST_CHECK_EQUAL(rings.getNumberOfQueryEntries(), 10U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -5,11 +5,14 @@
 
 #define BOOST_TEST_NO_MAIN
 
+#include <thread>
+
 #include <boost/test/unit_test.hpp>
 
 #include "dnsdist.hh"
 #include "dnsdist-lua.hh"
 #include "dnsdist-lua-ffi.hh"
+#include "dnsdist-lua-per-thread.hh"
 #include "dnsdist-snmp.hh"
 #include "dolog.hh"
 
@@ -19,6 +22,9 @@ RecursiveLockGuarded<LuaContext> g_lua{LuaContext()};
 std::unique_ptr<DNSDistSNMPAgent> g_snmpAgent{nullptr};
 
 #if BENCH_POLICIES
+#include <queue>
+#include <random>
+
 #include "dnsdist-rings.hh"
 Rings g_rings;
 #endif /* BENCH_POLICIES */
@@ -101,7 +107,78 @@ static void benchPolicy(const ServerPolicy& pol)
       auto server = pol.getSelectedBackend(servers, dnsQuestion);
     }
   }
-  cerr << pol.name << " took " << std::to_string(sw.udiff()) << " us for " << names.size() << endl;
+  cerr << pol.getName() << " took " << std::to_string(sw.udiff()) << " us for " << names.size() << endl;
+#else
+  (void)pol;
+#endif /* BENCH_POLICIES */
+}
+
+/* simulate a pool of backends with very different response times, some of them getting slower
+   when they have more queries in flight, and report the tail latency observed with the given policy */
+static void simulatePolicy(const ServerPolicy& pol)
+{
+#if BENCH_POLICIES
+  struct SimulatedBackend
+  {
+    double d_baseLatencyUsec;
+    /* number of queries the backend can handle in parallel before slowing down */
+    double d_capacity;
+  };
+  const std::vector<SimulatedBackend> backends{
+    {1000.0, 50.0}, {1000.0, 50.0}, {1200.0, 50.0}, {1500.0, 40.0}, {2000.0, 40.0},
+    {3000.0, 30.0}, {5000.0, 20.0}, {10000.0, 10.0}, {20000.0, 10.0}, {50000.0, 5.0}};
+
+  auto dnsQuestion = getDQ();
+  ServerPolicy::NumberedServerVector servers;
+  for (size_t idx = 1; idx <= backends.size(); idx++) {
+    servers.emplace_back(idx, std::make_shared<DownstreamState>(ComboAddress("192.0.2." + std::to_string(idx) + ":53")));
+    servers.at(idx - 1).second->setUp();
+    servers.at(idx - 1).second->hash();
+  }
+
+  /* (completion time, backend index, query latency) */
+  using Completion = std::tuple<double, size_t, double>;
+  std::priority_queue<Completion, std::vector<Completion>, std::greater<>> inFlight;
+  std::mt19937 gen(42);
+  /* 100k queries per second */
+  std::exponential_distribution<double> interArrival(1.0 / 10.0);
+  std::exponential_distribution<double> jitter(1.0);
+  const size_t numberOfQueries = 1000000;
+  std::vector<double> latencies;
+  latencies.reserve(numberOfQueries);
+
+  double now = 0.0;
+  for (size_t query = 0; query < numberOfQueries; query++) {
+    now += interArrival(gen);
+    while (!inFlight.empty() && std::get<0>(inFlight.top()) <= now) {
+      const auto& [when, backendIdx, latency] = inFlight.top();
+      auto& backend = *servers.at(backendIdx).second;
+      --backend.outstanding;
+      backend.latencyUsec = (127.0 * backend.latencyUsec / 128.0) + latency / 128.0;
+      backend.updatePolicyLatency(latency);
+      inFlight.pop();
+    }
+
+    auto selected = pol.getSelectedBackend(servers, dnsQuestion);
+    size_t backendIdx = 0;
+    while (servers.at(backendIdx).second != selected.get()) {
+      backendIdx++;
+    }
+    const auto& simulated = backends.at(backendIdx);
+    auto& backend = *selected.get();
+    const auto load = static_cast<double>(backend.outstanding.load());
+    const auto slowdown = load > simulated.d_capacity ? load / simulated.d_capacity : 1.0;
+    const auto latency = simulated.d_baseLatencyUsec * slowdown * (0.5 + (0.5 * jitter(gen)));
+    ++backend.outstanding;
+    inFlight.emplace(now + latency, backendIdx, latency);
+    latencies.push_back(latency);
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&latencies](double pct) {
+    return latencies.at(static_cast<size_t>(pct * static_cast<double>(latencies.size() - 1)));
+  };
+  cerr << pol.getName() << ": p50 " << percentile(0.5) << " us, p90 " << percentile(0.9) << " us, p99 " << percentile(0.99) << " us, p99.9 " << percentile(0.999) << " us" << endl;
 #else
   (void)pol;
 #endif /* BENCH_POLICIES */
@@ -541,6 +618,221 @@ BOOST_AUTO_TEST_CASE(test_chashed)
 }
 #endif
 
+BOOST_AUTO_TEST_CASE(test_powerOfTwoLatency)
+{
+  auto dnsQuestion = getDQ();
+
+  ServerPolicy pol{"powerOfTwoLatency", powerOfTwoLatency, false};
+  ServerPolicy::NumberedServerVector servers;
+
+  /* empty list */
+  auto server = pol.getSelectedBackend(servers, dnsQuestion);
+  BOOST_CHECK(!server);
+
+  /* servers start as 'down' */
+  servers.emplace_back(1, std::make_shared<DownstreamState>(ComboAddress("192.0.2.1:53")));
+  server = pol.getSelectedBackend(servers, dnsQuestion);
+  BOOST_CHECK(!server);
+
+  /* mark the server as 'up' */
+  servers.at(0).second->setUp();
+  server = pol.getSelectedBackend(servers, dnsQuestion);
+  BOOST_REQUIRE(server);
+  BOOST_CHECK(server.get() == servers.at(0).second);
+
+  /* add a second server, 'down', we should always get the first one */
+  servers.emplace_back(2, std::make_shared<DownstreamState>(ComboAddress("192.0.2.2:53")));
+  for (size_t idx = 0; idx < 100; idx++) {
+    server = pol.getSelectedBackend(servers, dnsQuestion);
+    BOOST_REQUIRE(server);
+    BOOST_CHECK(server.get() == servers.at(0).second);
+  }
+
+  /* both 'up', the second one is faster. With two servers both are always compared, so the outcome does not depend on the draws */
+  servers.at(1).second->setUp();
+  servers.at(0).second->updatePolicyLatency(1000.0);
+  servers.at(1).second->updatePolicyLatency(100.0);
+  BOOST_CHECK_EQUAL(servers.at(0).second->d_policyLatencyUsec.load(), 1000.0);
+  for (size_t idx = 0; idx < 100; idx++) {
+    server = pol.getSelectedBackend(servers, dnsQuestion);
+    BOOST_REQUIRE(server);
+    BOOST_CHECK(server.get() == servers.at(1).second);
+  }
+
+  /* but if it has too many queries in flight, the first one becomes cheaper */
+  servers.at(1).second->outstanding = 20;
+  for (size_t idx = 0; idx < 100; idx++) {
+    server = pol.getSelectedBackend(servers, dnsQuestion);
+    BOOST_REQUIRE(server);
+    BOOST_CHECK(server.get() == servers.at(0).second);
+  }
+
+  /* unless its weight is high enough */
+  servers.at(1).second->setWeight(3);
+  for (size_t idx = 0; idx < 100; idx++) {
+    server = pol.getSelectedBackend(servers, dnsQuestion);
+    BOOST_REQUIRE(server);
+    BOOST_CHECK(server.get() == servers.at(1).second);
+  }
+  servers.at(1).second->setWeight(1);
+
+  /* the average moves by 1/16th of the difference */
+  servers.at(1).second->updatePolicyLatency(1700.0);
+  BOOST_CHECK_EQUAL(servers.at(1).second->d_policyLatencyUsec.load(), 200.0);
+
+  /* a server without any latency sample yet is compared on the outstanding queries */
+  servers.at(1).second->setDown();
+  servers.at(1).second->setUp();
+  BOOST_CHECK_EQUAL(servers.at(1).second->d_policyLatencyUsec.load(), 0.0);
+  servers.at(0).second->outstanding = 2;
+  servers.at(1).second->outstanding = 1;
+  for (size_t idx = 0; idx < 100; idx++) {
+    server = pol.getSelectedBackend(servers, dnsQuestion);
+    BOOST_REQUIRE(server);
+    BOOST_CHECK(server.get() == servers.at(1).second);
+  }
+
+  /* the list is replaced by one of the same size: the server selected last time at that position
+     is not the same one anymore, and should not be picked just because of its position */
+  servers.clear();
+  for (size_t idx = 1; idx <= 3; idx++) {
+    servers.emplace_back(idx, std::make_shared<DownstreamState>(ComboAddress("192.0.2." + std::to_string(idx) + ":53")));
+    servers.at(idx - 1).second->setUp();
+  }
+  servers.at(1).second->updatePolicyLatency(100.0);
+  servers.at(0).second->updatePolicyLatency(1000.0);
+  servers.at(2).second->updatePolicyLatency(1000.0);
+  /* make sure the fast server has been selected at least once */
+  for (size_t idx = 0; idx < 1000; idx++) {
+    server = pol.getSelectedBackend(servers, dnsQuestion);
+    BOOST_REQUIRE(server);
+    if (server.get() == servers.at(1).second) {
+      break;
+    }
+  }
+  BOOST_REQUIRE(server.get() == servers.at(1).second);
+  /* from now on it is always considered */
+  for (size_t idx = 0; idx < 100; idx++) {
+    server = pol.getSelectedBackend(servers, dnsQuestion);
+    BOOST_REQUIRE(server);
+    BOOST_CHECK(server.get() == servers.at(1).second);
+  }
+  /* replace it by a slow one, at the same position */
+  servers.at(1).second = std::make_shared<DownstreamState>(ComboAddress("192.0.2.4:53"));
+  servers.at(1).second->setUp();
+  servers.at(1).second->updatePolicyLatency(100000.0);
+  size_t slowSelected = 0;
+  for (size_t idx = 0; idx < 1000; idx++) {
+    server = pol.getSelectedBackend(servers, dnsQuestion);
+    BOOST_REQUIRE(server);
+    if (server.get() == servers.at(1).second) {
+      ++slowSelected;
+    }
+  }
+  /* there is always a faster server to compare it to */
+  BOOST_CHECK_EQUAL(slowSelected, 0U);
+
+  /* identical servers get a fair share of the queries */
+  servers.clear();
+  std::map<std::shared_ptr<DownstreamState>, uint64_t> serversMap;
+  for (size_t idx = 1; idx <= 10; idx++) {
+    servers.emplace_back(idx, std::make_shared<DownstreamState>(ComboAddress("192.0.2." + std::to_string(idx) + ":53")));
+    serversMap[servers.at(idx - 1).second] = 0;
+    servers.at(idx - 1).second->setUp();
+  }
+
+  /* over 10000 queries each server should get around 1000 of them, getting none would be
+     a much bigger deviation than what a working random source can produce */
+  const size_t fairShareQueries = 10000;
+  for (size_t idx = 0; idx < fairShareQueries; idx++) {
+    server = pol.getSelectedBackend(servers, dnsQuestion);
+    BOOST_REQUIRE(server);
+    BOOST_REQUIRE(serversMap.count(server.get()) == 1);
+    ++serversMap[server.get()];
+  }
+  uint64_t total = 0;
+  for (const auto& entry : serversMap) {
+    BOOST_CHECK_GT(entry.second, fairShareQueries / serversMap.size() / 2);
+    total += entry.second;
+  }
+  BOOST_CHECK_EQUAL(total, fairShareQueries);
+
+  /* most servers 'down', we still find the ones that are 'up' */
+  for (size_t idx = 0; idx < 9; idx++) {
+    servers.at(idx).second->setDown();
+  }
+  for (size_t idx = 0; idx < 100; idx++) {
+    server = pol.getSelectedBackend(servers, dnsQuestion);
+    BOOST_REQUIRE(server);
+    BOOST_CHECK(server.get() == servers.at(9).second);
+  }
+
+  benchPolicy(pol);
+
+  simulatePolicy(pol);
+  simulatePolicy(ServerPolicy{"leastOutstanding", leastOutstanding, false});
+  simulatePolicy(ServerPolicy{"wrandom", wrandom, false});
+  simulatePolicy(ServerPolicy{"roundrobin", roundrobin, false});
+}
+
+BOOST_AUTO_TEST_CASE(test_chashedRing)
+{
+  std::vector<DNSName> names;
+  names.reserve(1000);
+  for (size_t idx = 0; idx < 1000; idx++) {
+    names.emplace_back("powerdns-" + std::to_string(idx) + ".com.");
+  }
+
+  ServerPolicy::NumberedServerVector servers;
+  for (size_t idx = 1; idx <= 10; idx++) {
+    servers.emplace_back(idx, std::make_shared<DownstreamState>(ComboAddress("192.0.2." + std::to_string(idx) + ":53")));
+    servers.at(idx - 1).second->setUp();
+    servers.at(idx - 1).second->setWeight(100);
+  }
+
+  /* the ring has to select exactly the same servers as the per-server lookup */
+  const auto checkSameSelection = [&names](const ServerPolicy::NumberedServerVector& candidates) {
+    const ConsistentHashRing ring(candidates);
+    for (const auto& name : names) {
+      const auto qhash = name.hash(0);
+      BOOST_CHECK(chashedFromRing(ring, candidates, qhash) == chashedFromHash(candidates, qhash));
+    }
+  };
+
+  ConsistentHashRing ring(servers);
+  BOOST_CHECK_EQUAL(ring.size(), 1000U);
+  checkSameSelection(servers);
+
+  /* servers that are down are skipped */
+  servers.at(0).second->setDown();
+  servers.at(5).second->setDown();
+  checkSameSelection(servers);
+
+  /* a different weight */
+  servers.at(9).second->setWeight(1000);
+  checkSameSelection(servers);
+
+  /* overloaded servers are skipped as well when bounded-load is enabled */
+  dnsdist::configuration::updateImmutableConfiguration([](dnsdist::configuration::ImmutableConfiguration& config) {
+    config.d_consistentHashBalancingFactor = 1.5;
+  });
+  servers.at(3).second->outstanding = 100;
+  checkSameSelection(servers);
+  servers.at(3).second->outstanding = 0;
+  dnsdist::configuration::updateImmutableConfiguration([](dnsdist::configuration::ImmutableConfiguration& config) {
+    config.d_consistentHashBalancingFactor = 0;
+  });
+
+  /* no server available */
+  for (auto& server : servers) {
+    server.second->setDown();
+  }
+  const ConsistentHashRing downRing(servers);
+  BOOST_CHECK(!chashedFromRing(downRing, servers, names.at(0).hash(0)));
+  /* and a ring that was not built from these servers */
+  BOOST_CHECK(!chashedFromRing(ConsistentHashRing(ServerPolicy::NumberedServerVector()), servers, names.at(0).hash(0)));
+}
+
 BOOST_AUTO_TEST_CASE(test_lua)
 {
   std::vector<DNSName> names;
@@ -605,6 +897,91 @@ BOOST_AUTO_TEST_CASE(test_lua)
 #if 0
 #ifdef LUAJIT_VERSION
 
+BOOST_AUTO_TEST_CASE(test_lua_per_thread)
+{
+  std::vector<DNSName> names;
+  names.reserve(1000);
+  for (size_t idx = 0; idx < 1000; idx++) {
+    names.emplace_back("powerdns-" + std::to_string(idx) + ".com.");
+  }
+
+  static const std::string policySetupStr = R"foo(
+    function luahashed(servers, dq)
+      return 1 + (dq.qname:hash() % #servers)
+    end
+
+    local counter = 0
+    function luaroundrobin(servers, dq)
+      counter = counter + 1
+      return 1 + (counter % #servers)
+    end
+
+    setServerPolicyLua("luahashed", luahashed)
+    setServerPolicyLua("luaroundrobin", luaroundrobin)
+  )foo";
+  resetLuaContext();
+  dnsdist::configuration::updateImmutableConfiguration([](dnsdist::configuration::ImmutableConfiguration& config) {
+    config.d_luaPerThreadStates = true;
+  });
+  std::map<std::string, std::shared_ptr<ServerPolicy>> policies;
+  g_lua.lock()->writeFunction("setServerPolicyLua", [&policies](const string& name, const LuaContext::LuaObject& object) {
+    auto [policy, code] = dnsdist::lua::perthread::getFunctionAndCode<ServerPolicy::policyfunc_t>(*(g_lua.lock()), object, "setServerPolicyLua");
+    auto pol = std::make_shared<ServerPolicy>(name, policy, true);
+    if (code) {
+      pol->setPerThreadLuaCode(std::move(*code));
+    }
+    policies[name] = std::move(pol);
+  });
+  g_lua.lock()->executeCode(policySetupStr);
+
+  /* the round-robin one captures a local variable, it cannot be instantiated in a different Lua state */
+  BOOST_REQUIRE_EQUAL(policies.size(), 2U);
+  BOOST_CHECK(policies.at("luaroundrobin")->d_perThreadLuaPolicy == nullptr);
+  auto pol = policies.at("luahashed");
+  BOOST_REQUIRE(pol->d_perThreadLuaPolicy != nullptr);
+
+  ServerPolicy::NumberedServerVector servers;
+  for (size_t idx = 1; idx <= 10; idx++) {
+    servers.emplace_back(idx, std::make_shared<DownstreamState>(ComboAddress("192.0.2." + std::to_string(idx) + ":53")));
+    servers.at(idx - 1).second->setUp();
+  }
+
+  const auto selectAll = [&pol, &names, &servers]() {
+    std::vector<std::shared_ptr<DownstreamState>> selected;
+    for (const auto& name : names) {
+      auto dnsQuestion = getDQ(&name);
+      auto server = pol->getSelectedBackend(servers, dnsQuestion);
+      selected.push_back(server ? server.get() : nullptr);
+    }
+    return selected;
+  };
+
+  const auto fromThisThread = selectAll();
+  std::vector<std::shared_ptr<DownstreamState>> fromOtherThread;
+  std::thread other([&selectAll, &fromOtherThread]() {
+    fromOtherThread = selectAll();
+  });
+  other.join();
+
+  /* the same selection from the Lua states of both threads */
+  BOOST_REQUIRE_EQUAL(fromThisThread.size(), names.size());
+  BOOST_CHECK(fromThisThread == fromOtherThread);
+  BOOST_CHECK(std::find(fromThisThread.begin(), fromThisThread.end(), nullptr) == fromThisThread.end());
+
+  benchPolicy(*pol);
+
+  /* destroying the policy releases its function, which the threads then remove from their Lua state */
+  const auto generation = dnsdist::lua::perthread::getReleasedFunctionsGeneration();
+  policies.clear();
+  pol.reset();
+  BOOST_CHECK_GT(dnsdist::lua::perthread::getReleasedFunctionsGeneration(), generation);
+
+  dnsdist::configuration::updateImmutableConfiguration([](dnsdist::configuration::ImmutableConfiguration& config) {
+    config.d_luaPerThreadStates = false;
+  });
+  resetLuaContext();
+}
+
 BOOST_AUTO_TEST_CASE(test_lua_ffi_rr)
 {
   std::vector<DNSName> names;
@@ -5,6 +5,9 @@
 #define BOOST_TEST_NO_MAIN
 
 #include <boost/test/unit_test.hpp>
+#include <boost/test/data/test_case.hpp>
+#include <sys/wait.h>
+#include <thread>
 
 #include "ednscookies.hh"
 #include "ednsoptions.hh"
@@ -15,17 +18,28 @@
 #include "dnsdist-cache.hh"
 #include "gettime.hh"
 #include "packetcache.hh"
+#include "dnsdist-cache-shared.hh"
+
+/* needs to live outside of the test suite namespace to be found by the data test cases */
+static std::ostream& operator<<(std::ostream& ostr, DNSDistPacketCache::Engine engine)
+{
+  return ostr << (engine == DNSDistPacketCache::Engine::OpenAddressing ? "open-addressing" : "unordered-map");
+}
 
 BOOST_AUTO_TEST_SUITE(test_dnsdistpacketcache_cc)
 
 static bool receivedOverUDP = true;
 
-BOOST_AUTO_TEST_CASE(test_PacketCacheSimple)
+/* every test is run against all the storage engines */
+static const std::vector<DNSDistPacketCache::Engine> s_engines{DNSDistPacketCache::Engine::UnorderedMap, DNSDistPacketCache::Engine::OpenAddressing};
+
+BOOST_DATA_TEST_CASE(test_PacketCacheSimple, s_engines, engine)
 {
   const DNSDistPacketCache::CacheSettings settings{
     .d_maxEntries = 150000,
     .d_maxTTL = 86400,
     .d_minTTL = 1,
+    .d_engine = engine,
   };
   DNSDistPacketCache localCache(settings);
   BOOST_CHECK_EQUAL(localCache.getSize(), 0U);
@@ -133,7 +147,7 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheSimple)
   }
 }
 
-BOOST_AUTO_TEST_CASE(test_PacketCacheSharded)
+BOOST_DATA_TEST_CASE(test_PacketCacheSharded, s_engines, engine)
 {
   const DNSDistPacketCache::CacheSettings settings{
     .d_maxEntries = 150000,
@@ -144,6 +158,7 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheSharded)
     .d_staleTTL = 60,
     .d_shardCount = 10,
     .d_dontAge = false,
+    .d_engine = engine,
   };
   DNSDistPacketCache localCache(settings);
   BOOST_CHECK_EQUAL(localCache.getSize(), 0U);
@@ -243,12 +258,13 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheSharded)
   }
 }
 
-BOOST_AUTO_TEST_CASE(test_PacketCacheTCP)
+BOOST_DATA_TEST_CASE(test_PacketCacheTCP, s_engines, engine)
 {
   const DNSDistPacketCache::CacheSettings settings{
     .d_maxEntries = 150000,
     .d_maxTTL = 86400,
     .d_minTTL = 1,
+    .d_engine = engine,
   };
   DNSDistPacketCache localCache(settings);
   InternalQueryState ids;
@@ -313,12 +329,13 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheTCP)
   }
 }
 
-BOOST_AUTO_TEST_CASE(test_PacketCacheServFailTTL)
+BOOST_DATA_TEST_CASE(test_PacketCacheServFailTTL, s_engines, engine)
 {
   const DNSDistPacketCache::CacheSettings settings{
     .d_maxEntries = 150000,
     .d_maxTTL = 86400,
     .d_minTTL = 1,
+    .d_engine = engine,
   };
   DNSDistPacketCache localCache(settings);
   InternalQueryState ids;
@@ -369,7 +386,7 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheServFailTTL)
   }
 }
 
-BOOST_AUTO_TEST_CASE(test_PacketCacheNoDataTTL)
+BOOST_DATA_TEST_CASE(test_PacketCacheNoDataTTL, s_engines, engine)
 {
   const DNSDistPacketCache::CacheSettings settings{
     .d_maxEntries = 150000,
@@ -377,6 +394,7 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheNoDataTTL)
     .d_minTTL = 1,
     .d_tempFailureTTL = 60,
     .d_maxNegativeTTL = 1,
+    .d_engine = engine,
   };
   DNSDistPacketCache localCache(settings);
 
@@ -431,7 +449,7 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheNoDataTTL)
   }
 }
 
-BOOST_AUTO_TEST_CASE(test_PacketCacheNXDomainTTL)
+BOOST_DATA_TEST_CASE(test_PacketCacheNXDomainTTL, s_engines, engine)
 {
   const DNSDistPacketCache::CacheSettings settings{
     .d_maxEntries = 150000,
@@ -439,6 +457,7 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheNXDomainTTL)
     .d_minTTL = 1,
     .d_tempFailureTTL = 60,
     .d_maxNegativeTTL = 1,
+    .d_engine = engine,
   };
   DNSDistPacketCache localCache(settings);
 
@@ -493,7 +512,7 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheNXDomainTTL)
   }
 }
 
-BOOST_AUTO_TEST_CASE(test_PacketCacheTruncated)
+BOOST_DATA_TEST_CASE(test_PacketCacheTruncated, s_engines, engine)
 {
   InternalQueryState ids;
   ids.qtype = QType::A;
@@ -529,6 +548,7 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheTruncated)
       .d_minTTL = 1,
       .d_tempFailureTTL = 60,
       .d_maxNegativeTTL = 1,
+      .d_engine = engine,
     };
     DNSDistPacketCache localCache(settings);
     BOOST_CHECK_EQUAL(localCache.getSize(), 0U);
@@ -550,6 +570,7 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheTruncated)
       .d_maxTTL = 86400,
       .d_minTTL = 1,
       .d_truncatedTTL = 60,
+      .d_engine = engine,
     };
     DNSDistPacketCache localCache(settings);
     BOOST_CHECK_EQUAL(localCache.getSize(), 0U);
@@ -574,7 +595,7 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheTruncated)
   }
 }
 
-BOOST_AUTO_TEST_CASE(test_PacketCacheMaximumSize)
+BOOST_DATA_TEST_CASE(test_PacketCacheMaximumSize, s_engines, engine)
 {
   InternalQueryState ids;
   ids.qtype = QType::A;
@@ -613,6 +634,7 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheMaximumSize)
       .d_maximumEntrySize = response.size(),
       .d_maxTTL = 86400,
       .d_minTTL = 1,
+      .d_engine = engine,
     };
     DNSDistPacketCache packetCache(settings);
 
@@ -655,6 +677,7 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheMaximumSize)
       .d_maximumEntrySize = response.size() - 1,
       .d_maxTTL = 86400,
       .d_minTTL = 1,
+      .d_engine = engine,
     };
     DNSDistPacketCache packetCache(settings);
 
@@ -713,6 +736,7 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheMaximumSize)
       .d_maximumEntrySize = response.size(),
       .d_maxTTL = 86400,
       .d_minTTL = 1,
+      .d_engine = engine,
     };
     DNSDistPacketCache packetCache(settings);
 
@@ -747,12 +771,7 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheMaximumSize)
   }
 }
 
-const DNSDistPacketCache::CacheSettings s_localCacheSettings{
-  .d_maxEntries = 500000,
-};
-static DNSDistPacketCache s_localCache(s_localCacheSettings);
-
-static void threadMangler(unsigned int offset)
+static void threadMangler(DNSDistPacketCache& localCache, unsigned int offset)
 {
   InternalQueryState ids;
   ids.qtype = QType::A;
@@ -781,9 +800,9 @@ static void threadMangler(unsigned int offset)
       uint32_t key = 0;
       boost::optional<Netmask> subnet;
       DNSQuestion dnsQuestion(ids, query);
-      s_localCache.get(dnsQuestion, 0, &key, subnet, dnssecOK, receivedOverUDP);
+      localCache.get(dnsQuestion, 0, &key, subnet, dnssecOK, receivedOverUDP);
 
-      s_localCache.insert(key, subnet, *(getFlagsFromDNSHeader(dnsQuestion.getHeader().get())), dnssecOK, ids.qname, QType::A, QClass::IN, response, receivedOverUDP, 0, boost::none);
+      localCache.insert(key, subnet, *(getFlagsFromDNSHeader(dnsQuestion.getHeader().get())), dnssecOK, ids.qname, QType::A, QClass::IN, response, receivedOverUDP, 0, boost::none);
     }
   }
   catch (PDNSException& e) {
@@ -794,7 +813,7 @@ static void threadMangler(unsigned int offset)
 
 static std::atomic<uint64_t> s_missing{0};
 
-static void threadReader(unsigned int offset)
+static void threadReader(DNSDistPacketCache& localCache, unsigned int offset)
 {
   InternalQueryState ids;
   ids.qtype = QType::A;
@@ -813,7 +832,7 @@ static void threadReader(unsigned int offset)
       uint32_t key = 0;
       boost::optional<Netmask> subnet;
       DNSQuestion dnsQuestion(ids, query);
-      bool found = s_localCache.get(dnsQuestion, 0, &key, subnet, dnssecOK, receivedOverUDP);
+      bool found = localCache.get(dnsQuestion, 0, &key, subnet, dnssecOK, receivedOverUDP);
       if (!found) {
         s_missing++;
       }
@@ -825,13 +844,20 @@ static void threadReader(unsigned int offset)
   }
 }
 
-BOOST_AUTO_TEST_CASE(test_PacketCacheThreaded)
+BOOST_DATA_TEST_CASE(test_PacketCacheThreaded, s_engines, engine)
 {
+  const DNSDistPacketCache::CacheSettings settings{
+    .d_maxEntries = 500000,
+    .d_engine = engine,
+  };
+  DNSDistPacketCache localCache(settings);
+  s_missing = 0;
+
   try {
     std::vector<std::thread> threads;
     threads.reserve(4);
     for (int i = 0; i < 4; ++i) {
-      threads.emplace_back(threadMangler, i * 1000000UL);
+      threads.emplace_back(threadMangler, std::ref(localCache), i * 1000000UL);
     }
 
     for (auto& thr : threads) {
@@ -840,18 +866,18 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheThreaded)
 
     threads.clear();
 
-    BOOST_CHECK_EQUAL(s_localCache.getSize() + s_localCache.getDeferredInserts() + s_localCache.getInsertCollisions(), 400000U);
-    BOOST_CHECK_SMALL(1.0 * s_localCache.getInsertCollisions(), 10000.0);
+    BOOST_CHECK_EQUAL(localCache.getSize() + localCache.getDeferredInserts() + localCache.getInsertCollisions(), 400000U);
+    BOOST_CHECK_SMALL(1.0 * localCache.getInsertCollisions(), 10000.0);
 
     for (int i = 0; i < 4; ++i) {
-      threads.emplace_back(threadReader, i * 1000000UL);
+      threads.emplace_back(threadReader, std::ref(localCache), i * 1000000UL);
     }
 
     for (auto& thr : threads) {
       thr.join();
     }
 
-    BOOST_CHECK((s_localCache.getDeferredInserts() + s_localCache.getDeferredLookups() + s_localCache.getInsertCollisions()) >= s_missing.load());
+    BOOST_CHECK((localCache.getDeferredInserts() + localCache.getDeferredLookups() + localCache.getInsertCollisions()) >= s_missing.load());
   }
   catch (const PDNSException& e) {
     cerr << "Had error: " << e.reason << endl;
@@ -859,7 +885,7 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheThreaded)
   }
 }
 
-BOOST_AUTO_TEST_CASE(test_PCCollision)
+BOOST_DATA_TEST_CASE(test_PCCollision, s_engines, engine)
 {
   const DNSDistPacketCache::CacheSettings settings{
     .d_maxEntries = 150000,
@@ -872,6 +898,7 @@ BOOST_AUTO_TEST_CASE(test_PCCollision)
     .d_dontAge = false,
     .d_deferrableInsertLock = true,
     .d_parseECS = true,
+    .d_engine = engine,
   };
   DNSDistPacketCache localCache(settings);
   BOOST_CHECK_EQUAL(localCache.getSize(), 0U);
@@ -959,6 +986,7 @@ BOOST_AUTO_TEST_CASE(test_PCCollision)
   {
     const DNSDistPacketCache::CacheSettings settings{
       .d_maxEntries = 10000,
+      .d_engine = engine,
     };
     DNSDistPacketCache pc(settings);
     GenericDNSPacketWriter<PacketBuffer>::optvect_t ednsOptions;
@@ -999,7 +1027,7 @@ BOOST_AUTO_TEST_CASE(test_PCCollision)
 #endif
 }
 
-BOOST_AUTO_TEST_CASE(test_PCDNSSECCollision)
+BOOST_DATA_TEST_CASE(test_PCDNSSECCollision, s_engines, engine)
 {
   const DNSDistPacketCache::CacheSettings settings{
     .d_maxEntries = 150000,
@@ -1012,6 +1040,7 @@ BOOST_AUTO_TEST_CASE(test_PCDNSSECCollision)
     .d_dontAge = false,
     .d_deferrableInsertLock = true,
     .d_parseECS = true,
+    .d_engine = engine,
   };
   DNSDistPacketCache localCache(settings);
   BOOST_CHECK_EQUAL(localCache.getSize(), 0U);
@@ -1065,12 +1094,13 @@ BOOST_AUTO_TEST_CASE(test_PCDNSSECCollision)
   }
 }
 
-BOOST_AUTO_TEST_CASE(test_PacketCacheInspection)
+BOOST_DATA_TEST_CASE(test_PacketCacheInspection, s_engines, engine)
 {
   const DNSDistPacketCache::CacheSettings settings{
     .d_maxEntries = 150000,
     .d_maxTTL = 86400,
     .d_minTTL = 1,
+    .d_engine = engine,
   };
   DNSDistPacketCache localCache(settings);
   BOOST_CHECK_EQUAL(localCache.getSize(), 0U);
@@ -1311,12 +1341,13 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheInspection)
   }
 }
 
-BOOST_AUTO_TEST_CASE(test_PacketCacheXFR)
+BOOST_DATA_TEST_CASE(test_PacketCacheXFR, s_engines, engine)
 {
   const DNSDistPacketCache::CacheSettings settings{
     .d_maxEntries = 150000,
     .d_maxTTL = 86400,
     .d_minTTL = 1,
+    .d_engine = engine,
   };
   DNSDistPacketCache localCache(settings);
   BOOST_CHECK_EQUAL(localCache.getSize(), 0U);
@@ -1357,4 +1388,286 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheXFR)
   }
 }
 
+BOOST_DATA_TEST_CASE(test_PacketCacheSnapshot, s_engines, engine)
+{
+  const DNSDistPacketCache::CacheSettings settings{
+    .d_maxEntries = 150000,
+    .d_shardCount = 10,
+    .d_parseECS = true,
+    .d_engine = engine,
+  };
+  DNSDistPacketCache localCache(settings);
+
+  const size_t entries = 1000;
+  auto getQuery = [](size_t idx, InternalQueryState& ids) {
+    ids.qtype = QType::A;
+    ids.qclass = QClass::IN;
+    ids.protocol = dnsdist::Protocol::DoUDP;
+    ids.qname = DNSName(std::to_string(idx) + ".snapshot.cache.tests.powerdns.com.");
+    PacketBuffer query;
+    GenericDNSPacketWriter<PacketBuffer> pwQ(query, ids.qname, ids.qtype, ids.qclass, 0);
+    pwQ.getHeader()->rd = 1;
+    if (idx % 2 == 0) {
+      /* half of the entries have an ECS option */
+      GenericDNSPacketWriter<PacketBuffer>::optvect_t ednsOptions;
+      EDNSSubnetOpts opt;
+      opt.setSource(Netmask("10.0." + std::to_string(idx / 256) + "." + std::to_string(idx % 256) + "/32"));
+      ednsOptions.emplace_back(EDNSOptionCode::ECS, opt.makeOptString());
+      pwQ.addOpt(512, 0, 0, ednsOptions);
+    }
+    pwQ.commit();
+    return query;
+  };
+
+  for (size_t idx = 0; idx < entries; idx++) {
+    InternalQueryState ids;
+    auto query = getQuery(idx, ids);
+    const bool dnssecOK = idx % 3 == 0;
+
+    PacketBuffer response;
+    GenericDNSPacketWriter<PacketBuffer> pwR(response, ids.qname, ids.qtype, ids.qclass, 0);
+    pwR.getHeader()->rd = 1;
+    pwR.getHeader()->ra = 1;
+    pwR.getHeader()->qr = 1;
+    pwR.startRecord(ids.qname, ids.qtype, 3600, QClass::IN, DNSResourceRecord::ANSWER);
+    pwR.xfr32BitInt(0x01020304 + idx);
+    pwR.commit();
+
+    uint32_t key = 0;
+    boost::optional<Netmask> subnet;
+    DNSQuestion dnsQuestion(ids, query);
+    BOOST_CHECK(!localCache.get(dnsQuestion, 0, &key, subnet, dnssecOK, receivedOverUDP));
+    BOOST_CHECK_EQUAL(static_cast<bool>(subnet), idx % 2 == 0);
+    localCache.insert(key, subnet, *(getFlagsFromDNSHeader(dnsQuestion.getHeader().get())), dnssecOK, ids.qname, ids.qtype, ids.qclass, response, receivedOverUDP, RCode::NoError, boost::none);
+  }
+  BOOST_REQUIRE_EQUAL(localCache.getSize(), entries);
+
+  std::array<char, 64> snapshotPath{"/tmp/dnsdist-packetcache-snapshot-XXXXXX"};
+  int snapshotFD = mkstemp(snapshotPath.data());
+  BOOST_REQUIRE(snapshotFD >= 0);
+  close(snapshotFD);
+  const std::string snapshotFile(snapshotPath.data());
+
+  BOOST_CHECK_EQUAL(localCache.saveSnapshot(snapshotFile), entries);
+
+  /* restore into caches using every engine, with a different number of shards */
+  for (const auto restoredEngine : s_engines) {
+    for (const auto shards : {3U, 10U}) {
+      DNSDistPacketCache::CacheSettings restoredSettings = settings;
+      restoredSettings.d_shardCount = shards;
+      restoredSettings.d_engine = restoredEngine;
+      DNSDistPacketCache restoredCache(restoredSettings);
+      BOOST_CHECK_EQUAL(restoredCache.loadSnapshot(snapshotFile, 4), entries);
+      BOOST_CHECK_EQUAL(restoredCache.getSize(), entries);
+
+      for (size_t idx = 0; idx < entries; idx++) {
+        const bool dnssecOK = idx % 3 == 0;
+        InternalQueryState ids;
+        auto query = getQuery(idx, ids);
+        auto originalQuery = query;
+        uint32_t key = 0;
+        boost::optional<Netmask> subnet;
+        DNSQuestion dnsQuestion(ids, query);
+        BOOST_REQUIRE(restoredCache.get(dnsQuestion, 0, &key, subnet, dnssecOK, receivedOverUDP, 0, true));
+
+        InternalQueryState originalIDs;
+        getQuery(idx, originalIDs);
+        boost::optional<Netmask> originalSubnet;
+        DNSQuestion originalQuestion(originalIDs, originalQuery);
+        BOOST_REQUIRE(localCache.get(originalQuestion, 0, &key, originalSubnet, dnssecOK, receivedOverUDP, 0, true));
+        BOOST_CHECK(dnsQuestion.getData() == originalQuestion.getData());
+        BOOST_CHECK(subnet == originalSubnet);
+
+        /* the DNSSEC OK flag and the ECS subnet are part of the restored entries */
+        InternalQueryState otherIDs;
+        auto otherQuery = getQuery(idx, otherIDs);
+        DNSQuestion otherQuestion(otherIDs, otherQuery);
+        BOOST_CHECK(!restoredCache.get(otherQuestion, 0, &key, subnet, !dnssecOK, receivedOverUDP));
+      }
+    }
+  }
+
+  /* a truncated snapshot is reported */
+  BOOST_REQUIRE_EQUAL(truncate(snapshotFile.c_str(), 1000), 0);
+  DNSDistPacketCache truncatedCache(settings);
+  BOOST_CHECK_THROW(truncatedCache.loadSnapshot(snapshotFile), std::runtime_error);
+  /* as well as a missing one */
+  unlink(snapshotFile.c_str());
+  BOOST_CHECK_THROW(truncatedCache.loadSnapshot(snapshotFile), std::runtime_error);
+}
+
+BOOST_DATA_TEST_CASE(test_PacketCacheSharedSegment, s_engines, engine)
+{
+  const std::string segmentName = "/dnsdist-packetcache-tests-" + std::to_string(getpid()) + "-" + std::to_string(static_cast<int>(engine));
+  dnsdist::cache::SharedSegment::unlink(segmentName);
+
+  /* a small first tier in front of a larger shared one */
+  DNSDistPacketCache::CacheSettings settings{
+    .d_maxEntries = 100,
+    .d_shardCount = 10,
+    .d_engine = engine,
+  };
+  settings.d_sharedSegmentName = segmentName;
+  settings.d_sharedSegmentEntries = 10000;
+
+  const size_t entries = 1000;
+  auto getQuery = [](size_t idx, InternalQueryState& ids) {
+    ids.qtype = QType::A;
+    ids.qclass = QClass::IN;
+    ids.protocol = dnsdist::Protocol::DoUDP;
+    ids.qname = DNSName(std::to_string(idx) + ".shared.cache.tests.powerdns.com.");
+    PacketBuffer query;
+    GenericDNSPacketWriter<PacketBuffer> pwQ(query, ids.qname, ids.qtype, ids.qclass, 0);
+    pwQ.getHeader()->rd = 1;
+    pwQ.commit();
+    return query;
+  };
+  auto lookup = [&getQuery](DNSDistPacketCache& cache, size_t idx) {
+    InternalQueryState ids;
+    auto query = getQuery(idx, ids);
+    uint32_t key = 0;
+    boost::optional<Netmask> subnet;
+    DNSQuestion dnsQuestion(ids, query);
+    if (!cache.get(dnsQuestion, 0, &key, subnet, false, receivedOverUDP, 0, true)) {
+      return false;
+    }
+    /* the address of the only A record is at the very end of the response */
+    const auto& response = dnsQuestion.getData();
+    uint32_t address = 0;
+    BOOST_REQUIRE(response.size() > sizeof(dnsheader) + sizeof(address));
+    memcpy(&address, &response.at(response.size() - sizeof(address)), sizeof(address));
+    return ntohl(address) == 0x01020304 + idx;
+  };
+  auto insert = [&getQuery](DNSDistPacketCache& cache, size_t idx) {
+    InternalQueryState ids;
+    auto query = getQuery(idx, ids);
+
+    PacketBuffer response;
+    GenericDNSPacketWriter<PacketBuffer> pwR(response, ids.qname, ids.qtype, ids.qclass, 0);
+    pwR.getHeader()->rd = 1;
+    pwR.getHeader()->ra = 1;
+    pwR.getHeader()->qr = 1;
+    pwR.startRecord(ids.qname, ids.qtype, 3600, QClass::IN, DNSResourceRecord::ANSWER);
+    pwR.xfr32BitInt(0x01020304 + idx);
+    pwR.commit();
+
+    uint32_t key = 0;
+    boost::optional<Netmask> subnet;
+    DNSQuestion dnsQuestion(ids, query);
+    BOOST_CHECK(!cache.get(dnsQuestion, 0, &key, subnet, false, receivedOverUDP));
+    cache.insert(key, subnet, *(getFlagsFromDNSHeader(dnsQuestion.getHeader().get())), false, ids.qname, ids.qtype, ids.qclass, response, receivedOverUDP, RCode::NoError, boost::none);
+  };
+
+  {
+    DNSDistPacketCache firstCache(settings);
+    for (size_t idx = 0; idx < entries; idx++) {
+      insert(firstCache, idx);
+    }
+    /* the first tier is full but every entry made it into the shared one */
+    BOOST_CHECK_EQUAL(firstCache.getSize(), 100U);
+    BOOST_CHECK_EQUAL(firstCache.getSharedSegmentInserts(), entries);
+
+    /* a second cache, as another process would, sees all of them */
+    DNSDistPacketCache secondCache(settings);
+    for (size_t idx = 0; idx < entries; idx++) {
+      BOOST_CHECK(lookup(secondCache, idx));
+    }
+    BOOST_CHECK_EQUAL(secondCache.getSharedSegmentHits(), entries);
+    BOOST_CHECK_EQUAL(secondCache.getMisses(), 0U);
+    /* and the hits have been copied into its first tier */
+    BOOST_CHECK_EQUAL(secondCache.getSize(), 100U);
+
+    /* removing an entry from one cache removes it from the shared segment */
+    firstCache.expungeByName(DNSName("0.shared.cache.tests.powerdns.com."));
+    BOOST_CHECK(!lookup(firstCache, 0));
+
+    /* the segment has to be attached to with the same parameters */
+    auto otherSettings = settings;
+    otherSettings.d_sharedSegmentSlotSize = 2048;
+    BOOST_CHECK_THROW(DNSDistPacketCache otherCache(otherSettings), std::runtime_error);
+  }
+
+  {
+    /* the entries survive a restart */
+    DNSDistPacketCache restartedCache(settings);
+    BOOST_CHECK_EQUAL(restartedCache.getSize(), 0U);
+    BOOST_CHECK(!lookup(restartedCache, 0));
+    for (size_t idx = 1; idx < entries; idx++) {
+      BOOST_CHECK(lookup(restartedCache, idx));
+    }
+
+    /* until the whole cache is expunged */
+    restartedCache.expunge(0);
+    BOOST_CHECK(!lookup(restartedCache, 1));
+  }
+
+  {
+    /* expired entries are purged from the shared segment, and only these */
+    DNSDistPacketCache cache(settings);
+    insert(cache, 0);
+    cache.purgeExpired(0, time(nullptr));
+    DNSDistPacketCache otherCache(settings);
+    BOOST_CHECK(lookup(otherCache, 0));
+    cache.purgeExpired(0, time(nullptr) + 7200);
+    DNSDistPacketCache lastCache(settings);
+    BOOST_CHECK(!lookup(lastCache, 0));
+  }
+
+  dnsdist::cache::SharedSegment::unlink(segmentName);
+}
+
+BOOST_AUTO_TEST_CASE(test_PacketCacheSharedSegmentLocks)
+{
+  using dnsdist::cache::SharedSegment;
+  const std::string segmentName = "/dnsdist-packetcache-locks-tests-" + std::to_string(getpid());
+  SharedSegment::unlink(segmentName);
+
+  SharedSegment segment(segmentName, 16, 256);
+  const DNSName qname("locks.shared.cache.tests.powerdns.com.");
+  const auto& qnameStorage = qname.getStorage();
+  const PacketBuffer response(64, 'a');
+  SharedSegment::EntryHeader header;
+  header.added = time(nullptr);
+  header.validity = header.added + 3600;
+  SharedSegment::EntryHeader gotHeader;
+  PacketBuffer gotData;
+  BOOST_REQUIRE(segment.store(42, header, qnameStorage, response));
+  BOOST_REQUIRE(segment.lookup(42, gotHeader, gotData) == SharedSegment::LookupResult::Found);
+
+  /* a visitor throwing an exception does not leave the slot locked */
+  BOOST_CHECK_THROW(segment.removeIf([](uint32_t /* key */, const dnsdist::cache::OpenAddressingShard::EntryView& /* entry */) -> bool {
+    throw std::runtime_error("Invalid entry");
+  }),
+                    std::runtime_error);
+  BOOST_CHECK(segment.lookup(42, gotHeader, gotData) == SharedSegment::LookupResult::Found);
+
+  /* a process dying while holding the lock of a slot */
+  pid_t child = fork();
+  BOOST_REQUIRE(child >= 0);
+  if (child == 0) {
+    segment.removeIf([](uint32_t /* key */, const dnsdist::cache::OpenAddressingShard::EntryView& /* entry */) -> bool {
+      _exit(0);
+    });
+    _exit(1);
+  }
+  int status = 0;
+  BOOST_REQUIRE_EQUAL(waitpid(child, &status, 0), child);
+  BOOST_REQUIRE(WIFEXITED(status));
+  BOOST_REQUIRE_EQUAL(WEXITSTATUS(status), 0);
+
+  /* leaves it locked */
+  BOOST_CHECK(segment.lookup(42, gotHeader, gotData) == SharedSegment::LookupResult::Busy);
+  BOOST_CHECK(!segment.store(42, header, qnameStorage, response));
+
+  /* until the abandoned lock delay has passed, then the next writer takes it over */
+  SharedSegment impatientSegment(segmentName, 16, 256, 1);
+  std::this_thread::sleep_for(std::chrono::milliseconds(2100));
+  BOOST_CHECK(!segment.store(42, header, qnameStorage, response));
+  BOOST_CHECK(impatientSegment.store(42, header, qnameStorage, response));
+  BOOST_CHECK(segment.lookup(42, gotHeader, gotData) == SharedSegment::LookupResult::Found);
+  BOOST_CHECK_EQUAL(gotData.size(), qnameStorage.size() + response.size());
+
+  SharedSegment::unlink(segmentName);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
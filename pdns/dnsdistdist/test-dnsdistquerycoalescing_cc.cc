@@ -0,0 +1,275 @@
+
+#ifndef BOOST_TEST_DYN_LINK
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+#include "dnsdist.hh"
+#include "dnsdist-cache.hh"
+#include "dnsdist-query-coalescing.hh"
+#include "dnswriter.hh"
+
+BOOST_AUTO_TEST_SUITE(dnsdistquerycoalescing_cc)
+
+static InternalQueryState getQueryState(const std::shared_ptr<DNSDistPacketCache>& cache, const DNSName& qname, uint16_t qid, uint32_t cacheKey)
+{
+  InternalQueryState ids;
+  ids.protocol = dnsdist::Protocol::DoUDP;
+  ids.packetCache = cache;
+  ids.qname = qname;
+  ids.qtype = QType::A;
+  ids.qclass = QClass::IN;
+  ids.origID = htons(qid);
+  ids.cacheKey = cacheKey;
+  ids.dnssecOK = false;
+  return ids;
+}
+
+BOOST_AUTO_TEST_CASE(test_Eligibility)
+{
+  DNSDistPacketCache::CacheSettings settings{
+    .d_maxEntries = 100,
+  };
+  auto cache = std::make_shared<DNSDistPacketCache>(settings);
+  settings.d_coalesceQueries = true;
+  auto coalescingCache = std::make_shared<DNSDistPacketCache>(settings);
+  const DNSName qname("powerdns.com.");
+
+  BOOST_CHECK(!dnsdist::QueryCoalescer::isEligible(getQueryState(cache, qname, 1, 42)));
+  BOOST_CHECK(dnsdist::QueryCoalescer::isEligible(getQueryState(coalescingCache, qname, 1, 42)));
+
+  auto ids = getQueryState(coalescingCache, qname, 1, 42);
+  ids.skipCache = true;
+  BOOST_CHECK(!dnsdist::QueryCoalescer::isEligible(ids));
+
+  ids = getQueryState(coalescingCache, qname, 1, 42);
+  ids.protocol = dnsdist::Protocol::DoTCP;
+  BOOST_CHECK(!dnsdist::QueryCoalescer::isEligible(ids));
+}
+
+BOOST_AUTO_TEST_CASE(test_ParkAndAnswer)
+{
+  DNSDistPacketCache::CacheSettings settings{
+    .d_maxEntries = 100,
+    .d_coalesceQueries = true,
+  };
+  auto cache = std::make_shared<DNSDistPacketCache>(settings);
+  dnsdist::QueryCoalescer coalescer(4);
+  const time_t now = time(nullptr);
+  const DNSName qname("www.powerdns.com.");
+  const DNSName otherCase("WwW.PowerDNS.com.");
+
+  auto leader = getQueryState(cache, qname, 1, 42);
+  BOOST_CHECK(coalescer.park(leader, nullptr, 2, now, 2) == dnsdist::QueryCoalescer::Result::Leader);
+
+  auto first = getQueryState(cache, otherCase, 2, 42);
+  /* the RD bit was not set on this query */
+  first.origFlags = 0;
+  BOOST_CHECK(coalescer.park(first, nullptr, 2, now, 2) == dnsdist::QueryCoalescer::Result::Parked);
+  auto second = getQueryState(cache, qname, 3, 42);
+  second.origFlags = htons(0x0100);
+  BOOST_CHECK(coalescer.park(second, nullptr, 2, now, 2) == dnsdist::QueryCoalescer::Result::Parked);
+  /* the limit has been reached */
+  auto third = getQueryState(cache, qname, 4, 42);
+  BOOST_CHECK(coalescer.park(third, nullptr, 2, now, 2) == dnsdist::QueryCoalescer::Result::NotCoalesced);
+  BOOST_CHECK_EQUAL(third.origID, htons(4));
+
+  /* same cache key but a different qname (hash collision), a different qtype or a different subnet: not identical */
+  auto collision = getQueryState(cache, DNSName("collision.powerdns.com."), 5, 42);
+  BOOST_CHECK(coalescer.park(collision, nullptr, 2, now, 2) == dnsdist::QueryCoalescer::Result::Leader);
+  auto otherType = getQueryState(cache, qname, 6, 42);
+  otherType.qtype = QType::AAAA;
+  BOOST_CHECK(coalescer.park(otherType, nullptr, 2, now, 2) == dnsdist::QueryCoalescer::Result::Leader);
+  auto otherSubnet = getQueryState(cache, qname, 7, 42);
+  otherSubnet.subnet = Netmask("192.0.2.0/24");
+  BOOST_CHECK(coalescer.park(otherSubnet, nullptr, 2, now, 2) == dnsdist::QueryCoalescer::Result::Leader);
+  BOOST_CHECK_EQUAL(coalescer.getParkedCount(), 2U);
+
+  PacketBuffer response;
+  GenericDNSPacketWriter<PacketBuffer> writer(response, qname, QType::A, QClass::IN, 0);
+  writer.getHeader()->qr = 1;
+  writer.getHeader()->rd = 1;
+  writer.getHeader()->ra = 1;
+  writer.getHeader()->id = leader.origID;
+  writer.startRecord(qname, QType::A, 60, QClass::IN, DNSResourceRecord::ANSWER);
+  writer.xfrIP(htonl(0x7f000001));
+  writer.commit();
+  const auto original = response;
+
+  std::vector<std::pair<uint16_t, PacketBuffer>> sent;
+  auto answered = coalescer.answer(leader, nullptr, response, [&sent](InternalQueryState& ids, PacketBuffer& copy) {
+    sent.emplace_back(ids.origID, copy);
+  });
+  BOOST_CHECK_EQUAL(answered, 2U);
+  BOOST_CHECK(response == original);
+  BOOST_REQUIRE_EQUAL(sent.size(), 2U);
+
+  for (const auto& [queryID, packet] : sent) {
+    BOOST_REQUIRE_EQUAL(packet.size(), original.size());
+    const dnsheader_aligned header(packet.data());
+    BOOST_CHECK_EQUAL(header->id, queryID);
+    BOOST_CHECK(header->qr);
+    BOOST_CHECK(header->ra);
+    /* the rest of the response is untouched */
+    BOOST_CHECK(std::equal(packet.begin() + sizeof(dnsheader) + qname.wirelength(), packet.end(), original.begin() + sizeof(dnsheader) + qname.wirelength()));
+  }
+  const dnsheader_aligned firstHeader(sent.at(0).second.data());
+  BOOST_CHECK_EQUAL(firstHeader->id, htons(2));
+  BOOST_CHECK(!firstHeader->rd);
+  BOOST_CHECK_EQUAL(DNSName(reinterpret_cast<const char*>(sent.at(0).second.data()), sent.at(0).second.size(), sizeof(dnsheader), false).getStorage(), otherCase.getStorage()); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+  const dnsheader_aligned secondHeader(sent.at(1).second.data());
+  BOOST_CHECK_EQUAL(secondHeader->id, htons(3));
+  BOOST_CHECK(secondHeader->rd);
+
+  /* the entry is gone, the next identical query is a new leader */
+  BOOST_CHECK_EQUAL(coalescer.answer(leader, nullptr, response, [](InternalQueryState&, PacketBuffer&) { BOOST_FAIL("No parked query should be left"); }), 0U);
+  auto next = getQueryState(cache, qname, 8, 42);
+  BOOST_CHECK(coalescer.park(next, nullptr, 2, now, 2) == dnsdist::QueryCoalescer::Result::Leader);
+}
+
+BOOST_AUTO_TEST_CASE(test_LostLeader)
+{
+  DNSDistPacketCache::CacheSettings settings{
+    .d_maxEntries = 100,
+    .d_coalesceQueries = true,
+  };
+  auto cache = std::make_shared<DNSDistPacketCache>(settings);
+  dnsdist::QueryCoalescer coalescer;
+  const time_t now = time(nullptr);
+  const DNSName qname("www.powerdns.com.");
+
+  auto leader = getQueryState(cache, qname, 1, 42);
+  BOOST_CHECK(coalescer.park(leader, nullptr, 10, now, 2) == dnsdist::QueryCoalescer::Result::Leader);
+  auto parked = getQueryState(cache, qname, 2, 42);
+  BOOST_CHECK(coalescer.park(parked, nullptr, 10, now + 1, 2) == dnsdist::QueryCoalescer::Result::Parked);
+
+  /* the leader has not been answered in time, the next identical query takes over */
+  auto newLeader = getQueryState(cache, qname, 3, 42);
+  BOOST_CHECK(coalescer.park(newLeader, nullptr, 10, now + 3, 2) == dnsdist::QueryCoalescer::Result::Leader);
+  BOOST_CHECK_EQUAL(coalescer.getParkedCount(), 1U);
+  std::vector<PacketBuffer> sent;
+  auto sender = [&sent](InternalQueryState&, PacketBuffer& response) {
+    sent.push_back(response);
+  };
+  BOOST_CHECK_EQUAL(coalescer.expire(now + 3, sender), 0U);
+  BOOST_CHECK(sent.empty());
+
+  /* and is not answered in time either, the parked query gets a ServFail */
+  BOOST_CHECK_EQUAL(coalescer.expire(now + 6, sender), 1U);
+  BOOST_CHECK_EQUAL(coalescer.getParkedCount(), 0U);
+  BOOST_REQUIRE_EQUAL(sent.size(), 1U);
+  const dnsheader_aligned header(sent.at(0).data());
+  BOOST_CHECK_EQUAL(header->id, htons(2));
+  BOOST_CHECK_EQUAL(header->rcode, RCode::ServFail);
+}
+
+BOOST_AUTO_TEST_CASE(test_FailedLeader)
+{
+  DNSDistPacketCache::CacheSettings settings{
+    .d_maxEntries = 100,
+    .d_coalesceQueries = true,
+  };
+  auto cache = std::make_shared<DNSDistPacketCache>(settings);
+  dnsdist::QueryCoalescer coalescer;
+  const time_t now = time(nullptr);
+  const DNSName qname("www.powerdns.com.");
+  const DNSName otherCase("WWW.powerdns.COM.");
+
+  auto leader = getQueryState(cache, qname, 1, 42);
+  BOOST_CHECK(coalescer.park(leader, nullptr, 10, now, 2) == dnsdist::QueryCoalescer::Result::Leader);
+  auto parked = getQueryState(cache, otherCase, 2, 42);
+  parked.origFlags = htons(0x0110);
+  BOOST_CHECK(coalescer.park(parked, nullptr, 10, now, 2) == dnsdist::QueryCoalescer::Result::Parked);
+
+  /* the leader timed out or could not be sent, the parked query gets a ServFail right away */
+  std::vector<PacketBuffer> sent;
+  auto sender = [&sent](InternalQueryState&, PacketBuffer& response) {
+    sent.push_back(response);
+  };
+  BOOST_CHECK_EQUAL(coalescer.fail(leader, nullptr, sender), 1U);
+  BOOST_CHECK_EQUAL(coalescer.getParkedCount(), 0U);
+  BOOST_REQUIRE_EQUAL(sent.size(), 1U);
+  const auto& response = sent.at(0);
+  const dnsheader_aligned header(response.data());
+  BOOST_CHECK_EQUAL(header->id, htons(2));
+  BOOST_CHECK(header->qr);
+  BOOST_CHECK(header->rd);
+  BOOST_CHECK(header->cd);
+  BOOST_CHECK_EQUAL(header->rcode, RCode::ServFail);
+  BOOST_CHECK_EQUAL(ntohs(header->qdcount), 1U);
+  BOOST_CHECK_EQUAL(ntohs(header->ancount), 0U);
+  BOOST_CHECK_EQUAL(DNSName(reinterpret_cast<const char*>(response.data()), response.size(), sizeof(dnsheader), false).getStorage(), otherCase.getStorage()); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+
+  /* the entry is gone */
+  BOOST_CHECK_EQUAL(coalescer.fail(leader, nullptr, [](InternalQueryState&, PacketBuffer&) { BOOST_FAIL("No parked query should be left"); }), 0U);
+  auto next = getQueryState(cache, qname, 3, 42);
+  BOOST_CHECK(coalescer.park(next, nullptr, 10, now, 2) == dnsdist::QueryCoalescer::Result::Leader);
+}
+
+BOOST_AUTO_TEST_CASE(test_StaleLeader)
+{
+  DNSDistPacketCache::CacheSettings settings{
+    .d_maxEntries = 100,
+    .d_coalesceQueries = true,
+  };
+  auto cache = std::make_shared<DNSDistPacketCache>(settings);
+  dnsdist::QueryCoalescer coalescer;
+  const time_t now = time(nullptr);
+  const DNSName qname("www.powerdns.com.");
+  /* only used as identifiers, never dereferenced */
+  const auto* firstBackend = reinterpret_cast<const DownstreamState*>(0x1); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast,performance-no-int-to-ptr)
+  const auto* secondBackend = reinterpret_cast<const DownstreamState*>(0x2); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast,performance-no-int-to-ptr)
+
+  auto leader = getQueryState(cache, qname, 1, 42);
+  BOOST_CHECK(coalescer.park(leader, firstBackend, 10, now, 2) == dnsdist::QueryCoalescer::Result::Leader);
+  BOOST_CHECK(leader.coalescingLeaderID != 0);
+  auto parked = getQueryState(cache, qname, 2, 42);
+  BOOST_CHECK(coalescer.park(parked, firstBackend, 10, now, 2) == dnsdist::QueryCoalescer::Result::Parked);
+
+  /* the leader is lost, a new one takes over, on a backend with a longer timeout */
+  auto newLeader = getQueryState(cache, qname, 3, 42);
+  BOOST_CHECK(coalescer.park(newLeader, secondBackend, 10, now + 3, 5) == dnsdist::QueryCoalescer::Result::Leader);
+  BOOST_CHECK(newLeader.coalescingLeaderID != 0);
+  BOOST_CHECK(newLeader.coalescingLeaderID != leader.coalescingLeaderID);
+
+  std::vector<uint16_t> sent;
+  auto sender = [&sent](InternalQueryState& ids, PacketBuffer&) {
+    sent.push_back(ids.origID);
+  };
+  /* the previous leader fails late: nothing happens, the new leader is in charge */
+  BOOST_CHECK_EQUAL(coalescer.fail(leader, firstBackend, sender), 0U);
+  BOOST_CHECK(sent.empty());
+  BOOST_CHECK_EQUAL(coalescer.getParkedCount(), 1U);
+  /* same ID but not the backend the new leader was sent to */
+  BOOST_CHECK_EQUAL(coalescer.fail(newLeader, firstBackend, sender), 0U);
+  BOOST_CHECK_EQUAL(coalescer.getParkedCount(), 1U);
+  /* the timeout of the new leader's backend applies */
+  BOOST_CHECK_EQUAL(coalescer.expire(now + 6, sender), 0U);
+  BOOST_CHECK_EQUAL(coalescer.getParkedCount(), 1U);
+
+  PacketBuffer response;
+  GenericDNSPacketWriter<PacketBuffer> writer(response, qname, QType::A, QClass::IN, 0);
+  writer.getHeader()->qr = 1;
+  writer.getHeader()->id = leader.origID;
+  writer.commit();
+
+  /* a late answer to the previous leader answers the queries parked so far but keeps the entry */
+  BOOST_CHECK_EQUAL(coalescer.answer(leader, firstBackend, response, sender), 1U);
+  BOOST_REQUIRE_EQUAL(sent.size(), 1U);
+  BOOST_CHECK_EQUAL(sent.at(0), htons(2));
+  auto late = getQueryState(cache, qname, 4, 42);
+  BOOST_CHECK(coalescer.park(late, secondBackend, 10, now + 6, 5) == dnsdist::QueryCoalescer::Result::Parked);
+  BOOST_CHECK_EQUAL(late.coalescingLeaderID, 0U);
+
+  /* and the new leader fails, the query parked behind it gets a ServFail and the entry is gone */
+  BOOST_CHECK_EQUAL(coalescer.fail(newLeader, secondBackend, sender), 1U);
+  BOOST_REQUIRE_EQUAL(sent.size(), 2U);
+  BOOST_CHECK_EQUAL(sent.at(1), htons(4));
+  auto next = getQueryState(cache, qname, 5, 42);
+  BOOST_CHECK(coalescer.park(next, secondBackend, 10, now + 6, 5) == dnsdist::QueryCoalescer::Result::Leader);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
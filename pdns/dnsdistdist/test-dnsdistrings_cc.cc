@@ -144,6 +144,76 @@ BOOST_AUTO_TEST_CASE(test_Rings_Simple) {
   test_ring(500, 100, 5);
 }
 
+BOOST_AUTO_TEST_CASE(test_Rings_PerThread) {
+  const size_t maxEntries = 100;
+  const size_t numberOfShards = 10;
+  const size_t perThreadSize = 50;
+  Rings rings;
+  rings.init(maxEntries, numberOfShards, 0, true, true, perThreadSize);
+  BOOST_CHECK(rings.hasPerThreadRings());
+
+  dnsheader dh;
+  memset(&dh, 0, sizeof(dh));
+  DNSName qname("rings.powerdns.com.");
+  ComboAddress requestor("192.0.2.1");
+  ComboAddress server("192.0.2.42");
+  uint16_t qtype = QType::AAAA;
+  uint16_t size = 42;
+  unsigned int latency = 100;
+  struct timespec now;
+  gettime(&now);
+
+  /* nothing is visible until the per-thread rings have been merged */
+  for (size_t idx = 0; idx < perThreadSize; idx++) {
+    rings.insertQuery(now, requestor, qname, qtype, size, dh, dnsdist::Protocol::DoUDP);
+    rings.insertResponse(now, requestor, qname, qtype, latency, size, dh, server, dnsdist::Protocol::DoUDP);
+  }
+  BOOST_CHECK_EQUAL(rings.getNumberOfQueryEntries(), 0U);
+  BOOST_CHECK_EQUAL(rings.getNumberOfResponseEntries(), 0U);
+
+  /* the per-thread ring is now full, so this one is dropped */
+  rings.insertQuery(now, requestor, qname, qtype, size, dh, dnsdist::Protocol::DoUDP);
+  BOOST_CHECK_EQUAL(rings.d_droppedQueryInserts.load(), 1U);
+  BOOST_CHECK_EQUAL(rings.d_droppedResponseInserts.load(), 0U);
+
+  BOOST_CHECK_EQUAL(rings.mergePerThreadRings(), perThreadSize * 2);
+  BOOST_CHECK_EQUAL(rings.mergePerThreadRings(), 0U);
+  BOOST_CHECK_EQUAL(rings.getNumberOfQueryEntries(), perThreadSize);
+  BOOST_CHECK_EQUAL(rings.getNumberOfResponseEntries(), perThreadSize);
+  size_t queries = 0;
+  size_t responses = 0;
+  for (const auto& shard : rings.d_shards) {
+    for (const auto& entry : *shard->queryRing.lock()) {
+      BOOST_CHECK(checkQuery(entry, qname, qtype, size, now, requestor));
+      queries++;
+    }
+    for (const auto& entry : *shard->respRing.lock()) {
+      BOOST_CHECK(checkResponse(entry, qname, qtype, size, now, requestor, latency, server));
+      responses++;
+    }
+  }
+  BOOST_CHECK_EQUAL(queries, perThreadSize);
+  BOOST_CHECK_EQUAL(responses, perThreadSize);
+
+  /* entries recorded by other threads end up in the shards as well,
+     and once the shards are full older entries get overwritten */
+  std::vector<std::thread> writers;
+  for (size_t idx = 0; idx < 4; idx++) {
+    writers.emplace_back([&rings, &qname, &requestor, &dh, &now, qtype, size]() {
+      for (size_t count = 0; count < perThreadSize; count++) {
+        rings.insertQuery(now, requestor, qname, qtype, size, dh, dnsdist::Protocol::DoTCP);
+      }
+    });
+  }
+  for (auto& writer : writers) {
+    writer.join();
+  }
+  BOOST_CHECK_EQUAL(rings.mergePerThreadRings(), perThreadSize * 4);
+  BOOST_CHECK_EQUAL(rings.getNumberOfQueryEntries(), maxEntries);
+  BOOST_CHECK_EQUAL(rings.d_overwrittenQueryEntries.load(), perThreadSize * 5 - maxEntries);
+  BOOST_CHECK_EQUAL(rings.d_droppedQueryInserts.load(), 1U);
+}
+
 static void ringReaderThread(Rings& rings, std::atomic<bool>& done, size_t numberOfEntries, uint16_t qtype)
 {
   size_t iterationsDone = 0;
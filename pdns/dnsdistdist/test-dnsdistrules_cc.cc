@@ -12,6 +12,10 @@
 #include "dnsdist-rules.hh"
 #include "dnsdist-rules-factory.hh"
 
+#if BENCH_MAXQPSIP
+#include "gettime.hh"
+#endif /* BENCH_MAXQPSIP */
+
 void checkParameterBound(const std::string& parameter, uint64_t value, uint64_t max)
 {
   if (value > max) {
@@ -115,7 +119,7 @@ BOOST_AUTO_TEST_CASE(test_MaxQPSIPRule) {
   unsigned int expiration = 300;
   unsigned int cleanupDelay = 60;
   unsigned int scanFraction = 10;
-  auto rule = dnsdist::selectors::getMaxQPSIPSelector(maxQPS, 32, 64, maxBurst, expiration, cleanupDelay, scanFraction, 1);
+  auto rule = dnsdist::selectors::getMaxQPSIPSelector(maxQPS, 32, 64, maxBurst, expiration, cleanupDelay, scanFraction, 1, std::nullopt);
 
   InternalQueryState ids;
   ids.qname = DNSName("powerdns.com.");
@@ -201,6 +205,105 @@ BOOST_AUTO_TEST_CASE(test_MaxQPSIPRule) {
   BOOST_CHECK_EQUAL(scanned, 0U);
 }
 
+BOOST_AUTO_TEST_CASE(test_MaxQPSIPRule_Table) {
+  const unsigned int maxQPS = 10;
+  const size_t tableSize = 1024;
+  MaxQPSIPRule rule(maxQPS, 24, 64, maxQPS, 300, 60, 10, 10, tableSize);
+
+  InternalQueryState ids;
+  ids.qname = DNSName("powerdns.com.");
+  ids.qtype = QType::A;
+  ids.qclass = QClass::IN;
+  ids.origDest = ComboAddress("127.0.0.1:53");
+  ids.origRemote = ComboAddress("192.0.2.1:42");
+  ids.protocol = dnsdist::Protocol::DoUDP;
+  ids.queryRealTime.start();
+  PacketBuffer packet(sizeof(dnsheader));
+  DNSQuestion dq(ids, packet);
+
+  struct timespec beginTime;
+  /* unlike the QPS limiters, the table uses the real time of the query */
+  gettime(&beginTime, true);
+
+  for (size_t idx = 0; idx < maxQPS; idx++) {
+    /* different addresses in the same /24 share the same limit */
+    ids.origRemote = ComboAddress("192.0.2." + std::to_string(idx) + ":42");
+    BOOST_CHECK_EQUAL(rule.matches(&dq), false);
+    BOOST_CHECK_EQUAL(rule.getEntriesCount(), 1U);
+  }
+
+  /* maxQPS + 1, we should be blocked */
+  BOOST_CHECK_EQUAL(rule.matches(&dq), true);
+  /* but not a different /24 */
+  ids.origRemote = ComboAddress("192.0.3.1:42");
+  BOOST_CHECK_EQUAL(rule.matches(&dq), false);
+  BOOST_CHECK_EQUAL(rule.getEntriesCount(), 2U);
+
+  /* nothing has expired yet */
+  struct timespec cutOff = beginTime;
+  cutOff.tv_sec -= 1;
+  size_t scanned = 0;
+  BOOST_CHECK_EQUAL(rule.cleanup(cutOff, &scanned), 0U);
+  BOOST_CHECK_EQUAL(scanned, 2U);
+
+  /* more clients than the table can hold, the least recently seen ones are evicted */
+  for (size_t idx = 0; idx < 4 * tableSize; idx++) {
+    ids.origRemote = ComboAddress("10." + std::to_string(idx / 256) + "." + std::to_string(idx % 256) + ".1");
+    BOOST_CHECK_EQUAL(rule.matches(&dq), false);
+  }
+  BOOST_CHECK_LE(rule.getEntriesCount(), tableSize);
+  BOOST_CHECK_GT(rule.getEntriesCount(), tableSize / 2);
+
+  /* everything is expired */
+  gettime(&cutOff, true);
+  cutOff.tv_sec += 1;
+  const auto count = rule.getEntriesCount();
+  BOOST_CHECK_EQUAL(rule.cleanup(cutOff, &scanned), count);
+  BOOST_CHECK_EQUAL(scanned, count);
+  BOOST_CHECK_EQUAL(rule.getEntriesCount(), 0U);
+
+  ids.origRemote = ComboAddress("192.0.2.1:42");
+  BOOST_CHECK_EQUAL(rule.matches(&dq), false);
+  BOOST_CHECK_EQUAL(rule.getEntriesCount(), 1U);
+  rule.clear();
+  BOOST_CHECK_EQUAL(rule.getEntriesCount(), 0U);
+}
+
+#if BENCH_MAXQPSIP
+BOOST_AUTO_TEST_CASE(bench_MaxQPSIPRule) {
+  /* one million distinct sources, seen twice, with the sharded containers and with a compact table */
+  const size_t sources = 1000000;
+  PacketBuffer packet(sizeof(dnsheader));
+  InternalQueryState ids;
+  ids.qname = DNSName("powerdns.com.");
+  ids.qtype = QType::A;
+  ids.qclass = QClass::IN;
+  ids.origDest = ComboAddress("127.0.0.1:53");
+  ids.protocol = dnsdist::Protocol::DoUDP;
+  ids.queryRealTime.start();
+  std::vector<ComboAddress> addresses;
+  addresses.reserve(sources);
+  for (size_t idx = 0; idx < sources; idx++) {
+    addresses.emplace_back("10." + std::to_string(idx >> 16) + "." + std::to_string((idx >> 8) & 0xff) + "." + std::to_string(idx & 0xff));
+  }
+
+  for (const size_t tableSize : {static_cast<size_t>(0), 2 * sources}) {
+    MaxQPSIPRule rule(10, 32, 64, 10, 300, 60, 10, 10, tableSize);
+    DNSQuestion dq(ids, packet);
+    for (size_t pass = 0; pass < 2; pass++) {
+      StopWatch stopWatch;
+      stopWatch.start();
+      size_t matched = 0;
+      for (const auto& address : addresses) {
+        ids.origRemote = address;
+        matched += rule.matches(&dq) ? 1 : 0;
+      }
+      cerr << (tableSize == 0 ? "sharded containers" : "compact table") << (pass == 0 ? ", new sources: " : ", known sources: ") << static_cast<uint64_t>(stopWatch.udiff() * 1000 / sources) << " ns/query, " << rule.getEntriesCount() << " entries, " << matched << " matched" << endl;
+    }
+  }
+}
+#endif /* BENCH_MAXQPSIP */
+
 BOOST_AUTO_TEST_CASE(test_poolOutstandingRule) {
   auto dq = getDQ();
 
@@ -304,4 +407,46 @@ BOOST_AUTO_TEST_CASE(test_payloadSizeRule) {
   auto got = buildSelector("TestMaxQPSIPRule", parameters);
 }
 
+#if defined(HAVE_RE2)
+BOOST_AUTO_TEST_CASE(test_regexSetRule) {
+  const std::vector<std::string> expressions{"[0-9]{5,}\\..*", ".*\\.powerdns\\.com", "powerdns\\.com", "sub\\.powerdns\\.com"};
+  RegexSetRule rule(expressions, "regex");
+  BOOST_CHECK_EQUAL(rule.toString(), "RE2 set match: 4 expressions, tag 'regex'");
+
+  auto check = [&rule](const std::string& name, std::optional<std::string> expected) {
+    const DNSName qname(name);
+    auto dnsQuestion = getDQ(&qname);
+    dnsQuestion.ids.qTag.reset();
+    BOOST_CHECK_EQUAL(rule.matches(&dnsQuestion), expected.has_value());
+    if (expected) {
+      BOOST_REQUIRE(dnsQuestion.ids.qTag);
+      BOOST_CHECK_EQUAL(dnsQuestion.ids.qTag->at("regex"), *expected);
+    }
+    else {
+      BOOST_CHECK(!dnsQuestion.ids.qTag);
+    }
+  };
+
+  /* the expressions need to match the whole name, which has no trailing dot */
+  check("powerdns.com.", "3");
+  check("PowerDNS.COM.", std::nullopt);
+  check("www.powerdns.com.", "2");
+  /* the first matching expression is reported */
+  check("sub.powerdns.com.", "2");
+  check("123456.powerdns.com.", "1");
+  check("1234.example.", std::nullopt);
+  check("powerdns.com.example.", std::nullopt);
+
+  /* no tag */
+  RegexSetRule untagged(expressions, "");
+  const DNSName qname("www.powerdns.com.");
+  auto dnsQuestion = getDQ(&qname);
+  dnsQuestion.ids.qTag.reset();
+  BOOST_CHECK(untagged.matches(&dnsQuestion));
+  BOOST_CHECK(!dnsQuestion.ids.qTag);
+
+  BOOST_CHECK_THROW(RegexSetRule({"valid", "(invalid"}, ""), std::runtime_error);
+}
+#endif /* HAVE_RE2 */
+
 BOOST_AUTO_TEST_SUITE_END()
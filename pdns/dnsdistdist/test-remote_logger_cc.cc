@@ -0,0 +1 @@
+../test-remote_logger_cc.cc
\ No newline at end of file
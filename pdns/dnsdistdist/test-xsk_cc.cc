@@ -0,0 +1,164 @@
+#ifndef BOOST_TEST_DYN_LINK
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#define BOOST_TEST_NO_MAIN
+
+#include "config.h"
+
+#include <boost/test/unit_test.hpp>
+
+#ifdef HAVE_XSK
+#include "dnswriter.hh"
+#include "xsk.hh"
+
+/* the linux specific headers need to be included AFTER the regular ones, see xsk.cc */
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+
+BOOST_AUTO_TEST_SUITE(xsk_cc)
+
+static const MACAddr s_clientMAC{0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+static const MACAddr s_ourMAC{0x02, 0x00, 0x00, 0x00, 0x00, 0x02};
+
+/* build an Ethernet + IPv4 + UDP frame carrying the supplied payload, the way the kernel would hand it to us */
+static size_t buildIPv4Frame(std::vector<uint8_t>& frame, const MACAddr& sourceMAC, const MACAddr& destMAC, const ComboAddress& source, const ComboAddress& dest, const PacketBuffer& payload)
+{
+  ethhdr ethHeader{};
+  memcpy(ethHeader.h_source, sourceMAC.data(), sourceMAC.size());
+  memcpy(ethHeader.h_dest, destMAC.data(), destMAC.size());
+  ethHeader.h_proto = htons(ETH_P_IP);
+
+  iphdr ipHeader{};
+  ipHeader.version = 4;
+  ipHeader.ihl = sizeof(iphdr) / 4;
+  ipHeader.tot_len = htons(sizeof(iphdr) + sizeof(udphdr) + payload.size());
+  ipHeader.ttl = 64;
+  ipHeader.protocol = IPPROTO_UDP;
+  ipHeader.saddr = source.sin4.sin_addr.s_addr;
+  ipHeader.daddr = dest.sin4.sin_addr.s_addr;
+
+  udphdr udpHeader{};
+  udpHeader.source = source.sin4.sin_port;
+  udpHeader.dest = dest.sin4.sin_port;
+  udpHeader.len = htons(sizeof(udphdr) + payload.size());
+
+  size_t pos = 0;
+  memcpy(&frame.at(pos), &ethHeader, sizeof(ethHeader));
+  pos += sizeof(ethHeader);
+  memcpy(&frame.at(pos), &ipHeader, sizeof(ipHeader));
+  pos += sizeof(ipHeader);
+  memcpy(&frame.at(pos), &udpHeader, sizeof(udpHeader));
+  pos += sizeof(udpHeader);
+  memcpy(&frame.at(pos), payload.data(), payload.size());
+  pos += payload.size();
+  return pos;
+}
+
+static PacketBuffer buildPayload(uint16_t queryID, bool response)
+{
+  PacketBuffer payload;
+  GenericDNSPacketWriter<PacketBuffer> packetWriter(payload, DNSName("powerdns.com."), QType::A, QClass::IN, 0);
+  packetWriter.getHeader()->id = queryID;
+  packetWriter.getHeader()->rd = 1;
+  if (response) {
+    packetWriter.getHeader()->qr = 1;
+    packetWriter.startRecord(DNSName("powerdns.com."), QType::A, 60, QClass::IN, DNSResourceRecord::ANSWER);
+    packetWriter.xfrIP(ComboAddress("192.0.2.42").sin4.sin_addr.s_addr);
+    packetWriter.commit();
+  }
+  return payload;
+}
+
+BOOST_AUTO_TEST_CASE(test_ResponsePath)
+{
+  const ComboAddress client("192.0.2.1:53000");
+  const ComboAddress frontend("192.0.2.2:53");
+  const ComboAddress ourBackendSide("192.0.2.2:40000");
+  const ComboAddress backend("192.0.2.3:53");
+
+  /* the query arrives from the client, we keep its headers so that we can answer from the frame of the response */
+  std::vector<uint8_t> queryFrame(XskSocket::getFrameSize());
+  const auto query = buildPayload(0x4242, false);
+  XskPacket queryPacket(queryFrame.data(), buildIPv4Frame(queryFrame, s_clientMAC, s_ourMAC, client, frontend, query), queryFrame.size());
+  BOOST_REQUIRE(queryPacket.parse(false));
+  BOOST_CHECK(!queryPacket.isIPV6());
+  BOOST_CHECK_EQUAL(queryPacket.getFromAddr().toStringWithPort(), client.toStringWithPort());
+  BOOST_CHECK_EQUAL(queryPacket.getToAddr().toStringWithPort(), frontend.toStringWithPort());
+
+  /* the payload is copied into a buffer that keeps its allocation across packets */
+  PacketBuffer buffer;
+  queryPacket.copyPayloadTo(buffer);
+  BOOST_CHECK(buffer == query);
+  auto queryHeader = queryPacket.cloneHeaderToPacketBuffer();
+  BOOST_CHECK_EQUAL(queryHeader.size(), sizeof(ethhdr) + sizeof(iphdr) + sizeof(udphdr));
+
+  /* the response comes back from the backend in a different frame */
+  std::vector<uint8_t> responseFrame(XskSocket::getFrameSize());
+  const auto backendResponse = buildPayload(0x1234, true);
+  XskPacket responsePacket(responseFrame.data(), buildIPv4Frame(responseFrame, s_ourMAC, s_ourMAC, backend, ourBackendSide, backendResponse), responseFrame.size());
+  BOOST_REQUIRE(responsePacket.parse(false));
+  responsePacket.copyPayloadTo(buffer);
+  BOOST_CHECK(buffer == backendResponse);
+  /* copying a smaller payload does not need a new allocation */
+  const auto* previousData = buffer.data();
+  queryPacket.copyPayloadTo(buffer);
+  BOOST_CHECK(buffer == query);
+  BOOST_CHECK(buffer.data() == previousData);
+  responsePacket.copyPayloadTo(buffer);
+  BOOST_CHECK(buffer.data() == previousData);
+
+  /* processing the response restores the ID of the initial query */
+  buffer.at(0) = 0x42;
+  buffer.at(1) = 0x42;
+  BOOST_REQUIRE_LE(buffer.size(), responsePacket.getCapacity());
+
+  /* then the frame is turned into the response to the client */
+  responsePacket.setHeader(queryHeader);
+  BOOST_CHECK(queryHeader.empty());
+  BOOST_REQUIRE(responsePacket.setPayload(buffer));
+  BOOST_CHECK((responsePacket.getFlags() & XskPacket::UPDATE) != 0U);
+  responsePacket.updatePacket();
+  BOOST_CHECK_EQUAL(responsePacket.getFrameLen(), sizeof(ethhdr) + sizeof(iphdr) + sizeof(udphdr) + buffer.size());
+  BOOST_CHECK_EQUAL(responsePacket.getDataLen(), buffer.size());
+
+  /* parse the resulting frame as it would be seen on the wire */
+  XskPacket sent(responseFrame.data(), responsePacket.getFrameLen(), responseFrame.size());
+  BOOST_REQUIRE(sent.parse(false));
+  BOOST_CHECK_EQUAL(sent.getFromAddr().toStringWithPort(), frontend.toStringWithPort());
+  BOOST_CHECK_EQUAL(sent.getToAddr().toStringWithPort(), client.toStringWithPort());
+  PacketBuffer sentPayload;
+  sent.copyPayloadTo(sentPayload);
+  BOOST_CHECK(sentPayload == buffer);
+
+  ethhdr ethHeader{};
+  memcpy(&ethHeader, responseFrame.data(), sizeof(ethHeader));
+  BOOST_CHECK(memcmp(ethHeader.h_dest, s_clientMAC.data(), s_clientMAC.size()) == 0);
+  BOOST_CHECK(memcmp(ethHeader.h_source, s_ourMAC.data(), s_ourMAC.size()) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_ResponseTooLarge)
+{
+  const ComboAddress backend("192.0.2.3:53");
+  const ComboAddress ourBackendSide("192.0.2.2:40000");
+
+  std::vector<uint8_t> responseFrame(XskSocket::getFrameSize());
+  const auto backendResponse = buildPayload(0x1234, true);
+  XskPacket responsePacket(responseFrame.data(), buildIPv4Frame(responseFrame, s_ourMAC, s_ourMAC, backend, ourBackendSide, backendResponse), responseFrame.size());
+  BOOST_REQUIRE(responsePacket.parse(false));
+
+  /* a response that does not fit into the frame has to be sent over the regular socket instead */
+  PacketBuffer tooLarge(responsePacket.getCapacity() + 1);
+  BOOST_CHECK(!responsePacket.setPayload(tooLarge));
+  BOOST_CHECK_EQUAL(responsePacket.getFlags() & XskPacket::UPDATE, 0U);
+  BOOST_CHECK_EQUAL(responsePacket.getDataLen(), backendResponse.size());
+  /* but one that exactly fills it is fine */
+  PacketBuffer exact(responsePacket.getCapacity());
+  BOOST_CHECK(responsePacket.setPayload(exact));
+  BOOST_CHECK_EQUAL(responsePacket.getFrameLen(), responseFrame.size() - XDP_PACKET_HEADROOM);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+#endif /* HAVE_XSK */
@@ -802,14 +802,20 @@ XskPacket::XskPacket(uint8_t* frame_, size_t dataSize, size_t frameSize_) :
 }
 
 PacketBuffer XskPacket::clonePacketBuffer() const
+{
+  PacketBuffer tmp;
+  copyPayloadTo(tmp);
+  return tmp;
+}
+
+void XskPacket::copyPayloadTo(PacketBuffer& buffer) const
 {
   const auto size = getDataSize();
-  PacketBuffer tmp(size);
+  buffer.resize(size);
   if (size > 0) {
     // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
-    memcpy(tmp.data(), frame + getDataOffset(), size);
+    memcpy(buffer.data(), frame + getDataOffset(), size);
   }
-  return tmp;
 }
 
 bool XskPacket::setPayload(const PacketBuffer& buf)
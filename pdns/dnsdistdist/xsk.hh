@@ -250,6 +250,8 @@ public:
   [[nodiscard]] uint32_t getDataLen() const noexcept;
   [[nodiscard]] uint32_t getFrameLen() const noexcept;
   [[nodiscard]] PacketBuffer clonePacketBuffer() const;
+  /* same as clonePacketBuffer() but reuses the memory already allocated by the buffer, if any */
+  void copyPayloadTo(PacketBuffer& buffer) const;
   [[nodiscard]] PacketBuffer cloneHeaderToPacketBuffer() const;
   void setAddr(const ComboAddress& from_, MACAddr fromMAC, const ComboAddress& to_, MACAddr toMAC) noexcept;
   bool setPayload(const PacketBuffer& buf);
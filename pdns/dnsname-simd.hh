@@ -0,0 +1,267 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+#include <string_view>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* defined in dnsname.cc, it is the table behind dns_tolower() from dnsname.hh, which includes this file */
+extern const unsigned char dns_tolower_table[256];
+
+/* Case-insensitive primitives for DNS names in wire format, processing 32 (AVX2) or
+   16 (SSE2) bytes at a time when the compiler targets these instruction sets, then 8 bytes
+   at a time using plain 64-bit integers. Only the ASCII A-Z range is folded, exactly like
+   dns_tolower(), so the results are always identical to the byte-per-byte versions below,
+   which are kept for reference, tests and benchmarks. */
+namespace pdns::dnsname_simd
+{
+inline const char* implementation()
+{
+#if defined(__AVX2__)
+  return "avx2";
+#elif defined(__SSE2__)
+  return "sse2";
+#else
+  return "swar";
+#endif
+}
+
+namespace detail
+{
+  inline unsigned char toLowerByte(unsigned char chr)
+  {
+    return dns_tolower_table[chr];
+  }
+}
+
+namespace scalar
+{
+  inline void toLower(const unsigned char* src, size_t len, unsigned char* dst)
+  {
+    for (size_t idx = 0; idx < len; idx++) {
+      dst[idx] = detail::toLowerByte(src[idx]);
+    }
+  }
+
+  inline bool iequals(const void* lhs, const void* rhs, size_t len)
+  {
+    const auto* left = static_cast<const unsigned char*>(lhs);
+    const auto* right = static_cast<const unsigned char*>(rhs);
+    for (size_t idx = 0; idx < len; idx++) {
+      if (detail::toLowerByte(left[idx]) != detail::toLowerByte(right[idx])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /* returns the difference between the first pair of bytes that differ, once lowercased, like strncasecmp() */
+  inline int icompare(const void* lhs, const void* rhs, size_t len)
+  {
+    const auto* left = static_cast<const unsigned char*>(lhs);
+    const auto* right = static_cast<const unsigned char*>(rhs);
+    for (size_t idx = 0; idx < len; idx++) {
+      if (int diff = detail::toLowerByte(left[idx]) - detail::toLowerByte(right[idx]); diff != 0) {
+        return diff;
+      }
+    }
+    return 0;
+  }
+}
+
+namespace detail
+{
+  /* lowercases 8 bytes at once, without any branch and regardless of the byte order */
+  inline uint64_t toLowerWord(uint64_t word)
+  {
+    constexpr uint64_t ones = 0x0101010101010101ULL;
+    constexpr uint64_t highBits = 0x80 * ones;
+    const uint64_t heptets = word & ~highBits;
+    /* the high bit of each byte is set if that byte is above 'Z', respectively at least 'A' */
+    const uint64_t aboveZ = heptets + (0x7F - 'Z') * ones;
+    const uint64_t atLeastA = heptets + (0x80 - 'A') * ones;
+    const uint64_t isUpper = (atLeastA ^ aboveZ) & ~word & highBits;
+    return word | (isUpper >> 2);
+  }
+
+  inline uint64_t loadWord(const unsigned char* ptr)
+  {
+    uint64_t word{0};
+    memcpy(&word, ptr, sizeof(word));
+    return word;
+  }
+
+#if defined(__SSE2__)
+  inline __m128i load16(const unsigned char* ptr)
+  {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr)); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast): intrinsics
+  }
+
+  inline __m128i toLower16(__m128i vec)
+  {
+    /* shift 'A'..'Z' to the lowest signed values so that a single signed comparison finds them */
+    const __m128i shifted = _mm_add_epi8(vec, _mm_set1_epi8(static_cast<char>(0x80 - 'A')));
+    const __m128i isUpper = _mm_cmplt_epi8(shifted, _mm_set1_epi8(static_cast<char>(-128 + 26)));
+    return _mm_or_si128(vec, _mm_and_si128(isUpper, _mm_set1_epi8(0x20)));
+  }
+
+  /* one bit per byte, set if the bytes are equal once lowercased */
+  inline uint32_t equalMask16(const unsigned char* lhs, const unsigned char* rhs)
+  {
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(toLower16(load16(lhs)), toLower16(load16(rhs)))));
+  }
+  static constexpr uint32_t s_allEqual16 = 0xFFFFU;
+#endif
+
+#if defined(__AVX2__)
+  inline __m256i load32(const unsigned char* ptr)
+  {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr)); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast): intrinsics
+  }
+
+  inline __m256i toLower32(__m256i vec)
+  {
+    const __m256i shifted = _mm256_add_epi8(vec, _mm256_set1_epi8(static_cast<char>(0x80 - 'A')));
+    const __m256i isUpper = _mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(-128 + 26)), shifted);
+    return _mm256_or_si256(vec, _mm256_and_si256(isUpper, _mm256_set1_epi8(0x20)));
+  }
+
+  inline uint32_t equalMask32(const unsigned char* lhs, const unsigned char* rhs)
+  {
+    return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(toLower32(load32(lhs)), toLower32(load32(rhs)))));
+  }
+  static constexpr uint32_t s_allEqual32 = 0xFFFFFFFFU;
+#endif
+}
+
+/* lowercases 'len' bytes from 'src' into 'dst', which may be the same buffer */
+inline void toLower(const unsigned char* src, size_t len, unsigned char* dst)
+{
+  size_t idx = 0;
+#if defined(__AVX2__)
+  for (; idx + 32 <= len; idx += 32) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + idx), detail::toLower32(detail::load32(src + idx))); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast): intrinsics
+  }
+#endif
+#if defined(__SSE2__)
+  for (; idx + 16 <= len; idx += 16) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + idx), detail::toLower16(detail::load16(src + idx))); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast): intrinsics
+  }
+#endif
+  for (; idx + sizeof(uint64_t) <= len; idx += sizeof(uint64_t)) {
+    const uint64_t word = detail::toLowerWord(detail::loadWord(src + idx));
+    memcpy(dst + idx, &word, sizeof(word));
+  }
+  for (; idx < len; idx++) {
+    dst[idx] = detail::toLowerByte(src[idx]);
+  }
+}
+
+inline bool iequals(const void* lhs, const void* rhs, size_t len)
+{
+  const auto* left = static_cast<const unsigned char*>(lhs);
+  const auto* right = static_cast<const unsigned char*>(rhs);
+  /* the last block always overlaps bytes that have already been checked,
+     which is harmless and cheaper than dealing with the remaining bytes one by one */
+#if defined(__AVX2__)
+  if (len >= 32) {
+    for (size_t idx = 0; idx + 32 < len; idx += 32) {
+      if (detail::equalMask32(left + idx, right + idx) != detail::s_allEqual32) {
+        return false;
+      }
+    }
+    return detail::equalMask32(left + len - 32, right + len - 32) == detail::s_allEqual32;
+  }
+#endif
+#if defined(__SSE2__)
+  if (len >= 16) {
+    for (size_t idx = 0; idx + 16 < len; idx += 16) {
+      if (detail::equalMask16(left + idx, right + idx) != detail::s_allEqual16) {
+        return false;
+      }
+    }
+    return detail::equalMask16(left + len - 16, right + len - 16) == detail::s_allEqual16;
+  }
+#endif
+  if (len >= sizeof(uint64_t)) {
+    for (size_t idx = 0; idx + sizeof(uint64_t) < len; idx += sizeof(uint64_t)) {
+      if (detail::toLowerWord(detail::loadWord(left + idx)) != detail::toLowerWord(detail::loadWord(right + idx))) {
+        return false;
+      }
+    }
+    return detail::toLowerWord(detail::loadWord(left + len - sizeof(uint64_t))) == detail::toLowerWord(detail::loadWord(right + len - sizeof(uint64_t)));
+  }
+  return scalar::iequals(left, right, len);
+}
+
+/* returns the difference between the first pair of bytes that differ, once lowercased, like strncasecmp() */
+inline int icompare(const void* lhs, const void* rhs, size_t len)
+{
+  const auto* left = static_cast<const unsigned char*>(lhs);
+  const auto* right = static_cast<const unsigned char*>(rhs);
+  size_t idx = 0;
+#if defined(__AVX2__)
+  for (; idx + 32 <= len; idx += 32) {
+    if (const uint32_t mask = detail::equalMask32(left + idx, right + idx); mask != detail::s_allEqual32) {
+      idx += __builtin_ctz(~mask);
+      return detail::toLowerByte(left[idx]) - detail::toLowerByte(right[idx]);
+    }
+  }
+#endif
+#if defined(__SSE2__)
+  for (; idx + 16 <= len; idx += 16) {
+    if (const uint32_t mask = detail::equalMask16(left + idx, right + idx); mask != detail::s_allEqual16) {
+      idx += __builtin_ctz(~mask & detail::s_allEqual16);
+      return detail::toLowerByte(left[idx]) - detail::toLowerByte(right[idx]);
+    }
+  }
+#endif
+  /* skip the 8-byte words that are equal, the first difference is then found by the byte loop */
+  for (; idx + sizeof(uint64_t) <= len; idx += sizeof(uint64_t)) {
+    if (detail::toLowerWord(detail::loadWord(left + idx)) != detail::toLowerWord(detail::loadWord(right + idx))) {
+      break;
+    }
+  }
+  return scalar::icompare(left + idx, right + idx, len - idx);
+}
+
+/* three-way comparison of two labels or names, a shorter string sorting first when it is a prefix
+   of the other, like pdns_ilexicographical_compare_three_way() */
+inline int icompare(std::string_view lhs, std::string_view rhs)
+{
+  if (int ret = icompare(lhs.data(), rhs.data(), std::min(lhs.size(), rhs.size())); ret != 0) {
+    return ret;
+  }
+  if (lhs.size() == rhs.size()) {
+    return 0;
+  }
+  return lhs.size() < rhs.size() ? -1 : 1;
+}
+}
@@ -60,6 +60,7 @@ inline unsigned char dns_tolower(unsigned char chr)
 }
 
 #include "burtle.hh"
+#include "dnsname-simd.hh"
 #include "views.hh"
 
 /* Quest in life:
@@ -141,9 +142,9 @@ public:
   }
   void makeUsLowerCase()
   {
-    for(auto & c : d_storage) {
-      c=dns_tolower(c);
-    }
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast): the storage is made of bytes
+    auto* data = reinterpret_cast<unsigned char*>(d_storage.data());
+    pdns::dnsname_simd::toLower(data, d_storage.size(), data);
   }
   void makeUsRelative(const DNSName& zone);
   DNSName getCommonLabels(const DNSName& other) const; //!< Return the list of common labels from the top, for example 'c.d' for 'a.b.c.d' and 'x.y.c.d'
@@ -422,7 +423,7 @@ struct SuffixMatchTree
   }
   bool operator<(const SuffixMatchTree& rhs) const
   {
-    return strcasecmp(d_name.c_str(), rhs.d_name.c_str()) < 0;
+    return pdns::dnsname_simd::icompare(d_name, rhs.d_name) < 0;
   }
 
   std::string d_name;
@@ -438,29 +439,13 @@ struct SuffixMatchTree
     std::string_view d_name;
     bool operator<(const SuffixMatchTree& smt) const
     {
-      auto compareUpTo = std::min(this->d_name.size(), smt.d_name.size());
-      auto ret = strncasecmp(this->d_name.data(), smt.d_name.data(), compareUpTo);
-      if (ret != 0) {
-        return ret < 0;
-      }
-      if (this->d_name.size() == smt.d_name.size()) {
-        return ret < 0;
-      }
-      return this->d_name.size() < smt.d_name.size();
+      return pdns::dnsname_simd::icompare(this->d_name, smt.d_name) < 0;
     }
   };
 
   bool operator<(const LightKey& lk) const
   {
-    auto compareUpTo = std::min(this->d_name.size(), lk.d_name.size());
-    auto ret = strncasecmp(this->d_name.data(), lk.d_name.data(), compareUpTo);
-    if (ret != 0) {
-      return ret < 0;
-    }
-    if (this->d_name.size() == lk.d_name.size()) {
-      return ret < 0;
-    }
-    return this->d_name.size() < lk.d_name.size();
+    return pdns::dnsname_simd::icompare(this->d_name, lk.d_name) < 0;
   }
 
   template<typename V>
@@ -745,14 +730,7 @@ bool DNSName::operator==(const DNSName& rhs) const
     return false;
   }
 
-  const auto* us = d_storage.cbegin();
-  const auto* p = rhs.d_storage.cbegin();
-  for (; us != d_storage.cend() && p != rhs.d_storage.cend(); ++us, ++p) {
-    if (dns_tolower(*p) != dns_tolower(*us)) {
-      return false;
-    }
-  }
-  return true;
+  return pdns::dnsname_simd::iequals(d_storage.data(), rhs.d_storage.data(), d_storage.size());
 }
 
 struct DNSNameSet: public std::unordered_set<DNSName> {
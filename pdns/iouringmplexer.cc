@@ -0,0 +1,842 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+/* we need IORING_FEAT_EXT_ARG (Linux 5.11) to wait for completions with a timeout */
+#if defined(HAVE_LINUX_IO_URING_H) && defined(IORING_FEAT_EXT_ARG)
+
+#include <array>
+#include <csignal>
+#include <cstring>
+#include <limits>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <unordered_map>
+
+#include "mplexer.hh"
+#include "misc.hh"
+
+#include "namespaces.hh"
+
+static unsigned loadAcquire(const unsigned* ptr)
+{
+  return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+static void storeRelease(unsigned* ptr, unsigned value)
+{
+  __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+}
+
+/* Readiness notifications via io_uring poll requests. All the changes made to the set of
+   watched descriptors since the last call to run() or getAvailableFDs() are queued in the
+   submission ring and submitted, in a single batch, by the system call waiting for events.
+   We use one-shot poll requests that are re-armed, in the next batch, once the corresponding
+   callbacks have been called: multishot poll requests only report new wake-ups, which would
+   break the level-triggered semantics expected from a multiplexer.
+   Descriptors added via addReceiveFD() are read by the kernel itself, using multishot receive
+   requests picking their buffers from a ring we provide (Linux 6.0+), and the received datagrams
+   are only reported by getReceivedData(). The buffers handed out are given back to the kernel
+   at the beginning of the next call. */
+class IOUringFDMultiplexer : public FDMultiplexer
+{
+public:
+  IOUringFDMultiplexer(unsigned int maxEventsHint);
+  IOUringFDMultiplexer(const IOUringFDMultiplexer&) = delete;
+  IOUringFDMultiplexer(IOUringFDMultiplexer&&) = delete;
+  IOUringFDMultiplexer& operator=(const IOUringFDMultiplexer&) = delete;
+  IOUringFDMultiplexer& operator=(IOUringFDMultiplexer&&) = delete;
+  ~IOUringFDMultiplexer() override
+  {
+    cleanup();
+  }
+
+  int run(struct timeval* tv, int timeout = 500) override;
+  void getAvailableFDs(std::vector<int>& fds, int timeout) override;
+
+  void addFD(int fd, FDMultiplexer::EventKind kind) override;
+  void removeFD(int fd, FDMultiplexer::EventKind kind) override;
+  void alterFD(int fd, FDMultiplexer::EventKind from, FDMultiplexer::EventKind to) override;
+
+  bool supportsReceive() const override
+  {
+    return d_canReceive;
+  }
+  void addReceiveFD(int fd, size_t maxSize) override;
+  void removeReceiveFD(int fd) override;
+  void getReceivedData(std::vector<ReceivedData>& received, int timeout) override;
+
+  string getName() const override
+  {
+    return "io_uring";
+  }
+
+private:
+  struct WatchedFD
+  {
+    uint32_t d_generation{0};
+    uint32_t d_events{0};
+    /* whether a poll request is pending for that descriptor */
+    bool d_armed{false};
+  };
+
+  struct Event
+  {
+    int d_fd;
+    uint32_t d_generation;
+    int32_t d_result;
+  };
+
+  struct Receiver
+  {
+    uint32_t d_generation{0};
+    uint16_t d_group{0};
+    /* whether a receive request is pending for that descriptor */
+    bool d_armed{false};
+  };
+
+  /* buffers of the same size, provided to the kernel via a ring shared with it */
+  struct BufferGroup
+  {
+    std::vector<char> d_buffers;
+    void* d_ring{MAP_FAILED};
+    size_t d_bufferSize{0};
+    uint16_t d_id{0};
+    /* our tail, including the buffers that have not been made visible to the kernel yet */
+    uint16_t d_tail{0};
+  };
+
+  /* the highest bit of the user data is only set for receive requests, which use 7 bits for the
+     buffer group and 24 bits for the generation, instead of 31, so that stale completions can
+     still give their buffer back */
+  static constexpr uint64_t s_receiveRequest{1ULL << 63};
+  static constexpr size_t s_maxBufferGroups{128};
+  static constexpr uint32_t s_receiveGenerationMask{0xffffff};
+
+  static uint64_t getUserData(int fd, uint32_t generation)
+  {
+    return (static_cast<uint64_t>(generation) << 32) | static_cast<uint32_t>(fd);
+  }
+
+  static uint64_t getReceiveUserData(int fd, uint32_t generation, uint16_t group)
+  {
+    return s_receiveRequest | (static_cast<uint64_t>(group) << 56) | (static_cast<uint64_t>(generation & s_receiveGenerationMask) << 32) | static_cast<uint32_t>(fd);
+  }
+
+  unsigned getPendingSubmissions() const
+  {
+    return d_sqLocalTail - loadAcquire(d_sqHead);
+  }
+
+  void cleanup();
+  io_uring_sqe* getSQE();
+  int enter(unsigned int toSubmit, unsigned int minComplete, int timeout);
+  void waitForEvents(int timeout);
+  void queuePoll(int fd, WatchedFD& watched);
+  void rearm();
+  uint32_t getNextGeneration();
+  size_t getEventsCount() const
+  {
+    return d_events.size() + d_received.size();
+  }
+  bool testReceive();
+  uint16_t getBufferGroup(size_t bufferSize);
+  void releaseBufferGroups();
+  void recycleBuffers();
+  void provideBuffer(BufferGroup& group, uint16_t bufferID) const;
+  static void publishBuffers(BufferGroup& group);
+  void queueReceive(int fd, Receiver& receiver);
+  void handleReceiveCompletion(const io_uring_cqe& cqe);
+  void rearmReceivers();
+
+  std::unordered_map<int, WatchedFD> d_watched;
+  std::unordered_map<int, Receiver> d_receivers;
+  std::vector<Event> d_events;
+  std::vector<ReceivedData> d_received;
+  std::vector<BufferGroup> d_groups;
+  /* group and identifier of the buffers to give back to the kernel */
+  std::vector<std::pair<uint16_t, uint16_t>> d_buffersToRecycle;
+  std::vector<int> d_receiversToRearm;
+  void* d_rings{MAP_FAILED};
+  size_t d_ringsSize{0};
+  io_uring_sqe* d_sqes{static_cast<io_uring_sqe*>(MAP_FAILED)};
+  size_t d_sqesSize{0};
+  /* submission ring, shared with the kernel */
+  unsigned* d_sqHead{nullptr};
+  unsigned* d_sqTail{nullptr};
+  unsigned* d_sqArray{nullptr};
+  unsigned* d_sqFlags{nullptr};
+  unsigned d_sqMask{0};
+  unsigned d_sqEntries{0};
+  /* our tail, including the entries that have not been made visible to the kernel yet */
+  unsigned d_sqLocalTail{0};
+  /* completion ring, shared with the kernel */
+  unsigned* d_cqHead{nullptr};
+  unsigned* d_cqTail{nullptr};
+  io_uring_cqe* d_cqes{nullptr};
+  unsigned d_cqMask{0};
+  unsigned d_maxEvents;
+  /* the number of buffers in a group, a power of two at least twice as large as the number of events
+     we report in one call. When all of them are in use, the kernel stops receiving for us and the
+     datagrams wait in the socket buffer until the next call gives some of them back */
+  uint32_t d_buffersPerGroup;
+  uint32_t d_generation{0};
+  int d_ringfd{-1};
+  bool d_canReceive{false};
+};
+
+static FDMultiplexer* makeIOUring(unsigned int maxEventsHint)
+{
+  return new IOUringFDMultiplexer(maxEventsHint);
+}
+
+static struct IOUringRegisterOurselves
+{
+  IOUringRegisterOurselves()
+  {
+    /* never selected by default, it has to be explicitly requested */
+    FDMultiplexer::getOptInMultiplexerMap().emplace("io_uring", &makeIOUring);
+  }
+} doItIOUring;
+
+template <typename T>
+static T* ringPointer(void* base, uint32_t offset)
+{
+  return reinterpret_cast<T*>(static_cast<char*>(base) + offset); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast,cppcoreguidelines-pro-bounds-pointer-arithmetic): this is how the kernel describes the ring layout
+}
+
+static uint32_t getBuffersPerGroup(unsigned int maxEvents)
+{
+  /* a power of two, up to the limit set by the kernel */
+  uint32_t count = 16;
+  while (count < maxEvents * 2 && count < 32768) {
+    count *= 2;
+  }
+  return count;
+}
+
+IOUringFDMultiplexer::IOUringFDMultiplexer(unsigned int maxEventsHint) :
+  d_maxEvents(std::max(maxEventsHint, 1U)), d_buffersPerGroup(getBuffersPerGroup(d_maxEvents))
+{
+  io_uring_params params{};
+  /* the completion ring is twice as large by default, and completions are not dropped when it is full */
+  const unsigned int entries = std::min(std::max(maxEventsHint, 64U), 4096U);
+#if defined(IORING_SETUP_COOP_TASKRUN)
+  /* do not interrupt the thread when a request completes, the work needed to complete it (copying a
+     received datagram, for example) is then done in batches when we ask for completions (Linux 5.19+) */
+  params.flags = IORING_SETUP_COOP_TASKRUN;
+  d_ringfd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+  if (d_ringfd < 0 && errno == EINVAL) {
+    params = io_uring_params{};
+    d_ringfd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+  }
+#else
+  d_ringfd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+#endif
+  if (d_ringfd < 0) {
+    throw FDMultiplexerException("Setting up io_uring: " + stringerror());
+  }
+
+  const uint32_t required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+  if ((params.features & required) != required) {
+    cleanup();
+    throw FDMultiplexerException("Setting up io_uring: the kernel does not support the required features");
+  }
+
+  d_ringsSize = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned), params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+  d_rings = mmap(nullptr, d_ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, d_ringfd, IORING_OFF_SQ_RING);
+  if (d_rings == MAP_FAILED) {
+    int err = errno;
+    cleanup();
+    throw FDMultiplexerException("Mapping the io_uring rings: " + stringerror(err));
+  }
+  d_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+  d_sqes = static_cast<io_uring_sqe*>(mmap(nullptr, d_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, d_ringfd, IORING_OFF_SQES));
+  if (d_sqes == MAP_FAILED) {
+    int err = errno;
+    cleanup();
+    throw FDMultiplexerException("Mapping the io_uring submission entries: " + stringerror(err));
+  }
+
+  d_sqHead = ringPointer<unsigned>(d_rings, params.sq_off.head);
+  d_sqTail = ringPointer<unsigned>(d_rings, params.sq_off.tail);
+  d_sqArray = ringPointer<unsigned>(d_rings, params.sq_off.array);
+  d_sqFlags = ringPointer<unsigned>(d_rings, params.sq_off.flags);
+  d_sqMask = *ringPointer<unsigned>(d_rings, params.sq_off.ring_mask);
+  d_sqEntries = *ringPointer<unsigned>(d_rings, params.sq_off.ring_entries);
+  d_sqLocalTail = *d_sqTail;
+  d_cqHead = ringPointer<unsigned>(d_rings, params.cq_off.head);
+  d_cqTail = ringPointer<unsigned>(d_rings, params.cq_off.tail);
+  d_cqes = ringPointer<io_uring_cqe>(d_rings, params.cq_off.cqes);
+  d_cqMask = *ringPointer<unsigned>(d_rings, params.cq_off.ring_mask);
+  d_events.reserve(d_maxEvents);
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0); // for self-test
+  if (fd < 0) {
+    return;
+  }
+
+  try {
+    addReadFD(fd, 0);
+    /* make sure that poll requests are actually accepted */
+    std::vector<int> ready;
+    getAvailableFDs(ready, 0);
+    removeReadFD(fd);
+    close(fd);
+  }
+  catch (const FDMultiplexerException& fe) {
+    close(fd);
+    cleanup();
+    throw FDMultiplexerException("io_uring multiplexer failed self-test: " + string(fe.what()));
+  }
+
+  /* not being able to receive is fine, the callers will read from the descriptors themselves */
+  d_canReceive = testReceive();
+}
+
+bool IOUringFDMultiplexer::testReceive()
+{
+#if defined(IORING_RECV_MULTISHOT)
+  std::array<int, 2> fds{-1, -1};
+  if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds.data()) != 0) {
+    return false;
+  }
+
+  bool result = false;
+  d_canReceive = true;
+  try {
+    addReceiveFD(fds[0], 64);
+    std::vector<ReceivedData> received;
+    if (send(fds[1], "x", 1, 0) == 1) {
+      getReceivedData(received, 100);
+      result = received.size() == 1 && received.at(0).d_fd == fds[0] && received.at(0).d_size == 1 && received.at(0).d_data[0] == 'x';
+    }
+    removeReceiveFD(fds[0]);
+    /* submit the cancellation before the buffers go away */
+    getReceivedData(received, 0);
+  }
+  catch (const FDMultiplexerException& exp) {
+    result = false;
+    d_receivers.clear();
+  }
+  d_canReceive = false;
+  close(fds[0]);
+  close(fds[1]);
+  releaseBufferGroups();
+  return result;
+#else
+  return false;
+#endif /* IORING_RECV_MULTISHOT */
+}
+
+void IOUringFDMultiplexer::cleanup()
+{
+  releaseBufferGroups();
+  if (d_sqes != MAP_FAILED) {
+    munmap(d_sqes, d_sqesSize);
+    d_sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+  }
+  if (d_rings != MAP_FAILED) {
+    munmap(d_rings, d_ringsSize);
+    d_rings = MAP_FAILED;
+  }
+  if (d_ringfd >= 0) {
+    close(d_ringfd);
+    d_ringfd = -1;
+  }
+}
+
+io_uring_sqe* IOUringFDMultiplexer::getSQE()
+{
+  if (getPendingSubmissions() >= d_sqEntries) {
+    /* the submission ring is full, submit what we have so far */
+    enter(getPendingSubmissions(), 0, 0);
+    if (getPendingSubmissions() >= d_sqEntries) {
+      throw FDMultiplexerException("The io_uring submission ring is full");
+    }
+  }
+
+  const unsigned index = d_sqLocalTail & d_sqMask;
+  auto* sqe = &d_sqes[index]; // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic): ring shared with the kernel
+  memset(sqe, 0, sizeof(*sqe));
+  d_sqArray[index] = index; // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic): ring shared with the kernel
+  d_sqLocalTail++;
+  return sqe;
+}
+
+int IOUringFDMultiplexer::enter(unsigned int toSubmit, unsigned int minComplete, int timeout)
+{
+  /* make the new submission entries visible to the kernel */
+  storeRelease(d_sqTail, d_sqLocalTail);
+
+  __kernel_timespec waitFor{};
+  io_uring_getevents_arg arg{};
+  arg.sigmask = 0;
+  arg.sigmask_sz = _NSIG / 8;
+  if (minComplete > 0 && timeout >= 0) {
+    waitFor.tv_sec = timeout / 1000;
+    waitFor.tv_nsec = static_cast<long long>(timeout % 1000) * 1000000;
+    arg.ts = reinterpret_cast<uint64_t>(&waitFor); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast): the kernel wants the address as an integer
+  }
+
+  /* we always ask for events, even when we are not waiting, so that pending completions are flushed */
+  const unsigned int flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+  int ret = static_cast<int>(syscall(__NR_io_uring_enter, d_ringfd, toSubmit, minComplete, flags, &arg, sizeof(arg)));
+  /* ETIME: timeout, EBUSY/EAGAIN: completion ring overflow, we need to reap first */
+  if (ret < 0 && errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+    throw FDMultiplexerException("io_uring returned error: " + stringerror());
+  }
+  return ret;
+}
+
+void IOUringFDMultiplexer::queuePoll(int fd, WatchedFD& watched)
+{
+  auto* sqe = getSQE();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+#if __BYTE_ORDER == __BIG_ENDIAN
+  sqe->poll32_events = (watched.d_events << 16) | (watched.d_events >> 16);
+#else
+  sqe->poll32_events = watched.d_events;
+#endif
+  sqe->user_data = getUserData(fd, watched.d_generation);
+  watched.d_armed = true;
+}
+
+static uint32_t convertEventKind(FDMultiplexer::EventKind kind)
+{
+  switch (kind) {
+  case FDMultiplexer::EventKind::Read:
+    return POLLIN;
+  case FDMultiplexer::EventKind::Write:
+    return POLLOUT;
+  case FDMultiplexer::EventKind::Both:
+    return POLLIN | POLLOUT;
+  }
+
+  throw std::runtime_error("Unhandled event kind in the io_uring multiplexer");
+}
+
+/* a new generation, so that completions related to a previous registration of the same descriptor are ignored.
+   It never uses the highest bit, which is reserved for receive requests */
+uint32_t IOUringFDMultiplexer::getNextGeneration()
+{
+  d_generation = (d_generation + 1) & 0x7fffffffU;
+  if (d_generation == 0) {
+    d_generation = 1;
+  }
+  return d_generation;
+}
+
+void IOUringFDMultiplexer::addFD(int fd, FDMultiplexer::EventKind kind)
+{
+  auto [entry, inserted] = d_watched.try_emplace(fd);
+  if (!inserted) {
+    throw FDMultiplexerException("Adding fd to io_uring set: already present");
+  }
+
+  entry->second.d_generation = getNextGeneration();
+  entry->second.d_events = convertEventKind(kind);
+  try {
+    queuePoll(fd, entry->second);
+  }
+  catch (...) {
+    d_watched.erase(entry);
+    throw;
+  }
+}
+
+void IOUringFDMultiplexer::removeFD(int fd, FDMultiplexer::EventKind)
+{
+  auto entry = d_watched.find(fd);
+  if (entry == d_watched.end()) {
+    throw FDMultiplexerException("Removing fd from io_uring set: not present");
+  }
+
+  if (entry->second.d_armed) {
+    auto* sqe = getSQE();
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = getUserData(fd, entry->second.d_generation);
+    /* we are not interested in the result */
+    sqe->user_data = 0;
+  }
+  d_watched.erase(entry);
+}
+
+void IOUringFDMultiplexer::alterFD(int fd, FDMultiplexer::EventKind from, FDMultiplexer::EventKind to)
+{
+  removeFD(fd, from);
+  addFD(fd, to);
+}
+
+void IOUringFDMultiplexer::waitForEvents(int timeout)
+{
+  d_events.clear();
+  d_received.clear();
+  recycleBuffers();
+
+  /* submit the pending changes and, unless we already have completions, wait for some */
+  const bool haveCompletions = *d_cqHead != loadAcquire(d_cqTail);
+  enter(getPendingSubmissions(), (haveCompletions || timeout == 0) ? 0 : 1, timeout);
+
+  while (getEventsCount() < d_maxEvents) {
+    unsigned head = *d_cqHead;
+    const unsigned tail = loadAcquire(d_cqTail);
+    if (head == tail) {
+      /* completions that did not fit into the ring are moved there when we enter the kernel */
+      if ((loadAcquire(d_sqFlags) & IORING_SQ_CQ_OVERFLOW) == 0) {
+        break;
+      }
+      enter(getPendingSubmissions(), 0, 0);
+      if (*d_cqHead == loadAcquire(d_cqTail)) {
+        break;
+      }
+      continue;
+    }
+
+    for (; head != tail && getEventsCount() < d_maxEvents; head++) {
+      const auto& cqe = d_cqes[head & d_cqMask]; // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic): ring shared with the kernel
+      if ((cqe.user_data & s_receiveRequest) != 0) {
+        handleReceiveCompletion(cqe);
+        continue;
+      }
+      if (cqe.user_data == 0 || cqe.res == -ECANCELED) {
+        continue;
+      }
+      const auto fd = static_cast<int>(cqe.user_data & 0xffffffffU);
+      const auto generation = static_cast<uint32_t>(cqe.user_data >> 32);
+      auto entry = d_watched.find(fd);
+      if (entry == d_watched.end() || entry->second.d_generation != generation) {
+        /* the descriptor has been removed, or removed and added again, since */
+        continue;
+      }
+      entry->second.d_armed = false;
+      d_events.push_back({fd, generation, cqe.res});
+    }
+    storeRelease(d_cqHead, head);
+  }
+
+  rearmReceivers();
+}
+
+void IOUringFDMultiplexer::rearm()
+{
+  for (const auto& event : d_events) {
+    auto entry = d_watched.find(event.d_fd);
+    if (entry != d_watched.end() && entry->second.d_generation == event.d_generation && !entry->second.d_armed) {
+      queuePoll(event.d_fd, entry->second);
+    }
+  }
+}
+
+void IOUringFDMultiplexer::getAvailableFDs(std::vector<int>& fds, int timeout)
+{
+  waitForEvents(timeout);
+  for (const auto& event : d_events) {
+    fds.push_back(event.d_fd);
+  }
+  rearm();
+}
+
+void IOUringFDMultiplexer::getReceivedData(std::vector<ReceivedData>& received, int timeout)
+{
+  waitForEvents(timeout);
+  received.insert(received.end(), d_received.begin(), d_received.end());
+  /* readiness events are only reported by run() and getAvailableFDs(), but the poll requests still need to be re-armed */
+  rearm();
+}
+
+int IOUringFDMultiplexer::run(struct timeval* now, int timeout)
+{
+  InRun guard(d_inrun);
+
+  waitForEvents(timeout);
+  gettimeofday(now, nullptr); // MANDATORY
+
+  int count = 0;
+  for (const auto& event : d_events) {
+    /* an error on the poll request itself, like EBADF, is reported to both sides, as EPOLLERR would be */
+    const uint32_t events = event.d_result < 0 ? POLLERR : static_cast<uint32_t>(event.d_result);
+    if ((events & POLLIN) || (events & POLLERR) || (events & POLLHUP)) {
+      const auto& iter = d_readCallbacks.find(event.d_fd);
+      if (iter != d_readCallbacks.end()) {
+        iter->d_callback(iter->d_fd, iter->d_parameter);
+        count++;
+      }
+    }
+
+    if ((events & POLLOUT) || (events & POLLERR) || (events & POLLHUP)) {
+      const auto& iter = d_writeCallbacks.find(event.d_fd);
+      if (iter != d_writeCallbacks.end()) {
+        iter->d_callback(iter->d_fd, iter->d_parameter);
+        count++;
+      }
+    }
+  }
+
+  /* the callbacks might have removed descriptors, or even added them back */
+  rearm();
+  return count;
+}
+
+void IOUringFDMultiplexer::addReceiveFD(int fd, size_t maxSize)
+{
+  if (!d_canReceive) {
+    throw FDMultiplexerException("The io_uring multiplexer does not support receiving data on this kernel");
+  }
+  if (maxSize == 0 || maxSize > std::numeric_limits<uint32_t>::max()) {
+    throw FDMultiplexerException("Invalid receive size for the io_uring multiplexer: " + std::to_string(maxSize));
+  }
+
+  auto [entry, inserted] = d_receivers.try_emplace(fd);
+  if (!inserted) {
+    throw FDMultiplexerException("Adding fd to the io_uring receive set: already present");
+  }
+
+  try {
+    entry->second.d_generation = getNextGeneration();
+    entry->second.d_group = getBufferGroup(maxSize);
+    queueReceive(fd, entry->second);
+  }
+  catch (...) {
+    d_receivers.erase(entry);
+    throw;
+  }
+}
+
+void IOUringFDMultiplexer::removeReceiveFD(int fd)
+{
+  auto entry = d_receivers.find(fd);
+  if (entry == d_receivers.end()) {
+    throw FDMultiplexerException("Removing fd from the io_uring receive set: not present");
+  }
+
+  if (entry->second.d_armed) {
+    auto* sqe = getSQE();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = getReceiveUserData(fd, entry->second.d_generation, entry->second.d_group);
+    /* we are not interested in the result */
+    sqe->user_data = 0;
+    /* submit it right away so that the kernel does not consume, on our behalf, datagrams we would drop */
+    enter(getPendingSubmissions(), 0, 0);
+  }
+  d_receivers.erase(entry);
+}
+
+#if defined(IORING_RECV_MULTISHOT)
+
+uint16_t IOUringFDMultiplexer::getBufferGroup(size_t bufferSize)
+{
+  for (const auto& group : d_groups) {
+    if (group.d_bufferSize == bufferSize) {
+      return group.d_id;
+    }
+  }
+
+  if (d_groups.size() >= s_maxBufferGroups) {
+    throw FDMultiplexerException("Too many different receive sizes for the io_uring multiplexer");
+  }
+
+  BufferGroup group;
+  group.d_id = static_cast<uint16_t>(d_groups.size());
+  group.d_bufferSize = bufferSize;
+  /* the ring has to be page-aligned */
+  group.d_ring = mmap(nullptr, d_buffersPerGroup * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (group.d_ring == MAP_FAILED) {
+    throw FDMultiplexerException("Allocating an io_uring buffer ring: " + stringerror());
+  }
+
+  io_uring_buf_reg reg{};
+  reg.ring_addr = reinterpret_cast<uint64_t>(group.d_ring); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast): the kernel wants the address as an integer
+  reg.ring_entries = d_buffersPerGroup;
+  reg.bgid = group.d_id;
+  if (syscall(__NR_io_uring_register, d_ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    int err = errno;
+    munmap(group.d_ring, d_buffersPerGroup * sizeof(io_uring_buf));
+    throw FDMultiplexerException("Registering an io_uring buffer ring: " + stringerror(err));
+  }
+
+  group.d_buffers.resize(bufferSize * d_buffersPerGroup);
+  for (uint32_t bufferID = 0; bufferID < d_buffersPerGroup; bufferID++) {
+    provideBuffer(group, static_cast<uint16_t>(bufferID));
+  }
+  publishBuffers(group);
+  d_groups.push_back(std::move(group));
+  return d_groups.back().d_id;
+}
+
+void IOUringFDMultiplexer::releaseBufferGroups()
+{
+  for (auto& group : d_groups) {
+    if (d_ringfd >= 0) {
+      io_uring_buf_reg reg{};
+      reg.bgid = group.d_id;
+      syscall(__NR_io_uring_register, d_ringfd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    }
+    munmap(group.d_ring, d_buffersPerGroup * sizeof(io_uring_buf));
+  }
+  d_groups.clear();
+  d_buffersToRecycle.clear();
+  d_received.clear();
+}
+
+void IOUringFDMultiplexer::recycleBuffers()
+{
+  if (d_buffersToRecycle.empty()) {
+    return;
+  }
+
+  for (const auto& [groupID, bufferID] : d_buffersToRecycle) {
+    provideBuffer(d_groups.at(groupID), bufferID);
+  }
+  d_buffersToRecycle.clear();
+
+  for (auto& group : d_groups) {
+    publishBuffers(group);
+  }
+}
+
+void IOUringFDMultiplexer::provideBuffer(BufferGroup& group, uint16_t bufferID) const
+{
+  /* the tail of the ring overlaps the last field of the first entry, which we leave alone */
+  auto* entry = &static_cast<io_uring_buf*>(group.d_ring)[group.d_tail & (d_buffersPerGroup - 1U)]; // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic): ring shared with the kernel
+  entry->addr = reinterpret_cast<uint64_t>(&group.d_buffers.at(bufferID * group.d_bufferSize)); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast): the kernel wants the address as an integer
+  entry->len = static_cast<uint32_t>(group.d_bufferSize);
+  entry->bid = bufferID;
+  group.d_tail++;
+}
+
+void IOUringFDMultiplexer::publishBuffers(BufferGroup& group)
+{
+  /* make the new buffers visible to the kernel */
+  __atomic_store_n(&static_cast<io_uring_buf_ring*>(group.d_ring)->tail, group.d_tail, __ATOMIC_RELEASE);
+}
+
+void IOUringFDMultiplexer::queueReceive(int fd, Receiver& receiver)
+{
+  auto* sqe = getSQE();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = receiver.d_group;
+  /* the size of the buffer picked from the group */
+  sqe->len = 0;
+  sqe->user_data = getReceiveUserData(fd, receiver.d_generation, receiver.d_group);
+  receiver.d_armed = true;
+}
+
+void IOUringFDMultiplexer::handleReceiveCompletion(const io_uring_cqe& cqe)
+{
+  const auto fd = static_cast<int>(cqe.user_data & 0xffffffffU);
+  const auto generation = static_cast<uint32_t>(cqe.user_data >> 32) & s_receiveGenerationMask;
+  const auto groupID = static_cast<uint16_t>((cqe.user_data >> 56) & 0x7fU);
+  auto entry = d_receivers.find(fd);
+  /* the descriptor might have been removed, or removed and added again, since */
+  const bool current = entry != d_receivers.end() && (entry->second.d_generation & s_receiveGenerationMask) == generation;
+
+  if (current && (cqe.flags & IORING_CQE_F_MORE) == 0) {
+    /* the kernel stopped receiving for us, for example because it ran out of buffers (ENOBUFS),
+       which we give back before submitting a new request. Do not insist on permanent errors. */
+    entry->second.d_armed = false;
+    if (cqe.res != -EBADF && cqe.res != -EINVAL && cqe.res != -ENOTSOCK && cqe.res != -EOPNOTSUPP && cqe.res != -ECANCELED) {
+      d_receiversToRearm.push_back(fd);
+    }
+  }
+
+  if ((cqe.flags & IORING_CQE_F_BUFFER) == 0) {
+    return;
+  }
+
+  if (groupID >= d_groups.size()) {
+    /* the group has been released since */
+    return;
+  }
+  const auto bufferID = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+  d_buffersToRecycle.emplace_back(groupID, bufferID);
+  if (current && cqe.res > 0) {
+    const auto& group = d_groups.at(groupID);
+    d_received.push_back({&group.d_buffers.at(bufferID * group.d_bufferSize), static_cast<size_t>(cqe.res), fd});
+  }
+}
+
+void IOUringFDMultiplexer::rearmReceivers()
+{
+  for (const auto fd : d_receiversToRearm) {
+    auto entry = d_receivers.find(fd);
+    if (entry != d_receivers.end() && !entry->second.d_armed) {
+      queueReceive(fd, entry->second);
+    }
+  }
+  d_receiversToRearm.clear();
+}
+
+#else /* IORING_RECV_MULTISHOT */
+
+uint16_t IOUringFDMultiplexer::getBufferGroup(size_t /* bufferSize */)
+{
+  throw FDMultiplexerException("The io_uring multiplexer does not support receiving data on this system");
+}
+
+void IOUringFDMultiplexer::releaseBufferGroups()
+{
+}
+
+void IOUringFDMultiplexer::recycleBuffers()
+{
+}
+
+void IOUringFDMultiplexer::provideBuffer(BufferGroup& /* group */, uint16_t /* bufferID */) const
+{
+}
+
+void IOUringFDMultiplexer::publishBuffers(BufferGroup& /* group */)
+{
+}
+
+void IOUringFDMultiplexer::queueReceive(int /* fd */, Receiver& /* receiver */)
+{
+  throw FDMultiplexerException("The io_uring multiplexer does not support receiving data on this system");
+}
+
+void IOUringFDMultiplexer::handleReceiveCompletion(const io_uring_cqe& /* cqe */)
+{
+}
+
+void IOUringFDMultiplexer::rearmReceivers()
+{
+}
+
+#endif /* IORING_RECV_MULTISHOT */
+
+#endif /* HAVE_LINUX_IO_URING_H && IORING_FEAT_EXT_ARG */
@@ -77,6 +77,9 @@ public:
   /* The maximum number of events processed in a single run will be capped to the
      minimum value of maxEventsHint and s_maxevents, to reduce memory usage. */
   static FDMultiplexer* getMultiplexerSilent(unsigned int maxEventsHint = s_maxevents);
+  /* Same as above, but first tries the opt-in multiplexer named 'preferred', if any (see getOptInMultiplexerMap()),
+     falling back to the default ones if it is not available or cannot be set up */
+  static FDMultiplexer* getMultiplexerSilent(const std::string& preferred, unsigned int maxEventsHint = s_maxevents);
 
   struct InRun
   {
@@ -237,6 +240,50 @@ public:
     return theMap;
   }
 
+  typedef std::map<std::string, getMultiplexer_t*> FDMultiplexerNamedMap_t;
+
+  /* multiplexers that are never selected by default, only when explicitly requested by name */
+  static FDMultiplexerNamedMap_t& getOptInMultiplexerMap()
+  {
+    static FDMultiplexerNamedMap_t theMap;
+    return theMap;
+  }
+
+  struct ReceivedData
+  {
+    const char* d_data;
+    size_t d_size;
+    int d_fd;
+  };
+
+  /* Some multiplexers can read datagrams on our behalf, as soon as they are received,
+     saving the system calls otherwise needed to read from the descriptors that are ready */
+  virtual bool supportsReceive() const
+  {
+    return false;
+  }
+
+  //! Start reading datagrams of at most maxSize bytes from fd, which must not be in the read or write watch lists
+  virtual void addReceiveFD(int /* fd */, size_t /* maxSize */)
+  {
+    throw FDMultiplexerException("The " + getName() + " multiplexer does not support receiving data");
+  }
+
+  //! Stop reading datagrams from fd, dropping the ones already read but not reported yet. You can't call this function on an fd that is closed already!
+  virtual void removeReceiveFD(int /* fd */)
+  {
+    throw FDMultiplexerException("The " + getName() + " multiplexer does not support receiving data");
+  }
+
+  /* timeout is in ms, 0 will return immediately, -1 will block until at least one datagram has been received.
+     Only the descriptors added via addReceiveFD() are reported, and the data is only valid until the next call
+     to run(), getAvailableFDs() or getReceivedData(). A datagram larger than the maxSize passed to addReceiveFD()
+     is truncated to that size. */
+  virtual void getReceivedData(std::vector<ReceivedData>& /* received */, int /* timeout */)
+  {
+    throw FDMultiplexerException("The " + getName() + " multiplexer does not support receiving data");
+  }
+
   virtual std::string getName() const = 0;
 
   size_t getWatchedFDCount(bool writeFDs) const
@@ -25,6 +25,25 @@ FDMultiplexer* FDMultiplexer::getMultiplexerSilent(unsigned int maxEventsHint)
   return ret;
 }
 
+FDMultiplexer* FDMultiplexer::getMultiplexerSilent(const std::string& preferred, unsigned int maxEventsHint)
+{
+  if (!preferred.empty()) {
+    const auto& optIn = FDMultiplexer::getOptInMultiplexerMap();
+    const auto it = optIn.find(preferred);
+    if (it != optIn.end()) {
+      try {
+        return it->second(std::min(maxEventsHint, FDMultiplexer::s_maxevents));
+      }
+      catch (const FDMultiplexerException& fe) {
+        /* not supported by this kernel, for example, use the default one */
+      }
+      catch (...) {
+      }
+    }
+  }
+  return getMultiplexerSilent(maxEventsHint);
+}
+
 class PollFDMultiplexer : public FDMultiplexer
 {
 public:
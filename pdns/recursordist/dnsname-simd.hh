@@ -0,0 +1 @@
+../dnsname-simd.hh
\ No newline at end of file
@@ -25,9 +25,11 @@
 #include "dnsname.hh"
 #include "dnsparser.hh"
 #include "logging.hh"
+#include "persistent-hashmap.hh"
 #include <map>
 #include <unordered_map>
 #include <limits>
+#include <string_view>
 #include <utility>
 
 /* This class implements a filtering policy that is able to fully implement RPZ, but is not bound to it.
@@ -295,25 +297,33 @@ public:
     [[nodiscard]] DNSRecord getRecordFromCustom(const DNSName& qname, const std::shared_ptr<const DNSRecordContent>& custom) const;
   };
 
+  /* Copying a zone is cheap: the name triggers are held in persistent maps and the netmask trees are
+     shared until they are modified, so the copy made to apply an IXFR only costs what the delta touches,
+     and the zone currently in use is never modified. */
   class Zone
   {
   public:
+    using PolicyNameMap = PersistentHashMap<DNSName, Policy>;
+
     Zone() :
+      d_qpolAddr(std::make_shared<NetmaskTree<Policy>>()),
+      d_propolNSAddr(std::make_shared<NetmaskTree<Policy>>()),
+      d_postpolAddr(std::make_shared<NetmaskTree<Policy>>()),
       d_zoneData(std::make_shared<PolicyZoneData>())
     {
     }
 
     void clear()
     {
-      d_qpolAddr.clear();
-      d_postpolAddr.clear();
+      d_qpolAddr = std::make_shared<NetmaskTree<Policy>>();
+      d_postpolAddr = std::make_shared<NetmaskTree<Policy>>();
       d_propolName.clear();
-      d_propolNSAddr.clear();
+      d_propolNSAddr = std::make_shared<NetmaskTree<Policy>>();
       d_qpolName.clear();
     }
-    void reserve(size_t entriesCount)
+    void reserve(size_t /* entriesCount */)
     {
-      d_qpolName.reserve(entriesCount);
+      // the persistent maps grow without rehashing, there is nothing to reserve
     }
     void setName(const std::string& name)
     {
@@ -381,7 +391,7 @@ public:
 
     [[nodiscard]] size_t size() const
     {
-      return d_qpolAddr.size() + d_postpolAddr.size() + d_propolName.size() + d_propolNSAddr.size() + d_qpolName.size();
+      return d_qpolAddr->size() + d_postpolAddr->size() + d_propolName.size() + d_propolNSAddr->size() + d_qpolName.size();
     }
 
     void setIncludeSOA(bool flag)
@@ -416,7 +426,7 @@ public:
 
     [[nodiscard]] bool hasClientPolicies() const
     {
-      return !d_qpolAddr.empty();
+      return !d_qpolAddr->empty();
     }
     [[nodiscard]] bool hasQNamePolicies() const
     {
@@ -428,11 +438,11 @@ public:
     }
     [[nodiscard]] bool hasNSIPPolicies() const
     {
-      return !d_propolNSAddr.empty();
+      return !d_propolNSAddr->empty();
     }
     [[nodiscard]] bool hasResponsePolicies() const
     {
-      return !d_postpolAddr.empty();
+      return !d_postpolAddr->empty();
     }
     [[nodiscard]] Priority getPriority() const
     {
@@ -445,28 +455,100 @@ public:
 
     static DNSName maskToRPZ(const Netmask& netmask);
 
-  private:
-    void addNameTrigger(std::unordered_map<DNSName, Policy>& map, const DNSName& n, Policy&& pol, bool ignoreDuplicate, PolicyType ptype);
-    void addNetmaskTrigger(NetmaskTree<Policy>& nmt, const Netmask& netmask, Policy&& pol, bool ignoreDuplicate, PolicyType ptype);
-    static bool rmNameTrigger(std::unordered_map<DNSName, Policy>& map, const DNSName& n, const Policy& pol);
-    static bool rmNetmaskTrigger(NetmaskTree<Policy>& nmt, const Netmask& netmask, const Policy& pol);
+    [[nodiscard]] const PolicyNameMap& getQNameTriggers() const
+    {
+      return d_qpolName;
+    }
 
-    static bool findExactNamedPolicy(const std::unordered_map<DNSName, DNSFilterEngine::Policy>& polmap, const DNSName& qname, DNSFilterEngine::Policy& pol);
-    static bool findNamedPolicy(const std::unordered_map<DNSName, DNSFilterEngine::Policy>& polmap, const DNSName& qname, DNSFilterEngine::Policy& pol);
+  private:
+    void addNameTrigger(PolicyNameMap& map, const DNSName& n, Policy&& pol, bool ignoreDuplicate, PolicyType ptype);
+    void addNetmaskTrigger(std::shared_ptr<NetmaskTree<Policy>>& tree, const Netmask& netmask, Policy&& pol, bool ignoreDuplicate, PolicyType ptype);
+    static bool rmNameTrigger(PolicyNameMap& map, const DNSName& n, const Policy& pol);
+    static bool rmNetmaskTrigger(std::shared_ptr<NetmaskTree<Policy>>& tree, const Netmask& netmask, const Policy& pol);
+    static NetmaskTree<Policy>& getMutableTree(std::shared_ptr<NetmaskTree<Policy>>& tree);
+
+    static bool findExactNamedPolicy(const PolicyNameMap& polmap, const DNSName& qname, DNSFilterEngine::Policy& pol);
+    static bool findNamedPolicy(const PolicyNameMap& polmap, const DNSName& qname, DNSFilterEngine::Policy& pol);
     static void dumpNamedPolicy(FILE* filePtr, const DNSName& name, const Policy& pol);
     static void dumpAddrPolicy(FILE* filePtr, const Netmask& netmask, const DNSName& name, const Policy& pol);
 
-    std::unordered_map<DNSName, Policy> d_qpolName; // QNAME trigger (RPZ)
-    NetmaskTree<Policy> d_qpolAddr; // Source address
-    std::unordered_map<DNSName, Policy> d_propolName; // NSDNAME (RPZ)
-    NetmaskTree<Policy> d_propolNSAddr; // NSIP (RPZ)
-    NetmaskTree<Policy> d_postpolAddr; // IP trigger (RPZ)
+    PolicyNameMap d_qpolName; // QNAME trigger (RPZ)
+    std::shared_ptr<NetmaskTree<Policy>> d_qpolAddr; // Source address
+    PolicyNameMap d_propolName; // NSDNAME (RPZ)
+    std::shared_ptr<NetmaskTree<Policy>> d_propolNSAddr; // NSIP (RPZ)
+    std::shared_ptr<NetmaskTree<Policy>> d_postpolAddr; // IP trigger (RPZ)
     DNSName d_domain;
     std::shared_ptr<PolicyZoneData> d_zoneData{nullptr};
     uint32_t d_serial{0};
     uint32_t d_refresh{0};
   };
 
+  /* The QNAME triggers of all the zones merged into a single read-only label trie, so that one walk
+     down the labels of the query name finds the exact and wildcard matches of every zone at once.
+     The children of a node are stored next to each other and sorted by label, and the matches of a node
+     are sorted by zone, so the first match of an enabled zone is the one with the highest priority.
+     It keeps a copy of the trigger maps it has been built from, which is cheap (see Zone), keeps the
+     policies it points to alive, and tells which zones have been modified since, so that it can still
+     be used for the others. */
+  class QNameTrie
+  {
+  public:
+    struct Match
+    {
+      const Zone::PolicyNameMap::value_type* d_entry;
+      uint32_t d_zone;
+    };
+
+    QNameTrie(const std::vector<std::shared_ptr<Zone>>& zones);
+
+    // whether the trie has been built from the current QNAME triggers of these zones
+    [[nodiscard]] bool isCurrent(const std::vector<std::shared_ptr<Zone>>& zones) const;
+    // whether the trie has been built from the current QNAME triggers of the zone at that index
+    [[nodiscard]] bool isCurrent(size_t zoneIdx, const std::shared_ptr<Zone>& zone) const;
+    // returns the best match from a zone enabled in zoneEnabled, or nullptr
+    [[nodiscard]] const Match* lookup(const DNSName& qname, const std::vector<bool>& zoneEnabled, bool& wildcard) const;
+
+    [[nodiscard]] size_t getNodesCount() const
+    {
+      return d_nodes.size();
+    }
+
+    [[nodiscard]] size_t getZonesCount() const
+    {
+      return d_triggers.size();
+    }
+
+  private:
+    struct BuildEntry
+    {
+      const Zone::PolicyNameMap::value_type* d_entry;
+      uint32_t d_zone;
+      uint32_t d_labelsCount;
+    };
+
+    struct Node
+    {
+      uint32_t d_labelOffset{0};
+      uint32_t d_firstChild{0};
+      uint32_t d_childrenCount{0};
+      uint32_t d_firstMatch{0};
+      uint32_t d_matchesCount{0};
+      uint32_t d_wildcardChild{s_noNode};
+      uint8_t d_labelLength{0};
+    };
+
+    static constexpr uint32_t s_noNode = std::numeric_limits<uint32_t>::max();
+
+    void build(uint32_t nodeIdx, const std::vector<BuildEntry>& entries, size_t begin, size_t end, uint32_t depth);
+    [[nodiscard]] std::string_view getLabel(const Node& node) const;
+    [[nodiscard]] const Node* findChild(const Node& node, std::string_view label) const;
+
+    std::vector<Node> d_nodes; // the root is the first one
+    std::vector<Match> d_matches;
+    std::string d_labels;
+    std::vector<Zone::PolicyNameMap> d_triggers; // indexed by zone
+  };
+
   DNSFilterEngine();
   void clear()
   {
@@ -511,6 +593,26 @@ public:
     }
   }
 
+  // the trie is expensive to build, so it is built from a copy of the engine then installed with setQNameTrie()
+  [[nodiscard]] std::shared_ptr<const QNameTrie> buildQNameTrie() const
+  {
+    return std::make_shared<const QNameTrie>(d_zones);
+  }
+  // installs the trie, returns whether it has been built from the current zones
+  bool setQNameTrie(std::shared_ptr<const QNameTrie> trie)
+  {
+    if (!trie) {
+      return false;
+    }
+    d_qnameTrie = std::move(trie);
+    return d_qnameTrie->isCurrent(d_zones);
+  }
+  // the zones modified since the trie has been built are looked up one by one until the next one is installed
+  [[nodiscard]] bool hasCurrentQNameTrie() const
+  {
+    return d_qnameTrie && d_qnameTrie->isCurrent(d_zones);
+  }
+
   bool getQueryPolicy(const DNSName& qname, const std::unordered_map<std::string, bool>& discardedPolicies, Policy& policy) const;
   bool getClientPolicy(const ComboAddress& address, const std::unordered_map<std::string, bool>& discardedPolicies, Policy& policy) const;
   bool getProcessingPolicy(const DNSName& qname, const std::unordered_map<std::string, bool>& discardedPolicies, Policy& policy) const;
@@ -572,6 +674,7 @@ public:
 private:
   void assureZones(size_t zone);
   vector<std::shared_ptr<Zone>> d_zones;
+  std::shared_ptr<const QNameTrie> d_qnameTrie{nullptr};
 };
 
 void mergePolicyTags(std::unordered_set<std::string>& tags, const std::unordered_set<std::string>& newTags);
@@ -1410,6 +1410,38 @@
         'desc': 'Number of authoritative server cookie probes not resulting in success',
         'snmp': 161,
     },
+    {
+        'name': 'udp-recv-batches',
+        'lambda': '[] { return g_Counters.sum(rec::Counter::udpRecvBatches); }',
+        'desc': 'Number of recvmmsg() calls that returned at least one incoming UDP query',
+        'longdesc': 'Dividing ``udp-recv-batched-queries`` by this value gives the average number of queries received per batch, see :ref:`setting-udp-batch-size`.',
+        'snmp': 162,
+    },
+    {
+        'name': 'udp-recv-batched-queries',
+        'lambda': '[] { return g_Counters.sum(rec::Counter::udpRecvBatchedQueries); }',
+        'desc': 'Number of incoming UDP queries received via recvmmsg()',
+        'snmp': 163,
+    },
+    {
+        'name': 'udp-batched-answers',
+        'lambda': '[] { return g_Counters.sum(rec::Counter::udpBatchedAnswers); }',
+        'desc': 'Number of packet cache answers sent to UDP clients via sendmmsg()',
+        'snmp': 164,
+    },
+    {
+        'name': 'udp-outgoing-sockets-opened',
+        'lambda': '[] { return g_Counters.sum(rec::Counter::udpOutgoingSocketsOpened); }',
+        'desc': 'Number of UDP sockets opened to send queries to authoritative servers',
+        'snmp': 165,
+    },
+    {
+        'name': 'udp-outgoing-socket-reuses',
+        'lambda': '[] { return g_Counters.sum(rec::Counter::udpOutgoingSocketReuses); }',
+        'desc': 'Number of queries to authoritative servers sent over an already open UDP socket',
+        'longdesc': 'Each reuse saves the ``socket()``, ``bind()``, ``connect()`` and ``close()`` system calls and the two event multiplexer updates needed for a new socket, see :ref:`setting-udp-socket-max-queries`.',
+        'snmp': 166,
+    },
     {
         'name': 'remote-logger-count',
         'lambda':  '''[]() {
@@ -28,6 +28,7 @@
 #include "ednspadding.hh"
 #include "query-local-address.hh"
 #include "rec-taskqueue.hh"
+#include "rec-udp-batch.hh"
 #include "shuffle.hh"
 #include "validate-recursor.hh"
 #include "ratelimitedlog.hh"
@@ -71,6 +72,7 @@ static set<int> g_fromtosockets; // listen sockets that use 'sendfromto()' mecha
 NetmaskGroup g_paddingFrom;
 size_t g_proxyProtocolMaximumSize;
 size_t g_maxUDPQueriesPerRound;
+size_t g_udpBatchSize{1};
 unsigned int g_maxMThreads;
 unsigned int g_paddingTag;
 PaddingMode g_paddingMode;
@@ -99,8 +101,27 @@ GlobalStateHolder<NetmaskGroup> g_dontThrottleNetmasks;
 GlobalStateHolder<SuffixMatchNode> g_DoTToAuthNames;
 uint64_t g_latencyStatSize;
 
-LWResult::Result UDPClientSocks::getSocket(const ComboAddress& toaddr, const std::optional<ComboAddress>& localAddress, int* fileDesc)
+unsigned int UDPClientSocks::s_maxQueriesPerSocket{1};
+unsigned int UDPClientSocks::s_maxSocketAgeMsec{1000};
+
+LWResult::Result UDPClientSocks::getSocket(const ComboAddress& toaddr, const std::optional<ComboAddress>& localAddress, int* fileDesc, bool& reused, const struct timeval& now, bool allowReuse)
 {
+  reused = false;
+  const UDPSocketPool::key_t key{toaddr, localAddress ? *localAddress : ComboAddress()};
+
+  if (d_pool.enabled() && allowReuse) {
+    int toClose = -1;
+    *fileDesc = d_pool.get(key, now, toClose);
+    if (toClose >= 0) {
+      closeSocket(toClose);
+    }
+    if (*fileDesc >= 0) {
+      reused = true;
+      ++t_Counters.at(rec::Counter::udpOutgoingSocketReuses);
+      return LWResult::Result::Success;
+    }
+  }
+
   *fileDesc = makeClientSocket(toaddr.sin4.sin_family, localAddress);
   if (*fileDesc < 0) { // temporary error - receive exception otherwise
     return LWResult::Result::OSLimitError;
@@ -123,11 +144,37 @@ LWResult::Result UDPClientSocks::getSocket(const ComboAddress& toaddr, const std
   }
 
   d_numsocks++;
+  ++t_Counters.at(rec::Counter::udpOutgoingSocketsOpened);
+  if (d_pool.enabled()) {
+    d_pool.add(*fileDesc, key, now, allowReuse);
+  }
   return LWResult::Result::Success;
 }
 
 // return a socket to the pool, or simply erase it
 void UDPClientSocks::returnSocket(int fileDesc)
+{
+  // a shared socket that has exceeded its budget is closed as soon as the last query using it is done
+  if (d_pool.release(fileDesc, g_now)) {
+    closeSocket(fileDesc);
+  }
+}
+
+void UDPClientSocks::retireSocket(int fileDesc)
+{
+  if (d_pool.retire(fileDesc)) {
+    closeSocket(fileDesc);
+  }
+}
+
+void UDPClientSocks::pruneIdle(const struct timeval& now)
+{
+  for (const auto fileDesc : d_pool.pruneIdle(now)) {
+    closeSocket(fileDesc);
+  }
+}
+
+void UDPClientSocks::closeSocket(int fileDesc)
 {
   try {
     t_fdm->removeReadFD(fileDesc);
@@ -324,7 +371,8 @@ LWResult::Result asendto(const void* data, size_t len, int /* flags */,
     }
   }
 
-  auto ret = t_udpclientsocks->getSocket(toAddress, localAddress, fileDesc);
+  bool reused = false;
+  auto ret = t_udpclientsocks->getSocket(toAddress, localAddress, fileDesc, reused, now);
   if (ret != LWResult::Result::Success) {
     return ret;
   }
@@ -332,12 +380,26 @@ LWResult::Result asendto(const void* data, size_t len, int /* flags */,
   pident->fd = *fileDesc;
   pident->id = qid;
 
-  t_fdm->addReadFD(*fileDesc, handleUDPServerResponse, pident);
+  if (reused && g_multiTasker->getWaiters().count(pident) != 0) {
+    // a query for the same name and type with the same ID is already waiting for an answer on that socket,
+    // the answers could not be told apart so use a socket of our own
+    t_udpclientsocks->returnSocket(*fileDesc);
+    ret = t_udpclientsocks->getSocket(toAddress, localAddress, fileDesc, reused, now, false);
+    if (ret != LWResult::Result::Success) {
+      return ret;
+    }
+    pident->fd = *fileDesc;
+  }
+
+  if (!reused) {
+    t_fdm->addReadFD(*fileDesc, handleUDPServerResponse, pident);
+  }
   ssize_t sent = send(*fileDesc, data, len, 0);
 
   int tmp = errno;
 
   if (sent < 0) {
+    t_udpclientsocks->retireSocket(*fileDesc);
     t_udpclientsocks->returnSocket(*fileDesc);
     errno = tmp; // this is for logging purposes only
     return LWResult::Result::PermanentError;
@@ -401,6 +463,8 @@ LWResult::Result arecvfrom(PacketBuffer& packet, int /* flags */, const ComboAdd
   }
   /* getting there means error or timeout, it's up to us to close the socket */
   if (fileDesc >= 0) {
+    // a late answer must not be received on a shared socket, it would look like a spoofing attempt
+    t_udpclientsocks->retireSocket(fileDesc);
     t_udpclientsocks->returnSocket(fileDesc);
   }
 
@@ -2144,6 +2208,10 @@ bool expectProxyProtocol(const ComboAddress& from, const ComboAddress& listenAdd
   return false;
 }
 
+// Packet cache answers to the queries of a single recvmmsg() batch, only set while the queries of that batch
+// are being processed, see handleNewUDPQuestionsBatch()
+static thread_local UDPAnswerBatch* t_udpAnswerBatch{nullptr};
+
 // fromaddr: the address the query is coming from
 // destaddr: the address the query was received on
 // source: the address we assume the query is coming from, might be set by proxy protocol
@@ -2307,16 +2375,23 @@ static string* doProcessUDPQuestion(const std::string& question, const ComboAddr
                             "source", Logging::Loggable(source), "remote", Logging::Loggable(fromaddr));
         }
         match = eventTrace.add(RecEventTrace::AnswerSent);
-        struct msghdr msgh{};
-        struct iovec iov{};
-        cmsgbuf_aligned cbuf{};
-        fillMSGHdr(&msgh, &iov, &cbuf, 0, reinterpret_cast<char*>(response.data()), response.length(), const_cast<ComboAddress*>(&fromaddr)); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast,cppcoreguidelines-pro-type-const-cast)
-        msgh.msg_control = nullptr;
-
-        if (g_fromtosockets.count(fileDesc) != 0) {
-          addCMsgSrcAddr(&msgh, &cbuf, &destaddr, 0);
+        int sendErr = 0;
+        if (t_udpAnswerBatch != nullptr && t_udpAnswerBatch->d_socket == fileDesc) {
+          // sent with the other answers of the batch, errors are logged by sendUDPAnswerBatch()
+          t_udpAnswerBatch->add(std::move(response), fromaddr, destaddr, source);
+        }
+        else {
+          struct msghdr msgh{};
+          struct iovec iov{};
+          cmsgbuf_aligned cbuf{};
+          fillMSGHdr(&msgh, &iov, &cbuf, 0, reinterpret_cast<char*>(response.data()), response.length(), const_cast<ComboAddress*>(&fromaddr)); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast,cppcoreguidelines-pro-type-const-cast)
+          msgh.msg_control = nullptr;
+
+          if (g_fromtosockets.count(fileDesc) != 0) {
+            addCMsgSrcAddr(&msgh, &cbuf, &destaddr, 0);
+          }
+          sendErr = sendOnNBSocket(fileDesc, &msgh);
         }
-        int sendErr = sendOnNBSocket(fileDesc, &msgh);
         eventTrace.add(RecEventTrace::AnswerSent, sendErr, false, match);
         traceScope.close(0);
         if (t_protobufServers.servers && logResponse && (!luaconfsLocal->protobufExportConfig.taggedOnly || (pbData && pbData->d_tagged))) {
@@ -2431,209 +2506,316 @@ static string* doProcessUDPQuestion(const std::string& question, const ComboAddr
   return nullptr;
 }
 
-static void handleNewUDPQuestion(int fileDesc, FDMultiplexer::funcparam_t& /* var */) // NOLINT(readability-function-cognitive-complexity): https://github.com/PowerDNS/pdns/issues/12791
+// Handles a single query read from a listening UDP socket. Returns false if the query was dropped in a way
+// that ends the current round of reading from that socket.
+static bool handleUDPQuestion(int fileDesc, std::string& data, struct msghdr& msgh, ssize_t len, const ComboAddress& fromaddr, std::vector<ProxyProtocolValue>& proxyProtocolValues, RecEventTrace& eventTrace, pdns::trace::InitialSpanInfo& otTrace) // NOLINT(readability-function-cognitive-complexity): https://github.com/PowerDNS/pdns/issues/12791
 {
-  const bool proxyActive = t_proxyProtocolACL && !t_proxyProtocolACL->empty();
-  static const size_t maxIncomingQuerySize = !proxyActive ? 512 : (512 + g_proxyProtocolMaximumSize);
-  static thread_local std::string data;
-  ComboAddress fromaddr; // the address the query is coming from
   ComboAddress source; // the address we assume the query is coming from, might be set by proxy protocol
   ComboAddress destination; // the address we assume the query was sent to, might be set by proxy protocol
-  struct msghdr msgh{};
-  struct iovec iov{};
-  cmsgbuf_aligned cbuf;
-  bool firstQuery = true;
-  std::vector<ProxyProtocolValue> proxyProtocolValues;
-  RecEventTrace eventTrace;
-  pdns::trace::InitialSpanInfo otTrace;
+  bool proxyProto = false;
+  proxyProtocolValues.clear();
+
+  eventTrace.clear();
+  eventTrace.setEnabled(SyncRes::s_event_trace_enabled != 0);
+  // eventTrace uses monotonic time, while OpenTelemetry uses absolute time. setEnabled()
+  // established the reference point, get an absolute TS as close as possible to the
+  // eventTrace start of trace time.
+  auto traceTS = pdns::trace::timestamp();
+  auto match = eventTrace.add(RecEventTrace::ReqRecv);
+  if (SyncRes::eventTraceEnabled(SyncRes::event_trace_to_ot)) {
+    otTrace.clear();
+    otTrace.start_time_unix_nano = traceTS;
+  }
+
+  if ((msgh.msg_flags & MSG_TRUNC) != 0) {
+    t_Counters.at(rec::Counter::truncatedDrops)++;
+    if (!g_quiet) {
+      g_slogudpin->info(Logr::Error, "Ignoring truncated query", "remote", Logging::Loggable(fromaddr));
+    }
+    return false;
+  }
 
-  for (size_t queriesCounter = 0; queriesCounter < g_maxUDPQueriesPerRound; queriesCounter++) {
-    bool proxyProto = false;
-    proxyProtocolValues.clear();
-    data.resize(maxIncomingQuerySize);
-    fromaddr.sin6.sin6_family = AF_INET6; // this makes sure fromaddr is big enough
-    fillMSGHdr(&msgh, &iov, &cbuf, sizeof(cbuf), data.data(), data.size(), &fromaddr);
+  data.resize(static_cast<size_t>(len));
 
-    if (ssize_t len = recvmsg(fileDesc, &msgh, 0); len >= 0) {
-      eventTrace.clear();
-      eventTrace.setEnabled(SyncRes::s_event_trace_enabled != 0);
-      // eventTrace uses monotonic time, while OpenTelemetry uses absolute time. setEnabled()
-      // established the reference point, get an absolute TS as close as possible to the
-      // eventTrace start of trace time.
-      auto traceTS = pdns::trace::timestamp();
-      auto match = eventTrace.add(RecEventTrace::ReqRecv);
-      if (SyncRes::eventTraceEnabled(SyncRes::event_trace_to_ot)) {
-        otTrace.clear();
-        otTrace.start_time_unix_nano = traceTS;
+  ComboAddress destaddr; // the address the query was sent to to
+  destaddr.reset(); // this makes sure we ignore this address if not explictly set below
+  const auto* loc = rplookup(g_listenSocketsAddresses, fileDesc);
+  if (HarvestDestinationAddress(&msgh, &destaddr)) {
+    // but.. need to get port too
+    if (loc != nullptr) {
+      destaddr.sin4.sin_port = loc->sin4.sin_port;
+    }
+  }
+  else {
+    if (loc != nullptr) {
+      destaddr = *loc;
+    }
+    else {
+      destaddr.sin4.sin_family = fromaddr.sin4.sin_family;
+      socklen_t slen = destaddr.getSocklen();
+      getsockname(fileDesc, reinterpret_cast<sockaddr*>(&destaddr), &slen); // if this fails, we're ok with it  // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+    }
+  }
+  if (expectProxyProtocol(fromaddr, destaddr)) {
+    bool tcp = false;
+    ssize_t used = parseProxyHeader(data, proxyProto, source, destination, tcp, proxyProtocolValues);
+    if (used <= 0) {
+      ++t_Counters.at(rec::Counter::proxyProtocolInvalidCount);
+      if (!g_quiet) {
+        g_slogudpin->info(Logr::Error, "Ignoring invalid proxy protocol query", "length", Logging::Loggable(len),
+                          "used", Logging::Loggable(used), "remote", Logging::Loggable(fromaddr));
       }
-      firstQuery = false;
-
-      if ((msgh.msg_flags & MSG_TRUNC) != 0) {
-        t_Counters.at(rec::Counter::truncatedDrops)++;
-        if (!g_quiet) {
-          g_slogudpin->info(Logr::Error, "Ignoring truncated query", "remote", Logging::Loggable(fromaddr));
-        }
-        return;
+      return false;
+    }
+    if (static_cast<size_t>(used) > g_proxyProtocolMaximumSize) {
+      if (g_quiet) {
+        g_slogudpin->info(Logr::Error, "Proxy protocol header in UDP packet  is larger than proxy-protocol-maximum-size",
+                          "used", Logging::Loggable(used), "remote", Logging::Loggable(fromaddr));
       }
+      ++t_Counters.at(rec::Counter::proxyProtocolInvalidCount);
+      return false;
+    }
+
+    data.erase(0, used);
+  }
+  else if (len > 512) {
+    /* we only allow UDP packets larger than 512 for those with a proxy protocol header */
+    t_Counters.at(rec::Counter::truncatedDrops)++;
+    if (!g_quiet) {
+      g_slogudpin->info(Logr::Error, "Ignoring truncated query", "remote", Logging::Loggable(fromaddr));
+    }
+    return false;
+  }
 
-      data.resize(static_cast<size_t>(len));
+  if (data.size() < sizeof(dnsheader)) {
+    t_Counters.at(rec::Counter::ignoredCount)++;
+    if (!g_quiet) {
+      g_slogudpin->info(Logr::Error, "Ignoring too-short query", "length", Logging::Loggable(data.size()),
+                        "remote", Logging::Loggable(fromaddr));
+    }
+    return false;
+  }
 
-      ComboAddress destaddr; // the address the query was sent to to
-      destaddr.reset(); // this makes sure we ignore this address if not explictly set below
-      const auto* loc = rplookup(g_listenSocketsAddresses, fileDesc);
-      if (HarvestDestinationAddress(&msgh, &destaddr)) {
-        // but.. need to get port too
-        if (loc != nullptr) {
-          destaddr.sin4.sin_port = loc->sin4.sin_port;
-        }
+  if (!proxyProto) {
+    source = fromaddr;
+  }
+  ComboAddress mappedSource = source;
+  if (t_proxyMapping) {
+    if (const auto* iter = t_proxyMapping->lookup(source)) {
+      mappedSource = iter->second.address;
+      ++iter->second.stats.netmaskMatches;
+    }
+  }
+  if (t_remotes) {
+    t_remotes->push_back(source);
+  }
+
+  if (t_allowFrom && !t_allowFrom->match(&mappedSource)) {
+    if (!g_quiet) {
+      g_slogudpin->info(Logr::Error, "Dropping UDP query, address not matched by allow-from", "source", Logging::Loggable(mappedSource));
+    }
+
+    t_Counters.at(rec::Counter::unauthorizedUDP)++;
+    return false;
+  }
+
+  BOOST_STATIC_ASSERT(offsetof(sockaddr_in, sin_port) == offsetof(sockaddr_in6, sin6_port));
+  if (fromaddr.sin4.sin_port == 0) { // also works for IPv6
+    if (!g_quiet) {
+      g_slogudpin->info(Logr::Error, "Dropping UDP query can't deal with port 0", "remote", Logging::Loggable(fromaddr));
+    }
+
+    t_Counters.at(rec::Counter::clientParseError)++; // not quite the best place to put it, but needs to go somewhere
+    return false;
+  }
+
+  try {
+    const dnsheader_aligned headerdata(data.data());
+    const dnsheader* dnsheader = headerdata.get();
+
+    if (dnsheader->qr) {
+      t_Counters.at(rec::Counter::ignoredCount)++;
+      if (g_logCommonErrors) {
+        g_slogudpin->info(Logr::Error, "Ignoring answer on server socket", "remote", Logging::Loggable(fromaddr));
       }
-      else {
-        if (loc != nullptr) {
-          destaddr = *loc;
-        }
-        else {
-          destaddr.sin4.sin_family = fromaddr.sin4.sin_family;
-          socklen_t slen = destaddr.getSocklen();
-          getsockname(fileDesc, reinterpret_cast<sockaddr*>(&destaddr), &slen); // if this fails, we're ok with it  // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
-        }
+    }
+    else if (dnsheader->opcode != static_cast<unsigned>(Opcode::Query) && dnsheader->opcode != static_cast<unsigned>(Opcode::Notify)) {
+      t_Counters.at(rec::Counter::ignoredCount)++;
+      if (g_logCommonErrors) {
+        g_slogudpin->info(Logr::Error, "Ignoring unsupported opcode server socket", "remote", Logging::Loggable(fromaddr), "opcode", Logging::Loggable(Opcode::to_s(dnsheader->opcode)));
       }
-      if (expectProxyProtocol(fromaddr, destaddr)) {
-        bool tcp = false;
-        ssize_t used = parseProxyHeader(data, proxyProto, source, destination, tcp, proxyProtocolValues);
-        if (used <= 0) {
-          ++t_Counters.at(rec::Counter::proxyProtocolInvalidCount);
+    }
+    else if (dnsheader->qdcount == 0U) {
+      t_Counters.at(rec::Counter::emptyQueriesCount)++;
+      if (g_logCommonErrors) {
+        g_slogudpin->info(Logr::Error, "Ignoring empty (qdcount == 0) query on server socket!", "remote", Logging::Loggable(fromaddr));
+      }
+    }
+    else {
+      if (dnsheader->opcode == static_cast<unsigned>(Opcode::Notify)) {
+        if (!t_allowNotifyFrom || !t_allowNotifyFrom->match(&mappedSource)) {
           if (!g_quiet) {
-            g_slogudpin->info(Logr::Error, "Ignoring invalid proxy protocol query", "length", Logging::Loggable(len),
-                              "used", Logging::Loggable(used), "remote", Logging::Loggable(fromaddr));
-          }
-          return;
-        }
-        if (static_cast<size_t>(used) > g_proxyProtocolMaximumSize) {
-          if (g_quiet) {
-            g_slogudpin->info(Logr::Error, "Proxy protocol header in UDP packet  is larger than proxy-protocol-maximum-size",
-                              "used", Logging::Loggable(used), "remote", Logging::Loggable(fromaddr));
+            g_slogudpin->info(Logr::Error, "Dropping UDP NOTIFY from address not matched by allow-notify-from",
+                              "source", Logging::Loggable(mappedSource));
           }
-          ++t_Counters.at(rec::Counter::proxyProtocolInvalidCount);
-          return;
-        }
-
-        data.erase(0, used);
-      }
-      else if (len > 512) {
-        /* we only allow UDP packets larger than 512 for those with a proxy protocol header */
-        t_Counters.at(rec::Counter::truncatedDrops)++;
-        if (!g_quiet) {
-          g_slogudpin->info(Logr::Error, "Ignoring truncated query", "remote", Logging::Loggable(fromaddr));
-        }
-        return;
-      }
 
-      if (data.size() < sizeof(dnsheader)) {
-        t_Counters.at(rec::Counter::ignoredCount)++;
-        if (!g_quiet) {
-          g_slogudpin->info(Logr::Error, "Ignoring too-short query", "length", Logging::Loggable(data.size()),
-                            "remote", Logging::Loggable(fromaddr));
+          t_Counters.at(rec::Counter::sourceDisallowedNotify)++;
+          return false;
         }
-        return;
       }
 
+      struct timeval tval = {0, 0};
+      HarvestTimestamp(&msgh, &tval);
       if (!proxyProto) {
-        source = fromaddr;
+        destination = destaddr;
       }
-      ComboAddress mappedSource = source;
-      if (t_proxyMapping) {
-        if (const auto* iter = t_proxyMapping->lookup(source)) {
-          mappedSource = iter->second.address;
-          ++iter->second.stats.netmaskMatches;
-        }
+
+      eventTrace.add(RecEventTrace::ReqRecv, 0, false, match);
+      if (RecThreadInfo::weDistributeQueries()) {
+        std::string localdata = data;
+        distributeAsyncFunction(data, [localdata = std::move(localdata), fromaddr, destaddr, source, destination, mappedSource, tval, fileDesc, proxyProtocolValues, eventTrace, otTrace]() mutable {
+          return doProcessUDPQuestion(localdata, fromaddr, destaddr, source, destination, mappedSource, tval, fileDesc, proxyProtocolValues, eventTrace, otTrace);
+        });
       }
-      if (t_remotes) {
-        t_remotes->push_back(source);
+      else {
+        doProcessUDPQuestion(data, fromaddr, destaddr, source, destination, mappedSource, tval, fileDesc, proxyProtocolValues, eventTrace, otTrace);
       }
+    }
+  }
+  catch (const MOADNSException& mde) {
+    t_Counters.at(rec::Counter::clientParseError)++;
+    if (g_logCommonErrors) {
+      g_slogudpin->error(Logr::Error, mde.what(), "Unable to parse packet from remote UDP client", "remote", Logging::Loggable(fromaddr), "exception", Logging::Loggable("MOADNSException"));
+    }
+  }
+  catch (const std::runtime_error& e) {
+    t_Counters.at(rec::Counter::clientParseError)++;
+    if (g_logCommonErrors) {
+      g_slogudpin->error(Logr::Error, e.what(), "Unable to parse packet from remote UDP client", "remote", Logging::Loggable(fromaddr), "exception", Logging::Loggable("std::runtime_error"));
+    }
+  }
+  return true;
+}
 
-      if (t_allowFrom && !t_allowFrom->match(&mappedSource)) {
-        if (!g_quiet) {
-          g_slogudpin->info(Logr::Error, "Dropping UDP query, address not matched by allow-from", "source", Logging::Loggable(mappedSource));
-        }
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+static void sendUDPAnswerBatch(UDPAnswerBatch& batch)
+{
+  const bool addSource = g_fromtosockets.count(batch.d_socket) != 0;
+  auto sent = batch.send(addSource, [](const UDPAnswerBatch::Answer& answer, int sendErr) {
+    if (g_logCommonErrors) {
+      g_slogudpin->error(Logr::Error, sendErr, "Sending UDP reply to client failed", "source", Logging::Loggable(answer.d_source), "remote", Logging::Loggable(answer.d_remote));
+    }
+  });
+  t_Counters.at(rec::Counter::udpBatchedAnswers) += sent;
+}
 
-        t_Counters.at(rec::Counter::unauthorizedUDP)++;
-        return;
-      }
+// Reads up to g_udpBatchSize queries at once with recvmmsg(), until the socket is drained or g_maxUDPQueriesPerRound
+// queries have been read. Packet cache hits are answered with a single sendmmsg() call per batch.
+static void handleNewUDPQuestionsBatch(int fileDesc)
+{
+  const bool proxyActive = t_proxyProtocolACL && !t_proxyProtocolACL->empty();
+  static const size_t maxIncomingQuerySize = !proxyActive ? 512 : (512 + g_proxyProtocolMaximumSize);
+  struct ReceiveBuffers
+  {
+    std::vector<std::string> d_data;
+    std::vector<ComboAddress> d_remotes;
+    std::vector<struct mmsghdr> d_msgs;
+    std::vector<struct iovec> d_iovs;
+    std::vector<cmsgbuf_aligned> d_cbufs;
+  };
+  static thread_local ReceiveBuffers bufs;
+  static thread_local UDPAnswerBatch answers;
+  std::vector<ProxyProtocolValue> proxyProtocolValues;
+  RecEventTrace eventTrace;
+  pdns::trace::InitialSpanInfo otTrace;
 
-      BOOST_STATIC_ASSERT(offsetof(sockaddr_in, sin_port) == offsetof(sockaddr_in6, sin6_port));
-      if (fromaddr.sin4.sin_port == 0) { // also works for IPv6
-        if (!g_quiet) {
-          g_slogudpin->info(Logr::Error, "Dropping UDP query can't deal with port 0", "remote", Logging::Loggable(fromaddr));
-        }
+  const size_t batchSize = g_udpBatchSize;
+  if (bufs.d_msgs.size() != batchSize) {
+    bufs.d_data.resize(batchSize);
+    bufs.d_remotes.resize(batchSize);
+    bufs.d_msgs.resize(batchSize);
+    bufs.d_iovs.resize(batchSize);
+    bufs.d_cbufs.resize(batchSize);
+  }
+  answers.d_socket = fileDesc;
 
-        t_Counters.at(rec::Counter::clientParseError)++; // not quite the best place to put it, but needs to go somewhere
-        return;
+  bool firstQuery = true;
+  bool stop = false;
+  size_t queriesCounter = 0;
+  while (!stop && queriesCounter < g_maxUDPQueriesPerRound) {
+    const size_t toRead = std::min(batchSize, g_maxUDPQueriesPerRound - queriesCounter);
+    for (size_t idx = 0; idx < toRead; ++idx) {
+      auto& data = bufs.d_data.at(idx);
+      auto& fromaddr = bufs.d_remotes.at(idx);
+      data.resize(maxIncomingQuerySize);
+      fromaddr.sin6.sin6_family = AF_INET6; // this makes sure fromaddr is big enough
+      fillMSGHdr(&bufs.d_msgs.at(idx).msg_hdr, &bufs.d_iovs.at(idx), &bufs.d_cbufs.at(idx), sizeof(cmsgbuf_aligned), data.data(), data.size(), &fromaddr);
+      bufs.d_msgs.at(idx).msg_len = 0;
+    }
+
+    int got = recvmmsg(fileDesc, bufs.d_msgs.data(), toRead, 0, nullptr);
+    if (got <= 0) {
+      if (firstQuery && errno == EAGAIN) {
+        t_Counters.at(rec::Counter::noPacketError)++;
       }
+      break;
+    }
+    firstQuery = false;
+    queriesCounter += got;
+    ++t_Counters.at(rec::Counter::udpRecvBatches);
+    t_Counters.at(rec::Counter::udpRecvBatchedQueries) += got;
 
-      try {
-        const dnsheader_aligned headerdata(data.data());
-        const dnsheader* dnsheader = headerdata.get();
+    // the datagrams of this batch have already been read from the socket, so we process all of them even if one
+    // of them ends the round
+    t_udpAnswerBatch = &answers;
+    for (int idx = 0; idx < got; ++idx) {
+      auto& msg = bufs.d_msgs.at(idx);
+      if (!handleUDPQuestion(fileDesc, bufs.d_data.at(idx), msg.msg_hdr, static_cast<ssize_t>(msg.msg_len), bufs.d_remotes.at(idx), proxyProtocolValues, eventTrace, otTrace)) {
+        stop = true;
+      }
+    }
+    t_udpAnswerBatch = nullptr;
+    sendUDPAnswerBatch(answers);
 
-        if (dnsheader->qr) {
-          t_Counters.at(rec::Counter::ignoredCount)++;
-          if (g_logCommonErrors) {
-            g_slogudpin->info(Logr::Error, "Ignoring answer on server socket", "remote", Logging::Loggable(fromaddr));
-          }
-        }
-        else if (dnsheader->opcode != static_cast<unsigned>(Opcode::Query) && dnsheader->opcode != static_cast<unsigned>(Opcode::Notify)) {
-          t_Counters.at(rec::Counter::ignoredCount)++;
-          if (g_logCommonErrors) {
-            g_slogudpin->info(Logr::Error, "Ignoring unsupported opcode server socket", "remote", Logging::Loggable(fromaddr), "opcode", Logging::Loggable(Opcode::to_s(dnsheader->opcode)));
-          }
-        }
-        else if (dnsheader->qdcount == 0U) {
-          t_Counters.at(rec::Counter::emptyQueriesCount)++;
-          if (g_logCommonErrors) {
-            g_slogudpin->info(Logr::Error, "Ignoring empty (qdcount == 0) query on server socket!", "remote", Logging::Loggable(fromaddr));
-          }
-        }
-        else {
-          if (dnsheader->opcode == static_cast<unsigned>(Opcode::Notify)) {
-            if (!t_allowNotifyFrom || !t_allowNotifyFrom->match(&mappedSource)) {
-              if (!g_quiet) {
-                g_slogudpin->info(Logr::Error, "Dropping UDP NOTIFY from address not matched by allow-notify-from",
-                                  "source", Logging::Loggable(mappedSource));
-              }
+    if (static_cast<size_t>(got) < toRead) {
+      // the socket has been drained
+      break;
+    }
+  }
+  t_Counters.updateSnap(g_regressionTestMode);
+}
+#endif /* HAVE_RECVMMSG && HAVE_SENDMMSG */
 
-              t_Counters.at(rec::Counter::sourceDisallowedNotify)++;
-              return;
-            }
-          }
+static void handleNewUDPQuestion(int fileDesc, FDMultiplexer::funcparam_t& /* var */)
+{
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+  if (g_udpBatchSize > 1) {
+    handleNewUDPQuestionsBatch(fileDesc);
+    return;
+  }
+#endif /* HAVE_RECVMMSG && HAVE_SENDMMSG */
 
-          struct timeval tval = {0, 0};
-          HarvestTimestamp(&msgh, &tval);
-          if (!proxyProto) {
-            destination = destaddr;
-          }
+  const bool proxyActive = t_proxyProtocolACL && !t_proxyProtocolACL->empty();
+  static const size_t maxIncomingQuerySize = !proxyActive ? 512 : (512 + g_proxyProtocolMaximumSize);
+  static thread_local std::string data;
+  ComboAddress fromaddr; // the address the query is coming from
+  struct msghdr msgh{};
+  struct iovec iov{};
+  cmsgbuf_aligned cbuf;
+  bool firstQuery = true;
+  std::vector<ProxyProtocolValue> proxyProtocolValues;
+  RecEventTrace eventTrace;
+  pdns::trace::InitialSpanInfo otTrace;
 
-          eventTrace.add(RecEventTrace::ReqRecv, 0, false, match);
-          if (RecThreadInfo::weDistributeQueries()) {
-            std::string localdata = data;
-            distributeAsyncFunction(data, [localdata = std::move(localdata), fromaddr, destaddr, source, destination, mappedSource, tval, fileDesc, proxyProtocolValues, eventTrace, otTrace]() mutable {
-              return doProcessUDPQuestion(localdata, fromaddr, destaddr, source, destination, mappedSource, tval, fileDesc, proxyProtocolValues, eventTrace, otTrace);
-            });
-          }
-          else {
-            doProcessUDPQuestion(data, fromaddr, destaddr, source, destination, mappedSource, tval, fileDesc, proxyProtocolValues, eventTrace, otTrace);
-          }
-        }
-      }
-      catch (const MOADNSException& mde) {
-        t_Counters.at(rec::Counter::clientParseError)++;
-        if (g_logCommonErrors) {
-          g_slogudpin->error(Logr::Error, mde.what(), "Unable to parse packet from remote UDP client", "remote", Logging::Loggable(fromaddr), "exception", Logging::Loggable("MOADNSException"));
-        }
-      }
-      catch (const std::runtime_error& e) {
-        t_Counters.at(rec::Counter::clientParseError)++;
-        if (g_logCommonErrors) {
-          g_slogudpin->error(Logr::Error, e.what(), "Unable to parse packet from remote UDP client", "remote", Logging::Loggable(fromaddr), "exception", Logging::Loggable("std::runtime_error"));
-        }
+  for (size_t queriesCounter = 0; queriesCounter < g_maxUDPQueriesPerRound; queriesCounter++) {
+    data.resize(maxIncomingQuerySize);
+    fromaddr.sin6.sin6_family = AF_INET6; // this makes sure fromaddr is big enough
+    fillMSGHdr(&msgh, &iov, &cbuf, sizeof(cbuf), data.data(), data.size(), &fromaddr);
+
+    if (ssize_t len = recvmsg(fileDesc, &msgh, 0); len >= 0) {
+      firstQuery = false;
+      if (!handleUDPQuestion(fileDesc, data, msgh, len, fromaddr, proxyProtocolValues, eventTrace, otTrace)) {
+        return;
       }
     }
     else {
@@ -2932,6 +3114,27 @@ static void handleUDPServerResponse(int fileDesc, FDMultiplexer::funcparam_t& va
 
   if (len < 0) {
     // len < 0: error on socket
+    if (t_udpclientsocks->isPooled(fileDesc)) {
+      // the socket is shared by the queries sent to that remote, all of them get the error
+      t_udpclientsocks->retireSocket(fileDesc);
+      std::vector<std::shared_ptr<PacketID>> pids;
+      for (const auto& waiter : g_multiTasker->getWaiters()) {
+        if (waiter.key->fd == fileDesc) {
+          pids.push_back(waiter.key);
+        }
+      }
+      for (const auto& waiting : pids) {
+        t_udpclientsocks->returnSocket(fileDesc);
+        PacketBuffer empty;
+        auto iter = g_multiTasker->getWaiters().find(waiting);
+        if (iter != g_multiTasker->getWaiters().end()) {
+          doResends(iter, waiting, empty);
+        }
+        g_multiTasker->sendEvent(waiting, &empty);
+      }
+      return;
+    }
+
     t_udpclientsocks->returnSocket(fileDesc);
 
     PacketBuffer empty;
@@ -0,0 +1,269 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// returns the object owned by ptr, after replacing it by a copy if other owners share it, so that it can be
+// modified without them noticing
+template <typename T>
+T& getUniquelyOwned(std::shared_ptr<T>& ptr)
+{
+  if (ptr.use_count() != 1) {
+    ptr = std::make_shared<T>(*ptr);
+  }
+  else {
+    // pairs with the release done by the other owners when they dropped their reference, possibly from another thread
+    std::atomic_thread_fence(std::memory_order_acquire);
+  }
+  return *ptr;
+}
+
+/* A hash array mapped trie (HAMT) whose nodes are shared between copies of the map.
+
+   Copying the map only copies a pointer to the root node. A modification copies the nodes on the path
+   from the root to the modified entry, unless the map is their only owner, in which case they are
+   modified in place. Copying a large map and applying a few changes to the copy therefore costs
+   proportionally to the number of changes, and the original map is left untouched so it can keep being
+   read by other threads while the copy is modified.
+
+   Each branch node maps the next s_bitsPerLevel bits of the hash of the key to its children, only
+   storing the children that exist. Leaves hold up to s_leafCapacity entries, and are split into a branch
+   when they overflow, until the bits of the hash are exhausted.
+
+   A single map must not be modified by several threads at the same time, but distinct copies can be.
+   Since a map that shares its root with a copy never modifies it in place, two maps having the same
+   root are known to hold the same entries, which isSameVersionAs() exposes.
+*/
+template <typename Key, typename Value, typename Hash = std::hash<Key>, typename KeyEqual = std::equal_to<Key>>
+class PersistentHashMap
+{
+public:
+  using value_type = std::pair<Key, Value>;
+
+  [[nodiscard]] size_t size() const
+  {
+    return d_size;
+  }
+
+  [[nodiscard]] bool empty() const
+  {
+    return d_size == 0;
+  }
+
+  void clear()
+  {
+    d_root.reset();
+    d_size = 0;
+  }
+
+  // returns nullptr if there is no entry for that key
+  [[nodiscard]] const value_type* lookup(const Key& key) const
+  {
+    const auto hash = Hash()(key);
+    const Node* node = d_root.get();
+    unsigned int shift = 0;
+    while (node != nullptr) {
+      if (node->d_leaf) {
+        for (const auto& entry : node->d_entries) {
+          if (entry.d_hash == hash && KeyEqual()(entry.d_value.first, key)) {
+            return &entry.d_value;
+          }
+        }
+        return nullptr;
+      }
+      const auto bit = getBit(hash, shift);
+      if ((node->d_bitmap & bit) == 0) {
+        return nullptr;
+      }
+      node = node->d_children[getPosition(node->d_bitmap, bit)].get();
+      shift += s_bitsPerLevel;
+    }
+    return nullptr;
+  }
+
+  // returns a modifiable value for that key, copying the nodes shared with other maps as needed, or nullptr if there is no such entry
+  Value* getMutable(const Key& key)
+  {
+    if (lookup(key) == nullptr) {
+      return nullptr;
+    }
+    bool inserted = false;
+    return &insertAt(d_root, Hash()(key), 0, key, nullptr, inserted)->second;
+  }
+
+  // inserts value if there is no entry for that key yet, returns the entry for that key and whether it has been inserted
+  std::pair<value_type*, bool> insert(const Key& key, Value&& value)
+  {
+    bool inserted = false;
+    auto* entry = insertAt(d_root, Hash()(key), 0, key, &value, inserted);
+    if (inserted) {
+      ++d_size;
+    }
+    return {entry, inserted};
+  }
+
+  // returns whether an entry has been removed
+  bool erase(const Key& key)
+  {
+    if (lookup(key) == nullptr) {
+      return false;
+    }
+    if (eraseAt(d_root, Hash()(key), 0, key)) {
+      d_root.reset();
+    }
+    --d_size;
+    return true;
+  }
+
+  // whether neither map has been modified since one has been copied from the other
+  [[nodiscard]] bool isSameVersionAs(const PersistentHashMap& other) const
+  {
+    return d_root == other.d_root;
+  }
+
+  // calls visitor(const value_type&) for every entry, in no particular order
+  template <typename Visitor>
+  void visit(const Visitor& visitor) const
+  {
+    if (d_root) {
+      visitNode(*d_root, visitor);
+    }
+  }
+
+private:
+  static constexpr unsigned int s_bitsPerLevel = 6;
+  static constexpr unsigned int s_hashBits = 32; // only the lower 32 bits of the hash are used
+  static constexpr size_t s_leafCapacity = 8;
+
+  struct Entry
+  {
+    size_t d_hash;
+    value_type d_value;
+  };
+
+  struct Node
+  {
+    std::vector<std::shared_ptr<Node>> d_children; // branch only, ordered by bit
+    std::vector<Entry> d_entries; // leaf only
+    uint64_t d_bitmap{0}; // branch only, the bits of the children that exist
+    bool d_leaf{true};
+  };
+
+  static uint64_t getBit(size_t hash, unsigned int shift)
+  {
+    return uint64_t(1) << ((hash >> shift) & ((1U << s_bitsPerLevel) - 1));
+  }
+
+  static size_t getPosition(uint64_t bitmap, uint64_t bit)
+  {
+    return __builtin_popcountll(bitmap & (bit - 1));
+  }
+
+  static std::shared_ptr<Node>& getChild(Node& node, size_t hash, unsigned int shift)
+  {
+    const auto bit = getBit(hash, shift);
+    const auto pos = getPosition(node.d_bitmap, bit);
+    if ((node.d_bitmap & bit) == 0) {
+      node.d_bitmap |= bit;
+      node.d_children.insert(node.d_children.begin() + static_cast<std::ptrdiff_t>(pos), std::make_shared<Node>());
+    }
+    return node.d_children[pos];
+  }
+
+  static void split(Node& node, unsigned int shift)
+  {
+    auto entries = std::move(node.d_entries);
+    node.d_entries.clear();
+    node.d_leaf = false;
+    for (auto& entry : entries) {
+      getChild(node, entry.d_hash, shift)->d_entries.push_back(std::move(entry));
+    }
+  }
+
+  // when value is nullptr, the entry is known to exist and we only want it to be modifiable
+  static value_type* insertAt(std::shared_ptr<Node>& slot, size_t hash, unsigned int shift, const Key& key, Value* value, bool& inserted)
+  {
+    if (!slot) {
+      slot = std::make_shared<Node>();
+    }
+    auto& node = getUniquelyOwned(slot);
+    if (node.d_leaf) {
+      for (auto& entry : node.d_entries) {
+        if (entry.d_hash == hash && KeyEqual()(entry.d_value.first, key)) {
+          return &entry.d_value;
+        }
+      }
+      if (node.d_entries.size() < s_leafCapacity || shift >= s_hashBits) {
+        node.d_entries.push_back({hash, {key, std::move(*value)}});
+        inserted = true;
+        return &node.d_entries.back().d_value;
+      }
+      split(node, shift);
+    }
+    return insertAt(getChild(node, hash, shift), hash, shift + s_bitsPerLevel, key, value, inserted);
+  }
+
+  // the entry is known to exist, returns whether the node is now empty
+  static bool eraseAt(std::shared_ptr<Node>& slot, size_t hash, unsigned int shift, const Key& key)
+  {
+    auto& node = getUniquelyOwned(slot);
+    if (node.d_leaf) {
+      for (auto iter = node.d_entries.begin(); iter != node.d_entries.end(); ++iter) {
+        if (iter->d_hash == hash && KeyEqual()(iter->d_value.first, key)) {
+          if (iter != node.d_entries.end() - 1) {
+            *iter = std::move(node.d_entries.back());
+          }
+          node.d_entries.pop_back();
+          break;
+        }
+      }
+      return node.d_entries.empty();
+    }
+    const auto bit = getBit(hash, shift);
+    const auto pos = getPosition(node.d_bitmap, bit);
+    if (eraseAt(node.d_children[pos], hash, shift + s_bitsPerLevel, key)) {
+      node.d_children.erase(node.d_children.begin() + static_cast<std::ptrdiff_t>(pos));
+      node.d_bitmap &= ~bit;
+    }
+    return node.d_children.empty();
+  }
+
+  template <typename Visitor>
+  static void visitNode(const Node& node, const Visitor& visitor)
+  {
+    for (const auto& entry : node.d_entries) {
+      visitor(entry.d_value);
+    }
+    for (const auto& child : node.d_children) {
+      visitNode(*child, visitor);
+    }
+  }
+
+  std::shared_ptr<Node> d_root{nullptr};
+  size_t d_size{0};
+};
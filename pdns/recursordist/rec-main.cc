@@ -410,6 +410,22 @@ ArgvMap& arg()
 static FDMultiplexer* getMultiplexer(Logr::log_t log)
 {
   FDMultiplexer* ret = nullptr;
+  const auto& preferred = ::arg()["event-multiplexer"];
+  if (!preferred.empty()) {
+    const auto& optIn = FDMultiplexer::getOptInMultiplexerMap();
+    const auto mplexer = optIn.find(preferred);
+    if (mplexer == optIn.end()) {
+      log->info(Logr::Warning, "Requested multiplexer is not available, falling back", "name", Logging::Loggable(preferred));
+    }
+    else {
+      try {
+        return mplexer->second(FDMultiplexer::s_maxevents);
+      }
+      catch (FDMultiplexerException& fe) {
+        log->error(Logr::Warning, fe.what(), "Non-fatal error initializing requested multiplexer, falling back", "name", Logging::Loggable(preferred));
+      }
+    }
+  }
   for (const auto& mplexer : FDMultiplexer::getMultiplexerMap()) {
     try {
       ret = mplexer.second(FDMultiplexer::s_maxevents);
@@ -2279,6 +2295,15 @@ static int serviceMain(Logr::log_t log)
   g_maxTCPPerClient = ::arg().asNum("max-tcp-per-client");
   g_tcpMaxQueriesPerConn = ::arg().asNum("max-tcp-queries-per-connection");
   g_maxUDPQueriesPerRound = ::arg().asNum("max-udp-queries-per-round");
+  UDPClientSocks::s_maxQueriesPerSocket = std::max(::arg().asNum("udp-socket-max-queries"), 1);
+  UDPClientSocks::s_maxSocketAgeMsec = ::arg().asNum("udp-socket-max-age-msec");
+  g_udpBatchSize = std::max(::arg().asNum("udp-batch-size"), 1);
+#if !defined(HAVE_RECVMMSG) || !defined(HAVE_SENDMMSG)
+  if (g_udpBatchSize > 1) {
+    log->info(Logr::Warning, "Batching of incoming UDP queries requested but recvmmsg() or sendmmsg() is not supported, disabling", "udp-batch-size", Logging::Loggable(g_udpBatchSize));
+    g_udpBatchSize = 1;
+  }
+#endif
 
   g_useKernelTimestamp = ::arg().mustDo("protobuf-use-kernel-timestamp");
   g_maxChainLength = ::arg().asNum("max-chain-length");
@@ -2475,6 +2500,13 @@ static void houseKeepingWork(Logr::log_t log)
     t_tcp_manager.cleanup(now);
   });
 
+  static thread_local PeriodicTask pruneUDPSocketsTask{"pruneUDPSocketsTask", 1};
+  pruneUDPSocketsTask.runIfDue(now, [now]() {
+    if (t_udpclientsocks) {
+      t_udpclientsocks->pruneIdle(now);
+    }
+  });
+
   const auto& info = RecThreadInfo::self();
 
   // Threads handling packets process config changes in the input path, but not all threads process input packets
@@ -3234,6 +3266,7 @@ int main(int argc, char** argv)
     }
 
     ret = serviceMain(startupLog);
+    stopRPZQNameTrieBuilder();
     {
       std::scoped_lock lock(g_doneRunning.mutex);
       g_doneRunning.done = true;
@@ -3354,6 +3387,9 @@ WipeCacheResult wipeCaches(const DNSName& canon, bool subtree, uint16_t qtype)
 
 void startLuaConfigDelayedThreads(const LuaConfigItems& luaConfig, uint64_t generation)
 {
+  if (!luaConfig.rpzs.empty()) {
+    requestRPZQNameTrieRebuild();
+  }
   for (const auto& rpzPrimary : luaConfig.rpzs) {
     if (rpzPrimary.zoneXFRParams.primaries.empty()) {
       continue;
@@ -35,6 +35,7 @@
 #include "rec-protozero.hh"
 #include "syncres.hh"
 #include "rec-snmp.hh"
+#include "rec-udp-socket-pool.hh"
 #include "rec_channel.hh"
 #include "threadname.hh"
 #include "recpacketcache.hh"
@@ -166,8 +167,12 @@ extern DoneRunning g_doneRunning;
 // you can ask this class for a UDP socket to send a query from
 // this socket is not yours, don't even think about deleting it
 // but after you call 'returnSocket' on it, don't assume anything anymore
+// If s_maxQueriesPerSocket is larger than 1, a connected socket is kept open and shared by the queries sent to the same
+// remote from the same local address, until it has been used for s_maxQueriesPerSocket queries or is older than
+// s_maxSocketAgeMsec. Answers are matched to their query via the PacketID (ID, qname and qtype), as usual.
 class UDPClientSocks
 {
+  UDPSocketPool d_pool{s_maxQueriesPerSocket, s_maxSocketAgeMsec};
   unsigned int d_numsocks;
 
 public:
@@ -176,14 +181,30 @@ public:
   {
   }
 
-  LWResult::Result getSocket(const ComboAddress& toaddr, const std::optional<ComboAddress>& localAddress, int* fileDesc);
+  // if allowReuse is false, a new socket is created and will not be shared with other queries
+  LWResult::Result getSocket(const ComboAddress& toaddr, const std::optional<ComboAddress>& localAddress, int* fileDesc, bool& reused, const struct timeval& now, bool allowReuse = true);
 
   // return a socket to the pool, or simply erase it
   void returnSocket(int fileDesc);
 
+  // stop handing out that socket for new queries, for example after an error or a timeout
+  void retireSocket(int fileDesc);
+
+  // close the sockets that are not used by any query anymore and have exceeded their time budget
+  void pruneIdle(const struct timeval& now);
+
+  [[nodiscard]] bool isPooled(int fileDesc) const
+  {
+    return d_pool.contains(fileDesc);
+  }
+
+  static unsigned int s_maxQueriesPerSocket;
+  static unsigned int s_maxSocketAgeMsec;
+
 private:
   // returns -1 for errors which might go away, throws for ones that won't
   static int makeClientSocket(int family, const std::optional<ComboAddress>& localAddress);
+  void closeSocket(int fileDesc);
 };
 
 enum class PaddingMode
@@ -219,6 +240,7 @@ extern int g_tcpTimeout;
 extern uint16_t g_udpTruncationThreshold;
 extern double g_balancingFactor;
 extern size_t g_maxUDPQueriesPerRound;
+extern size_t g_udpBatchSize;
 extern bool g_useKernelTimestamp;
 extern bool g_allowNoRD;
 extern unsigned int g_maxChainLength;
@@ -1002,6 +1002,20 @@ The path to the /etc/hosts file, or equivalent.
 This file can be used to serve data authoritatively using :ref:`setting-export-etc-hosts`.
  ''',
     },
+    {
+        'name' : 'event_multiplexer',
+        'section' : 'recursor',
+        'type' : LType.String,
+        'default' : '',
+        'help' : 'Name of an opt-in event multiplexer to use instead of the default one, for example io_uring',
+        'doc' : '''
+Name of an event multiplexer that is not used by default, to use in the threads handling queries instead of the default one of the platform. The multiplexer tells these threads when their UDP and TCP sockets are ready.
+Currently the only supported value is ``io_uring``, on Linux 5.11 or later. It only uses ``io_uring`` to wait for sockets to become readable or writable, batching the poll requests into the system call waiting for events. Reading from and writing to the sockets is still done with the usual system calls.
+If that multiplexer is not available, the recursor logs a warning and falls back to the default one.
+An empty value, the default, means the default multiplexer of the platform, for example ``epoll`` on Linux.
+ ''',
+        'versionadded': '5.4.0',
+    },
     {
         'name' : 'event_trace_enabled',
         'section' : 'recursor',
@@ -1762,6 +1776,23 @@ returning back to normal processing and handling other events.
  ''',
     'versionadded': '4.1.4'
     },
+    {
+        'name' : 'udp_batch_size',
+        'section' : 'incoming',
+        'type' : LType.Uint64,
+        'default' : '1',
+        'help' : 'Maximum number of UDP queries received with a single recvmmsg() call, 1 means no batching',
+        'doc' : '''
+Maximum number of incoming UDP DNS queries read from a listening socket with a single ``recvmmsg()`` call.
+When set to a value larger than 1, answers served from the packet cache for the queries of such a batch are sent back together with a single ``sendmmsg()`` call, while the other queries are handed to ``mthreads`` as usual.
+This reduces the number of system calls per query on a busy recursor with a high packet cache hit ratio.
+The number of queries processed per round is still capped by :ref:`setting-max-udp-queries-per-round`.
+The ``udp-recv-batches`` and ``udp-recv-batched-queries`` metrics can be used to compute the average size of the batches.
+When :ref:`setting-pdns-distributes-queries` is enabled, only the receiving side is batched, as the answers are sent by the worker threads.
+This setting has no effect if the platform does not support ``recvmmsg()`` and ``sendmmsg()``.
+ ''',
+        'versionadded': '5.4.0',
+    },
     {
         'name' : 'minimum_ttl_override',
         'section' : 'recursor',
@@ -2985,6 +3016,40 @@ To log only queries resulting in a ``ServFail`` answer from the resolving proces
 Also note that queries that do produce a result but with a failing DNSSEC validation are not written to the log
  ''',
     },
+    {
+        'name' : 'udp_socket_max_queries',
+        'section' : 'outgoing',
+        'type' : LType.Uint64,
+        'default' : '1',
+        'help' : 'Maximum number of queries sent to an authoritative server over the same UDP socket, sharing its source port. 1 (the default) means a new socket for each query',
+        'doc' : '''
+Maximum number of queries sent over the same UDP socket, connected to a given authoritative server from a given local address.
+When set to a value larger than 1, such a socket is kept open after the answer has been received, and reused for the next queries to the same server, including concurrent ones.
+This saves the system calls needed to create, bind, connect and close a socket for each query, and the corresponding updates of the event multiplexer.
+Pooling is disabled by default, and only done when this setting is larger than 1.
+
+This is a trade-off against the resistance to spoofing attempts: the queries sent over the same socket share its source port, so an attacker who learned that port only has to guess the message ID, qname and qtype to have a forged answer accepted for any of them, instead of also guessing a fresh random port for each query.
+To limit that exposure, a socket is only reused for queries to the same server, and is replaced by a new one, using a new random source port, after :ref:`setting-udp-socket-max-age-msec` milliseconds or after this number of queries, whichever comes first.
+A socket is also replaced after a timeout or an error.
+A socket that has exceeded its budget is closed as soon as the last query using it is done.
+An idle socket is closed once it is older than :ref:`setting-udp-socket-max-age-msec`, which can take up to one more second as idle sockets are pruned once per second, so each thread can keep one socket open per recently queried server and local address for that long.
+The ``udp-outgoing-sockets-opened`` and ``udp-outgoing-socket-reuses`` metrics show how many sockets were opened and how many were saved.
+ ''',
+        'versionadded': '5.4.0',
+    },
+    {
+        'name' : 'udp_socket_max_age_msec',
+        'section' : 'outgoing',
+        'type' : LType.Uint64,
+        'default' : '1000',
+        'help' : 'Maximum time in milliseconds a UDP socket to an authoritative server is reused',
+        'doc' : '''
+Maximum time, in milliseconds, during which a UDP socket connected to an authoritative server is used for new queries.
+
+See :ref:`setting-udp-socket-max-queries`.
+ ''',
+        'versionadded': '5.4.0',
+    },
     {
         'name' : 'udp_source_port_min',
         'section' : 'outgoing',
@@ -107,6 +107,11 @@ enum class Counter : uint8_t
   cookieRetry,
   cookieProbeSupported,
   cookieProbeUnsupported,
+  udpRecvBatches,
+  udpRecvBatchedQueries,
+  udpBatchedAnswers,
+  udpOutgoingSocketsOpened,
+  udpOutgoingSocketReuses,
 
   numberOfCounters
 };
@@ -0,0 +1,67 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "rec-udp-batch.hh"
+
+#if defined(HAVE_SENDMMSG)
+size_t UDPAnswerBatch::send(bool addSource, const ErrorHandler& onError)
+{
+  const size_t count = d_answers.size();
+  if (count == 0) {
+    return 0;
+  }
+
+  d_msgs.resize(count);
+  d_iovs.resize(count);
+  d_cbufs.resize(count);
+  for (size_t idx = 0; idx < count; ++idx) {
+    auto& answer = d_answers.at(idx);
+    auto& msgh = d_msgs.at(idx).msg_hdr;
+    fillMSGHdr(&msgh, &d_iovs.at(idx), &d_cbufs.at(idx), 0, answer.d_response.data(), answer.d_response.size(), &answer.d_remote);
+    msgh.msg_control = nullptr;
+    if (addSource) {
+      addCMsgSrcAddr(&msgh, &d_cbufs.at(idx), &answer.d_local, 0);
+    }
+    d_msgs.at(idx).msg_len = 0;
+  }
+
+  size_t pos = 0;
+  size_t sent = 0;
+  while (pos < count) {
+    int ret = sendmmsg(d_socket, &d_msgs.at(pos), count - pos, 0);
+    if (ret <= 0) {
+      // the first pending answer could not be sent, skip it and carry on with the next ones
+      onError(d_answers.at(pos), errno);
+      ++pos;
+      continue;
+    }
+    pos += ret;
+    sent += ret;
+  }
+  d_answers.clear();
+  return sent;
+}
+#endif
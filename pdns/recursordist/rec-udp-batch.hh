@@ -0,0 +1,61 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <sys/socket.h>
+#include <vector>
+
+#include "iputils.hh"
+#include "misc.hh"
+
+// Answers to the queries of a single recvmmsg() batch, sent together once the whole batch has been processed
+struct UDPAnswerBatch
+{
+  struct Answer
+  {
+    std::string d_response;
+    ComboAddress d_remote;
+    ComboAddress d_local;
+    ComboAddress d_source; // only used for logging
+  };
+  using ErrorHandler = std::function<void(const Answer& answer, int error)>;
+
+  void add(std::string&& response, const ComboAddress& remote, const ComboAddress& local, const ComboAddress& source)
+  {
+    d_answers.push_back({std::move(response), remote, local, source});
+  }
+
+#if defined(HAVE_SENDMMSG)
+  // Sends the pending answers over d_socket with as few sendmmsg() calls as possible, then forgets them.
+  // An answer that cannot be sent is reported to onError() and skipped. Returns the number of answers sent.
+  size_t send(bool addSource, const ErrorHandler& onError);
+#endif
+
+  std::vector<Answer> d_answers;
+  std::vector<struct mmsghdr> d_msgs;
+  std::vector<struct iovec> d_iovs;
+  std::vector<cmsgbuf_aligned> d_cbufs;
+  int d_socket{-1};
+};
@@ -0,0 +1,113 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "rec-udp-socket-pool.hh"
+#include "misc.hh"
+
+int UDPSocketPool::get(const key_t& key, const struct timeval& now, int& toClose)
+{
+  toClose = -1;
+  auto iter = d_available.find(key);
+  if (iter == d_available.end()) {
+    return -1;
+  }
+
+  const auto fileDesc = iter->second;
+  auto& entry = d_pooled.at(fileDesc);
+  if (!isExhausted(entry, now)) {
+    ++entry.d_queries;
+    ++entry.d_outstanding;
+    return fileDesc;
+  }
+
+  // budget exhausted, a new socket with a new random port is needed
+  if (retire(fileDesc)) {
+    toClose = fileDesc;
+  }
+  return -1;
+}
+
+void UDPSocketPool::add(int fileDesc, const key_t& key, const struct timeval& now, bool shared)
+{
+  d_pooled[fileDesc] = PooledSocket{key, now, 1, 1, !shared};
+  if (shared) {
+    d_available[key] = fileDesc;
+  }
+}
+
+bool UDPSocketPool::release(int fileDesc, const struct timeval& now)
+{
+  auto iter = d_pooled.find(fileDesc);
+  if (iter == d_pooled.end()) {
+    return true;
+  }
+
+  auto& entry = iter->second;
+  if (entry.d_outstanding > 0) {
+    --entry.d_outstanding;
+  }
+  if (entry.d_retired || isExhausted(entry, now)) {
+    return retire(fileDesc);
+  }
+  // kept for the next queries to that remote
+  return false;
+}
+
+bool UDPSocketPool::retire(int fileDesc)
+{
+  auto iter = d_pooled.find(fileDesc);
+  if (iter == d_pooled.end()) {
+    return false;
+  }
+
+  auto& entry = iter->second;
+  if (!entry.d_retired) {
+    entry.d_retired = true;
+    if (auto avail = d_available.find(entry.d_key); avail != d_available.end() && avail->second == fileDesc) {
+      d_available.erase(avail);
+    }
+  }
+  if (entry.d_outstanding > 0) {
+    return false;
+  }
+  d_pooled.erase(iter);
+  return true;
+}
+
+std::vector<int> UDPSocketPool::pruneIdle(const struct timeval& now)
+{
+  std::vector<int> expired;
+  for (const auto& [fileDesc, entry] : d_pooled) {
+    if (entry.d_outstanding == 0 && isExhausted(entry, now)) {
+      expired.push_back(fileDesc);
+    }
+  }
+  for (const auto fileDesc : expired) {
+    retire(fileDesc);
+  }
+  return expired;
+}
+
+bool UDPSocketPool::isExhausted(const PooledSocket& entry, const struct timeval& now) const
+{
+  return entry.d_queries >= d_maxQueries || uSec(now - entry.d_created) >= static_cast<uint64_t>(d_maxAgeMsec) * 1000;
+}
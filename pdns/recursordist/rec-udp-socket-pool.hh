@@ -0,0 +1,99 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <map>
+#include <sys/time.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "iputils.hh"
+
+// Keeps track of the connected outgoing UDP sockets shared by the queries sent to the same remote from the same
+// local address, see UDPClientSocks. It does not do any I/O: the caller opens the sockets and closes the ones it
+// is told to close.
+// A socket is handed out until it has been used for maxQueries queries or is older than maxAgeMsec, then it is
+// retired and closed once the last query using it is done.
+class UDPSocketPool
+{
+public:
+  using key_t = std::pair<ComboAddress, ComboAddress>; // remote, local
+
+  UDPSocketPool(unsigned int maxQueries, unsigned int maxAgeMsec) :
+    d_maxQueries(maxQueries), d_maxAgeMsec(maxAgeMsec)
+  {
+  }
+
+  // sockets are only shared if more than one query is allowed per socket
+  [[nodiscard]] bool enabled() const
+  {
+    return d_maxQueries > 1;
+  }
+
+  // returns the socket to use for a new query to that remote from that local address, or -1 if a new one has to
+  // be opened. If the current socket has exceeded its budget it is retired, and set in 'toClose' if no query is
+  // using it anymore, otherwise 'toClose' is set to -1
+  int get(const key_t& key, const struct timeval& now, int& toClose);
+
+  // a new socket has been opened for a query, and will be handed out to the next queries if 'shared' is set
+  void add(int fileDesc, const key_t& key, const struct timeval& now, bool shared);
+
+  // the query using that socket is done, returns true if the socket has to be closed. That is the case for a
+  // socket not known to the pool, and for one that is not used anymore and has exceeded its budget
+  bool release(int fileDesc, const struct timeval& now);
+
+  // stop handing out that socket, returns true if it has to be closed right away because no query is using it
+  bool retire(int fileDesc);
+
+  // retires the sockets that are not used by any query and have exceeded their time budget, returning them
+  // so that they can be closed
+  std::vector<int> pruneIdle(const struct timeval& now);
+
+  [[nodiscard]] bool contains(int fileDesc) const
+  {
+    return d_pooled.count(fileDesc) != 0;
+  }
+
+  [[nodiscard]] size_t size() const
+  {
+    return d_pooled.size();
+  }
+
+private:
+  struct PooledSocket
+  {
+    key_t d_key;
+    struct timeval d_created{};
+    unsigned int d_queries{0}; // number of queries sent over this socket so far
+    unsigned int d_outstanding{0}; // number of queries that have not released this socket yet
+    bool d_retired{false}; // no longer handed out, closed once the last outstanding query is done
+  };
+
+  [[nodiscard]] bool isExhausted(const PooledSocket& entry, const struct timeval& now) const;
+
+  std::unordered_map<int, PooledSocket> d_pooled;
+  std::map<key_t, int> d_available; // the socket currently handed out for each remote and local address
+  const unsigned int d_maxQueries;
+  const unsigned int d_maxAgeMsec;
+};
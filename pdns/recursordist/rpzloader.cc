@@ -457,7 +457,7 @@ static void preloadRPZFIle(RPZTrackerParams& params, const DNSName& zoneName, st
   while (!params.zoneXFRParams.soaRecordContent) {
     /* if we received an empty sr, the zone was not really preloaded */
 
-    /* full copy, as promised */
+    /* copy, as promised. This is cheap since the triggers are shared until modified */
     std::shared_ptr<DNSFilterEngine::Zone> newZone = std::make_shared<DNSFilterEngine::Zone>(*oldZone);
     for (const auto& primary : params.zoneXFRParams.primaries) {
       try {
@@ -471,6 +471,7 @@ static void preloadRPZFIle(RPZTrackerParams& params, const DNSName& zoneName, st
         g_luaconfs.modify([zoneIdx = params.zoneXFRParams.zoneIdx, &newZone](LuaConfigItems& lci) {
           lci.dfe.setZone(zoneIdx, newZone);
         });
+        requestRPZQNameTrieRebuild();
 
         if (!params.dumpZoneFileName.empty()) {
           dumpZoneToDisk(logger, newZone, params.dumpZoneFileName);
@@ -584,7 +585,8 @@ static bool RPZTrackerIteration(RPZTrackerParams& params, const DNSName& zoneNam
       logger->info(Logr::Info, "This policy is no more, stopping the existing RPZ update thread");
       return false;
     }
-    /* we need to make a _full copy_ of the zone we are going to work on */
+    /* we need to make a copy of the zone we are going to work on. The triggers are shared with the
+       existing zone until they are modified, so this only costs what the deltas touch */
     std::shared_ptr<DNSFilterEngine::Zone> newZone = std::make_shared<DNSFilterEngine::Zone>(*oldZone);
     /* initialize the current serial to the last one */
     std::shared_ptr<const SOARecordContent> currentSR = params.zoneXFRParams.soaRecordContent;
@@ -664,6 +666,7 @@ static bool RPZTrackerIteration(RPZTrackerParams& params, const DNSName& zoneNam
     g_luaconfs.modify([zoneIdx = params.zoneXFRParams.zoneIdx, &newZone](LuaConfigItems& lci) {
       lci.dfe.setZone(zoneIdx, newZone);
     });
+    requestRPZQNameTrieRebuild();
 
     if (!params.dumpZoneFileName.empty()) {
       dumpZoneToDisk(logger, newZone, params.dumpZoneFileName);
@@ -687,7 +690,7 @@ void RPZIXFRTracker(RPZTrackerParams params, uint64_t configGeneration)
   auto logger = g_slog->withName("rpz");
   ZoneXFR::ZoneWaiter waiter(std::this_thread::get_id());
 
-  /* we can _never_ modify this zone directly, we need to do a full copy then replace the existing zone */
+  /* we can _never_ modify this zone directly, we need to make a copy then replace the existing zone */
   std::shared_ptr<DNSFilterEngine::Zone> oldZone = g_luaconfs.getLocal()->dfe.getZone(params.zoneXFRParams.zoneIdx);
   if (!oldZone) {
     logger->error(Logr::Error, "Unable to retrieve RPZ zone from configuration", "index", Logging::Loggable(params.zoneXFRParams.zoneIdx));
@@ -714,3 +717,93 @@ void RPZIXFRTracker(RPZTrackerParams params, uint64_t configGeneration)
 
   ZoneXFR::clearZoneTracker(zoneName);
 }
+
+/* Building the trie merging the QNAME triggers of all RPZ zones takes a while for large zones, so it is done
+   by a dedicated thread, which coalesces the requests received while it was busy. Until the new trie has been
+   installed, the QNAME lookups are done zone by zone.
+   Since every change to a zone requires a full rebuild, a new build does not start before as much time as the
+   previous one took has passed, and at least s_qnameTrieMinRebuildDelay, so that frequent updates of large zones do not keep a
+   core busy. */
+static constexpr std::chrono::seconds s_qnameTrieMinRebuildDelay{1};
+
+static struct
+{
+  std::mutex mutex;
+  std::condition_variable condVar;
+  bool requested{false};
+  bool running{false};
+  bool stop{false};
+} s_qnameTrieBuilder;
+
+static void RPZQNameTrieBuilder()
+{
+  setThreadName("rec/rpztrie");
+  auto logger = g_slog->withName("rpz");
+  std::chrono::microseconds delay{0};
+  uint64_t stale = 0;
+
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(s_qnameTrieBuilder.mutex);
+      s_qnameTrieBuilder.condVar.wait_for(lock, delay, [] { return s_qnameTrieBuilder.stop; });
+      s_qnameTrieBuilder.condVar.wait(lock, [] { return s_qnameTrieBuilder.requested || s_qnameTrieBuilder.stop; });
+      if (s_qnameTrieBuilder.stop) {
+        s_qnameTrieBuilder.running = false;
+        s_qnameTrieBuilder.condVar.notify_all();
+        return;
+      }
+      s_qnameTrieBuilder.requested = false;
+    }
+
+    uint64_t elapsed = 0;
+    try {
+      DTime dtime;
+      dtime.set();
+      auto trie = g_luaconfs.getLocal()->dfe.buildQNameTrie();
+      elapsed = dtime.udiff();
+      /* if some zones have been modified in the meantime, the trie is still used for the other ones and another build has been requested */
+      bool current = false;
+      g_luaconfs.modify([&trie, &current](LuaConfigItems& lci) {
+        current = lci.dfe.setQNameTrie(trie);
+      });
+      if (current) {
+        stale = 0;
+        logger->info(Logr::Debug, "Built the RPZ QNAME trie", "nodes", Logging::Loggable(trie->getNodesCount()), "usec", Logging::Loggable(elapsed));
+      }
+      else {
+        ++stale;
+        logger->info(Logr::Info, "Some zones changed while the RPZ QNAME trie was built, QNAME lookups for these zones are done zone by zone until the next one is installed", "nodes", Logging::Loggable(trie->getNodesCount()), "usec", Logging::Loggable(elapsed), "stale", Logging::Loggable(stale));
+      }
+    }
+    catch (const std::exception& e) {
+      logger->error(Logr::Error, e.what(), "Exception while building the RPZ QNAME trie", "exception", Logging::Loggable("std::exception"));
+    }
+    delay = std::max(std::chrono::microseconds(elapsed), std::chrono::microseconds(s_qnameTrieMinRebuildDelay));
+  }
+}
+
+void requestRPZQNameTrieRebuild()
+{
+  {
+    std::lock_guard<std::mutex> lock(s_qnameTrieBuilder.mutex);
+    if (s_qnameTrieBuilder.stop) {
+      return;
+    }
+    s_qnameTrieBuilder.requested = true;
+    if (!s_qnameTrieBuilder.running) {
+      std::thread theThread(RPZQNameTrieBuilder);
+      theThread.detach();
+      s_qnameTrieBuilder.running = true;
+    }
+  }
+  s_qnameTrieBuilder.condVar.notify_all();
+}
+
+void stopRPZQNameTrieBuilder()
+{
+  std::unique_lock<std::mutex> lock(s_qnameTrieBuilder.mutex);
+  s_qnameTrieBuilder.stop = true;
+  s_qnameTrieBuilder.condVar.notify_all();
+  // a build in progress is not interrupted
+  s_qnameTrieBuilder.condVar.wait(lock, [] { return !s_qnameTrieBuilder.running; });
+}
@@ -47,6 +47,10 @@ struct RPZTrackerParams
 
 std::shared_ptr<const SOARecordContent> loadRPZFromFile(const std::string& fname, const std::shared_ptr<DNSFilterEngine::Zone>& zone, const boost::optional<DNSFilterEngine::Policy>& defpol, bool defpolOverrideLocal, uint32_t maxTTL);
 void RPZIXFRTracker(RPZTrackerParams params, uint64_t configGeneration);
+// asks for the trie merging the QNAME triggers of all zones to be rebuilt in the background, to be called when zones have changed
+void requestRPZQNameTrieRebuild();
+// stops the thread building that trie, waiting for the build in progress, if any, to finish
+void stopRPZQNameTrieBuilder();
 
 struct rpzStats
 {
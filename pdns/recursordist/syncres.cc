@@ -117,18 +117,76 @@ private:
   cont_t d_cont;
 };
 
-static LockGuarded<nsspeeds_t> s_nsSpeeds;
+/* The nameserver state shared by all threads is split into shards, each protected by its own lock,
+   so that threads looking up or updating different nameservers do not contend on a single lock.
+   The shard is selected from a hash of the key, like for the record and negative caches, so
+   all the entries for a given nameserver are in the same shard. */
+template <typename T>
+class ShardedLockGuarded
+{
+public:
+  static constexpr size_t s_shardsCount = 64;
+
+  auto lock(size_t hash)
+  {
+    return d_shards.at(hash % d_shards.size()).lock();
+  }
+
+  template <typename F>
+  void forEach(const F& func)
+  {
+    for (auto& shard : d_shards) {
+      auto content = shard.lock();
+      func(*content);
+    }
+  }
+
+  [[nodiscard]] size_t size()
+  {
+    size_t total = 0;
+    forEach([&total](const T& content) { total += content.size(); });
+    return total;
+  }
+
+  void clear()
+  {
+    forEach([](T& content) { content.clear(); });
+  }
+
+private:
+  std::array<LockGuarded<T>, s_shardsCount> d_shards;
+};
+
+static size_t getShardHash(const ComboAddress& address)
+{
+  return ComboAddress::addressOnlyHash()(address);
+}
+
+static size_t getShardHash(const DNSName& name)
+{
+  return name.hash();
+}
+
+static ShardedLockGuarded<nsspeeds_t> s_nsSpeeds;
 
 size_t SyncRes::getNSSpeedTable(size_t maxSize, std::string& ret)
 {
-  const auto copy = *s_nsSpeeds.lock();
+  nsspeeds_t copy;
+  s_nsSpeeds.forEach([&copy](const nsspeeds_t& shard) { copy.insert(shard.begin(), shard.end()); });
   return copy.getPB(s_serverID, maxSize, ret);
 }
 
 size_t SyncRes::putIntoNSSpeedTable(const std::string& ret)
 {
-  auto lock = s_nsSpeeds.lock();
-  return lock->putPB(time(nullptr) - 300, ret);
+  nsspeeds_t speeds;
+  speeds.putPB(time(nullptr) - 300, ret);
+  size_t inserted = 0;
+  for (const auto& entry : speeds) {
+    if (s_nsSpeeds.lock(getShardHash(entry.d_name))->insert(entry).second) {
+      ++inserted;
+    }
+  }
+  return inserted;
 }
 
 class Throttle
@@ -243,7 +301,7 @@ private:
   cont_t d_cont;
 };
 
-static LockGuarded<Throttle> s_throttle;
+static ShardedLockGuarded<Throttle> s_throttle;
 
 struct SavedParentEntry
 {
@@ -295,8 +353,8 @@ SuffixMatchNode SyncRes::s_ednsdomains;
 EDNSSubnetOpts SyncRes::s_ecsScopeZero;
 string SyncRes::s_serverID;
 SyncRes::LogMode SyncRes::s_lm;
-static LockGuarded<fails_t<ComboAddress>> s_fails;
-static LockGuarded<fails_t<DNSName>> s_nonresolving;
+static ShardedLockGuarded<fails_t<ComboAddress>> s_fails;
+static ShardedLockGuarded<fails_t<DNSName>> s_nonresolving;
 
 struct DoTStatus
 {
@@ -1041,11 +1099,11 @@ struct ednsstatus_t : public multi_index_container<SyncRes::EDNSStatus,
   static const time_t Expire = 7200;
 };
 
-static LockGuarded<ednsstatus_t> s_ednsstatus;
+static ShardedLockGuarded<ednsstatus_t> s_ednsstatus;
 
 SyncRes::EDNSStatus::EDNSMode SyncRes::getEDNSStatus(const ComboAddress& server)
 {
-  auto lock = s_ednsstatus.lock();
+  auto lock = s_ednsstatus.lock(getShardHash(server));
   const auto& iter = lock->find(server);
   if (iter == lock->end()) {
     return EDNSStatus::EDNSOK;
@@ -1055,17 +1113,17 @@ SyncRes::EDNSStatus::EDNSMode SyncRes::getEDNSStatus(const ComboAddress& server)
 
 uint64_t SyncRes::getEDNSStatusesSize()
 {
-  return s_ednsstatus.lock()->size();
+  return s_ednsstatus.size();
 }
 
 void SyncRes::clearEDNSStatuses()
 {
-  s_ednsstatus.lock()->clear();
+  s_ednsstatus.clear();
 }
 
 void SyncRes::pruneEDNSStatuses(time_t cutoff)
 {
-  s_ednsstatus.lock()->prune(cutoff);
+  s_ednsstatus.forEach([cutoff](ednsstatus_t& shard) { shard.prune(cutoff); });
 }
 
 uint64_t SyncRes::doEDNSDump(int fileDesc)
@@ -1082,7 +1140,8 @@ uint64_t SyncRes::doEDNSDump(int fileDesc)
   uint64_t count = 0;
 
   fprintf(filePtr.get(), "; edns dump follows\n; ip\tstatus\tttd\n");
-  const auto copy = s_ednsstatus.lock()->getMap();
+  ednsstatus_t copy;
+  s_ednsstatus.forEach([&copy](const ednsstatus_t& shard) { copy.insert(shard.begin(), shard.end()); });
   for (const auto& eds : copy) {
     count++;
     timebuf_t tmp;
@@ -1093,30 +1152,31 @@ uint64_t SyncRes::doEDNSDump(int fileDesc)
 
 void SyncRes::pruneNSSpeeds(time_t limit)
 {
-  auto lock = s_nsSpeeds.lock();
-  auto& ind = lock->get<timeval>();
-  ind.erase(ind.begin(), ind.upper_bound(timeval{limit, 0}));
+  s_nsSpeeds.forEach([limit](nsspeeds_t& shard) {
+    auto& ind = shard.get<timeval>();
+    ind.erase(ind.begin(), ind.upper_bound(timeval{limit, 0}));
+  });
 }
 
 uint64_t SyncRes::getNSSpeedsSize()
 {
-  return s_nsSpeeds.lock()->size();
+  return s_nsSpeeds.size();
 }
 
 void SyncRes::submitNSSpeed(const DNSName& server, const ComboAddress& address, int usec, const struct timeval& now)
 {
-  auto lock = s_nsSpeeds.lock();
+  auto lock = s_nsSpeeds.lock(getShardHash(server));
   lock->find_or_enter(server, now).submit(address, usec, now);
 }
 
 void SyncRes::clearNSSpeeds()
 {
-  s_nsSpeeds.lock()->clear();
+  s_nsSpeeds.clear();
 }
 
 float SyncRes::getNSSpeed(const DNSName& server, const ComboAddress& address)
 {
-  auto lock = s_nsSpeeds.lock();
+  auto lock = s_nsSpeeds.lock(getShardHash(server));
   return lock->find_or_enter(server).d_collection[address].peek();
 }
 
@@ -1135,46 +1195,49 @@ uint64_t SyncRes::doDumpNSSpeeds(int fileDesc)
   fprintf(filePtr.get(), "; nsspeed dump follows\n; nsname\ttimestamp\t[ip/decaying-ms/last-ms...]\n");
   uint64_t count = 0;
 
-  // Create a copy to avoid holding the lock while doing I/O
-  for (const auto& iter : *s_nsSpeeds.lock()) {
-    count++;
+  // Copy one shard at a time to avoid holding the lock while doing I/O
+  s_nsSpeeds.forEach([&](const nsspeeds_t& shard) {
+    const auto copy = shard;
+    for (const auto& iter : copy) {
+      count++;
 
-    // an <empty> can appear hear in case of authoritative (hosted) zones
-    timebuf_t tmp;
-    fprintf(filePtr.get(), "%s\t%s\t", iter.d_name.toLogString().c_str(), isoDateTimeMillis(iter.d_lastget, tmp));
-    bool first = true;
-    for (const auto& line : iter.d_collection) {
-      fprintf(filePtr.get(), "%s%s/%.3f/%.3f", first ? "" : "\t", line.first.toStringWithPortExcept(53).c_str(), line.second.peek() / 1000.0F, static_cast<float>(line.second.last()) / 1000.0F);
-      first = false;
+      // an <empty> can appear hear in case of authoritative (hosted) zones
+      timebuf_t tmp;
+      fprintf(filePtr.get(), "%s\t%s\t", iter.d_name.toLogString().c_str(), isoDateTimeMillis(iter.d_lastget, tmp));
+      bool first = true;
+      for (const auto& line : iter.d_collection) {
+        fprintf(filePtr.get(), "%s%s/%.3f/%.3f", first ? "" : "\t", line.first.toStringWithPortExcept(53).c_str(), line.second.peek() / 1000.0F, static_cast<float>(line.second.last()) / 1000.0F);
+        first = false;
+      }
+      fprintf(filePtr.get(), "\n");
     }
-    fprintf(filePtr.get(), "\n");
-  }
+  });
   return count;
 }
 
 uint64_t SyncRes::getThrottledServersSize()
 {
-  return s_throttle.lock()->size();
+  return s_throttle.size();
 }
 
 void SyncRes::pruneThrottledServers(time_t now)
 {
-  s_throttle.lock()->prune(now);
+  s_throttle.forEach([now](Throttle& shard) { shard.prune(now); });
 }
 
 void SyncRes::clearThrottle()
 {
-  s_throttle.lock()->clear();
+  s_throttle.clear();
 }
 
 bool SyncRes::isThrottled(time_t now, const ComboAddress& server, const DNSName& target, QType qtype)
 {
-  return s_throttle.lock()->shouldThrottle(now, std::tuple(server, target, qtype));
+  return s_throttle.lock(getShardHash(server))->shouldThrottle(now, std::tuple(server, target, qtype));
 }
 
 bool SyncRes::isThrottled(time_t now, const ComboAddress& server)
 {
-  auto throttled = s_throttle.lock()->shouldThrottle(now, std::tuple(server, g_rootdnsname, 0));
+  auto throttled = s_throttle.lock(getShardHash(server))->shouldThrottle(now, std::tuple(server, g_rootdnsname, 0));
   if (throttled) {
     // Give fully throttled servers a chance to be used, to avoid having one bad zone spoil the NS
     // record for others using the same NS. If the NS answers, it will be unThrottled immediately
@@ -1187,18 +1250,19 @@ bool SyncRes::isThrottled(time_t now, const ComboAddress& server)
 
 void SyncRes::unThrottle(const ComboAddress& server, const DNSName& name, QType qtype)
 {
-  s_throttle.lock()->clear(std::tuple(server, g_rootdnsname, 0));
-  s_throttle.lock()->clear(std::tuple(server, name, qtype));
+  auto lock = s_throttle.lock(getShardHash(server));
+  lock->clear(std::tuple(server, g_rootdnsname, 0));
+  lock->clear(std::tuple(server, name, qtype));
 }
 
 void SyncRes::doThrottle(time_t now, const ComboAddress& server, time_t duration, unsigned int tries, Throttle::Reason reason)
 {
-  s_throttle.lock()->throttle(now, std::tuple(server, g_rootdnsname, 0), duration, tries, reason);
+  s_throttle.lock(getShardHash(server))->throttle(now, std::tuple(server, g_rootdnsname, 0), duration, tries, reason);
 }
 
 void SyncRes::doThrottle(time_t now, const ComboAddress& server, const DNSName& name, QType qtype, time_t duration, unsigned int tries, Throttle::Reason reason)
 {
-  s_throttle.lock()->throttle(now, std::tuple(server, name, qtype), duration, tries, reason);
+  s_throttle.lock(getShardHash(server))->throttle(now, std::tuple(server, name, qtype), duration, tries, reason);
 }
 
 uint64_t SyncRes::doDumpThrottleMap(int fileDesc)
@@ -1217,7 +1281,11 @@ uint64_t SyncRes::doDumpThrottleMap(int fileDesc)
   uint64_t count = 0;
 
   // Get a copy to avoid holding the lock while doing I/O
-  const auto throttleMap = s_throttle.lock()->getThrottleMap();
+  Throttle::cont_t throttleMap;
+  s_throttle.forEach([&throttleMap](const Throttle& shard) {
+    const auto copy = shard.getThrottleMap();
+    throttleMap.insert(copy.begin(), copy.end());
+  });
   for (const auto& iter : throttleMap) {
     count++;
     timebuf_t tmp;
@@ -1230,22 +1298,22 @@ uint64_t SyncRes::doDumpThrottleMap(int fileDesc)
 
 uint64_t SyncRes::getFailedServersSize()
 {
-  return s_fails.lock()->size();
+  return s_fails.size();
 }
 
 void SyncRes::clearFailedServers()
 {
-  s_fails.lock()->clear();
+  s_fails.clear();
 }
 
 void SyncRes::pruneFailedServers(time_t cutoff)
 {
-  s_fails.lock()->prune(cutoff);
+  s_fails.forEach([cutoff](fails_t<ComboAddress>& shard) { shard.prune(cutoff); });
 }
 
 unsigned long SyncRes::getServerFailsCount(const ComboAddress& server)
 {
-  return s_fails.lock()->value(server);
+  return s_fails.lock(getShardHash(server))->value(server);
 }
 
 uint64_t SyncRes::doDumpFailedServers(int fileDesc)
@@ -1264,7 +1332,12 @@ uint64_t SyncRes::doDumpFailedServers(int fileDesc)
   uint64_t count = 0;
 
   // We get a copy, so the I/O does not need to happen while holding the lock
-  for (const auto& iter : s_fails.lock()->getMapCopy()) {
+  fails_t<ComboAddress>::cont_t copy;
+  s_fails.forEach([&copy](const fails_t<ComboAddress>& shard) {
+    const auto shardCopy = shard.getMapCopy();
+    copy.insert(shardCopy.begin(), shardCopy.end());
+  });
+  for (const auto& iter : copy) {
     count++;
     timebuf_t tmp;
     fprintf(filePtr.get(), "%s\t%" PRIu64 "\t%s\n", iter.key.toString().c_str(), iter.value, timestamp(iter.last, tmp));
@@ -1275,17 +1348,17 @@ uint64_t SyncRes::doDumpFailedServers(int fileDesc)
 
 uint64_t SyncRes::getNonResolvingNSSize()
 {
-  return s_nonresolving.lock()->size();
+  return s_nonresolving.size();
 }
 
 void SyncRes::clearNonResolvingNS()
 {
-  s_nonresolving.lock()->clear();
+  s_nonresolving.clear();
 }
 
 void SyncRes::pruneNonResolving(time_t cutoff)
 {
-  s_nonresolving.lock()->prune(cutoff);
+  s_nonresolving.forEach([cutoff](fails_t<DNSName>& shard) { shard.prune(cutoff); });
 }
 
 uint64_t SyncRes::doDumpNonResolvingNS(int fileDesc)
@@ -1304,7 +1377,12 @@ uint64_t SyncRes::doDumpNonResolvingNS(int fileDesc)
   uint64_t count = 0;
 
   // We get a copy, so the I/O does not need to happen while holding the lock
-  for (const auto& iter : s_nonresolving.lock()->getMapCopy()) {
+  fails_t<DNSName>::cont_t copy;
+  s_nonresolving.forEach([&copy](const fails_t<DNSName>& shard) {
+    const auto shardCopy = shard.getMapCopy();
+    copy.insert(shardCopy.begin(), shardCopy.end());
+  });
+  for (const auto& iter : copy) {
     count++;
     timebuf_t tmp;
     fprintf(filePtr.get(), "%s\t%" PRIu64 "\t%s\n", iter.key.toString().c_str(), iter.value, timestamp(iter.last, tmp));
@@ -1445,7 +1523,7 @@ LWResult::Result SyncRes::asyncresolveWrapper(const OptLog& log, const ComboAddr
   // Read current status, defaulting to OK
   SyncRes::EDNSStatus::EDNSMode mode = EDNSStatus::EDNSOK;
   {
-    auto lock = s_ednsstatus.lock();
+    auto lock = s_ednsstatus.lock(getShardHash(address));
     auto ednsstatus = lock->find(address); // does this include port? YES
     if (ednsstatus != lock->end()) {
       if (ednsstatus->ttd != 0 && ednsstatus->ttd < d_now.tv_sec) {
@@ -1498,7 +1576,7 @@ LWResult::Result SyncRes::asyncresolveWrapper(const OptLog& log, const ComboAddr
       // We sent out with EDNS
       // ret is LWResult::Result::Success
       // ednsstatus in table might be pruned or changed by another request/thread, so do a new lookup/insert if needed
-      auto lock = s_ednsstatus.lock(); // all three branches below need a lock
+      auto lock = s_ednsstatus.lock(getShardHash(address)); // all three branches below need a lock
 
       // Determine new mode
       if (ret == LWResult::Result::BindError) {
@@ -2083,7 +2161,7 @@ void SyncRes::selectNSOnSpeed(const DNSName& qname, const string& prefix, vector
   */
   map<ComboAddress, float> speeds;
   {
-    auto lock = s_nsSpeeds.lock();
+    auto lock = s_nsSpeeds.lock(getShardHash(qname));
     const auto& collection = lock->find_or_enter(qname, d_now);
     float factor = collection.getFactor(d_now);
     for (const auto& val : ret) {
@@ -3075,7 +3153,7 @@ std::vector<std::pair<DNSName, float>> SyncRes::shuffleInSpeedOrder(const DNSNam
   std::vector<std::pair<DNSName, float>> rnameservers;
   rnameservers.reserve(tnameservers.size());
   for (const auto& tns : tnameservers) {
-    float speed = s_nsSpeeds.lock()->fastest(tns.first, d_now);
+    float speed = s_nsSpeeds.lock(getShardHash(tns.first))->fastest(tns.first, d_now);
     rnameservers.emplace_back(tns.first, speed);
     if (tns.first.empty()) { // this was an authoritative OOB zone, don't pollute the nsSpeeds with that
       return rnameservers;
@@ -3110,7 +3188,7 @@ vector<ComboAddress> SyncRes::shuffleForwardSpeed(const DNSName& qname, const ve
 
   for (const auto& val : nameservers) {
     DNSName nsName = DNSName(val.toStringWithPort());
-    float speed = s_nsSpeeds.lock()->fastest(nsName, d_now);
+    float speed = s_nsSpeeds.lock(getShardHash(nsName))->fastest(nsName, d_now);
     speeds[val] = speed;
   }
   shuffle(nameservers.begin(), nameservers.end(), pdns::dns_random_engine());
@@ -3434,7 +3512,7 @@ vector<ComboAddress> SyncRes::retrieveAddressesForNS(const std::string& prefix,
   size_t nonresolvingfails = 0;
   if (!tns->first.empty()) {
     if (s_nonresolvingnsmaxfails > 0) {
-      nonresolvingfails = s_nonresolving.lock()->value(tns->first);
+      nonresolvingfails = s_nonresolving.lock(getShardHash(tns->first))->value(tns->first);
       if (nonresolvingfails >= s_nonresolvingnsmaxfails) {
         LOG(prefix << qname << ": NS " << tns->first << " in non-resolving map, skipping" << endl);
         return result;
@@ -3450,7 +3528,7 @@ vector<ComboAddress> SyncRes::retrieveAddressesForNS(const std::string& prefix,
     catch (const ImmediateServFailException& ex) {
       if (s_nonresolvingnsmaxfails > 0 && d_outqueries > oldOutQueries) {
         if (!shouldNotThrottle(&tns->first, nullptr)) {
-          s_nonresolving.lock()->incr(tns->first, d_now);
+          s_nonresolving.lock(getShardHash(tns->first))->incr(tns->first, d_now);
         }
       }
       throw ex;
@@ -3458,12 +3536,12 @@ vector<ComboAddress> SyncRes::retrieveAddressesForNS(const std::string& prefix,
     if (s_nonresolvingnsmaxfails > 0 && d_outqueries > oldOutQueries) {
       if (result.empty()) {
         if (!shouldNotThrottle(&tns->first, nullptr)) {
-          s_nonresolving.lock()->incr(tns->first, d_now);
+          s_nonresolving.lock(getShardHash(tns->first))->incr(tns->first, d_now);
         }
       }
       else if (nonresolvingfails > 0) {
         // Succeeding resolve, clear memory of recent failures
-        s_nonresolving.lock()->clear(tns->first);
+        s_nonresolving.lock(getShardHash(tns->first))->clear(tns->first);
       }
     }
     pierceDontQuery = false;
@@ -5544,10 +5622,10 @@ bool SyncRes::doResolveAtThisIP(const std::string& prefix, const DNSName& qname,
         responseUsec = lwr.d_usec;
       }
 
-      s_nsSpeeds.lock()->find_or_enter(nsName.empty() ? DNSName(remoteIP.toStringWithPort()) : nsName, d_now).submit(remoteIP, static_cast<int>(responseUsec), d_now);
+      submitNSSpeed(nsName.empty() ? DNSName(remoteIP.toStringWithPort()) : nsName, remoteIP, static_cast<int>(responseUsec), d_now);
 
       // make sure we don't throttle the root
-      if (s_serverdownmaxfails > 0 && auth != g_rootdnsname && s_fails.lock()->incr(remoteIP, d_now) >= s_serverdownmaxfails) {
+      if (s_serverdownmaxfails > 0 && auth != g_rootdnsname && s_fails.lock(getShardHash(remoteIP))->incr(remoteIP, d_now) >= s_serverdownmaxfails) {
         LOG(prefix << qname << ": Max fails reached resolving on " << remoteIP.toString() << ". Going full throttle for " << s_serverdownthrottletime << " seconds" << endl);
         // mark server as down
         doThrottle(d_now.tv_sec, remoteIP, s_serverdownthrottletime, 10000, Throttle::Reason::ServerDown);
@@ -5575,7 +5653,7 @@ bool SyncRes::doResolveAtThisIP(const std::string& prefix, const DNSName& qname,
     if (!chained && !dontThrottle) {
 
       // let's make sure we prefer a different server for some time, if there is one available
-      s_nsSpeeds.lock()->find_or_enter(nsName.empty() ? DNSName(remoteIP.toStringWithPort()) : nsName, d_now).submit(remoteIP, 1000000, d_now); // 1 sec
+      submitNSSpeed(nsName.empty() ? DNSName(remoteIP.toStringWithPort()) : nsName, remoteIP, 1000000, d_now); // 1 sec
 
       if (doTCP) {
         // we can be more heavy-handed over TCP
@@ -5595,7 +5673,7 @@ bool SyncRes::doResolveAtThisIP(const std::string& prefix, const DNSName& qname,
         // rather than throttling what could be the only server we have for this destination, let's make sure we try a different one if there is one available
         // on the other hand, we might keep hammering a server under attack if there is no other alternative, or the alternative is overwhelmed as well, but
         // at the very least we will detect that if our packets stop being answered
-        s_nsSpeeds.lock()->find_or_enter(nsName.empty() ? DNSName(remoteIP.toStringWithPort()) : nsName, d_now).submit(remoteIP, 1000000, d_now); // 1 sec
+        submitNSSpeed(nsName.empty() ? DNSName(remoteIP.toStringWithPort()) : nsName, remoteIP, 1000000, d_now); // 1 sec
       }
       else {
         Throttle::Reason reason{};
@@ -5618,7 +5696,7 @@ bool SyncRes::doResolveAtThisIP(const std::string& prefix, const DNSName& qname,
 
   /* this server sent a valid answer, mark it backup up if it was down */
   if (s_serverdownmaxfails > 0) {
-    s_fails.lock()->clear(remoteIP);
+    s_fails.lock(getShardHash(remoteIP))->clear(remoteIP);
   }
   // Clear all throttles for this IP, both general and specific throttles for qname-qtype
   unThrottle(remoteIP, qname, qtype);
@@ -6028,7 +6106,7 @@ int SyncRes::doResolveAt(NsSet& nameservers, DNSName auth, bool flawedNSSet, con
           */
           //        cout<<"ms: "<<lwr.d_usec/1000.0<<", "<<g_avgLatency/1000.0<<'\n';
 
-          s_nsSpeeds.lock()->find_or_enter(tns->first.empty() ? DNSName(remoteIP->toStringWithPort()) : tns->first, d_now).submit(*remoteIP, static_cast<int>(lwr.d_usec), d_now);
+          submitNSSpeed(tns->first.empty() ? DNSName(remoteIP->toStringWithPort()) : tns->first, *remoteIP, static_cast<int>(lwr.d_usec), d_now);
 
           /* we have received an answer, are we done ? */
           bool done = processAnswer(depth, prefix, lwr, qname, qtype, auth, wasForwarded, ednsmask, sendRDQuery, nameservers, ret, luaconfsLocal->dfe, &gotNewServers, &rcode, context.state, *remoteIP);
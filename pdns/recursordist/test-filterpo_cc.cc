@@ -834,6 +834,94 @@ BOOST_AUTO_TEST_CASE(test_multiple_filter_policies_order)
   }
 }
 
+BOOST_AUTO_TEST_CASE(test_qname_trie)
+{
+  /* the trie should give the same results than looking into each zone */
+  DNSFilterEngine dfe;
+  const std::vector<std::string> labels{"a", "b", "c", "*"};
+  const std::vector<DNSFilterEngine::PolicyKind> kinds{DNSFilterEngine::PolicyKind::Drop, DNSFilterEngine::PolicyKind::NXDOMAIN, DNSFilterEngine::PolicyKind::NODATA, DNSFilterEngine::PolicyKind::Truncate};
+  std::vector<DNSName> names{DNSName("example."), DNSName("*.")};
+  for (size_t idx = 0; idx < names.size(); idx++) {
+    if (names.at(idx).countLabels() < 4) {
+      for (const auto& label : labels) {
+        names.push_back(DNSName(label) + names.at(idx));
+      }
+    }
+  }
+
+  for (size_t zoneIdx = 0; zoneIdx < 4; zoneIdx++) {
+    auto zone = std::make_shared<DNSFilterEngine::Zone>();
+    zone->setName("zone" + std::to_string(zoneIdx));
+    for (size_t idx = 0; idx < names.size(); idx++) {
+      if ((idx * 7 + zoneIdx * 3) % (zoneIdx + 2) == 0) {
+        zone->addQNameTrigger(names.at(idx), DNSFilterEngine::Policy(kinds.at((idx + zoneIdx) % kinds.size()), DNSFilterEngine::PolicyType::QName));
+      }
+    }
+    dfe.addZone(zone);
+  }
+  BOOST_CHECK(!dfe.hasCurrentQNameTrie());
+
+  auto withTrie = dfe;
+  BOOST_REQUIRE(withTrie.setQNameTrie(withTrie.buildQNameTrie()));
+  BOOST_CHECK(withTrie.hasCurrentQNameTrie());
+
+  std::vector<DNSName> queries{DNSName("."), DNSName("other.")};
+  for (const auto& name : names) {
+    queries.push_back(name);
+    queries.push_back(DNSName("D") + name);
+    queries.push_back(DNSName("e.D") + name);
+    queries.push_back(DNSName(toUpper(name.toString())));
+  }
+
+  auto checkSameResults = [&queries](const DNSFilterEngine& reference, const DNSFilterEngine& tested) {
+    const std::vector<std::unordered_map<std::string, bool>> discarded{{}, {{"zone0", true}}, {{"zone1", true}, {"zone2", true}}};
+    for (const auto& qname : queries) {
+      for (const auto priority : {DNSFilterEngine::maximumPriority, DNSFilterEngine::Priority(2), DNSFilterEngine::Priority(1), DNSFilterEngine::Priority(0)}) {
+        for (const auto& discardedPolicies : discarded) {
+          const auto expected = reference.getQueryPolicy(qname, discardedPolicies, priority);
+          const auto got = tested.getQueryPolicy(qname, discardedPolicies, priority);
+          BOOST_CHECK_EQUAL(got.wasHit(), expected.wasHit());
+          BOOST_CHECK(got.d_kind == expected.d_kind);
+          BOOST_CHECK_EQUAL(got.getPriority(), expected.getPriority());
+          BOOST_CHECK_EQUAL(got.getName(), expected.getName());
+          BOOST_CHECK_EQUAL(got.getTrigger(), expected.getTrigger());
+          BOOST_CHECK_EQUAL(got.getHit(), expected.getHit());
+        }
+      }
+    }
+  };
+  checkSameResults(dfe, withTrie);
+
+  /* a modified zone makes the trie stale for that zone only, which is looked up on its own */
+  auto newZone = std::make_shared<DNSFilterEngine::Zone>(*withTrie.getZone(1));
+  newZone->addQNameTrigger(DNSName("d.example."), DNSFilterEngine::Policy(DNSFilterEngine::PolicyKind::Drop, DNSFilterEngine::PolicyType::QName));
+  newZone->addQNameTrigger(DNSName("*.D.b.example."), DNSFilterEngine::Policy(DNSFilterEngine::PolicyKind::NODATA, DNSFilterEngine::PolicyType::QName));
+  auto oldTrie = withTrie.buildQNameTrie();
+  withTrie.setZone(1, newZone);
+  dfe.setZone(1, newZone);
+  BOOST_CHECK(!withTrie.hasCurrentQNameTrie());
+  BOOST_CHECK(!withTrie.setQNameTrie(oldTrie));
+  BOOST_CHECK(oldTrie->isCurrent(0, withTrie.getZone(0)));
+  BOOST_CHECK(!oldTrie->isCurrent(1, withTrie.getZone(1)));
+  BOOST_CHECK(oldTrie->isCurrent(2, withTrie.getZone(2)));
+  checkSameResults(dfe, withTrie);
+  BOOST_CHECK(withTrie.getQueryPolicy(DNSName("d.example."), {}, DNSFilterEngine::maximumPriority).wasHit());
+
+  /* and so is a zone added since */
+  auto addedZone = std::make_shared<DNSFilterEngine::Zone>();
+  addedZone->setName("zone4");
+  addedZone->addQNameTrigger(DNSName("e.D.example."), DNSFilterEngine::Policy(DNSFilterEngine::PolicyKind::NXDOMAIN, DNSFilterEngine::PolicyType::QName));
+  addedZone->addQNameTrigger(DNSName("*.example."), DNSFilterEngine::Policy(DNSFilterEngine::PolicyKind::Truncate, DNSFilterEngine::PolicyType::QName));
+  withTrie.addZone(addedZone);
+  dfe.addZone(addedZone);
+  BOOST_CHECK(!oldTrie->isCurrent(4, withTrie.getZone(4)));
+  checkSameResults(dfe, withTrie);
+
+  BOOST_REQUIRE(withTrie.setQNameTrie(withTrie.buildQNameTrie()));
+  checkSameResults(dfe, withTrie);
+  BOOST_CHECK(withTrie.getQueryPolicy(DNSName("d.example."), {}, DNSFilterEngine::maximumPriority).wasHit());
+}
+
 BOOST_AUTO_TEST_CASE(test_mask_to_rpz)
 {
   BOOST_CHECK_EQUAL(DNSFilterEngine::Zone::maskToRPZ(Netmask("::2/127")).toString(), "127.2.zz.");
@@ -846,3 +934,91 @@ BOOST_AUTO_TEST_CASE(test_mask_to_rpz)
   BOOST_CHECK_EQUAL(DNSFilterEngine::Zone::maskToRPZ(Netmask("1:0:0:2:0:0:0:0/127")).toString(), "127.zz.2.0.0.1.");
   BOOST_CHECK_EQUAL(DNSFilterEngine::Zone::maskToRPZ(Netmask("1:0:0:0:0:2:0:0/127")).toString(), "127.0.0.2.zz.1.");
 }
+
+BOOST_AUTO_TEST_CASE(test_zone_copy_on_write)
+{
+  auto zone = std::make_shared<DNSFilterEngine::Zone>();
+  zone->setName("Unit test copy on write");
+
+  for (size_t idx = 0; idx < 1000; idx++) {
+    zone->addQNameTrigger(DNSName("name" + std::to_string(idx) + ".example."), DNSFilterEngine::Policy(DNSFilterEngine::PolicyKind::Drop, DNSFilterEngine::PolicyType::QName));
+    zone->addNSTrigger(DNSName("ns" + std::to_string(idx) + ".example."), DNSFilterEngine::Policy(DNSFilterEngine::PolicyKind::Drop, DNSFilterEngine::PolicyType::NSDName));
+  }
+  const DNSName customName("custom.example.");
+  zone->addQNameTrigger(customName, DNSFilterEngine::Policy(DNSFilterEngine::PolicyKind::Custom, DNSFilterEngine::PolicyType::QName, 0, nullptr, {DNSRecordContent::make(QType::A, QClass::IN, "192.0.2.1")}));
+  zone->addQNameTrigger(customName, DNSFilterEngine::Policy(DNSFilterEngine::PolicyKind::Custom, DNSFilterEngine::PolicyType::QName, 0, nullptr, {DNSRecordContent::make(QType::A, QClass::IN, "192.0.2.2")}));
+  zone->addClientTrigger(Netmask("192.0.2.0/24"), DNSFilterEngine::Policy(DNSFilterEngine::PolicyKind::Drop, DNSFilterEngine::PolicyType::ClientIP));
+  zone->addResponseTrigger(Netmask("198.51.100.0/24"), DNSFilterEngine::Policy(DNSFilterEngine::PolicyKind::Drop, DNSFilterEngine::PolicyType::ResponseIP));
+  BOOST_CHECK_EQUAL(zone->size(), 2003U);
+
+  /* what an IXFR does: copy the zone then apply the delta to the copy */
+  auto copy = std::make_shared<DNSFilterEngine::Zone>(*zone);
+  BOOST_CHECK_EQUAL(copy->size(), 2003U);
+  for (size_t idx = 0; idx < 100; idx++) {
+    BOOST_CHECK(copy->rmQNameTrigger(DNSName("name" + std::to_string(idx) + ".example."), DNSFilterEngine::Policy(DNSFilterEngine::PolicyKind::Drop, DNSFilterEngine::PolicyType::QName)));
+    copy->addQNameTrigger(DNSName("new" + std::to_string(idx) + ".example."), DNSFilterEngine::Policy(DNSFilterEngine::PolicyKind::Drop, DNSFilterEngine::PolicyType::QName));
+  }
+  BOOST_CHECK(copy->rmNSTrigger(DNSName("ns0.example."), DNSFilterEngine::Policy(DNSFilterEngine::PolicyKind::Drop, DNSFilterEngine::PolicyType::NSDName)));
+  BOOST_CHECK(copy->rmQNameTrigger(customName, DNSFilterEngine::Policy(DNSFilterEngine::PolicyKind::Custom, DNSFilterEngine::PolicyType::QName, 0, nullptr, {DNSRecordContent::make(QType::A, QClass::IN, "192.0.2.1")})));
+  BOOST_CHECK(copy->rmClientTrigger(Netmask("192.0.2.0/24"), DNSFilterEngine::Policy(DNSFilterEngine::PolicyKind::Drop, DNSFilterEngine::PolicyType::ClientIP)));
+  copy->addResponseTrigger(Netmask("203.0.113.0/24"), DNSFilterEngine::Policy(DNSFilterEngine::PolicyKind::Drop, DNSFilterEngine::PolicyType::ResponseIP));
+  BOOST_CHECK_EQUAL(copy->size(), 2002U);
+
+  /* the original zone is left untouched */
+  BOOST_CHECK_EQUAL(zone->size(), 2003U);
+  DNSFilterEngine::Policy pol;
+  BOOST_CHECK(zone->findExactQNamePolicy(DNSName("name0.example."), pol));
+  BOOST_CHECK(!zone->findExactQNamePolicy(DNSName("new0.example."), pol));
+  BOOST_CHECK(zone->findExactNSPolicy(DNSName("ns0.example."), pol));
+  BOOST_CHECK(zone->findExactQNamePolicy(customName, pol));
+  BOOST_CHECK_EQUAL(pol.d_custom->size(), 2U);
+  BOOST_CHECK(zone->findClientPolicy(ComboAddress("192.0.2.1"), pol));
+  BOOST_CHECK(!zone->findResponsePolicy(ComboAddress("203.0.113.1"), pol));
+
+  /* and the copy has the changes */
+  BOOST_CHECK(!copy->findExactQNamePolicy(DNSName("name0.example."), pol));
+  BOOST_CHECK(copy->findExactQNamePolicy(DNSName("name100.example."), pol));
+  BOOST_CHECK(copy->findExactQNamePolicy(DNSName("new0.example."), pol));
+  BOOST_CHECK(!copy->findExactNSPolicy(DNSName("ns0.example."), pol));
+  BOOST_CHECK(copy->findExactQNamePolicy(customName, pol));
+  BOOST_CHECK_EQUAL(pol.d_custom->size(), 1U);
+  BOOST_CHECK(!copy->findClientPolicy(ComboAddress("192.0.2.1"), pol));
+  BOOST_CHECK(copy->findResponsePolicy(ComboAddress("203.0.113.1"), pol));
+  BOOST_CHECK(copy->findResponsePolicy(ComboAddress("198.51.100.1"), pol));
+}
+
+#if 0
+BOOST_AUTO_TEST_CASE(test_zone_ixfr_bench)
+{
+  /* applies IXFRs of 100 removals and 100 additions to a zone of 5M entries, the way the RPZ loader does */
+  const size_t zoneSize = 5000000;
+  const size_t deltaSize = 100;
+  const size_t rounds = 100;
+
+  auto zone = std::make_shared<DNSFilterEngine::Zone>();
+  zone->setName("Benchmark");
+  DTime dtime;
+  dtime.set();
+  for (size_t idx = 0; idx < zoneSize; idx++) {
+    zone->addQNameTrigger(DNSName("name" + std::to_string(idx) + ".example."), DNSFilterEngine::Policy(DNSFilterEngine::PolicyKind::Drop, DNSFilterEngine::PolicyType::QName));
+  }
+  cerr << "Loading " << zoneSize << " entries took " << dtime.udiff() / 1000 << " ms" << endl;
+
+  std::vector<std::shared_ptr<DNSFilterEngine::Zone>> previous;
+  size_t next = zoneSize;
+  dtime.set();
+  for (size_t round = 0; round < rounds; round++) {
+    auto copy = std::make_shared<DNSFilterEngine::Zone>(*zone);
+    for (size_t idx = 0; idx < deltaSize; idx++) {
+      copy->rmQNameTrigger(DNSName("name" + std::to_string(round * deltaSize + idx) + ".example."), DNSFilterEngine::Policy(DNSFilterEngine::PolicyKind::Drop, DNSFilterEngine::PolicyType::QName));
+      copy->addQNameTrigger(DNSName("name" + std::to_string(next++) + ".example."), DNSFilterEngine::Policy(DNSFilterEngine::PolicyKind::Drop, DNSFilterEngine::PolicyType::QName));
+    }
+    /* keep the previous versions alive, as in-flight queries might */
+    previous.push_back(zone);
+    zone = std::move(copy);
+  }
+  auto elapsed = dtime.udiff();
+  cerr << "Applying " << rounds << " IXFRs of " << deltaSize * 2 << " changes took " << elapsed / 1000 << " ms, " << elapsed / rounds << " us per IXFR" << endl;
+  BOOST_CHECK_EQUAL(zone->size(), zoneSize);
+}
+#endif
@@ -0,0 +1,205 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef BOOST_TEST_DYN_LINK
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#define BOOST_TEST_NO_MAIN
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+
+#include <random>
+#include <string>
+#include <unordered_map>
+
+#include "persistent-hashmap.hh"
+
+BOOST_AUTO_TEST_SUITE(persistent_hashmap_hh)
+
+using Map = PersistentHashMap<std::string, unsigned int>;
+
+static void checkSame(const Map& map, const std::unordered_map<std::string, unsigned int>& reference)
+{
+  BOOST_REQUIRE_EQUAL(map.size(), reference.size());
+  for (const auto& [key, value] : reference) {
+    const auto* entry = map.lookup(key);
+    BOOST_REQUIRE(entry != nullptr);
+    BOOST_CHECK_EQUAL(entry->first, key);
+    BOOST_CHECK_EQUAL(entry->second, value);
+  }
+  size_t visited = 0;
+  map.visit([&reference, &visited](const Map::value_type& entry) {
+    ++visited;
+    auto iter = reference.find(entry.first);
+    BOOST_REQUIRE(iter != reference.end());
+    BOOST_CHECK_EQUAL(iter->second, entry.second);
+  });
+  BOOST_CHECK_EQUAL(visited, reference.size());
+}
+
+BOOST_AUTO_TEST_CASE(test_basic)
+{
+  Map map;
+  BOOST_CHECK(map.empty());
+  BOOST_CHECK(map.lookup("a") == nullptr);
+  BOOST_CHECK(map.getMutable("a") == nullptr);
+  BOOST_CHECK(!map.erase("a"));
+
+  auto [entry, inserted] = map.insert("a", 1);
+  BOOST_CHECK(inserted);
+  BOOST_CHECK_EQUAL(entry->first, "a");
+  BOOST_CHECK_EQUAL(entry->second, 1U);
+  BOOST_CHECK_EQUAL(map.size(), 1U);
+
+  /* an existing entry is not replaced */
+  std::tie(entry, inserted) = map.insert("a", 2);
+  BOOST_CHECK(!inserted);
+  BOOST_CHECK_EQUAL(entry->second, 1U);
+  BOOST_CHECK_EQUAL(map.size(), 1U);
+
+  *map.getMutable("a") = 3;
+  BOOST_CHECK_EQUAL(map.lookup("a")->second, 3U);
+
+  BOOST_CHECK(map.erase("a"));
+  BOOST_CHECK(map.empty());
+  BOOST_CHECK(map.lookup("a") == nullptr);
+
+  map.insert("b", 4);
+  map.clear();
+  BOOST_CHECK(map.empty());
+  BOOST_CHECK(map.lookup("b") == nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(test_random_against_unordered_map)
+{
+  std::mt19937 gen(42);
+  std::uniform_int_distribution<unsigned int> keys(0, 20000);
+  std::uniform_int_distribution<unsigned int> ops(0, 2);
+
+  Map map;
+  std::unordered_map<std::string, unsigned int> reference;
+
+  for (unsigned int idx = 0; idx < 100000; idx++) {
+    const auto key = std::to_string(keys(gen));
+    switch (ops(gen)) {
+    case 0:
+    case 1: {
+      auto inserted = map.insert(key, unsigned(idx)).second;
+      BOOST_CHECK_EQUAL(inserted, reference.emplace(key, idx).second);
+      break;
+    }
+    case 2:
+      BOOST_CHECK_EQUAL(map.erase(key), reference.erase(key) == 1);
+      break;
+    }
+  }
+
+  checkSame(map, reference);
+
+  for (auto& [key, value] : reference) {
+    value++;
+    auto* mutableValue = map.getMutable(key);
+    BOOST_REQUIRE(mutableValue != nullptr);
+    (*mutableValue)++;
+  }
+
+  checkSame(map, reference);
+
+  for (const auto& entry : reference) {
+    BOOST_CHECK(map.erase(entry.first));
+  }
+  BOOST_CHECK(map.empty());
+}
+
+struct CollidingHash
+{
+  size_t operator()(const std::string& key) const
+  {
+    /* only 4 distinct hashes, to exercise the overflowing leaves */
+    return std::hash<std::string>()(key) & 3U;
+  }
+};
+
+BOOST_AUTO_TEST_CASE(test_collisions)
+{
+  PersistentHashMap<std::string, unsigned int, CollidingHash> map;
+  for (unsigned int idx = 0; idx < 1000; idx++) {
+    BOOST_CHECK(map.insert(std::to_string(idx), unsigned(idx)).second);
+  }
+  BOOST_CHECK_EQUAL(map.size(), 1000U);
+  for (unsigned int idx = 0; idx < 1000; idx++) {
+    const auto* entry = map.lookup(std::to_string(idx));
+    BOOST_REQUIRE(entry != nullptr);
+    BOOST_CHECK_EQUAL(entry->second, idx);
+  }
+  for (unsigned int idx = 0; idx < 1000; idx += 2) {
+    BOOST_CHECK(map.erase(std::to_string(idx)));
+  }
+  BOOST_CHECK_EQUAL(map.size(), 500U);
+  for (unsigned int idx = 0; idx < 1000; idx++) {
+    BOOST_CHECK_EQUAL(map.lookup(std::to_string(idx)) != nullptr, (idx % 2) == 1);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_copies_are_independent)
+{
+  Map original;
+  std::unordered_map<std::string, unsigned int> originalReference;
+  for (unsigned int idx = 0; idx < 10000; idx++) {
+    original.insert(std::to_string(idx), unsigned(idx));
+    originalReference.emplace(std::to_string(idx), idx);
+  }
+
+  Map copy(original);
+  std::unordered_map<std::string, unsigned int> copyReference(originalReference);
+  BOOST_CHECK(copy.isSameVersionAs(original));
+
+  /* modify the copy */
+  for (unsigned int idx = 0; idx < 100; idx++) {
+    BOOST_CHECK(copy.erase(std::to_string(idx)));
+    copyReference.erase(std::to_string(idx));
+    copy.insert("new-" + std::to_string(idx), unsigned(idx));
+    copyReference.emplace("new-" + std::to_string(idx), idx);
+    *copy.getMutable(std::to_string(idx + 5000)) = 0;
+    copyReference[std::to_string(idx + 5000)] = 0;
+  }
+
+  checkSame(original, originalReference);
+  checkSame(copy, copyReference);
+  BOOST_CHECK(!copy.isSameVersionAs(original));
+
+  /* then the original */
+  Map second(original);
+  original.clear();
+  originalReference.clear();
+  checkSame(original, originalReference);
+  checkSame(copy, copyReference);
+  BOOST_CHECK_EQUAL(second.size(), 10000U);
+  BOOST_CHECK_EQUAL(second.lookup("42")->second, 42U);
+  BOOST_CHECK(second.lookup("new-42") == nullptr);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
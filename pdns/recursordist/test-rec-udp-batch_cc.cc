@@ -0,0 +1,111 @@
+#ifndef BOOST_TEST_DYN_LINK
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#define BOOST_TEST_NO_MAIN
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+#include "rec-udp-batch.hh"
+#include "sstuff.hh"
+
+BOOST_AUTO_TEST_SUITE(test_rec_udp_batch_cc)
+
+#if defined(HAVE_SENDMMSG)
+static ComboAddress getBoundAddress(const Socket& sock)
+{
+  ComboAddress local("127.0.0.1");
+  socklen_t len = local.getSocklen();
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  BOOST_REQUIRE_EQUAL(getsockname(sock.getHandle(), reinterpret_cast<sockaddr*>(&local), &len), 0);
+  return local;
+}
+
+BOOST_AUTO_TEST_CASE(test_send)
+{
+  Socket receiver(AF_INET, SOCK_DGRAM);
+  receiver.bind(ComboAddress("127.0.0.1:0"));
+  const auto receiverAddress = getBoundAddress(receiver);
+  Socket sender(AF_INET, SOCK_DGRAM);
+  sender.bind(ComboAddress("127.0.0.1:0"));
+  const auto senderAddress = getBoundAddress(sender);
+
+  UDPAnswerBatch batch;
+  batch.d_socket = sender.getHandle();
+  const auto onError = [](const UDPAnswerBatch::Answer& answer, int error) {
+    BOOST_FAIL("Unexpected error " << error << " while sending an answer to " << answer.d_remote.toStringWithPort());
+  };
+
+  /* nothing to send */
+  BOOST_CHECK_EQUAL(batch.send(false, onError), 0U);
+
+  const size_t count = 10;
+  for (size_t idx = 0; idx < count; idx++) {
+    batch.add("answer-" + std::to_string(idx), receiverAddress, senderAddress, receiverAddress);
+  }
+  BOOST_CHECK_EQUAL(batch.send(false, onError), count);
+  /* the answers are flushed once sent */
+  BOOST_CHECK(batch.d_answers.empty());
+
+  /* all the answers are received, in order, from the socket of the batch */
+  for (size_t idx = 0; idx < count; idx++) {
+    std::string received;
+    ComboAddress from;
+    receiver.recvFrom(received, from);
+    BOOST_CHECK_EQUAL(received, "answer-" + std::to_string(idx));
+    BOOST_CHECK_EQUAL(from.toStringWithPort(), senderAddress.toStringWithPort());
+  }
+
+  /* the buffers are reused for the next batch */
+  batch.add("again", receiverAddress, senderAddress, receiverAddress);
+  BOOST_CHECK_EQUAL(batch.send(false, onError), 1U);
+  std::string received;
+  ComboAddress from;
+  receiver.recvFrom(received, from);
+  BOOST_CHECK_EQUAL(received, "again");
+}
+
+BOOST_AUTO_TEST_CASE(test_send_failure)
+{
+  Socket receiver(AF_INET, SOCK_DGRAM);
+  receiver.bind(ComboAddress("127.0.0.1:0"));
+  const auto receiverAddress = getBoundAddress(receiver);
+  Socket sender(AF_INET, SOCK_DGRAM);
+  sender.bind(ComboAddress("127.0.0.1:0"));
+  const auto senderAddress = getBoundAddress(sender);
+
+  UDPAnswerBatch batch;
+  batch.d_socket = sender.getHandle();
+  std::vector<std::string> failed;
+  const auto onError = [&failed](const UDPAnswerBatch::Answer& answer, int error) {
+    BOOST_CHECK(error != 0);
+    failed.push_back(answer.d_response);
+  };
+
+  /* an IPv6 destination cannot be reached from an IPv4 socket: that answer is skipped,
+     and the ones before and after it are still sent */
+  const ComboAddress unreachable("[2001:db8::1]:53");
+  batch.add("first", receiverAddress, senderAddress, receiverAddress);
+  batch.add("unreachable", unreachable, senderAddress, unreachable);
+  batch.add("second", receiverAddress, senderAddress, receiverAddress);
+  batch.add("unreachable-last", unreachable, senderAddress, unreachable);
+  BOOST_CHECK_EQUAL(batch.send(false, onError), 2U);
+  BOOST_CHECK(batch.d_answers.empty());
+  BOOST_REQUIRE_EQUAL(failed.size(), 2U);
+  BOOST_CHECK_EQUAL(failed.at(0), "unreachable");
+  BOOST_CHECK_EQUAL(failed.at(1), "unreachable-last");
+
+  for (const auto& expected : {"first", "second"}) {
+    std::string received;
+    ComboAddress from;
+    receiver.recvFrom(received, from);
+    BOOST_CHECK_EQUAL(received, expected);
+  }
+}
+#endif /* HAVE_SENDMMSG */
+
+BOOST_AUTO_TEST_SUITE_END()
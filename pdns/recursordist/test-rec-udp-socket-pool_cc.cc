@@ -0,0 +1,177 @@
+#ifndef BOOST_TEST_DYN_LINK
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#define BOOST_TEST_NO_MAIN
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+#include "rec-udp-socket-pool.hh"
+
+BOOST_AUTO_TEST_SUITE(test_rec_udp_socket_pool_cc)
+
+static const UDPSocketPool::key_t s_key{ComboAddress("192.0.2.1:53"), ComboAddress()};
+static const UDPSocketPool::key_t s_otherKey{ComboAddress("192.0.2.2:53"), ComboAddress()};
+
+static struct timeval later(const struct timeval& now, unsigned int msec)
+{
+  struct timeval result = now;
+  result.tv_sec += msec / 1000;
+  result.tv_usec += (msec % 1000) * 1000;
+  if (result.tv_usec >= 1000000) {
+    ++result.tv_sec;
+    result.tv_usec -= 1000000;
+  }
+  return result;
+}
+
+BOOST_AUTO_TEST_CASE(test_disabled)
+{
+  UDPSocketPool pool(1, 1000);
+  BOOST_CHECK(!pool.enabled());
+  BOOST_CHECK(UDPSocketPool(2, 1000).enabled());
+
+  // a socket the pool does not know about is always closed
+  const struct timeval now{1000, 0};
+  BOOST_CHECK(pool.release(42, now));
+  BOOST_CHECK(!pool.retire(42));
+}
+
+BOOST_AUTO_TEST_CASE(test_reuse)
+{
+  UDPSocketPool pool(3, 1000);
+  const struct timeval now{1000, 0};
+  int toClose = -1;
+
+  BOOST_CHECK_EQUAL(pool.get(s_key, now, toClose), -1);
+  pool.add(10, s_key, now, true);
+  BOOST_CHECK(pool.contains(10));
+
+  // handed out for the same remote, not for another one
+  BOOST_CHECK_EQUAL(pool.get(s_key, now, toClose), 10);
+  BOOST_CHECK_EQUAL(toClose, -1);
+  BOOST_CHECK_EQUAL(pool.get(s_otherKey, now, toClose), -1);
+
+  // kept open while the budget is not exhausted
+  BOOST_CHECK(!pool.release(10, now));
+  BOOST_CHECK(!pool.release(10, now));
+  BOOST_CHECK_EQUAL(pool.get(s_key, now, toClose), 10);
+
+  // third query, the budget is exhausted: the socket is no longer handed out and closed once idle
+  BOOST_CHECK_EQUAL(pool.get(s_key, now, toClose), -1);
+  BOOST_CHECK_EQUAL(toClose, -1);
+  BOOST_CHECK(pool.release(10, now));
+  BOOST_CHECK(!pool.contains(10));
+  BOOST_CHECK_EQUAL(pool.size(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(test_exhausted_idle)
+{
+  UDPSocketPool pool(2, 1000);
+  const struct timeval now{1000, 0};
+  int toClose = -1;
+
+  pool.add(10, s_key, now, true);
+  BOOST_CHECK(!pool.release(10, now));
+  BOOST_CHECK_EQUAL(pool.get(s_key, now, toClose), 10);
+  // the last query of the budget is done
+  BOOST_CHECK(pool.release(10, now));
+  BOOST_CHECK(!pool.contains(10));
+
+  // an idle socket that expired is closed when the next query asks for one
+  pool.add(11, s_key, now, true);
+  BOOST_CHECK(!pool.release(11, now));
+  BOOST_CHECK_EQUAL(pool.get(s_key, later(now, 1000), toClose), -1);
+  BOOST_CHECK_EQUAL(toClose, 11);
+  BOOST_CHECK(!pool.contains(11));
+}
+
+BOOST_AUTO_TEST_CASE(test_expired_on_release)
+{
+  UDPSocketPool pool(100, 1000);
+  const struct timeval now{1000, 0};
+  int toClose = -1;
+
+  pool.add(10, s_key, now, true);
+  BOOST_CHECK_EQUAL(pool.get(s_key, later(now, 500), toClose), 10);
+  BOOST_CHECK(!pool.release(10, later(now, 900)));
+  // the socket expired while a query was still using it, it is closed when that query is done
+  BOOST_CHECK(pool.release(10, later(now, 1000)));
+  BOOST_CHECK(!pool.contains(10));
+  BOOST_CHECK_EQUAL(pool.get(s_key, later(now, 1000), toClose), -1);
+  BOOST_CHECK_EQUAL(toClose, -1);
+}
+
+BOOST_AUTO_TEST_CASE(test_retire)
+{
+  UDPSocketPool pool(100, 1000);
+  const struct timeval now{1000, 0};
+  int toClose = -1;
+
+  pool.add(10, s_key, now, true);
+  BOOST_CHECK_EQUAL(pool.get(s_key, now, toClose), 10);
+  // retired after an error, while two queries are using it
+  BOOST_CHECK(!pool.retire(10));
+  BOOST_CHECK_EQUAL(pool.get(s_key, now, toClose), -1);
+  BOOST_CHECK_EQUAL(toClose, -1);
+  BOOST_CHECK(!pool.release(10, now));
+  BOOST_CHECK(pool.release(10, now));
+  BOOST_CHECK(!pool.contains(10));
+
+  // a newer socket for the same remote is not affected by the retirement of an older one
+  pool.add(11, s_key, now, true);
+  BOOST_CHECK_EQUAL(pool.get(s_key, now, toClose), 11);
+  pool.add(12, s_key, now, false);
+  BOOST_CHECK(pool.release(12, now));
+  BOOST_CHECK_EQUAL(pool.get(s_key, now, toClose), 11);
+}
+
+BOOST_AUTO_TEST_CASE(test_not_shared)
+{
+  UDPSocketPool pool(100, 1000);
+  const struct timeval now{1000, 0};
+  int toClose = -1;
+
+  pool.add(10, s_key, now, false);
+  BOOST_CHECK(pool.contains(10));
+  BOOST_CHECK_EQUAL(pool.get(s_key, now, toClose), -1);
+  BOOST_CHECK(pool.release(10, now));
+  BOOST_CHECK(!pool.contains(10));
+}
+
+BOOST_AUTO_TEST_CASE(test_prune_idle)
+{
+  UDPSocketPool pool(100, 1000);
+  const struct timeval now{1000, 0};
+  int toClose = -1;
+
+  pool.add(10, s_key, now, true);
+  BOOST_CHECK(!pool.release(10, now));
+  pool.add(11, s_otherKey, later(now, 500), true);
+  BOOST_CHECK(!pool.release(11, later(now, 500)));
+  pool.add(12, s_otherKey, now, false);
+
+  BOOST_CHECK(pool.pruneIdle(later(now, 999)).empty());
+
+  // only the idle socket that exceeded its age is pruned, not the one still in use
+  auto pruned = pool.pruneIdle(later(now, 1000));
+  BOOST_REQUIRE_EQUAL(pruned.size(), 1U);
+  BOOST_CHECK_EQUAL(pruned.at(0), 10);
+  BOOST_CHECK(!pool.contains(10));
+  BOOST_CHECK(pool.contains(12));
+  BOOST_CHECK_EQUAL(pool.get(s_key, later(now, 1000), toClose), -1);
+  BOOST_CHECK_EQUAL(pool.get(s_otherKey, later(now, 1000), toClose), 11);
+  BOOST_CHECK(!pool.release(11, later(now, 1000)));
+
+  pruned = pool.pruneIdle(later(now, 1500));
+  BOOST_REQUIRE_EQUAL(pruned.size(), 1U);
+  BOOST_CHECK_EQUAL(pruned.at(0), 11);
+  BOOST_CHECK(pool.release(12, later(now, 1500)));
+  BOOST_CHECK_EQUAL(pool.size(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -462,6 +462,108 @@ BOOST_AUTO_TEST_CASE(test_throttled_server_time)
   BOOST_CHECK(!SyncRes::isThrottled(now + 2, ns));
 }
 
+BOOST_AUTO_TEST_CASE(test_nameserver_state_many_servers)
+{
+  std::unique_ptr<SyncRes> sr;
+  initSR(sr);
+
+  /* the nameserver state is split into shards, make sure that counting, pruning
+     and dumping still cover all of them */
+  const size_t count = 1000;
+  const struct timeval now = sr->getNow();
+  for (size_t idx = 0; idx < count; idx++) {
+    const ComboAddress address("192.0." + std::to_string(idx / 256) + "." + std::to_string(idx % 256) + ":53");
+    const DNSName name("ns" + std::to_string(idx) + ".powerdns.com.");
+    SyncRes::doThrottle(now.tv_sec, address, idx % 2 == 0 ? 10 : 100, 10000, SyncRes::ThrottleReason::Timeout);
+    SyncRes::submitNSSpeed(name, address, 1000 + static_cast<int>(idx), now);
+  }
+
+  BOOST_CHECK_EQUAL(SyncRes::getThrottledServersSize(), count);
+  BOOST_CHECK_EQUAL(SyncRes::getNSSpeedsSize(), count);
+  BOOST_CHECK_EQUAL(SyncRes::getNSSpeed(DNSName("ns42.powerdns.com."), ComboAddress("192.0.0.42:53")), 1042.0F);
+  BOOST_CHECK(SyncRes::isThrottled(now.tv_sec, ComboAddress("192.0.3.231:53")));
+
+  auto devNull = FDWrapper(open("/dev/null", O_WRONLY));
+  BOOST_REQUIRE(devNull.getHandle() >= 0);
+  BOOST_CHECK_EQUAL(SyncRes::doDumpThrottleMap(devNull.getHandle()), count);
+  BOOST_CHECK_EQUAL(SyncRes::doDumpNSSpeeds(devNull.getHandle()), count);
+
+  SyncRes::pruneThrottledServers(now.tv_sec + 50);
+  BOOST_CHECK_EQUAL(SyncRes::getThrottledServersSize(), count / 2);
+  SyncRes::unThrottle(ComboAddress("192.0.0.1:53"), g_rootdnsname, QType::A);
+  BOOST_CHECK_EQUAL(SyncRes::getThrottledServersSize(), (count / 2) - 1);
+
+  SyncRes::clearThrottle();
+  BOOST_CHECK_EQUAL(SyncRes::getThrottledServersSize(), 0U);
+  SyncRes::pruneNSSpeeds(now.tv_sec + 1);
+  BOOST_CHECK_EQUAL(SyncRes::getNSSpeedsSize(), 0U);
+}
+
+#if 0
+/* Contention benchmark: resolve names from many threads at once against mock
+   authoritative servers, so that the threads keep looking up and updating
+   the nameserver state (speeds, throttling, EDNS status and failures) */
+BOOST_AUTO_TEST_CASE(test_nameserver_state_contention)
+{
+  std::unique_ptr<SyncRes> sr;
+  initSR(sr);
+  primeHints();
+  SyncRes::s_serverdownmaxfails = 1000000;
+
+  const size_t zonesCount = 100;
+  const size_t queriesPerThread = 100000;
+  auto callback = [](const ComboAddress& address, const DNSName& domain, int /* type */, bool /* doTCP */, bool /* sendRDQuery */, int /* EDNS0Level */, struct timeval* /* now */, boost::optional<Netmask>& /* srcmask */, const ResolveContext& /* context */, LWResult* res, bool* /* chained */) {
+    if (isRootServer(address)) {
+      /* delegate host-N.zone-M.bench. to zone-M.bench., served by two out of ten nameservers */
+      const auto zone = domain.getRawLabels().size() >= 3 ? DNSName(domain.getRawLabel(1) + ".bench.") : domain;
+      const auto zoneIdx = std::hash<std::string>()(zone.toString()) % 10;
+      setLWResult(res, 0, false, false, true);
+      for (size_t nsIdx = 0; nsIdx < 2; nsIdx++) {
+        const auto nsName = "ns" + std::to_string((zoneIdx + nsIdx) % 10) + ".bench-servers.net.";
+        addRecordToLW(res, zone, QType::NS, nsName, DNSResourceRecord::AUTHORITY, 172800);
+        addRecordToLW(res, nsName, QType::A, "192.0.2." + std::to_string(((zoneIdx + nsIdx) % 10) + 1), DNSResourceRecord::ADDITIONAL, 3600);
+      }
+      return LWResult::Result::Success;
+    }
+    setLWResult(res, 0, true, false, true);
+    addRecordToLW(res, domain, QType::A, "192.0.2.254", DNSResourceRecord::ANSWER, 1);
+    return LWResult::Result::Success;
+  };
+
+  for (const size_t threadsCount : {1, 4, 16, 32, 64}) {
+    std::vector<std::thread> threads;
+    threads.reserve(threadsCount);
+    DTime watch;
+    watch.set();
+    for (size_t threadIdx = 0; threadIdx < threadsCount; threadIdx++) {
+      threads.emplace_back([threadIdx, &callback]() {
+        /* the domain map is per-thread */
+        SyncRes::setDomainMap(std::make_shared<SyncRes::domainmap_t>());
+        vector<DNSRecord> ret;
+        for (size_t idx = 0; idx < queriesPerThread; idx++) {
+          ret.clear();
+          /* a new resolver for every query, like the recursor does, since the per-query limits are kept in it */
+          struct timeval now{};
+          Utility::gettimeofday(&now, nullptr);
+          SyncRes resolver(now);
+          resolver.setDoEDNS0(true);
+          resolver.setLogMode(SyncRes::LogNone);
+          resolver.setAsyncCallback(callback);
+          /* different names every time, so that we don't get answers from the cache */
+          const DNSName target("host-" + std::to_string(threadIdx) + "-" + std::to_string(idx) + ".zone-" + std::to_string(idx % zonesCount) + ".bench.");
+          resolver.beginResolve(target, QType(QType::A), QClass::IN, ret);
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    const auto elapsed = std::max(static_cast<uint64_t>(watch.udiff()), static_cast<uint64_t>(1));
+    cerr << threadsCount << " threads: " << (threadsCount * queriesPerThread) << " resolutions in " << elapsed / 1000 << " ms, " << (threadsCount * queriesPerThread * 1000000 / elapsed) << " resolutions/s" << endl;
+  }
+}
+#endif
+
 BOOST_AUTO_TEST_CASE(test_dont_query_server)
 {
   std::unique_ptr<SyncRes> sr;
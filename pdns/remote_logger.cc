@@ -2,6 +2,7 @@
 #include "threadname.hh"
 #include "remote_logger.hh"
 #include <sys/uio.h>
+#include "misc.hh"
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -12,88 +13,6 @@
 #endif
 #include "logging.hh"
 
-bool CircularWriteBuffer::hasRoomFor(const std::string& str) const
-{
-  if (d_buffer.size() + 2 + str.size() > d_buffer.capacity()) {
-    return false;
-  }
-
-  return true;
-}
-
-bool CircularWriteBuffer::write(const std::string& str)
-{
-  if (str.size() > std::numeric_limits<uint16_t>::max() || !hasRoomFor(str)) {
-    return false;
-  }
-
-  uint16_t len = htons(str.size());
-  const char* ptr = reinterpret_cast<const char*>(&len);
-  d_buffer.insert(d_buffer.end(), ptr, ptr + 2);
-  d_buffer.insert(d_buffer.end(), str.begin(), str.end());
-
-  return true;
-}
-
-bool CircularWriteBuffer::flush(int fd)
-{
-  if (d_buffer.empty()) {
-    // not optional, we report EOF otherwise
-    return false;
-  }
-
-  auto arr1 = d_buffer.array_one();
-  auto arr2 = d_buffer.array_two();
-
-  struct iovec iov[2];
-  int pos = 0;
-  for(const auto& arr : {arr1, arr2}) {
-    if(arr.second) {
-      iov[pos].iov_base = arr.first;
-      iov[pos].iov_len = arr.second;
-      ++pos;
-    }
-  }
-
-  ssize_t res = 0;
-  do {
-    res = writev(fd, iov, pos);
-
-    if (res < 0) {
-      if (errno == EINTR) {
-        continue;
-      }
-
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        return false;
-      }
-
-      /* we can't be sure we haven't sent a partial message,
-         and we don't want to send the remaining part after reconnecting */
-      d_buffer.clear();
-      throw std::runtime_error("Couldn't flush a thing: " + stringerror());
-    }
-    else if (!res) {
-      /* we can't be sure we haven't sent a partial message,
-         and we don't want to send the remaining part after reconnecting */
-      d_buffer.clear();
-      throw std::runtime_error("EOF");
-    }
-  }
-  while (res < 0);
-
-  if (static_cast<size_t>(res) == d_buffer.size()) {
-    d_buffer.clear();
-  }
-  else {
-    while (res--) {
-      d_buffer.pop_front();
-    }
-  }
-
-  return true;
-}
-
 const std::string& RemoteLoggerInterface::toErrorString(Result r)
 {
   static const std::array<std::string,5> str = {
@@ -107,7 +26,24 @@ const std::string& RemoteLoggerInterface::toErrorString(Result r)
   return str[std::min(i, 4U)];
 }
 
-RemoteLogger::RemoteLogger(const ComboAddress& remote, uint16_t timeout, uint64_t maxQueuedBytes, uint8_t reconnectWaitTime, bool asyncConnect): d_remote(remote), d_timeout(timeout), d_reconnectWaitTime(reconnectWaitTime), d_asyncConnect(asyncConnect), d_runtime({CircularWriteBuffer(maxQueuedBytes), nullptr})
+RemoteLoggerInterface::Result RemoteLoggerInterface::serializeAndQueue(const Serializer& serializer)
+{
+  static thread_local std::string data;
+  data.clear();
+  serializer(data);
+  return queueData(data);
+}
+
+static uint64_t getMonotonicUsec()
+{
+  timespec now{};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<uint64_t>(now.tv_sec) * 1000000U + static_cast<uint64_t>(now.tv_nsec) / 1000U;
+}
+
+static std::atomic<uint64_t> s_remoteLoggerIds{0};
+
+RemoteLogger::RemoteLogger(const ComboAddress& remote, uint16_t timeout, uint64_t maxQueuedBytes, uint8_t reconnectWaitTime, bool asyncConnect): d_remote(remote), d_maxQueuedBytes(maxQueuedBytes), d_blockSize(std::max(static_cast<uint64_t>(1U), std::min(static_cast<uint64_t>(s_blockSize), maxQueuedBytes / 4))), d_id(s_remoteLoggerIds++), d_timeout(timeout), d_reconnectWaitTime(reconnectWaitTime), d_asyncConnect(asyncConnect)
 {
   if (!d_asyncConnect) {
     reconnect();
@@ -122,13 +58,7 @@ bool RemoteLogger::reconnect()
     auto newSock = make_unique<Socket>(d_remote.sin4.sin_family, SOCK_STREAM, 0);
     newSock->setNonBlocking();
     newSock->connect(d_remote, d_timeout);
-
-    {
-      /* we are now successfully connected, time to take the lock and update the
-         socket */
-      auto runtime = d_runtime.lock();
-      runtime->d_socket = std::move(newSock);
-    }
+    d_socket = std::move(newSock);
   }
   catch (const std::exception& e) {
 #ifdef RECURSOR
@@ -143,50 +73,263 @@ bool RemoteLogger::reconnect()
   return true;
 }
 
-RemoteLoggerInterface::Result RemoteLogger::queueData(const std::string& data)
+RemoteLogger::ThreadBlock& RemoteLogger::getThreadBlock()
+{
+  /* the blocks of the current thread, one per logger it has been logging to,
+     looked up by the unique ID of the logger since addresses can be reused */
+  static thread_local std::vector<std::pair<uint64_t, std::shared_ptr<ThreadBlock>>> t_blocks;
+
+  for (const auto& [loggerId, block] : t_blocks) {
+    if (loggerId == d_id) {
+      return *block;
+    }
+  }
+
+  t_blocks.erase(std::remove_if(t_blocks.begin(), t_blocks.end(), [](const auto& entry) { return entry.second->d_loggerGone.load(); }), t_blocks.end());
+
+  auto block = std::make_shared<ThreadBlock>();
+  block->d_block.lock()->d_data.reserve(d_blockSize);
+  {
+    std::lock_guard<std::mutex> lock(d_queue.d_lock);
+    d_queue.d_threadBlocks.push_back(block);
+  }
+  t_blocks.emplace_back(d_id, std::move(block));
+  return *t_blocks.back().second;
+}
+
+/* Called with the lock of the thread block held. Makes sure that 'needed' bytes of the block are
+   accounted for in the queued bytes, returns false if the queue is full. Room for a whole block is
+   reserved at once when possible, so that the counter shared with the other threads is not updated
+   for every message */
+bool RemoteLogger::reserve(Block& block, uint64_t needed)
+{
+  const uint64_t missing = needed - block.d_reserved;
+  const uint64_t preferred = std::max(missing, d_blockSize > block.d_reserved ? static_cast<uint64_t>(d_blockSize) - block.d_reserved : static_cast<uint64_t>(0));
+  for (const uint64_t wanted : {preferred, missing}) {
+    if (d_queuedBytes.fetch_add(wanted) + wanted <= d_maxQueuedBytes) {
+      block.d_reserved += wanted;
+      return true;
+    }
+    d_queuedBytes -= wanted;
+    if (wanted == missing) {
+      break;
+    }
+  }
+  return false;
+}
+
+/* Called with the lock of the thread block held. The content of the block has already
+   been accounted for in the queued bytes, so it is never dropped */
+void RemoteLogger::handOver(Block& block)
+{
+  Block full;
+  std::swap(full, block);
+  block.d_data.reserve(d_blockSize);
+
+  /* give the room we reserved but did not use back */
+  d_queuedBytes -= full.d_reserved - full.d_data.size();
+  full.d_reserved = full.d_data.size();
+  {
+    std::lock_guard<std::mutex> lock(d_queue.d_lock);
+    d_queue.d_ready.push_back(std::move(full));
+  }
+  d_queue.d_wakeUp.notify_one();
+}
+
+template <typename Appender>
+RemoteLoggerInterface::Result RemoteLogger::queue(const Appender& appender)
 {
-  auto runtime = d_runtime.lock();
+  auto block = getThreadBlock().d_block.lock();
+  auto& data = block->d_data;
+  const auto start = data.size();
+
+  /* reserve room for the length, serialize in place then fill the length in */
+  data.append(2, '\0');
+  try {
+    appender(data);
+  }
+  catch (...) {
+    data.resize(start);
+    ++d_otherError;
+    return Result::OtherError;
+  }
 
-  if (data.size() > std::numeric_limits<uint16_t>::max()) {
-    ++runtime->d_stats.d_tooLarge;
+  const auto size = data.size() - start - 2;
+  if (size > std::numeric_limits<uint16_t>::max()) {
+    data.resize(start);
+    ++d_tooLarge;
     return Result::TooLarge;
   }
 
-  if (!runtime->d_writer.hasRoomFor(data)) {
-    /* not connected, queue is full, just drop */
-    if (!runtime->d_socket) {
-      ++runtime->d_stats.d_pipeFull;
-      return Result::PipeFull;
+  /* not connected or not sending fast enough, just drop */
+  if (data.size() > block->d_reserved && !reserve(*block, data.size())) {
+    data.resize(start);
+    ++d_pipeFull;
+    return Result::PipeFull;
+  }
+
+  const uint16_t len = htons(static_cast<uint16_t>(size));
+  memcpy(&data.at(start), &len, sizeof(len));
+
+  const auto now = getMonotonicUsec();
+  if (block->d_messages == 0) {
+    block->d_firstQueuedUsec = now;
+  }
+  ++block->d_messages;
+  block->d_queuedUsecSum += now;
+  ++d_queued;
+
+  if (data.size() >= d_blockSize) {
+    handOver(*block);
+  }
+
+  return Result::Queued;
+}
+
+RemoteLoggerInterface::Result RemoteLogger::queueData(const std::string& data)
+{
+  return queue([&data](std::string& buffer) { buffer.append(data); });
+}
+
+RemoteLoggerInterface::Result RemoteLogger::serializeAndQueue(const Serializer& serializer)
+{
+  return queue(serializer);
+}
+
+RemoteLoggerInterface::Stats RemoteLogger::getStats()
+{
+  Stats stats;
+  stats.d_queued = d_queued;
+  stats.d_pipeFull = d_pipeFull;
+  stats.d_tooLarge = d_tooLarge;
+  stats.d_otherError = d_otherError;
+  stats.d_connectionDrops = d_connectionDrops;
+  stats.d_sent = d_sent;
+  stats.d_queueLatencyUsec = d_queueLatencyUsec;
+  return stats;
+}
+
+size_t RemoteLogger::getThreadBlocksCount()
+{
+  std::lock_guard<std::mutex> lock(d_queue.d_lock);
+  return d_queue.d_threadBlocks.size();
+}
+
+/* hand over the partially filled blocks that have been waiting for too long,
+   and forget the blocks of threads that are gone */
+void RemoteLogger::sweepThreadBlocks(uint64_t now)
+{
+  std::vector<std::shared_ptr<ThreadBlock>> threadBlocks;
+  {
+    std::lock_guard<std::mutex> lock(d_queue.d_lock);
+    threadBlocks = d_queue.d_threadBlocks;
+  }
+
+  /* blocks of threads that are gone, and which are empty */
+  std::vector<const ThreadBlock*> unused;
+  const uint64_t maxAge = s_maxBlockAgeMS * 1000U;
+  for (const auto& threadBlock : threadBlocks) {
+    /* we are taking the locks in the same order than the logging threads:
+       the thread block first, then the queue */
+    auto block = threadBlock->d_block.lock();
+    if (block->d_messages > 0 && (now - block->d_firstQueuedUsec) >= maxAge) {
+      handOver(*block);
     }
-    try {
-      /* we try to flush some data */
-      if (!runtime->d_writer.flush(runtime->d_socket->getHandle())) {
-        /* but failed, let's just drop */
-        ++runtime->d_stats.d_pipeFull;
-        return Result::PipeFull;
-      }
+    /* our copy plus the one in the queue, so the thread is gone and
+       nobody can add to this block anymore */
+    if (threadBlock.use_count() == 2 && block->d_messages == 0) {
+      unused.push_back(threadBlock.get());
+    }
+  }
 
-      /* see if we freed enough data */
-      if (!runtime->d_writer.hasRoomFor(data)) {
-        /* we didn't */
-        ++runtime->d_stats.d_pipeFull;
-        return Result::PipeFull;
+  if (!unused.empty()) {
+    std::lock_guard<std::mutex> lock(d_queue.d_lock);
+    auto& blocks = d_queue.d_threadBlocks;
+    blocks.erase(std::remove_if(blocks.begin(), blocks.end(), [&unused](const auto& threadBlock) {
+      return std::find(unused.begin(), unused.end(), threadBlock.get()) != unused.end();
+    }), blocks.end());
+  }
+}
+
+void RemoteLogger::collectBlocks(std::deque<Block>& pending, bool wait)
+{
+  std::unique_lock<std::mutex> lock(d_queue.d_lock);
+  if (wait) {
+    d_queue.d_wakeUp.wait_for(lock, std::chrono::milliseconds(s_maxBlockAgeMS / 2), [this] { return !d_queue.d_ready.empty() || d_exiting; });
+  }
+  for (auto& block : d_queue.d_ready) {
+    pending.push_back(std::move(block));
+  }
+  d_queue.d_ready.clear();
+}
+
+/* offset is the number of bytes of the first pending block that have already been sent,
+   throws if the connection failed */
+void RemoteLogger::sendBlocks(std::deque<Block>& pending, size_t& offset)
+{
+  const int fileDesc = d_socket->getHandle();
+  std::array<iovec, 64> iov{};
+
+  while (!pending.empty()) {
+    size_t count = 0;
+    for (auto blockIt = pending.begin(); blockIt != pending.end() && count < iov.size(); ++blockIt, ++count) {
+      const size_t skip = count == 0 ? offset : 0;
+      iov.at(count).iov_base = &blockIt->d_data.at(skip);
+      iov.at(count).iov_len = blockIt->d_data.size() - skip;
+    }
+
+    ssize_t res = writev(fileDesc, iov.data(), static_cast<int>(count));
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
       }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        /* wait for a bit, but not too long since there might be blocks to collect */
+        res = waitForRWData(fileDesc, false, 0, s_maxBlockAgeMS / 2);
+        if (res > 0) {
+          continue;
+        }
+        if (res == 0) {
+          return;
+        }
+      }
+      throw std::runtime_error("Error writing to remote logger: " + stringerror());
     }
-    catch(const std::exception& e) {
-      //      cout << "Got exception writing: "<<e.what()<<endl;
-      runtime->d_socket.reset();
-      ++runtime->d_stats.d_otherError;
-      return Result::OtherError;
+    if (res == 0) {
+      throw std::runtime_error("EOF");
+    }
+
+    auto written = static_cast<size_t>(res);
+    const auto now = getMonotonicUsec();
+    while (written > 0) {
+      auto& block = pending.front();
+      const auto remaining = block.d_data.size() - offset;
+      if (written < remaining) {
+        offset += written;
+        break;
+      }
+      written -= remaining;
+      offset = 0;
+      d_sent += block.d_messages;
+      d_queueLatencyUsec += block.d_messages * now - block.d_queuedUsecSum;
+      d_queuedBytes -= block.d_data.size();
+      pending.pop_front();
     }
   }
+}
 
-  runtime->d_writer.write(data);
-  ++runtime->d_stats.d_queued;
-  return Result::Queued;
+void RemoteLogger::dropBlocks(std::deque<Block>& pending)
+{
+  /* we can't be sure we haven't sent a partial message,
+     and we don't want to send the remaining part after reconnecting */
+  for (const auto& block : pending) {
+    d_connectionDrops += block.d_messages;
+    d_queuedBytes -= block.d_data.size();
+  }
+  pending.clear();
 }
 
-void RemoteLogger::maintenanceThread() 
+void RemoteLogger::maintenanceThread()
 {
   try {
 #ifdef RECURSOR
@@ -196,44 +339,45 @@ void RemoteLogger::maintenanceThread()
 #endif
     setThreadName(threadName);
 
+    std::deque<Block> pending;
+    size_t offset = 0;
+    uint64_t lastConnectionAttempt = getMonotonicUsec();
+    uint64_t lastSweep = lastConnectionAttempt;
+
     for (;;) {
       if (d_exiting) {
         break;
       }
 
-      bool connected = true;
-      if (d_runtime.lock()->d_socket == nullptr) {
-        // if it was unset, it will remain so, we are the only ones setting it!
-        connected = reconnect();
+      auto now = getMonotonicUsec();
+      if (!d_socket && (now - lastConnectionAttempt) >= d_reconnectWaitTime * 1000000U) {
+        lastConnectionAttempt = now;
+        reconnect();
       }
 
-      /* we will just go to sleep if the reconnection just failed */
-      if (connected) {
+      /* don't sleep if we have something to send */
+      collectBlocks(pending, pending.empty() || !d_socket);
+
+      now = getMonotonicUsec();
+      if ((now - lastSweep) >= s_maxBlockAgeMS * 1000U / 2) {
+        lastSweep = now;
+        sweepThreadBlocks(now);
+        collectBlocks(pending, false);
+      }
+
+      if (d_socket && !pending.empty()) {
         try {
-          /* we don't want to take the lock while trying to reconnect */
-          auto runtime = d_runtime.lock();
-          if (runtime->d_socket) { // check if it is set
-            /* if flush() returns false, it means that we couldn't flush anything yet
-               either because there is nothing to flush, or because the outgoing TCP
-               buffer is full. That's fine by us */
-            runtime->d_writer.flush(runtime->d_socket->getHandle());
-          }
-          else {
-            connected = false;
-          }
+          sendBlocks(pending, offset);
         }
         catch (const std::exception& e) {
-          d_runtime.lock()->d_socket.reset();
-          connected = false;
-        }
-
-        if (!connected) {
-          /* let's try to reconnect right away, we are about to sleep anyway */
+          d_socket.reset();
+          dropBlocks(pending);
+          offset = 0;
+          /* let's try to reconnect right away */
+          lastConnectionAttempt = getMonotonicUsec();
           reconnect();
         }
       }
-
-      sleep(d_reconnectWaitTime);
     }
   }
   catch (const std::exception& e)
@@ -249,8 +393,12 @@ void RemoteLogger::maintenanceThread()
 
 RemoteLogger::~RemoteLogger()
 {
-  d_exiting = true;
+  stop();
 
   d_thread.join();
-}
 
+  std::lock_guard<std::mutex> lock(d_queue.d_lock);
+  for (const auto& threadBlock : d_queue.d_threadBlocks) {
+    threadBlock->d_loggerGone = true;
+  }
+}
@@ -25,37 +25,16 @@
 #endif
 
 #include <atomic>
-#include <queue>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
 #include <thread>
 
 #include "iputils.hh"
-#include "circular_buffer.hh"
 #include "lock.hh"
 #include "sstuff.hh"
-
-/* Writes can be submitted and they are atomically accepted. Either the whole write
-   ends up in the buffer or nothing ends up in the buffer.
-   In case nothing ends up in the buffer, an exception is thrown.
-   Similarly, EOF leads to this treatment
-
-   The filedescriptor can be in non-blocking mode.
-
-   This class is not threadsafe.
-*/
-
-class CircularWriteBuffer
-{
-public:
-  explicit CircularWriteBuffer(size_t size) : d_buffer(size)
-  {
-  }
-
-  bool hasRoomFor(const std::string& str) const;
-  bool write(const std::string& str);
-  bool flush(int fd);
-private:
-  boost::circular_buffer<char> d_buffer;
-};
+#include "stat_t.hh"
 
 class RemoteLoggerInterface
 {
@@ -66,6 +45,12 @@ public:
 
   virtual ~RemoteLoggerInterface() {};
   virtual Result queueData(const std::string& data) = 0;
+  /* appends a serialized message to the string it is passed */
+  using Serializer = std::function<void(std::string&)>;
+  /* Serialize a message and queue it. Loggers that can do so let the serializer write
+     directly into their queue, saving a copy, the default is to serialize into a
+     temporary string and call queueData() */
+  virtual Result serializeAndQueue(const Serializer& serializer);
   [[nodiscard]] virtual std::string address() const = 0;
   [[nodiscard]] virtual std::string toString() = 0;
   [[nodiscard]] virtual std::string name() const = 0;
@@ -84,6 +69,12 @@ public:
     uint64_t d_pipeFull{};
     uint64_t d_tooLarge{};
     uint64_t d_otherError{};
+    /* messages that were queued but then dropped because the connection failed before they were sent */
+    uint64_t d_connectionDrops{};
+    /* messages actually sent */
+    uint64_t d_sent{};
+    /* sum of the time spent in the queue by the messages that were sent, in microseconds */
+    uint64_t d_queueLatencyUsec{};
 
     Stats& operator += (const Stats& rhs)
     {
@@ -91,6 +82,9 @@ public:
       d_pipeFull += rhs.d_pipeFull;
       d_tooLarge += rhs.d_tooLarge;
       d_otherError += rhs.d_otherError;
+      d_connectionDrops += rhs.d_connectionDrops;
+      d_sent += rhs.d_sent;
+      d_queueLatencyUsec += rhs.d_queueLatencyUsec;
       return *this;
     }
   };
@@ -105,9 +99,15 @@ private:
 };
 
 /* Thread safe. Will connect asynchronously on request.
-   Runs a reconnection thread that also periodicall flushes.
-   Note that the buffer only runs as long as there is a connection.
-   If there is no connection we don't buffer a thing
+   Runs a sender thread that handles the connection and writes the queued messages.
+   Every thread logging messages appends them, prefixed by their length, to its own block
+   of memory, protected by a lock that is only contended when the sender thread collects
+   the block, so threads logging to the same remote do not contend with each other.
+   Full blocks are handed over to the sender thread, which writes them in batches with
+   writev(), and also collects partially filled blocks that have been waiting for too long.
+   Messages are queued even if there is no connection, until the queue is full. The messages
+   still sitting in the blocks of the logging threads count towards the maximum number of
+   queued bytes, so a message reported as queued is only dropped if the connection fails.
 */
 class RemoteLogger : public RemoteLoggerInterface
 {
@@ -124,44 +124,94 @@ public:
   }
 
   [[nodiscard]] Result queueData(const std::string& data) override;
+  [[nodiscard]] Result serializeAndQueue(const Serializer& serializer) override;
   [[nodiscard]] std::string name() const override
   {
     return "protobuf";
   }
   [[nodiscard]] std::string toString() override
   {
-    auto runtime = d_runtime.lock();
-    return d_remote.toStringWithPort() + " (" + std::to_string(runtime->d_stats.d_queued) + " processed, " + std::to_string(runtime->d_stats.d_pipeFull + runtime->d_stats.d_tooLarge + runtime->d_stats.d_otherError) + " dropped)";
+    auto stats = getStats();
+    return d_remote.toStringWithPort() + " (" + std::to_string(stats.d_queued) + " processed, " + std::to_string(stats.d_pipeFull + stats.d_tooLarge + stats.d_otherError + stats.d_connectionDrops) + " dropped)";
   }
 
-  [[nodiscard]] RemoteLoggerInterface::Stats getStats() override
-  {
-    return d_runtime.lock()->d_stats;
-  }
+  [[nodiscard]] RemoteLoggerInterface::Stats getStats() override;
+  /* the number of threads that have a block for this logger */
+  [[nodiscard]] size_t getThreadBlocksCount();
 
   void stop()
   {
     d_exiting = true;
+    d_queue.d_wakeUp.notify_one();
   }
 
+  /* size above which a block is handed over to the sender thread, lowered
+     when the maximum number of queued bytes is small */
+  static constexpr size_t s_blockSize{16384};
+  /* maximum time a message can wait in a partially filled block */
+  static constexpr unsigned int s_maxBlockAgeMS{100};
+
 private:
-  bool reconnect();
-  void maintenanceThread();
+  struct Block
+  {
+    std::string d_data;
+    size_t d_messages{0};
+    /* bytes accounted for in d_queuedBytes, at least the size of d_data */
+    uint64_t d_reserved{0};
+    /* monotonic time at which the first message was added, and sum of the times
+       all messages were added, in microseconds, to compute the queue latency */
+    uint64_t d_firstQueuedUsec{0};
+    uint64_t d_queuedUsecSum{0};
+  };
 
-  struct RuntimeData
+  struct ThreadBlock
   {
-    CircularWriteBuffer d_writer;
-    std::unique_ptr<Socket> d_socket{nullptr};
-    RemoteLoggerInterface::Stats d_stats{};
+    LockGuarded<Block> d_block;
+    std::atomic<bool> d_loggerGone{false};
   };
 
+  struct Queue
+  {
+    std::mutex d_lock;
+    std::condition_variable d_wakeUp;
+    /* full blocks waiting for the sender thread */
+    std::deque<Block> d_ready;
+    /* the blocks of every thread that logged a message via this logger */
+    std::vector<std::shared_ptr<ThreadBlock>> d_threadBlocks;
+  };
+
+  bool reconnect();
+  void maintenanceThread();
+  ThreadBlock& getThreadBlock();
+  template <typename Appender>
+  Result queue(const Appender& appender);
+  bool reserve(Block& block, uint64_t needed);
+  void handOver(Block& block);
+  void sweepThreadBlocks(uint64_t now);
+  void collectBlocks(std::deque<Block>& pending, bool wait);
+  void sendBlocks(std::deque<Block>& pending, size_t& offset);
+  void dropBlocks(std::deque<Block>& pending);
+
   ComboAddress d_remote;
+  uint64_t d_maxQueuedBytes;
+  size_t d_blockSize;
+  uint64_t d_id;
   uint16_t d_timeout;
   uint8_t d_reconnectWaitTime;
   std::atomic<bool> d_exiting{false};
   bool d_asyncConnect{false};
 
-  LockGuarded<RuntimeData> d_runtime;
+  Queue d_queue;
+  /* bytes reserved by the blocks of the logging threads, or handed over to the sender thread but not sent yet */
+  std::atomic<uint64_t> d_queuedBytes{0};
+  /* only used by the sender thread once it has been started */
+  std::unique_ptr<Socket> d_socket{nullptr};
+  pdns::stat_t d_queued{0};
+  pdns::stat_t d_pipeFull{0};
+  pdns::stat_t d_tooLarge{0};
+  pdns::stat_t d_otherError{0};
+  pdns::stat_t d_connectionDrops{0};
+  pdns::stat_t d_sent{0};
+  pdns::stat_t d_queueLatencyUsec{0};
   std::thread d_thread;
 };
-
@@ -22,3 +22,9 @@ RemoteLoggerInterface::Result RemoteLoggerPool::queueData(const std::string& dat
   std::shared_ptr<RemoteLoggerInterface> logger = d_pool.at(d_counter++ % d_pool.size());
   return logger->queueData(data);
 }
+
+RemoteLoggerInterface::Result RemoteLoggerPool::serializeAndQueue(const Serializer& serializer)
+{
+  std::shared_ptr<RemoteLoggerInterface> logger = d_pool.at(d_counter++ % d_pool.size());
+  return logger->serializeAndQueue(serializer);
+}
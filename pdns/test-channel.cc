@@ -5,6 +5,7 @@
 #define BOOST_TEST_NO_MAIN
 
 #include <boost/test/unit_test.hpp>
+#include <thread>
 
 #include "channel.hh"
 
@@ -87,6 +88,16 @@ BOOST_AUTO_TEST_CASE(test_object_queue_full)
   }
 }
 
+BOOST_AUTO_TEST_CASE(test_object_queue_capacity)
+{
+  /* the ring holds as many objects as the pipe it replaces would have held pointers */
+  BOOST_CHECK_EQUAL(pdns::channel::detail::getRingCapacity(0), 65536U / sizeof(void*));
+  BOOST_CHECK_EQUAL(pdns::channel::detail::getRingCapacity(1048576U), 1048576U / sizeof(void*));
+  BOOST_CHECK_EQUAL(pdns::channel::detail::getRingCapacity(1U), 64U);
+  /* rounded up to a power of two */
+  BOOST_CHECK_EQUAL(pdns::channel::detail::getRingCapacity(12500U * sizeof(void*)), 16384U);
+}
+
 BOOST_AUTO_TEST_CASE(test_object_queue_throw_on_eof)
 {
   auto [sender, receiver] = pdns::channel::createObjectQueue<MyObject>();
@@ -104,6 +115,110 @@ BOOST_AUTO_TEST_CASE(test_object_queue_do_not_throw_on_eof)
   BOOST_CHECK_EQUAL(receiver.isClosed(), true);
 }
 
+BOOST_AUTO_TEST_CASE(test_object_queue_wake_up)
+{
+  auto [sender, receiver] = pdns::channel::createObjectQueue<MyObject>();
+
+  /* nothing to receive */
+  BOOST_CHECK(!receiver.receive());
+  BOOST_CHECK_EQUAL(waitForData(receiver.getDescriptor(), 0, 0), 0);
+
+  for (size_t idx = 0; idx < 10; idx++) {
+    auto obj = std::make_unique<MyObject>();
+    obj->a = idx;
+    BOOST_CHECK(sender.send(std::move(obj)));
+  }
+
+  /* the descriptor stays readable as long as there are objects to receive */
+  for (size_t idx = 0; idx < 10; idx++) {
+    BOOST_CHECK_EQUAL(waitForData(receiver.getDescriptor(), 0, 0), 1);
+    auto got = receiver.receive();
+    BOOST_REQUIRE(got);
+    BOOST_CHECK_EQUAL((*got)->a, idx);
+  }
+
+  BOOST_CHECK(!receiver.receive());
+  BOOST_CHECK_EQUAL(waitForData(receiver.getDescriptor(), 0, 0), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_object_queue_several_senders)
+{
+  auto [sender, receiver] = pdns::channel::createObjectQueue<MyObject>();
+  const size_t threadsCount = 4;
+  const size_t perThread = 100000;
+
+  std::vector<std::thread> threads;
+  for (size_t threadIdx = 0; threadIdx < threadsCount; threadIdx++) {
+    threads.emplace_back([&sender = sender, threadIdx]() {
+      for (size_t idx = 0; idx < perThread; idx++) {
+        auto obj = std::make_unique<MyObject>();
+        obj->a = threadIdx * perThread + idx;
+        while (!sender.send(std::move(obj))) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+
+  size_t received = 0;
+  uint64_t sum = 0;
+  while (received < threadsCount * perThread) {
+    auto got = receiver.receive();
+    if (!got) {
+      BOOST_REQUIRE_GE(waitForData(receiver.getDescriptor(), 1, 0), 0);
+      continue;
+    }
+    sum += (*got)->a;
+    ++received;
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  const uint64_t total = threadsCount * perThread;
+  BOOST_CHECK_EQUAL(sum, total * (total - 1) / 2);
+  BOOST_CHECK(!receiver.receive());
+}
+
+BOOST_AUTO_TEST_CASE(test_object_queue_blocking_sender)
+{
+  /* small enough to block the sender quite often */
+  auto [sender, receiver] = pdns::channel::createObjectQueue<MyObject>(pdns::channel::SenderBlockingMode::SenderBlocking, pdns::channel::ReceiverBlockingMode::ReceiverBlocking, 64U);
+  const size_t count = 10000;
+
+  /* Boost.Test assertions are not thread-safe */
+  size_t failed = 0;
+  std::thread thread([&sender = sender, &failed]() {
+    for (size_t idx = 0; idx < count; idx++) {
+      auto obj = std::make_unique<MyObject>();
+      obj->a = idx;
+      if (!sender.send(std::move(obj))) {
+        ++failed;
+      }
+    }
+    sender.close();
+  });
+
+  for (size_t idx = 0; idx < count; idx++) {
+    auto got = receiver.receive();
+    BOOST_REQUIRE(got);
+    BOOST_CHECK_EQUAL((*got)->a, idx);
+  }
+  thread.join();
+  BOOST_CHECK_EQUAL(failed, 0U);
+
+  BOOST_CHECK_THROW(receiver.receive(), std::runtime_error);
+  BOOST_CHECK_EQUAL(receiver.isClosed(), true);
+}
+
+BOOST_AUTO_TEST_CASE(test_object_queue_receiver_closed)
+{
+  auto [sender, receiver] = pdns::channel::createObjectQueue<MyObject>();
+  receiver = pdns::channel::Receiver<MyObject>();
+  BOOST_CHECK_THROW(sender.send(std::make_unique<MyObject>()), std::runtime_error);
+}
+
 BOOST_AUTO_TEST_CASE(test_notification_queue_full)
 {
   auto [notifier, waiter] = pdns::channel::createNotificationQueue();
@@ -6,6 +6,7 @@
 
 #include <boost/test/unit_test.hpp>
 
+#include <algorithm>
 #include <cmath>
 #include <numeric>
 #include <unordered_set>
@@ -1069,6 +1070,61 @@ BOOST_AUTO_TEST_CASE(test_raw_data_comparison) {
   }
 }
 
+BOOST_AUTO_TEST_CASE(test_simd_case_insensitive) {
+  /* every byte value, on both sides of every block size used by the vectorized versions */
+  std::string allBytes;
+  for (size_t value = 0; value < 256; value++) {
+    allBytes.push_back(static_cast<char>(value));
+  }
+
+  for (size_t len = 0; len <= 80; len++) {
+    for (size_t offset = 0; offset + len <= allBytes.size(); offset += 7) {
+      const std::string_view lhs(allBytes.data() + offset, len);
+      std::string rhs(lhs);
+      std::transform(rhs.begin(), rhs.end(), rhs.begin(), dns_toupper);
+
+      std::string lowered(len, '\0');
+      std::string expected(len, '\0');
+      // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+      pdns::dnsname_simd::toLower(reinterpret_cast<const unsigned char*>(rhs.data()), len, reinterpret_cast<unsigned char*>(lowered.data()));
+      // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+      pdns::dnsname_simd::scalar::toLower(reinterpret_cast<const unsigned char*>(rhs.data()), len, reinterpret_cast<unsigned char*>(expected.data()));
+      BOOST_CHECK_EQUAL(lowered, expected);
+
+      BOOST_CHECK(pdns::dnsname_simd::iequals(lhs.data(), rhs.data(), len));
+      BOOST_CHECK_EQUAL(pdns::dnsname_simd::icompare(lhs.data(), rhs.data(), len), 0);
+
+      /* a single difference, at every possible position */
+      for (size_t pos = 0; pos < len; pos++) {
+        auto modified = rhs;
+        modified.at(pos) = static_cast<char>(modified.at(pos) ^ 0x01);
+        BOOST_CHECK_EQUAL(pdns::dnsname_simd::iequals(lhs.data(), modified.data(), len), pdns::dnsname_simd::scalar::iequals(lhs.data(), modified.data(), len));
+        BOOST_CHECK_EQUAL(pdns::dnsname_simd::icompare(lhs.data(), modified.data(), len), pdns::dnsname_simd::scalar::icompare(lhs.data(), modified.data(), len));
+        BOOST_CHECK_EQUAL(pdns::dnsname_simd::icompare(modified.data(), lhs.data(), len), pdns::dnsname_simd::scalar::icompare(modified.data(), lhs.data(), len));
+      }
+    }
+  }
+
+  BOOST_CHECK_LT(pdns::dnsname_simd::icompare(std::string_view("abc"), std::string_view("ABCD")), 0);
+  BOOST_CHECK_GT(pdns::dnsname_simd::icompare(std::string_view("abcd"), std::string_view("ABC")), 0);
+  BOOST_CHECK_EQUAL(pdns::dnsname_simd::icompare(std::string_view("abcd"), std::string_view("ABCD")), 0);
+  BOOST_CHECK_LT(pdns::dnsname_simd::icompare(std::string_view("a-very-long-label-to-cross-blocks-a"), std::string_view("A-VERY-LONG-LABEL-TO-CROSS-BLOCKS-B")), 0);
+
+  /* long names and labels, only differing by case */
+  const DNSName longName("a-rather-long-label-of-more-than-thirty-two-bytes.another-long-label.example.com.");
+  const DNSName longNameUpper("A-RATHER-LONG-LABEL-OF-MORE-THAN-THIRTY-TWO-BYTES.ANOTHER-LONG-LABEL.EXAMPLE.COM.");
+  BOOST_CHECK(longName == longNameUpper);
+  BOOST_CHECK(!(longName == DNSName("a-rather-long-label-of-more-than-thirty-two-bytes.another-long-label.example.con.")));
+
+  SuffixMatchNode smn;
+  smn.add(longName);
+  smn.add(DNSName("a-rather-long-label-of-more-than-thirty-two-bytes-too.another-long-label.example.com."));
+  BOOST_CHECK(smn.check(longNameUpper));
+  BOOST_CHECK(smn.check(DNSName("sub.") + longNameUpper));
+  BOOST_CHECK(smn.check(DNSName("A-RATHER-LONG-LABEL-OF-MORE-THAN-THIRTY-TWO-BYTES-TOO.ANOTHER-LONG-LABEL.EXAMPLE.COM.")));
+  BOOST_CHECK(!smn.check(DNSName("a-rather-long-label-of-more-than-thirty-two-byte.another-long-label.example.com.")));
+}
+
 #if defined(PDNS_AUTH)
 BOOST_AUTO_TEST_CASE(test_variantnames) {
   ZoneName zone1("..variant");
@@ -4,7 +4,10 @@
 
 #define BOOST_TEST_NO_MAIN
 
+#include <array>
+#include <atomic>
 #include <thread>
+#include <netinet/in.h>
 #include <boost/test/unit_test.hpp>
 
 #include "mplexer.hh"
@@ -12,6 +15,27 @@
 
 BOOST_AUTO_TEST_SUITE(mplexer)
 
+/* the default multiplexers, and the ones that have to be explicitly requested and are available */
+static std::vector<FDMultiplexer::getMultiplexer_t*> getAllMultiplexers()
+{
+  std::vector<FDMultiplexer::getMultiplexer_t*> result;
+  for (const auto& entry : FDMultiplexer::getMultiplexerMap()) {
+    result.push_back(entry.second);
+  }
+  for (const auto& entry : FDMultiplexer::getOptInMultiplexerMap()) {
+    try {
+      auto tentative = std::unique_ptr<FDMultiplexer>(entry.second(FDMultiplexer::s_maxevents));
+    }
+    catch (const FDMultiplexerException& exp) {
+      /* not supported by this kernel, for example */
+      BOOST_TEST_MESSAGE("Skipping the unavailable " << entry.first << " multiplexer: " << exp.what());
+      continue;
+    }
+    result.push_back(entry.second);
+  }
+  return result;
+}
+
 BOOST_AUTO_TEST_CASE(test_getMultiplexerSilent)
 {
   auto mplexer = std::unique_ptr<FDMultiplexer>(FDMultiplexer::getMultiplexerSilent());
@@ -23,10 +47,33 @@ BOOST_AUTO_TEST_CASE(test_getMultiplexerSilent)
   BOOST_CHECK(now.tv_sec != 0);
 }
 
+BOOST_AUTO_TEST_CASE(test_getMultiplexerSilentPreferred)
+{
+  /* an unknown multiplexer, we should fall back to the default one */
+  auto mplexer = std::unique_ptr<FDMultiplexer>(FDMultiplexer::getMultiplexerSilent("does-not-exist"));
+  BOOST_REQUIRE(mplexer != nullptr);
+  auto defaultMplexer = std::unique_ptr<FDMultiplexer>(FDMultiplexer::getMultiplexerSilent());
+  BOOST_CHECK_EQUAL(mplexer->getName(), defaultMplexer->getName());
+
+  for (const auto& entry : FDMultiplexer::getOptInMultiplexerMap()) {
+    bool available = true;
+    try {
+      auto tentative = std::unique_ptr<FDMultiplexer>(entry.second(FDMultiplexer::s_maxevents));
+    }
+    catch (const FDMultiplexerException& exp) {
+      /* not supported by this kernel, for example */
+      available = false;
+    }
+    mplexer = std::unique_ptr<FDMultiplexer>(FDMultiplexer::getMultiplexerSilent(entry.first));
+    BOOST_REQUIRE(mplexer != nullptr);
+    BOOST_CHECK_EQUAL(mplexer->getName(), available ? entry.first : defaultMplexer->getName());
+  }
+}
+
 BOOST_AUTO_TEST_CASE(test_MPlexer)
 {
-  for (const auto& entry : FDMultiplexer::getMultiplexerMap()) {
-    auto mplexer = std::unique_ptr<FDMultiplexer>(entry.second(FDMultiplexer::s_maxevents));
+  for (const auto& make : getAllMultiplexers()) {
+    auto mplexer = std::unique_ptr<FDMultiplexer>(make(FDMultiplexer::s_maxevents));
     BOOST_REQUIRE(mplexer != nullptr);
     //cerr<<"Testing multiplexer "<<mplexer->getName()<<endl;
 
@@ -226,8 +273,8 @@ BOOST_AUTO_TEST_CASE(test_MPlexer)
 
 BOOST_AUTO_TEST_CASE(test_MPlexer_ReadAndWrite)
 {
-  for (const auto& entry : FDMultiplexer::getMultiplexerMap()) {
-    auto mplexer = std::unique_ptr<FDMultiplexer>(entry.second(FDMultiplexer::s_maxevents));
+  for (const auto& make : getAllMultiplexers()) {
+    auto mplexer = std::unique_ptr<FDMultiplexer>(make(FDMultiplexer::s_maxevents));
     BOOST_REQUIRE(mplexer != nullptr);
     //cerr<<"Testing multiplexer "<<mplexer->getName()<<" for read AND write"<<endl;
 
@@ -305,7 +352,109 @@ BOOST_AUTO_TEST_CASE(test_MPlexer_ReadAndWrite)
   }
 }
 
-#if 0
+/* a pair of connected UDP sockets over the loopback, which unlike AF_UNIX ones can queue a lot of datagrams */
+static std::pair<int, int> getUDPSocketPair()
+{
+  int receiver = socket(AF_INET, SOCK_DGRAM, 0);
+  BOOST_REQUIRE(receiver >= 0);
+  int sender = socket(AF_INET, SOCK_DGRAM, 0);
+  BOOST_REQUIRE(sender >= 0);
+
+  struct sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  BOOST_REQUIRE_EQUAL(bind(receiver, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)), 0);
+  socklen_t addrLen = sizeof(addr);
+  BOOST_REQUIRE_EQUAL(getsockname(receiver, reinterpret_cast<struct sockaddr*>(&addr), &addrLen), 0);
+  BOOST_REQUIRE_EQUAL(connect(sender, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)), 0);
+  BOOST_REQUIRE_EQUAL(setNonBlocking(receiver), true);
+  return {receiver, sender};
+}
+
+BOOST_AUTO_TEST_CASE(test_MPlexer_Receive)
+{
+  for (const auto& make : getAllMultiplexers()) {
+    auto mplexer = std::unique_ptr<FDMultiplexer>(make(FDMultiplexer::s_maxevents));
+    BOOST_REQUIRE(mplexer != nullptr);
+
+    auto [receiver, sender] = getUDPSocketPair();
+    if (!mplexer->supportsReceive()) {
+      BOOST_CHECK_THROW(mplexer->addReceiveFD(receiver, 512), FDMultiplexerException);
+      close(receiver);
+      close(sender);
+      continue;
+    }
+
+    mplexer->addReceiveFD(receiver, 512);
+    /* we can't add it twice */
+    BOOST_CHECK_THROW(mplexer->addReceiveFD(receiver, 512), FDMultiplexerException);
+
+    std::vector<FDMultiplexer::ReceivedData> received;
+    mplexer->getReceivedData(received, 0);
+    BOOST_CHECK_EQUAL(received.size(), 0U);
+
+    /* more datagrams than buffers, the ones not fitting have to wait for the next round, but not
+       so many that they would not fit into the default socket buffer */
+    const size_t count = 150;
+    for (size_t idx = 0; idx < count; idx++) {
+      const auto payload = std::to_string(idx);
+      BOOST_REQUIRE_EQUAL(send(sender, payload.data(), payload.size(), 0), static_cast<ssize_t>(payload.size()));
+    }
+    /* larger than the maximum size, it will be truncated */
+    const std::string large(600, 'a');
+    BOOST_REQUIRE_EQUAL(send(sender, large.data(), large.size(), 0), static_cast<ssize_t>(large.size()));
+
+    std::vector<std::string> payloads;
+    for (size_t round = 0; round < 1000 && payloads.size() < count + 1; round++) {
+      received.clear();
+      mplexer->getReceivedData(received, 100);
+      for (const auto& entry : received) {
+        BOOST_CHECK_EQUAL(entry.d_fd, receiver);
+        payloads.emplace_back(entry.d_data, entry.d_size);
+      }
+    }
+    BOOST_REQUIRE_EQUAL(payloads.size(), count + 1);
+    for (size_t idx = 0; idx < count; idx++) {
+      BOOST_CHECK_EQUAL(payloads.at(idx), std::to_string(idx));
+    }
+    BOOST_CHECK_EQUAL(payloads.at(count), large.substr(0, 512));
+
+    /* readiness notifications still work next to the receive requests */
+    int pipes[2];
+    BOOST_REQUIRE_EQUAL(pipe(pipes), 0);
+    bool writeCBCalled = false;
+    mplexer->addWriteFD(pipes[1], [](int /* fd */, FDMultiplexer::funcparam_t& param) {
+      *boost::any_cast<bool*>(param) = true;
+    },
+                        &writeCBCalled);
+    struct timeval now;
+    BOOST_CHECK_EQUAL(mplexer->run(&now, 100), 1);
+    BOOST_CHECK_EQUAL(writeCBCalled, true);
+    mplexer->removeWriteFD(pipes[1]);
+    close(pipes[0]);
+    close(pipes[1]);
+
+    mplexer->removeReceiveFD(receiver);
+    BOOST_CHECK_THROW(mplexer->removeReceiveFD(receiver), FDMultiplexerException);
+    BOOST_REQUIRE_EQUAL(send(sender, "0", 1, 0), 1);
+    received.clear();
+    mplexer->getReceivedData(received, 100);
+    BOOST_CHECK_EQUAL(received.size(), 0U);
+
+    /* adding it back, the pending datagram should be there */
+    mplexer->addReceiveFD(receiver, 512);
+    received.clear();
+    mplexer->getReceivedData(received, 100);
+    BOOST_REQUIRE_EQUAL(received.size(), 1U);
+    BOOST_CHECK_EQUAL(std::string(received.at(0).d_data, received.at(0).d_size), "0");
+    mplexer->removeReceiveFD(receiver);
+
+    close(receiver);
+    close(sender);
+  }
+}
+
+#if BENCH_MPLEXER
 BOOST_AUTO_TEST_CASE(test_MPlexer_Bench)
 {
   const size_t count = 10000;
@@ -315,11 +464,11 @@ BOOST_AUTO_TEST_CASE(test_MPlexer_Bench)
   };
 
   std::vector<socket_pair> pairs(count);
-  auto readCB = [](int fd, FDMultiplexer::funcparam_t& param) {
+  auto readCB = [](int /* fd */, FDMultiplexer::funcparam_t& param) {
     auto calledPtr = boost::any_cast<bool*>(param);
     *calledPtr = true;
   };
-  auto writeCB = [](int fd, FDMultiplexer::funcparam_t& param) {
+  auto writeCB = [](int /* fd */, FDMultiplexer::funcparam_t& param) {
     auto calledPtr = boost::any_cast<bool*>(param);
     *calledPtr = true;
   };
@@ -333,8 +482,8 @@ BOOST_AUTO_TEST_CASE(test_MPlexer_Bench)
   std::vector<int> readyFDs;
   readyFDs.reserve(count * 2);
 
-  for (const auto& entry : FDMultiplexer::getMultiplexerMap()) {
-    auto mplexer = std::unique_ptr<FDMultiplexer>(entry.second());
+  for (const auto& make : getAllMultiplexers()) {
+    auto mplexer = std::unique_ptr<FDMultiplexer>(make(FDMultiplexer::s_maxevents));
     BOOST_REQUIRE(mplexer != nullptr);
     cerr<<"Testing multiplexer "<<mplexer->getName()<<" performances"<<endl;
 
@@ -399,6 +548,102 @@ BOOST_AUTO_TEST_CASE(test_MPlexer_Bench)
     }
   }
 }
-#endif
+
+BOOST_AUTO_TEST_CASE(test_MPlexer_Receive_Bench)
+{
+  static const size_t socketsCount = 64;
+  static const size_t rounds = 5000;
+  const std::string payload(100, 'a');
+  std::vector<std::pair<int, int>> pairs;
+  for (size_t idx = 0; idx < socketsCount; idx++) {
+    pairs.push_back(getUDPSocketPair());
+  }
+  std::vector<int> readyFDs;
+  std::vector<FDMultiplexer::ReceivedData> received;
+  std::array<char, 512> buffer{};
+  DTime dt;
+
+  /* readiness followed by recv() for every multiplexer, and the multiplexer receiving for us when it can */
+  std::vector<std::pair<FDMultiplexer::getMultiplexer_t*, bool>> modes;
+  for (const auto& make : getAllMultiplexers()) {
+    modes.emplace_back(make, false);
+    if (std::unique_ptr<FDMultiplexer>(make(FDMultiplexer::s_maxevents))->supportsReceive()) {
+      modes.emplace_back(make, true);
+    }
+  }
+
+  for (const auto& [make, receive] : modes) {
+    auto mplexer = std::unique_ptr<FDMultiplexer>(make(FDMultiplexer::s_maxevents));
+    BOOST_REQUIRE(mplexer != nullptr);
+    for (const auto& pair : pairs) {
+      if (receive) {
+        mplexer->addReceiveFD(pair.first, buffer.size());
+      }
+      else {
+        mplexer->addReadFD(pair.first, [](int, FDMultiplexer::funcparam_t&) {});
+      }
+    }
+
+    /* the datagrams are sent from a different thread, limiting the number of datagrams in flight so
+       that none is dropped, and we measure the CPU time spent by the receiving thread */
+    const size_t expected = rounds * socketsCount;
+    std::atomic<size_t> total{0};
+    std::thread sender([&pairs, &payload, &total]() {
+      for (size_t round = 0; round < rounds; round++) {
+        while ((round * socketsCount) - total.load() > socketsCount * 16) {
+          std::this_thread::yield();
+        }
+        for (const auto& pair : pairs) {
+          if (send(pair.second, payload.data(), payload.size(), 0) != static_cast<ssize_t>(payload.size())) {
+            return;
+          }
+        }
+      }
+    });
+
+    struct timespec cpuStart{};
+    struct timespec cpuEnd{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuStart);
+    dt.set();
+    while (total.load() < expected) {
+      size_t got = 0;
+      if (receive) {
+        received.clear();
+        mplexer->getReceivedData(received, 100);
+        got = received.size();
+      }
+      else {
+        readyFDs.clear();
+        mplexer->getAvailableFDs(readyFDs, 100);
+        for (const auto fd : readyFDs) {
+          if (recv(fd, buffer.data(), buffer.size(), 0) > 0) {
+            got++;
+          }
+        }
+      }
+      total += got;
+    }
+    const auto elapsed = dt.udiff();
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuEnd);
+    sender.join();
+    const auto cpu = static_cast<uint64_t>(cpuEnd.tv_sec - cpuStart.tv_sec) * 1000000000U + cpuEnd.tv_nsec - cpuStart.tv_nsec;
+    cerr << "Receiving " << total << " datagrams over " << socketsCount << " sockets with " << mplexer->getName() << (receive ? " (receive)" : " (readiness + recv)") << " took " << elapsed << " us, " << (cpu / total) << " ns of CPU time per datagram" << endl;
+
+    for (const auto& pair : pairs) {
+      if (receive) {
+        mplexer->removeReceiveFD(pair.first);
+      }
+      else {
+        mplexer->removeReadFD(pair.first);
+      }
+    }
+  }
+
+  for (const auto& pair : pairs) {
+    close(pair.first);
+    close(pair.second);
+  }
+}
+#endif /* BENCH_MPLEXER */
 
 BOOST_AUTO_TEST_SUITE_END()
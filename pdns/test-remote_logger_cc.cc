@@ -0,0 +1,184 @@
+#ifndef BOOST_TEST_DYN_LINK
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#define BOOST_TEST_NO_MAIN
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <netinet/in.h>
+#include <boost/test/unit_test.hpp>
+
+#include "remote_logger.hh"
+#include "misc.hh"
+
+BOOST_AUTO_TEST_SUITE(remote_logger_cc)
+
+/* a listening TCP socket on the loopback, with a small receive buffer */
+static std::pair<FDWrapper, ComboAddress> getListener()
+{
+  FDWrapper listener(socket(AF_INET, SOCK_STREAM, 0));
+  BOOST_REQUIRE(listener.getHandle() >= 0);
+  int bufferSize = 4096;
+  BOOST_REQUIRE_EQUAL(setsockopt(listener.getHandle(), SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize)), 0);
+  ComboAddress addr("127.0.0.1:0");
+  BOOST_REQUIRE_EQUAL(bind(listener.getHandle(), reinterpret_cast<const struct sockaddr*>(&addr), addr.getSocklen()), 0); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+  socklen_t addrLen = addr.getSocklen();
+  BOOST_REQUIRE_EQUAL(getsockname(listener.getHandle(), reinterpret_cast<struct sockaddr*>(&addr), &addrLen), 0); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+  BOOST_REQUIRE_EQUAL(listen(listener.getHandle(), 16), 0);
+  return {std::move(listener), addr};
+}
+
+/* read frames from the socket until 'count' of them have been received or nothing came for a while */
+static std::vector<std::string> readFrames(int sock, size_t count)
+{
+  std::vector<std::string> frames;
+  std::string buffer;
+  std::array<char, 4096> chunk{};
+  size_t pos = 0;
+  while (frames.size() < count) {
+    if (waitForData(sock, 5, 0) <= 0) {
+      break;
+    }
+    auto got = read(sock, chunk.data(), chunk.size());
+    if (got <= 0) {
+      break;
+    }
+    buffer.append(chunk.data(), static_cast<size_t>(got));
+    while (buffer.size() - pos >= 2) {
+      const size_t len = (static_cast<uint8_t>(buffer.at(pos)) << 8) + static_cast<uint8_t>(buffer.at(pos + 1));
+      if (buffer.size() - pos - 2 < len) {
+        break;
+      }
+      frames.emplace_back(buffer.substr(pos + 2, len));
+      pos += 2 + len;
+    }
+  }
+  return frames;
+}
+
+static std::string getMessage(size_t idx)
+{
+  /* messages of varying sizes, starting with their index */
+  auto message = std::to_string(idx) + ":";
+  message.append(100 + (idx * 37) % 900, static_cast<char>('a' + idx % 26));
+  return message;
+}
+
+static void waitForSent(RemoteLogger& logger, uint64_t count)
+{
+  for (size_t attempt = 0; attempt < 500 && logger.getStats().d_sent < count; attempt++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_queue_full)
+{
+  /* never connected, so nothing is sent, and the queue fills up */
+  const uint64_t maxQueuedBytes = 1000;
+  RemoteLogger logger(ComboAddress("127.0.0.1:9"), 1, maxQueuedBytes, 255, true);
+  const std::string message(100, 'a');
+  const size_t frameSize = message.size() + 2;
+  const size_t expectedQueued = maxQueuedBytes / frameSize;
+
+  size_t queued = 0;
+  size_t pipeFull = 0;
+  for (size_t idx = 0; idx < 20; idx++) {
+    auto result = logger.queueData(message);
+    if (result == RemoteLoggerInterface::Result::Queued) {
+      /* once the queue is full, it stays full */
+      BOOST_CHECK_EQUAL(pipeFull, 0U);
+      ++queued;
+    }
+    else {
+      BOOST_CHECK(result == RemoteLoggerInterface::Result::PipeFull);
+      ++pipeFull;
+    }
+  }
+  BOOST_CHECK_EQUAL(queued, expectedQueued);
+  BOOST_CHECK_EQUAL(pipeFull, 20U - expectedQueued);
+
+  BOOST_CHECK(logger.queueData(std::string(70000, 'a')) == RemoteLoggerInterface::Result::TooLarge);
+
+  /* the messages reported as queued are not dropped later, once their block is handed over */
+  std::this_thread::sleep_for(std::chrono::milliseconds(RemoteLogger::s_maxBlockAgeMS * 3));
+  const auto stats = logger.getStats();
+  BOOST_CHECK_EQUAL(stats.d_queued, expectedQueued);
+  BOOST_CHECK_EQUAL(stats.d_pipeFull, 20U - expectedQueued);
+  BOOST_CHECK_EQUAL(stats.d_tooLarge, 1U);
+  BOOST_CHECK_EQUAL(stats.d_sent, 0U);
+  BOOST_CHECK_EQUAL(logger.toString(), "127.0.0.1:9 (" + std::to_string(expectedQueued) + " processed, " + std::to_string(21U - expectedQueued) + " dropped)");
+}
+
+BOOST_AUTO_TEST_CASE(test_partial_writes)
+{
+  auto [listener, addr] = getListener();
+  RemoteLogger logger(addr, 2, 10000000, 1, false);
+  FDWrapper conn(accept(listener.getHandle(), nullptr, nullptr));
+  BOOST_REQUIRE(conn.getHandle() >= 0);
+
+  const size_t count = 3000;
+  for (size_t idx = 0; idx < count; idx++) {
+    BOOST_REQUIRE(logger.queueData(getMessage(idx)) == RemoteLoggerInterface::Result::Queued);
+  }
+  /* let the socket buffers fill up, so that the sender thread has to resume
+     in the middle of a block, and even of a message */
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+  auto frames = readFrames(conn.getHandle(), count);
+  BOOST_REQUIRE_EQUAL(frames.size(), count);
+  for (size_t idx = 0; idx < count; idx++) {
+    BOOST_CHECK_EQUAL(frames.at(idx), getMessage(idx));
+  }
+
+  waitForSent(logger, count);
+  const auto stats = logger.getStats();
+  BOOST_CHECK_EQUAL(stats.d_queued, count);
+  BOOST_CHECK_EQUAL(stats.d_sent, count);
+  BOOST_CHECK_EQUAL(stats.d_pipeFull, 0U);
+  BOOST_CHECK_EQUAL(stats.d_connectionDrops, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(test_thread_blocks)
+{
+  auto [listener, addr] = getListener();
+  RemoteLogger logger(addr, 2, 10000000, 1, false);
+  FDWrapper conn(accept(listener.getHandle(), nullptr, nullptr));
+  BOOST_REQUIRE(conn.getHandle() >= 0);
+
+  BOOST_REQUIRE(logger.queueData(getMessage(0)) == RemoteLoggerInterface::Result::Queued);
+  BOOST_CHECK_EQUAL(logger.getThreadBlocksCount(), 1U);
+
+  const size_t threadsCount = 4;
+  std::atomic<size_t> queued{0};
+  std::vector<std::thread> threads;
+  for (size_t idx = 1; idx <= threadsCount; idx++) {
+    threads.emplace_back([&logger, &queued, idx]() {
+      if (logger.queueData(getMessage(idx)) == RemoteLoggerInterface::Result::Queued) {
+        ++queued;
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  BOOST_CHECK_EQUAL(queued.load(), threadsCount);
+  BOOST_CHECK_EQUAL(logger.getThreadBlocksCount(), threadsCount + 1);
+
+  /* the partially filled blocks are handed over after a while, even those of threads that are gone */
+  auto frames = readFrames(conn.getHandle(), threadsCount + 1);
+  BOOST_CHECK_EQUAL(frames.size(), threadsCount + 1);
+  waitForSent(logger, threadsCount + 1);
+
+  /* then the blocks of the threads that are gone are forgotten, but not the one of this thread */
+  for (size_t attempt = 0; attempt < 100 && logger.getThreadBlocksCount() > 1; attempt++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  BOOST_CHECK_EQUAL(logger.getThreadBlocksCount(), 1U);
+  BOOST_REQUIRE(logger.queueData(getMessage(0)) == RemoteLoggerInterface::Result::Queued);
+  BOOST_CHECK_EQUAL(logger.getThreadBlocksCount(), 1U);
+  BOOST_CHECK_EQUAL(readFrames(conn.getHandle(), 1).size(), 1U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -37,8 +37,9 @@ class APITestsBase(DNSDistTest):
                         'latency-doq-avg10000', 'latency-doq-avg1000000', 'latency-doh3-avg100', 'latency-doh3-avg1000',
                         'latency-doh3-avg10000', 'latency-doh3-avg1000000','uptime', 'real-memory-usage', 'noncompliant-queries',
                         'noncompliant-responses', 'rdqueries', 'empty-queries', 'cache-hits',
-                        'cache-misses', 'cpu-iowait', 'cpu-steal', 'cpu-sys-msec', 'cpu-user-msec', 'fd-usage', 'dyn-blocked',
+                        'cache-misses', 'cache-coalesced-queries', 'cache-coalesced-failed', 'lua-lock-waits', 'lua-lock-wait-usec', 'cpu-iowait', 'cpu-steal', 'cpu-sys-msec', 'cpu-user-msec', 'fd-usage', 'dyn-blocked',
                         'dyn-block-nmg-size', 'rule-servfail', 'rule-truncated', 'security-status',
+                        'rings-dropped-queries', 'rings-dropped-responses', 'rings-overwritten-queries', 'rings-overwritten-responses',
                         'udp-in-csum-errors', 'udp-in-errors', 'udp-noport-errors', 'udp-recvbuf-errors', 'udp-sndbuf-errors',
                         'udp6-in-errors', 'udp6-recvbuf-errors', 'udp6-sndbuf-errors', 'udp6-noport-errors', 'udp6-in-csum-errors',
                         'doh-query-pipe-full', 'doh-response-pipe-full', 'doq-response-pipe-full', 'doh3-response-pipe-full', 'proxy-protocol-invalid', 'tcp-listen-overflows',
@@ -406,6 +407,48 @@ class TestAPIBasics(APITestsBase):
             for value in expectedResponseValues:
                 self.assertIn(value, entry)
 
+class TestAPIHeavyHitters(APITestsBase):
+    __test__ = True
+    _config_template = """
+    setACL({"127.0.0.1/32", "::1/128"})
+    setRingBuffersOptions({heavyHittersCapacity=100})
+    newServer{address="127.0.0.1:%s"}
+    webserver("127.0.0.1:%s")
+    setWebserverConfig({password="%s", apiKey="%s"})
+    """
+
+    def testServersLocalhostHeavyHitters(self):
+        """
+        API: /api/v1/servers/localhost/heavy-hitters
+        """
+        headers = {'x-api-key': self._webServerAPIKey}
+        url = 'http://127.0.0.1:' + str(self._webServerPort) + '/api/v1/servers/localhost/heavy-hitters'
+
+        for idx in range(5):
+            name = str(idx) + '.heavy-hitters.api.tests.powerdns.com.'
+            query = dns.message.make_query(name, 'A', 'IN')
+            response = dns.message.make_response(query)
+            response.set_rcode(dns.rcode.NXDOMAIN)
+            (receivedQuery, receivedResponse) = self.sendUDPQuery(query, response)
+            self.assertTrue(receivedQuery)
+            self.assertTrue(receivedResponse)
+
+        r = requests.get(url + '?count=1', headers=headers, timeout=self._webTimeout)
+        self.assertTrue(r)
+        self.assertEqual(r.status_code, 200)
+        content = r.json()
+        self.assertEqual(content['clients'], [{'client': '127.0.0.1/32', 'count': 5, 'error': 0}])
+        self.assertEqual(content['names'], [{'name': 'powerdns.com.', 'count': 5, 'error': 0}])
+        self.assertEqual(content['rcodes'], [{'rcode': 'nxdomain', 'name': 'powerdns.com.', 'count': 5, 'error': 0}])
+
+        url = 'http://127.0.0.1:' + str(self._webServerPort) + '/metrics'
+        r = requests.get(url, auth=('whatever', self._webServerBasicAuthPassword), timeout=self._webTimeout)
+        self.assertTrue(r)
+        self.assertEqual(r.status_code, 200)
+        self.assertIn('dnsdist_heavy_hitters_clients{client="127.0.0.1/32"} 5', r.text)
+        self.assertIn('dnsdist_heavy_hitters_names{name="powerdns.com."} 5', r.text)
+        self.assertIn('dnsdist_heavy_hitters_rcodes{rcode="nxdomain",name="powerdns.com."} 5', r.text)
+
 class TestAPIServerDown(APITestsBase):
     __test__ = True
     _config_template = """
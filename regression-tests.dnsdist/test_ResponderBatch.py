@@ -0,0 +1,47 @@
+#!/usr/bin/env python
+import dns
+from dnsdisttests import DNSDistTest
+
+class TestResponderBatch(DNSDistTest):
+
+    _config_template = """
+    newServer{address="127.0.0.1:%d", responderBatchSize=32}
+    """
+
+    def testSimpleA(self):
+        """
+        Responder batch: A queries relayed via recvmmsg/sendmmsg
+        """
+        for idx in range(20):
+            name = 'simplea-%d.responder-batch.tests.powerdns.com.' % (idx)
+            query = dns.message.make_query(name, 'A', 'IN', use_edns=False)
+            response = dns.message.make_response(query)
+            rrset = dns.rrset.from_text(name,
+                                        3600,
+                                        dns.rdataclass.IN,
+                                        dns.rdatatype.A,
+                                        '127.0.0.1')
+            response.answer.append(rrset)
+
+            (receivedQuery, receivedResponse) = self.sendUDPQuery(query, response)
+            self.assertTrue(receivedQuery)
+            self.assertTrue(receivedResponse)
+            receivedQuery.id = query.id
+            self.assertEqual(query, receivedQuery)
+            self.assertEqual(response, receivedResponse)
+
+class TestResponderBatchYaml(TestResponderBatch):
+
+    _config_template = ""
+    _config_params = []
+    _yaml_config_template = """---
+binds:
+  - listen_address: "127.0.0.1:%d"
+    protocol: Do53
+
+backends:
+  - address: "127.0.0.1:%d"
+    protocol: Do53
+    responder_batch_size: 32
+"""
+    _yaml_config_params = ['_dnsDistPort', '_testServerPort']